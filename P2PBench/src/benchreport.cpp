@@ -0,0 +1,110 @@
+#include "benchreport.h"
+
+#include <QDateTime>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QXmlStreamReader>
+
+namespace
+{
+	// nanoseconds in one unit of the walltime metrics, 0 for the other metrics
+	double walltimeScale(QStringRef const& metric)
+	{
+		if (metric == QLatin1String("WalltimeMilliseconds"))
+			return 1e6;
+		if (metric == QLatin1String("WalltimeNanoseconds"))
+			return 1.0;
+		return 0.0;
+	}
+
+	QJsonObject readFailure(QXmlStreamReader& reader, QString const& sFunction)
+	{
+		QJsonObject failure;
+		failure.insert(QStringLiteral("function"), sFunction);
+		while (reader.readNextStartElement())
+		{
+			if (reader.name() == QLatin1String("DataTag"))
+				failure.insert(QStringLiteral("tag"), reader.readElementText());
+			else if (reader.name() == QLatin1String("Description"))
+				failure.insert(QStringLiteral("description"), reader.readElementText());
+			else
+				reader.skipCurrentElement();
+		}
+		return failure;
+	}
+}
+
+bool writeBenchReport(QString const& sXmlPath, QString const& sJsonPath, QString& sError)
+{
+	QFile xmlFile(sXmlPath);
+	if (!xmlFile.open(QIODevice::ReadOnly))
+	{
+		sError = QStringLiteral("Unable to read the test log %1").arg(sXmlPath);
+		return false;
+	}
+
+	QJsonObject report;
+	QJsonArray results;
+	QJsonArray failures;
+	QString sFunction;
+	QXmlStreamReader reader(&xmlFile);
+	while (!reader.atEnd())
+	{
+		if (reader.readNext() != QXmlStreamReader::StartElement)
+			continue;
+		const QStringRef name = reader.name();
+		const QXmlStreamAttributes attributes = reader.attributes();
+		if (name == QLatin1String("TestCase"))
+		{
+			report.insert(QStringLiteral("testCase"), attributes.value(QLatin1String("name")).toString());
+		}
+		else if (name == QLatin1String("QtVersion"))
+		{
+			report.insert(QStringLiteral("qtVersion"), reader.readElementText());
+		}
+		else if (name == QLatin1String("TestFunction"))
+		{
+			sFunction = attributes.value(QLatin1String("name")).toString();
+		}
+		else if (name == QLatin1String("BenchmarkResult"))
+		{
+			const QStringRef metric = attributes.value(QLatin1String("metric"));
+			const double dValue = attributes.value(QLatin1String("value")).toDouble();
+			QJsonObject result;
+			result.insert(QStringLiteral("function"), sFunction);
+			result.insert(QStringLiteral("tag"), attributes.value(QLatin1String("tag")).toString());
+			result.insert(QStringLiteral("metric"), metric.toString());
+			result.insert(QStringLiteral("value"), dValue);
+			result.insert(QStringLiteral("iterations"), attributes.value(QLatin1String("iterations")).toLongLong());
+			const double dScale = walltimeScale(metric);
+			if (dScale > 0.0)
+				result.insert(QStringLiteral("nanoseconds"), dValue * dScale);
+			results.append(result);
+		}
+		else if (name == QLatin1String("Incident"))
+		{
+			const QStringRef type = attributes.value(QLatin1String("type"));
+			if (type == QLatin1String("fail") || type == QLatin1String("xpass"))
+				failures.append(readFailure(reader, sFunction));
+		}
+	}
+	if (reader.hasError())
+	{
+		sError = QStringLiteral("Unable to parse the test log %1: %2").arg(sXmlPath, reader.errorString());
+		return false;
+	}
+
+	report.insert(QStringLiteral("timestamp"), QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+	report.insert(QStringLiteral("results"), results);
+	report.insert(QStringLiteral("failures"), failures);
+	QFile jsonFile(sJsonPath);
+	if (!jsonFile.open(QIODevice::WriteOnly | QIODevice::Truncate)
+		|| jsonFile.write(QJsonDocument(report).toJson()) < 0)
+	{
+		sError = QStringLiteral("Unable to write the report %1").arg(sJsonPath);
+		return false;
+	}
+	return true;
+}
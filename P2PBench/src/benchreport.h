@@ -0,0 +1,11 @@
+#ifndef BENCHREPORT_H
+#define BENCHREPORT_H
+
+#include <QString>
+
+// Turns the XML log of a QtTest run into a JSON report, one entry per benchmark result with its test function,
+// data tag, metric, value per iteration and iteration count. The walltime results also get the value in
+// nanoseconds, so runs timed by QBENCHMARK and by hand compare on the same scale. Failed tests are listed apart.
+bool writeBenchReport(QString const& sXmlPath, QString const& sJsonPath, QString& sError);
+
+#endif // BENCHREPORT_H
@@ -0,0 +1,66 @@
+#include <QCoreApplication>
+#include <QFile>
+#include <QtTest>
+#include <cstdio>
+#include "benchreport.h"
+#include "logger.h"
+#include "serverbench.h"
+
+#ifdef Q_OS_UNIX
+#	include <sys/resource.h>
+#endif
+
+namespace
+{
+	// the fan-out keeps two descriptors open per recipient, more than the usual soft limit allows
+	void raiseDescriptorLimit()
+	{
+#ifdef Q_OS_UNIX
+		rlimit limit;
+		if (::getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur >= limit.rlim_max)
+			return;
+		limit.rlim_cur = limit.rlim_max;
+		::setrlimit(RLIMIT_NOFILE, &limit);
+#endif
+	}
+}
+
+// Takes the arguments of any QtTest executable, plus --json <file> to write the results as JSON for comparing runs
+int main(int argc, char* argv[])
+{
+	QCoreApplication a(argc, argv);
+	QStringList lstArguments = a.arguments();
+	QString sJsonPath;
+	const int nJsonOption = lstArguments.indexOf(QStringLiteral("--json"));
+	if (nJsonOption > 0)
+	{
+		if (nJsonOption + 1 >= lstArguments.size())
+		{
+			std::fprintf(stderr, "--json needs the path of the report\n");
+			return 1;
+		}
+		sJsonPath = lstArguments.at(nJsonOption + 1);
+		lstArguments.erase(lstArguments.begin() + nJsonOption, lstArguments.begin() + nJsonOption + 2);
+	}
+	// QtTest has no JSON logger, its XML log is converted once the run is over. The text log still goes to the console
+	const QString sXmlPath = sJsonPath + QLatin1String(".xml");
+	if (!sJsonPath.isEmpty())
+		lstArguments << QStringLiteral("-o") << sXmlPath + QLatin1String(",xml") << QStringLiteral("-o") << QStringLiteral("-,txt");
+
+	Logger::setLevel(LogLevel::Warning);
+	raiseDescriptorLimit();
+	ServerBench bench;
+	int nResult = QTest::qExec(&bench, lstArguments);
+	if (!sJsonPath.isEmpty())
+	{
+		QString sError;
+		if (!writeBenchReport(sXmlPath, sJsonPath, sError))
+		{
+			std::fprintf(stderr, "%s\n", qPrintable(sError));
+			nResult = 1;
+		}
+		QFile::remove(sXmlPath);
+	}
+	Logger::instance().stop();
+	return nResult;
+}
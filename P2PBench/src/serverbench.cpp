@@ -0,0 +1,451 @@
+#include "serverbench.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QScopeGuard>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QtTest>
+#include "chatserver.h"
+#include "messagecodec.h"
+#include "messages.h"
+#include "serverworker.h"
+
+// Hands the accepted descriptors over instead of opening sockets on them, a worker opens its own like in the server
+class LoopbackListener : public QTcpServer
+{
+public:
+	using QTcpServer::QTcpServer;
+
+	qintptr takeDescriptor()
+	{
+		return m_vecDescriptors.isEmpty() ? -1 : m_vecDescriptors.takeFirst();
+	}
+
+protected:
+	void incomingConnection(qintptr socketDescriptor) override
+	{
+		m_vecDescriptors.append(socketDescriptor);
+	}
+
+private:
+	QVector<qintptr> m_vecDescriptors;
+};
+
+namespace
+{
+	const int g_nTimeoutMs = 5000;
+	// time measured per benchmark, or rounds run when they are slow to set up
+	const qint64 g_nMeasuredNs = 500 * 1000 * 1000;
+	const int g_nRoundsMax = 100000;
+	// frames per round of the receive and route benchmarks
+	const int g_nBatchSize = 100;
+
+	class RoundClock
+	{
+	public:
+		void start()
+		{
+			m_timer.start();
+		}
+		void stop()
+		{
+			m_nElapsedNs += m_timer.nsecsElapsed();
+		}
+		qint64 elapsedNs() const
+		{
+			return m_nElapsedNs;
+		}
+
+	private:
+		QElapsedTimer m_timer;
+		qint64 m_nElapsedNs = 0;
+	};
+
+	QString sampleString()
+	{
+		return QStringLiteral("a sample value of thirty-two ch.");
+	}
+
+	bool sampleBool()
+	{
+		return true;
+	}
+
+	qint64 sampleInt()
+	{
+		return Q_INT64_C(1234567);
+	}
+
+	QStringList sampleStringList()
+	{
+		QStringList lstValues;
+		for (int nIndex = 0; nIndex < 20; ++nIndex)
+			lstValues.append(QStringLiteral("user_%1").arg(nIndex));
+		return lstValues;
+	}
+
+	// every message with all of its fields set, like the largest frames of its type
+#define P2P_MESSAGE(Name, type) \
+	Name##Message sample##Name() \
+	{ \
+		Name##Message message;
+#define P2P_FIELD(Message, Kind, Name, Key) \
+		message.set##Name(sample##Kind());
+#define P2P_END(Name) \
+		return message; \
+	}
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+
+	QByteArray samplePayload(MessageType messageType, WireEncoding encoding)
+	{
+		QByteArray payload;
+		switch (messageType)
+		{
+#define P2P_MESSAGE(Name, type) \
+		case MessageType::Name: \
+			serializeMessage(sample##Name(), payload, encoding); \
+			break;
+#define P2P_FIELD(Message, Kind, Name, Key)
+#define P2P_END(Name)
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+		default:
+			break;
+		}
+		return payload;
+	}
+
+	// rows named after the type and the encoding, e.g. "login cbor"
+	void addMessageRows()
+	{
+		QTest::addColumn<int>("messageType");
+		QTest::addColumn<int>("encoding");
+		QTest::addColumn<QByteArray>("payload");
+		for (WireEncoding encoding : { WireEncoding::Json, WireEncoding::Cbor })
+		{
+			const QByteArray encodingName = QString(MessageCodec::encodingName(encoding)).toLatin1();
+#define P2P_MESSAGE(Name, type) \
+			QTest::addRow("%s %s", #type, encodingName.constData()) << int(MessageType::Name) << int(encoding) << samplePayload(MessageType::Name, encoding);
+#define P2P_FIELD(Message, Kind, Name, Key)
+#define P2P_END(Name)
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+		}
+	}
+
+	template <typename Message>
+	void benchmarkEncode(Message const& message, WireEncoding encoding)
+	{
+		// the frame is built the way OutgoingMessage builds it, allocation included
+		int nSize = 0;
+		QBENCHMARK
+		{
+			nSize += encodeFrame(message, encoding).size();
+		}
+		QVERIFY(nSize > 0);
+	}
+}
+
+template <typename Round>
+bool ServerBench::measure(int nOperations, Round round)
+{
+	// the first round grows the buffers, it is not counted
+	RoundClock warmUp;
+	if (!round(warmUp))
+		return false;
+	RoundClock clock;
+	int nRounds = 0;
+	while (clock.elapsedNs() < g_nMeasuredNs && nRounds < g_nRoundsMax)
+	{
+		if (!round(clock))
+			return false;
+		++nRounds;
+	}
+	QTest::setBenchmarkResult(double(clock.elapsedNs()) / (double(nRounds) * nOperations), QTest::WalltimeNanoseconds);
+	return true;
+}
+
+void ServerBench::initTestCase()
+{
+	m_pListener = new LoopbackListener(this);
+	QVERIFY(m_pListener->listen(QHostAddress::LocalHost));
+}
+
+void ServerBench::encode_data()
+{
+	addMessageRows();
+}
+
+void ServerBench::encode()
+{
+	QFETCH(int, messageType);
+	QFETCH(int, encoding);
+	switch (MessageType(messageType))
+	{
+#define P2P_MESSAGE(Name, type) \
+	case MessageType::Name: \
+		benchmarkEncode(sample##Name(), WireEncoding(encoding)); \
+		break;
+#define P2P_FIELD(Message, Kind, Name, Key)
+#define P2P_END(Name)
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+	default:
+		QFAIL("Unknown message type");
+	}
+}
+
+void ServerBench::decode_data()
+{
+	addMessageRows();
+}
+
+void ServerBench::decode()
+{
+	QFETCH(QByteArray, payload);
+	int nRuns = 0;
+	int nParsed = 0;
+	QBENCHMARK
+	{
+		dispatchMessage(payload, [&nParsed](auto const&) -> void { ++nParsed; });
+		++nRuns;
+	}
+	QCOMPARE(nParsed, nRuns);
+}
+
+void ServerBench::receive_data()
+{
+	QTest::addColumn<int>("encoding");
+	QTest::addColumn<bool>("loggedIn");
+	// the direct messages of a logged in user take the relay fast path, before the login they are parsed
+	QTest::newRow("json") << int(WireEncoding::Json) << false;
+	QTest::newRow("json relay") << int(WireEncoding::Json) << true;
+	QTest::newRow("cbor") << int(WireEncoding::Cbor) << false;
+	QTest::newRow("cbor relay") << int(WireEncoding::Cbor) << true;
+}
+
+void ServerBench::receive()
+{
+	QFETCH(int, encoding);
+	QFETCH(bool, loggedIn);
+
+	TextMessage message;
+	message.setText(QString(64, QLatin1Char('x')));
+	message.setReceiver(QStringLiteral("user_42"));
+	QByteArray batch;
+	for (int nFrame = 0; nFrame < g_nBatchSize; ++nFrame)
+		appendFrame(batch, message, WireEncoding(encoding));
+
+	QTcpSocket client;
+	QScopedPointer<ServerWorker> pWorker(connectWorker(&client));
+	QVERIFY(pWorker);
+	if (loggedIn)
+		pWorker->setUserName(QStringLiteral("sender"));
+	int nReceived = 0;
+	connect(pWorker.data(), &ServerWorker::messageReceived, this, [&nReceived](QByteArray const&) -> void { ++nReceived; });
+	connect(pWorker.data(), &ServerWorker::directMessageReceived, this, [&nReceived](QByteArray const&, QByteArray const&) -> void { ++nReceived; });
+	QTcpSocket* pSocket = pWorker->m_pServerSocket;
+
+	const bool bMeasured = measure(g_nBatchSize,
+		[&](RoundClock& clock) -> bool
+		{
+			// the batch waits in the kernel before the worker is woken, like after a busy iteration of its thread
+			nReceived = 0;
+			client.write(batch);
+			if (!client.waitForBytesWritten(g_nTimeoutMs))
+				return false;
+			clock.start();
+			while (nReceived < g_nBatchSize)
+			{
+				if (!pSocket->waitForReadyRead(g_nTimeoutMs))
+					return false;
+			}
+			clock.stop();
+			return true;
+		}
+	);
+	QVERIFY(bMeasured);
+	QCOMPARE(nReceived, g_nBatchSize);
+}
+
+void ServerBench::route_data()
+{
+	QTest::addColumn<int>("users");
+	QTest::addColumn<bool>("relay");
+	for (int nUsers : { 10, 1000, 100000 })
+	{
+		const QByteArray users = nUsers >= 1000 ? QByteArray::number(nUsers / 1000) + 'k' : QByteArray::number(nUsers);
+		QTest::addRow("%s users", users.constData()) << nUsers << false;
+		QTest::addRow("%s users relay", users.constData()) << nUsers << true;
+	}
+}
+
+void ServerBench::route()
+{
+	QFETCH(int, users);
+	QFETCH(bool, relay);
+
+	ChatServer server;
+	QVector<ServerWorker*> vecUsers;
+	QTcpSocket client;
+	ServerWorker* pReceiver = connectWorker(&client);
+	const auto cleanup = qScopeGuard(
+		[&server, &vecUsers, pReceiver]() -> void
+		{
+			server.m_clients.clear();
+			qDeleteAll(vecUsers);
+			delete pReceiver;
+		}
+	);
+	QVERIFY(pReceiver);
+	registerUsers(server, users - 1, vecUsers);
+	server.m_clients.add(pReceiver);
+	QVERIFY(server.m_clients.registerName(pReceiver, QStringLiteral("receiver")));
+	ServerWorker* pSender = vecUsers.first();
+
+	TextMessage message;
+	message.setText(QString(64, QLatin1Char('x')));
+	message.setReceiver(QStringLiteral("receiver"));
+	QByteArray payload;
+	serializeMessage(message, payload, WireEncoding::Json);
+	DirectMessage direct;
+	QVERIFY(MessageCodec::scanDirectMessage(payload, direct));
+
+	const QVector<ServerWorker*> vecReceivers(1, pReceiver);
+	const QVector<QTcpSocket*> vecClients(1, &client);
+	QVector<qint64> vecDrained(1, 0);
+	const bool bMeasured = measure(g_nBatchSize,
+		[&](RoundClock& clock) -> bool
+		{
+			clock.start();
+			for (int nMessage = 0; nMessage < g_nBatchSize; ++nMessage)
+			{
+				if (relay)
+					server.directMessageReceived(pSender, direct.receiver, direct.text);
+				else
+					server.messageReceived(pSender, payload);
+			}
+			writeOut(vecReceivers);
+			clock.stop();
+			return drain(vecClients, vecReceivers, vecDrained);
+		}
+	);
+	QVERIFY(bMeasured);
+}
+
+void ServerBench::fanOut_data()
+{
+	QTest::addColumn<int>("recipients");
+	QTest::newRow("10 recipients") << 10;
+	QTest::newRow("100 recipients") << 100;
+	QTest::newRow("1k recipients") << 1000;
+}
+
+void ServerBench::fanOut()
+{
+	QFETCH(int, recipients);
+
+	ChatServer server;
+	QVector<ServerWorker*> vecWorkers;
+	QVector<QTcpSocket*> vecClients;
+	const auto cleanup = qScopeGuard(
+		[&server, &vecWorkers, &vecClients]() -> void
+		{
+			server.m_clients.clear();
+			qDeleteAll(vecWorkers);
+			qDeleteAll(vecClients);
+		}
+	);
+	for (int nRecipient = 0; nRecipient < recipients; ++nRecipient)
+	{
+		QTcpSocket* pClient = new QTcpSocket;
+		vecClients.append(pClient);
+		ServerWorker* pWorker = connectWorker(pClient);
+		if (!pWorker)
+			QSKIP("Not enough sockets for the recipients");
+		vecWorkers.append(pWorker);
+		server.m_clients.add(pWorker);
+		QVERIFY(server.m_clients.registerName(pWorker, QStringLiteral("user_%1").arg(nRecipient)));
+	}
+
+	NewUserMessage message;
+	message.setUserName(QStringLiteral("newcomer"));
+	QVector<qint64> vecDrained(recipients, 0);
+	const bool bMeasured = measure(1,
+		[&](RoundClock& clock) -> bool
+		{
+			clock.start();
+			OutgoingMessage outgoing(message);
+			server.broadcast(outgoing, nullptr, FrameKind::Ephemeral);
+			writeOut(vecWorkers);
+			clock.stop();
+			return drain(vecClients, vecWorkers, vecDrained);
+		}
+	);
+	QVERIFY(bMeasured);
+}
+
+ServerWorker* ServerBench::connectWorker(QTcpSocket* pClient)
+{
+	pClient->connectToHost(QHostAddress::LocalHost, m_pListener->serverPort());
+	if (!pClient->waitForConnected(g_nTimeoutMs) || !m_pListener->waitForNewConnection(g_nTimeoutMs))
+		return nullptr;
+	ServerWorker* pWorker = new ServerWorker;
+	if (!pWorker->setSocketDescriptor(m_pListener->takeDescriptor()))
+	{
+		delete pWorker;
+		return nullptr;
+	}
+	return pWorker;
+}
+
+bool ServerBench::drain(QVector<QTcpSocket*> const& vecClients, QVector<ServerWorker*> const& vecWorkers, QVector<qint64>& vecDrained)
+{
+	for (int nIndex = 0; nIndex < vecClients.size(); ++nIndex)
+	{
+		QTcpSocket* pClient = vecClients.at(nIndex);
+		ServerWorker* pWorker = vecWorkers.at(nIndex);
+		while (vecDrained.at(nIndex) < pWorker->m_nStreamOffset)
+		{
+			// what the kernel didn't take yet is still buffered by the socket of the worker
+			pWorker->m_pServerSocket->flush();
+			if (pClient->bytesAvailable() == 0 && !pClient->waitForReadyRead(g_nTimeoutMs))
+				return false;
+			vecDrained[nIndex] += pClient->readAll().size();
+		}
+	}
+	return true;
+}
+
+void ServerBench::registerUsers(ChatServer& server, int nCount, QVector<ServerWorker*>& vecWorkers)
+{
+	vecWorkers.reserve(vecWorkers.size() + nCount);
+	for (int nUser = 0; nUser < nCount; ++nUser)
+	{
+		ServerWorker* pWorker = new ServerWorker;
+		server.m_clients.add(pWorker);
+		server.m_clients.registerName(pWorker, QStringLiteral("user_%1").arg(nUser));
+		vecWorkers.append(pWorker);
+	}
+}
+
+void ServerBench::writeOut(QVector<ServerWorker*> const& vecWorkers)
+{
+	// the flushes were posted by the workers, the sockets send what they buffered on their next iteration
+	QCoreApplication::sendPostedEvents(nullptr, QEvent::MetaCall);
+	for (ServerWorker* pWorker : vecWorkers)
+	{
+		if (pWorker->m_pServerSocket->bytesToWrite() > 0)
+			pWorker->m_pServerSocket->flush();
+	}
+}
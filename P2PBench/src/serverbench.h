@@ -0,0 +1,55 @@
+#ifndef SERVERBENCH_H
+#define SERVERBENCH_H
+
+#include <QObject>
+#include <QVector>
+
+class ChatServer;
+class LoopbackListener;
+class ServerWorker;
+class QTcpSocket;
+
+// Microbenchmarks of the hot paths of the server. The codec runs under QBENCHMARK, the paths writing to sockets
+// are timed by hand so that feeding and draining the loopback clients between the rounds is left out.
+// The workers live in the main thread, ChatServer hands them their frames directly like a worker thread does.
+class ServerBench : public QObject
+{
+	Q_OBJECT
+
+private slots:
+	void initTestCase();
+
+	// serializeMessage of every message of messages.def with all of its fields set
+	void encode_data();
+	void encode();
+	// the dispatch the server runs on every payload, parsing included
+	void decode_data();
+	void decode();
+	// ServerWorker::receiveJson on a batch of frames waiting in the socket
+	void receive_data();
+	void receive();
+	// a direct message routed to one of many logged in users, parsed or through the relay fast path
+	void route_data();
+	void route();
+	// ChatServer::broadcast of a presence update, written to the sockets of all the recipients
+	void fanOut_data();
+	void fanOut();
+
+private:
+	// runs rounds until enough time was measured and reports the time per operation, false when a round failed.
+	// only the time between clock.start() and clock.stop() in a round counts
+	template <typename Round>
+	static bool measure(int nOperations, Round round);
+	// a worker serving the server end of a loopback connection, client is the other end
+	ServerWorker* connectWorker(QTcpSocket* pClient);
+	// reads what the workers wrote until the clients got all of it, returns false on a timeout
+	static bool drain(QVector<QTcpSocket*> const& vecClients, QVector<ServerWorker*> const& vecWorkers, QVector<qint64>& vecDrained);
+	// names nCount workers without a connection, only the lookups see them
+	static void registerUsers(ChatServer& server, int nCount, QVector<ServerWorker*>& vecWorkers);
+	// sends the queued frames the way the event loop of a server thread would
+	static void writeOut(QVector<ServerWorker*> const& vecWorkers);
+
+	LoopbackListener* m_pListener = nullptr;
+};
+
+#endif // SERVERBENCH_H
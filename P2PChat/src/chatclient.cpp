@@ -1,26 +1,72 @@
 #include "chatclient.h"
-#include <QTcpSocket>
-#include <QDataStream>
-#include <QJsonParseError>
-#include <QJsonDocument>
-#include <QJsonObject>
-#include <QJsonValue>
+#include "clientconnection.h"
+#include <QRandomGenerator>
+#include <QThread>
+#include <QTimer>
+
+namespace
+{
+	// messages per history request
+	const int g_nHistoryPage = 50;
+	// the window of the first reconnection attempt, doubled by every failed one up to the maximum
+	const int g_nReconnectBaseMs = 1000;
+	const int g_nReconnectMaxMs = 60000;
+	// a connection attempt taking longer counts as failed
+	const int g_nConnectTimeoutMs = 10000;
+	// messages kept while the connection is being restored
+	const int g_nOutboxMax = 200;
+}
 
 ChatClient::ChatClient(QObject *parent)
 	: QObject(parent),
-	  m_pClientSocket(new QTcpSocket(this)),
-	  m_bLoggedIn(false)
-{
-	connect(m_pClientSocket, &QTcpSocket::connected, this, &ChatClient::connected);
-	connect(m_pClientSocket, &QTcpSocket::disconnected, this, &ChatClient::disconnected);
-	connect(m_pClientSocket, &QTcpSocket::readyRead, this, &ChatClient::onReadyRead);
-	connect(m_pClientSocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &ChatClient::error);
-	connect(m_pClientSocket, &QTcpSocket::disconnected, this, 
-		[this]() -> void 
+	  m_pNetworkThread(new QThread(this)),
+	  m_pConnection(nullptr),
+	  m_socketState(QAbstractSocket::UnconnectedState),
+	  m_bLoggedIn(false),
+	  m_bFlushScheduled(false),
+	  m_encoding(WireEncoding::Json),
+	  m_nResumeFrom(0),
+	  m_nPort(0),
+	  m_bReconnecting(false),
+	  m_nReconnectAttempt(0),
+	  m_pReconnectTimer(new QTimer(this)),
+	  m_nOutboxCount(0)
+{
+	m_pReconnectTimer->setSingleShot(true);
+	connect(m_pReconnectTimer, &QTimer::timeout, this, &ChatClient::onReconnectTimer);
+
+	m_pConnection = new ClientConnection(this, 
+		[this](QByteArray const& payload) -> ClientConnection::Event 
 		{
-			m_bLoggedIn = false;
+			// parsed in the network thread, the message is copied into the event applying it here
+			ClientConnection::Event event;
+			dispatchMessage(payload, 
+				[this, &event](auto const& message) -> void 
+				{
+					event = [this, message]() -> void { handleMessage(message); };
+				}
+			);
+			// unknown and malformed messages are ignored
+			return event;
 		}
 	);
+	m_pConnection->moveToThread(m_pNetworkThread);
+	connect(m_pConnection, &ClientConnection::connected, this, &ChatClient::onConnected);
+	connect(m_pConnection, &ClientConnection::disconnected, this, &ChatClient::onDisconnected);
+	connect(m_pConnection, &ClientConnection::error, this, &ChatClient::onError);
+	connect(m_pConnection, &ClientConnection::stateChanged, this, &ChatClient::onStateChanged);
+	m_pNetworkThread->setObjectName(QStringLiteral("Network"));
+	m_pNetworkThread->start();
+}
+
+ChatClient::~ChatClient()
+{
+	// runs after everything posted to the connection before, a pending logout included
+	ClientConnection* pConnection = m_pConnection;
+	QMetaObject::invokeMethod(pConnection, [pConnection]() -> void { pConnection->close(); }, Qt::BlockingQueuedConnection);
+	m_pNetworkThread->quit();
+	m_pNetworkThread->wait();
+	delete m_pConnection;
 }
 
 QString ChatClient::getName() const
@@ -30,127 +76,397 @@ QString ChatClient::getName() const
 
 void ChatClient::login(QString const& sUserName)
 {
-	if (m_pClientSocket->state() == QAbstractSocket::ConnectedState) 
+	if (m_socketState == QAbstractSocket::ConnectedState) 
 	{
+		// the session belongs to the name, a login under another name starts a new one
+		if (sUserName.compare(m_sName, Qt::CaseInsensitive) != 0)
+			m_sSessionToken.clear();
 		m_sName = sUserName;
-		QDataStream clientStream(m_pClientSocket);
-		clientStream.setVersion(QDataStream::Qt_5_15);
 
-		QJsonObject message;
-		message[QStringLiteral("type")] = QStringLiteral("login");
-		message[QStringLiteral("username")] = sUserName;
+		LoginMessage message;
+		message.setUserName(sUserName);
+		// servers that don't know CBOR ignore the offer and keep talking JSON
+		message.setEncodings(QStringList(MessageCodec::encodingName(WireEncoding::Cbor)));
+		// the server replays what we missed or, when it can't, logs us in as usual
+		if (!m_sSessionToken.isEmpty())
+		{
+			message.setSession(m_sSessionToken);
+			message.setReceived(m_nResumeFrom);
+		}
 
-		clientStream << QJsonDocument(message).toJson(QJsonDocument::Compact);
+		queueMessage(message);
 	}
 }
 
-void ChatClient::sendMessage(QString const& sText, QString const& sReceiver)
+bool ChatClient::sendMessage(QString const& sText, QString const& sReceiver)
 {
 	if (sText.isEmpty())
-		return;
+		return false;
 	
-	QDataStream clientStream(m_pClientSocket);
-	clientStream.setVersion(QDataStream::Qt_5_15);
+	TextMessage message;
+	message.setText(sText);
+	message.setReceiver(sReceiver);
 	
-	QJsonObject message;
-	message[QStringLiteral("type")] = QStringLiteral("message");
-	message[QStringLiteral("text")] = sText;
-	message[QStringLiteral("receiver")] = sReceiver;
-	
-	clientStream << QJsonDocument(message).toJson();
+	return postMessage(message);
+}
+
+bool ChatClient::joinRoom(QString const& sRoom)
+{
+	if (sRoom.isEmpty())
+		return false;
+
+	JoinMessage message;
+	message.setRoom(sRoom);
+
+	return postMessage(message);
+}
+
+bool ChatClient::leaveRoom(QString const& sRoom)
+{
+	if (sRoom.isEmpty())
+		return false;
+
+	LeaveMessage message;
+	message.setRoom(sRoom);
+
+	return postMessage(message);
+}
+
+bool ChatClient::sendRoomMessage(QString const& sText, QString const& sRoom)
+{
+	if (sText.isEmpty())
+		return false;
+
+	TextMessage message;
+	message.setText(sText);
+	message.setRoom(sRoom);
+
+	return postMessage(message);
+}
+
+void ChatClient::requestHistory(QString const& sUserName, qint64 nBefore)
+{
+	// a history request is not worth keeping for later, the window asks again once logged in
+	if (sUserName.isEmpty() || !m_bLoggedIn)
+		return;
+
+	HistoryMessage message;
+	message.setUserName(sUserName);
+	message.setLimit(g_nHistoryPage);
+	if (nBefore > 0)
+		message.setBefore(nBefore);
+
+	queueMessage(message);
+}
+
+void ChatClient::requestRoomHistory(QString const& sRoom, qint64 nBefore)
+{
+	if (sRoom.isEmpty() || !m_bLoggedIn)
+		return;
+
+	HistoryMessage message;
+	message.setRoom(sRoom);
+	message.setLimit(g_nHistoryPage);
+	if (nBefore > 0)
+		message.setBefore(nBefore);
+
+	queueMessage(message);
+}
+
+void ChatClient::scheduleFlush()
+{
+	// the frames queued during this event loop iteration are written together
+	if (m_bFlushScheduled)
+		return;
+	m_bFlushScheduled = true;
+	QMetaObject::invokeMethod(this, &ChatClient::flushOutbound, Qt::QueuedConnection);
+}
+
+void ChatClient::flushOutbound()
+{
+	m_bFlushScheduled = false;
+	if (m_outbound.isEmpty())
+		return;
+	// the buffer is handed over, a new one is started for the next frames
+	ClientConnection* pConnection = m_pConnection;
+	const QByteArray outbound = m_outbound;
+	m_outbound = QByteArray();
+	QMetaObject::invokeMethod(pConnection, [pConnection, outbound]() -> void { pConnection->write(outbound); }, Qt::QueuedConnection);
+}
+
+bool ChatClient::reserveOutbox()
+{
+	if (!m_bReconnecting || m_nOutboxCount >= g_nOutboxMax)
+		return false;
+	++m_nOutboxCount;
+	return true;
+}
+
+void ChatClient::moveOutboundToOutbox()
+{
+	// the frames may be in CBOR, they are written again in JSON like the rest of the outbox
+	FrameDecoder decoder;
+	decoder.feed(m_outbound);
+	m_outbound.clear();
+	QByteArray payload;
+	while (decoder.nextFrame(payload) && reserveOutbox())
+	{
+		dispatchMessage(payload, 
+			[this](auto const& message) -> void 
+			{
+				appendFrame(m_outbox, message, WireEncoding::Json);
+			}
+		);
+	}
 }
 
 void ChatClient::disconnectFromHost()
 {
-	m_pClientSocket->disconnectFromHost();
+	// the server doesn't keep the session of a client that said goodbye
+	if (m_bLoggedIn)
+		queueMessage(LogoutMessage());
+	m_sSessionToken.clear();
+	flushOutbound();
+	// nothing is restored after a disconnection asked for
+	m_bLoggedIn = false;
+	m_bReconnecting = false;
+	m_pReconnectTimer->stop();
+	m_outbox.clear();
+	m_nOutboxCount = 0;
+	m_setRooms.clear();
+	QMetaObject::invokeMethod(m_pConnection, &ClientConnection::disconnectFromHost, Qt::QueuedConnection);
+}
+
+void ChatClient::scheduleReconnect()
+{
+	// full jitter, the clients dropped together by a server restart come back spread over the whole window
+	const int nWindow = qMin(g_nReconnectMaxMs, g_nReconnectBaseMs << qMin(m_nReconnectAttempt, 16));
+	const int nDelay = int(QRandomGenerator::global()->bounded(quint32(nWindow) + 1));
+	++m_nReconnectAttempt;
+	m_pReconnectTimer->start(nDelay);
+	emit reconnecting(m_nReconnectAttempt, nDelay);
 }
 
-void ChatClient::jsonReceived(const QJsonObject &docObj)
+void ChatClient::onReconnectTimer()
 {
-	const QJsonValue typeVal = docObj.value(QLatin1String("type"));
-	if (typeVal.isNull() || !typeVal.isString())
+	if (m_socketState == QAbstractSocket::UnconnectedState)
+	{
+		connectToHost();
+		m_pReconnectTimer->start(g_nConnectTimeoutMs);
 		return;
-	if (typeVal.toString().compare(QLatin1String("login"), Qt::CaseInsensitive) == 0) 
+	}
+	// still connecting, the attempt is given up
+	QMetaObject::invokeMethod(m_pConnection, &ClientConnection::abort, Qt::QueuedConnection);
+	scheduleReconnect();
+}
+
+void ChatClient::onConnected()
+{
+	if (!m_bReconnecting)
 	{
-		if (m_bLoggedIn)
-			return;
-		// success field contains the result of login attempt
-		const QJsonValue resultVal = docObj.value(QLatin1String("success"));
-		if (resultVal.isNull() || !resultVal.isBool())
-			return;
-		const bool bLoginSuccess = resultVal.toBool();
-		if (bLoginSuccess) 
+		emit connected();
+		return;
+	}
+	m_pReconnectTimer->stop();
+	login(m_sName);
+}
+
+void ChatClient::onDisconnected(qint64 nReceivedBytes)
+{
+	// a session is only worth resuming if it was logged in
+	const bool bWasLoggedIn = m_bLoggedIn;
+	if (bWasLoggedIn)
+		m_nResumeFrom = nReceivedBytes;
+	else if (!m_bReconnecting)
+		m_sSessionToken.clear();
+	m_bLoggedIn = false;
+	m_encoding = WireEncoding::Json;
+
+	if (!bWasLoggedIn)
+	{
+		// at most a login was waiting, the next connection sends its own
+		m_outbound.clear();
+		if (!m_bReconnecting)
 		{
-			emit loggedIn();
+			emit disconnected();
 			return;
 		}
-		// login attempt failed, so extract the reason of the failure from the JSON
-		const QJsonValue reasonVal = docObj.value(QLatin1String("reason"));
-		emit loginError(reasonVal.toString());
 	}
-	else if (typeVal.toString().compare(QLatin1String("message"), Qt::CaseInsensitive) == 0) 
+	else
 	{
-		const QJsonValue textVal = docObj.value(QLatin1String("text"));
-		const QJsonValue senderVal = docObj.value(QLatin1String("sender"));
-		if (textVal.isNull() || !textVal.isString())
-			return;
-		if (senderVal.isNull() || !senderVal.isString())
-			return;
-		
-		emit messageReceived(senderVal.toString(), textVal.toString());
-	} 
-	else if (typeVal.toString().compare(QLatin1String("newuser"), Qt::CaseInsensitive) == 0) 
-	{ 
-		// A user joined the chat
-		const QJsonValue usernameVal = docObj.value(QLatin1String("username"));
-		if (usernameVal.isNull() || !usernameVal.isString())
-			return;
-		
-		emit userJoined(usernameVal.toString());
-	} 
-	else if (typeVal.toString().compare(QLatin1String("userdisconnected"), Qt::CaseInsensitive) == 0) 
-	{ 
-		// A user left the chat
-		const QJsonValue usernameVal = docObj.value(QLatin1String("username"));
-		if (usernameVal.isNull() || !usernameVal.isString())
-			return;
-		
-		emit userLeft(usernameVal.toString());
+		m_bReconnecting = true;
+		m_nReconnectAttempt = 0;
+		moveOutboundToOutbox();
 	}
+	scheduleReconnect();
 }
 
-void ChatClient::connectToServer(QHostAddress const& address, quint16 port)
+void ChatClient::onError(QAbstractSocket::SocketError socketError, QAbstractSocket::SocketState socketState)
+{
+	// the drops of a logged in connection are handled by restoring it
+	if (!m_bLoggedIn && !m_bReconnecting)
+	{
+		emit error(socketError);
+		return;
+	}
+	// a failed attempt never connected, so no disconnection follows to schedule the next one
+	if (m_bReconnecting && socketState == QAbstractSocket::UnconnectedState)
+		scheduleReconnect();
+}
+
+void ChatClient::onStateChanged(QAbstractSocket::SocketState socketState)
 {
-	m_pClientSocket->connectToHost(address, port);
+	m_socketState = socketState;
 }
 
-void ChatClient::onReadyRead()
+void ChatClient::connectToHost()
 {
-	QByteArray jsonData;
-	QDataStream socketStream(m_pClientSocket);
-	socketStream.setVersion(QDataStream::Qt_5_15);
+	// the connection catches up with the request, until then the attempt counts as started
+	m_socketState = QAbstractSocket::HostLookupState;
+	ClientConnection* pConnection = m_pConnection;
+	const QHostAddress address = m_address;
+	const quint16 nPort = m_nPort;
+	QMetaObject::invokeMethod(pConnection, [pConnection, address, nPort]() -> void { pConnection->connectToHost(address, nPort); }, Qt::QueuedConnection);
+}
 
-	for (;;) 
+void ChatClient::handleMessage(LoginMessage const& message)
+{
+	if (m_bLoggedIn)
+		return;
+	// success field contains the result of login attempt
+	if (!message.hasSuccess())
+		return;
+	if (message.bSuccess) 
 	{
-		// start a transaction so we can revert to the previous state in case we try to read more data than is available on the socket
-		socketStream.startTransaction();
-		socketStream >> jsonData;
-		if (socketStream.commitTransaction()) 
+		// the server answers in the encoding it picked from our offer, the following frames use it
+		WireEncoding encoding;
+		if (MessageCodec::parseEncodingName(message.sEncoding, encoding))
+			m_encoding = encoding;
+		m_bLoggedIn = true;
+		m_sSessionToken = message.sSession;
+		const bool bResumed = message.hasResumed() && message.bResumed;
+		if (m_bReconnecting)
 		{
-			// we successfully read some data
-			QJsonParseError parseError;
-			const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData, &parseError);
-			if (parseError.error == QJsonParseError::NoError) 
+			m_bReconnecting = false;
+			// a new session left the rooms, they are joined again before the messages for them go out
+			if (!bResumed)
 			{
-				if (jsonDoc.isObject())
-					jsonReceived(jsonDoc.object());
+				for (QString const& sRoom : qAsConst(m_setRooms))
+				{
+					JoinMessage joinMessage;
+					joinMessage.setRoom(sRoom);
+					queueMessage(joinMessage);
+				}
 			}
-		} 
-		else 
+		}
+		// everything written while away goes out in the same batch
+		if (m_nOutboxCount > 0)
 		{
-			// the read failed, the socket goes automatically back to the state it was in before the transaction started
-			// just exit the loop and wait for more data to become available
-			break;
+			m_outbound += m_outbox;
+			m_outbox.clear();
+			m_nOutboxCount = 0;
+			scheduleFlush();
 		}
+		emit loggedIn(bResumed);
+		return;
 	}
+	// login attempt failed, so pass on the reason of the failure
+	m_bReconnecting = false;
+	m_pReconnectTimer->stop();
+	emit loginError(message.sReason);
+}
+
+void ChatClient::handleMessage(TextMessage const& message)
+{
+	if (!message.hasText() || !message.hasSender())
+		return;
+	if (message.hasRoom())
+		emit roomMessageReceived(message.sRoom, message.sSender, message.sText);
+	else
+		emit messageReceived(message.sSender, message.sText);
+}
+
+void ChatClient::handleMessage(NewUserMessage const& message)
+{
+	// A user joined the chat
+	if (!message.hasUserName())
+		return;
+	emit userJoined(message.sUserName);
+}
+
+void ChatClient::handleMessage(RosterMessage const& message)
+{
+	// everybody who was online when we logged in, sent once right after the login
+	if (!message.hasUsers())
+		return;
+	emit rosterReceived(message.lstUsers);
+}
+
+void ChatClient::handleMessage(UserDisconnectedMessage const& message)
+{
+	// A user left the chat
+	if (!message.hasUserName())
+		return;
+	emit userLeft(message.sUserName);
+}
+
+void ChatClient::handleMessage(JoinMessage const& message)
+{
+	if (!message.hasRoom())
+		return;
+	// our own join is answered with the members, the joins of the others carry their name
+	if (message.hasUsers())
+	{
+		m_setRooms.insert(message.sRoom);
+		emit roomJoined(message.sRoom, message.lstUsers);
+	}
+	else if (message.hasUserName())
+		emit userJoinedRoom(message.sRoom, message.sUserName);
+}
+
+void ChatClient::handleMessage(LeaveMessage const& message)
+{
+	if (!message.hasRoom() || !message.hasUserName())
+		return;
+	if (message.sUserName.compare(m_sName, Qt::CaseInsensitive) == 0)
+	{
+		m_setRooms.remove(message.sRoom);
+		emit roomLeft(message.sRoom);
+	}
+	else
+		emit userLeftRoom(message.sRoom, message.sUserName);
+}
+
+void ChatClient::handleMessage(HistoryMessage const& message)
+{
+	// the senders and the texts go in pairs, a page where they don't is broken
+	if (message.lstSenders.size() != message.lstTexts.size())
+		return;
+	if (message.hasReason())
+	{
+		if (message.hasRoom())
+			emit roomHistoryFailed(message.sRoom, message.sReason);
+		else if (message.hasUserName())
+			emit historyFailed(message.sUserName, message.sReason);
+		return;
+	}
+	const qint64 nFirst = message.hasCursor() && !message.lstTexts.isEmpty() ? message.nCursor : 0;
+	if (message.hasRoom())
+		emit roomHistoryReceived(message.sRoom, message.lstSenders, message.lstTexts, nFirst);
+	else if (message.hasUserName())
+		emit historyReceived(message.sUserName, message.lstSenders, message.lstTexts, nFirst);
+}
+
+void ChatClient::handleMessage(LogoutMessage const&)
+{
+	// only sent by clients
+}
+
+void ChatClient::connectToServer(QHostAddress const& address, quint16 port)
+{
+	m_address = address;
+	m_nPort = port;
+	m_bReconnecting = false;
+	m_pReconnectTimer->stop();
+	connectToHost();
 }
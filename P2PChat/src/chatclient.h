@@ -2,10 +2,17 @@
 #define CHATCLIENT_H
 
 #include <QObject>
-#include <QTcpSocket>
+#include <QAbstractSocket>
+#include <QHostAddress>
+#include <QSet>
+#include <QStringList>
+#include "framecodec.h"
+#include "messagecodec.h"
+#include "messages.h"
 
-class QHostAddress;
-class QJsonDocument;
+class ClientConnection;
+class QThread;
+class QTimer;
 
 class ChatClient : public QObject
 {
@@ -16,31 +23,130 @@ class ChatClient : public QObject
 
 public:
 	explicit ChatClient(QObject *parent = nullptr);
+	~ChatClient();
 	QString getName() const;
 
 public slots:
 	void connectToServer(QHostAddress const& address, quint16 port);
 	void login(QString const& userName);
-	void sendMessage(QString const& sText, QString const& sReceiver);
+	// while the connection is being restored the messages wait in the outbox, false when it is full
+	bool sendMessage(QString const& sText, QString const& sReceiver);
+	bool joinRoom(QString const& sRoom);
+	bool leaveRoom(QString const& sRoom);
+	// one message for the whole room, the server fans it out to the members
+	bool sendRoomMessage(QString const& sText, QString const& sRoom);
+	// a page of the conversation preceding the message numbered nBefore, the newest page when nBefore is 0
+	void requestHistory(QString const& sUserName, qint64 nBefore = 0);
+	void requestRoomHistory(QString const& sRoom, qint64 nBefore = 0);
 	void disconnectFromHost();
 
 private slots:
-	void onReadyRead();
+	void onConnected();
+	void onDisconnected(qint64 nReceivedBytes);
+	void onError(QAbstractSocket::SocketError socketError, QAbstractSocket::SocketState socketState);
+	void onStateChanged(QAbstractSocket::SocketState socketState);
+	void onReconnectTimer();
+	void flushOutbound();
 signals:
+	// only for the connections asked for, the ones restored after a drop log in on their own
 	void connected();
-	void loggedIn();
+	// bResumed when the server kept the session of the dropped connection and replayed what we missed
+	void loggedIn(bool bResumed);
 	void loginError(QString const& sReason);
+	// the connection ended and won't be restored
 	void disconnected();
+	// the connection dropped after the login, attempt nAttempt to restore it starts in nDelayMs
+	void reconnecting(int nAttempt, int nDelayMs);
 	void messageReceived(QString const& sSender, QString const& sText);
 	void error(QAbstractSocket::SocketError socketError);
 	void userJoined(QString const& sUserName);
+	void rosterReceived(QStringList const& lstUserNames);
 	void userLeft(QString const& sUserName);
+	// we joined sRoom, the room is named as the server knows it
+	void roomJoined(QString const& sRoom, QStringList const& lstMembers);
+	void roomLeft(QString const& sRoom);
+	void userJoinedRoom(QString const& sRoom, QString const& sUserName);
+	void userLeftRoom(QString const& sRoom, QString const& sUserName);
+	void roomMessageReceived(QString const& sRoom, QString const& sSender, QString const& sText);
+	// oldest message first, nFirst is the number of the first message and 0 when the page is empty
+	void historyReceived(QString const& sUserName, QStringList const& lstSenders, QStringList const& lstTexts, qint64 nFirst);
+	void roomHistoryReceived(QString const& sRoom, QStringList const& lstSenders, QStringList const& lstTexts, qint64 nFirst);
+	// the server couldn't read the page, the history may go on before it and can be asked for again
+	void historyFailed(QString const& sUserName, QString const& sReason);
+	void roomHistoryFailed(QString const& sRoom, QString const& sReason);
 
 private:
-	QTcpSocket* m_pClientSocket;
+	// the socket lives in the network thread, the messages are decoded there and applied here in batches
+	QThread* m_pNetworkThread;
+	ClientConnection* m_pConnection;
+	// the state of the socket as of the last event applied
+	QAbstractSocket::SocketState m_socketState;
 	bool m_bLoggedIn;
 	QString m_sName;
-	void jsonReceived(QJsonObject const& doc);
+	// frames waiting for the end of the event loop iteration
+	QByteArray m_outbound;
+	bool m_bFlushScheduled;
+	// JSON until the server accepts CBOR in the login reply
+	WireEncoding m_encoding;
+	// handed out by the server at login, presented again to resume the session after a dropped connection
+	QString m_sSessionToken;
+	// bytes of frames the previous connection received before it dropped, the position the server replays from
+	qint64 m_nResumeFrom;
+	QHostAddress m_address;
+	quint16 m_nPort;
+	// set from a drop after the login until the next login
+	bool m_bReconnecting;
+	int m_nReconnectAttempt;
+	// waits out the backoff, then bounds the connection attempt
+	QTimer* m_pReconnectTimer;
+	// frames written while the connection is being restored, sent together right after the login
+	QByteArray m_outbox;
+	int m_nOutboxCount;
+	// joined again when the server didn't keep our session
+	QSet<QString> m_setRooms;
+	void handleMessage(LoginMessage const& message);
+	void handleMessage(TextMessage const& message);
+	void handleMessage(NewUserMessage const& message);
+	void handleMessage(UserDisconnectedMessage const& message);
+	void handleMessage(RosterMessage const& message);
+	void handleMessage(JoinMessage const& message);
+	void handleMessage(LeaveMessage const& message);
+	void handleMessage(HistoryMessage const& message);
+	void handleMessage(LogoutMessage const& message);
+	template <typename Message>
+	void queueMessage(Message const& message);
+	template <typename Message>
+	bool postMessage(Message const& message);
+	void scheduleFlush();
+	// counts a message into the outbox, false when it isn't kept or the outbox is full
+	bool reserveOutbox();
+	// the frames not written yet wait in the outbox after a drop, the ones over its limit are lost
+	void moveOutboundToOutbox();
+	void scheduleReconnect();
+	void connectToHost();
 };
 
+template <typename Message>
+void ChatClient::queueMessage(Message const& message)
+{
+	// serialized straight into the outgoing buffer
+	appendFrame(m_outbound, message, m_encoding);
+	scheduleFlush();
+}
+
+template <typename Message>
+bool ChatClient::postMessage(Message const& message)
+{
+	if (m_bLoggedIn)
+	{
+		queueMessage(message);
+		return true;
+	}
+	if (!reserveOutbox())
+		return false;
+	// JSON is understood whatever encoding the next login settles on
+	appendFrame(m_outbox, message, WireEncoding::Json);
+	return true;
+}
+
 #endif // CHATCLIENT_H
\ No newline at end of file
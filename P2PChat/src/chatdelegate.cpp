@@ -0,0 +1,66 @@
+#include "chatdelegate.h"
+#include "chatmodel.h"
+
+#include <QApplication>
+#include <QPainter>
+#include <QStyle>
+#include <QWidget>
+
+namespace
+{
+	// layouts kept, a few screens of rows
+	const int g_nCachedRows = 2048;
+	const int g_nVerticalMargin = 2;
+}
+
+ChatDelegate::ChatDelegate(QObject* parent)
+	: QStyledItemDelegate(parent),
+	m_cache(g_nCachedRows)
+{
+}
+
+void ChatDelegate::paint(QPainter* pPainter, QStyleOptionViewItem const& option, QModelIndex const& index) const
+{
+	QStyleOptionViewItem opt = option;
+	initStyleOption(&opt, index);
+	QStyle* pStyle = opt.widget ? opt.widget->style() : QApplication::style();
+	pStyle->drawPrimitive(QStyle::PE_PanelItemViewItem, &opt, pPainter, opt.widget);
+
+	const CacheKey key(index.model(), index.data(ChatModel::KeyRole).toUInt());
+	QStaticText* pText = m_cache.object(key);
+	// the header rows change their text when the name of the user does
+	if (!pText || pText->text() != opt.text)
+	{
+		pText = new QStaticText(opt.text);
+		pText->setTextFormat(Qt::PlainText);
+		pText->setPerformanceHint(QStaticText::AggressiveCaching);
+		pText->prepare(QTransform(), opt.font);
+		m_cache.insert(key, pText);
+	}
+
+	const QPalette::ColorGroup colorGroup = !(opt.state & QStyle::State_Enabled) ? QPalette::Disabled
+		: (opt.state & QStyle::State_Active) ? QPalette::Normal : QPalette::Inactive;
+	const QPalette::ColorRole colorRole = (opt.state & QStyle::State_Selected) ? QPalette::HighlightedText : QPalette::Text;
+	const QRect textRect = pStyle->subElementRect(QStyle::SE_ItemViewItemText, &opt, opt.widget);
+	const QSizeF textSize = pText->size();
+	qreal x = textRect.left();
+	if (opt.displayAlignment & Qt::AlignHCenter)
+		x += (textRect.width() - textSize.width()) / 2;
+	const qreal y = textRect.top() + (textRect.height() - textSize.height()) / 2;
+
+	pPainter->save();
+	pPainter->setClipRect(textRect);
+	pPainter->setFont(opt.font);
+	pPainter->setPen(opt.palette.color(colorGroup, colorRole));
+	pPainter->drawStaticText(QPointF(x, y), *pText);
+	pPainter->restore();
+}
+
+QSize ChatDelegate::sizeHint(QStyleOptionViewItem const& option, QModelIndex const& index) const
+{
+	// every row is one line, the bold headers and the italic notices are as high as the messages
+	QStyleOptionViewItem opt = option;
+	initStyleOption(&opt, index);
+	const QFontMetrics fontMetrics(opt.font);
+	return QSize(fontMetrics.horizontalAdvance(opt.text), fontMetrics.height() + 2 * g_nVerticalMargin);
+}
@@ -0,0 +1,25 @@
+#ifndef CHATDELEGATE_H
+#define CHATDELEGATE_H
+
+#include <QCache>
+#include <QPair>
+#include <QStaticText>
+#include <QStyledItemDelegate>
+
+// Paints the rows of a ChatModel. All the rows are one line high so the view can lay them out without asking
+// for each size, and the text layouts of the rows recently shown are cached.
+class ChatDelegate : public QStyledItemDelegate
+{
+public:
+	explicit ChatDelegate(QObject* parent = nullptr);
+
+	void paint(QPainter* pPainter, QStyleOptionViewItem const& option, QModelIndex const& index) const override;
+	QSize sizeHint(QStyleOptionViewItem const& option, QModelIndex const& index) const override;
+
+private:
+	// rows of different conversations can have the same key, the model tells them apart
+	typedef QPair<const void*, uint> CacheKey;
+	mutable QCache<CacheKey, QStaticText> m_cache;
+};
+
+#endif // CHATDELEGATE_H
@@ -0,0 +1,227 @@
+#include "chatmodel.h"
+
+#include <QBrush>
+#include <QColor>
+#include <QFont>
+
+namespace
+{
+	const int g_nInitialCapacity = 64;
+}
+
+ChatModel::ChatModel(QObject* parent)
+	: QAbstractListModel(parent),
+	m_nHead(0),
+	m_nCount(0),
+	m_nNextKey(0),
+	m_vecAuthors(1),
+	m_nLastAuthor(0)
+{
+}
+
+int ChatModel::rowCount(QModelIndex const& parent) const
+{
+	return parent.isValid() ? 0 : m_nCount;
+}
+
+QVariant ChatModel::data(QModelIndex const& index, int nRole) const
+{
+	if (!index.isValid() || index.row() >= m_nCount)
+		return QVariant();
+
+	Record const& record = at(index.row());
+	const RowKind rowKind = RowKind(record.nKind);
+	switch (nRole)
+	{
+	case Qt::DisplayRole:
+		return rowKind == HeaderRow ? headerText(record.nAuthor) : record.sText;
+	case Qt::TextAlignmentRole:
+		return int((rowKind == NoticeRow ? Qt::AlignHCenter : Qt::AlignLeft) | Qt::AlignVCenter);
+	case Qt::FontRole:
+	{
+		if (rowKind == MessageRow)
+			return QVariant();
+		QFont font;
+		font.setBold(rowKind == HeaderRow);
+		font.setItalic(rowKind == NoticeRow);
+		return font;
+	}
+	case Qt::ForegroundRole:
+		if (rowKind == HeaderRow)
+			return QBrush(QColor(0x66, 0xB2, 0xFF));
+		if (rowKind == NoticeRow)
+			return QBrush(Qt::gray);
+		return QVariant();
+	case AuthorRole:
+		return record.nAuthor ? QVariant(m_vecAuthors.at(int(record.nAuthor))) : QVariant();
+	case KindRole:
+		return int(rowKind);
+	case SequenceRole:
+		return record.nSequence;
+	case KeyRole:
+		return record.nKey;
+	default:
+		return QVariant();
+	}
+}
+
+void ChatModel::setSelfName(QString const& sName)
+{
+	if (m_sSelfName == sName)
+		return;
+	m_sSelfName = sName;
+	if (m_nCount > 0)
+		emit dataChanged(index(0), index(m_nCount - 1), { Qt::DisplayRole });
+}
+
+ChatModel::RowKind ChatModel::kind(int nRow) const
+{
+	return RowKind(at(nRow).nKind);
+}
+
+QString ChatModel::author(int nRow) const
+{
+	return m_vecAuthors.at(int(at(nRow).nAuthor));
+}
+
+QString ChatModel::text(int nRow) const
+{
+	return at(nRow).sText;
+}
+
+qint64 ChatModel::sequence(int nRow) const
+{
+	return at(nRow).nSequence;
+}
+
+void ChatModel::appendMessage(QString const& sAuthor, QString const& sText)
+{
+	const quint32 nAuthor = internAuthor(sAuthor);
+	const bool bHeader = nAuthor != m_nLastAuthor || m_nCount == 0;
+	const int nAdded = bHeader ? 2 : 1;
+	reserve(m_nCount + nAdded);
+
+	beginInsertRows(QModelIndex(), m_nCount, m_nCount + nAdded - 1);
+	const int nMask = m_vecRing.size() - 1;
+	if (bHeader)
+		m_vecRing[(m_nHead + m_nCount++) & nMask] = makeRecord(HeaderRow, nAuthor, QString(), 0);
+	m_vecRing[(m_nHead + m_nCount++) & nMask] = makeRecord(MessageRow, nAuthor, sText, 0);
+	m_nLastAuthor = nAuthor;
+	endInsertRows();
+}
+
+void ChatModel::appendNotice(QString const& sText)
+{
+	reserve(m_nCount + 1);
+	beginInsertRows(QModelIndex(), m_nCount, m_nCount);
+	m_vecRing[(m_nHead + m_nCount++) & (m_vecRing.size() - 1)] = makeRecord(NoticeRow, 0, sText, 0);
+	m_nLastAuthor = 0;
+	endInsertRows();
+}
+
+int ChatModel::prependMessages(QStringList const& lstSenders, QStringList const& lstTexts, int nCount, qint64 nFirst)
+{
+	if (nCount <= 0)
+		return 0;
+
+	const bool bWasEmpty = m_nCount == 0;
+	const quint32 nNewestAuthor = internAuthor(lstSenders.at(nCount - 1));
+	// the first message shown keeps its header only if the page ends with another author
+	if (!bWasEmpty && kind(0) == HeaderRow && at(0).nAuthor == nNewestAuthor)
+		removeFirstRows(1);
+
+	QVector<Record> vecPage;
+	vecPage.reserve(nCount * 2);
+	quint32 nLastAuthor = 0;
+	for (int nIndex = 0; nIndex < nCount; ++nIndex)
+	{
+		const quint32 nAuthor = internAuthor(lstSenders.at(nIndex));
+		if (nIndex == 0 || nAuthor != nLastAuthor)
+		{
+			vecPage.append(makeRecord(HeaderRow, nAuthor, QString(), 0));
+			nLastAuthor = nAuthor;
+		}
+		vecPage.append(makeRecord(MessageRow, nAuthor, lstTexts.at(nIndex), nFirst + nIndex));
+	}
+
+	reserve(m_nCount + vecPage.size());
+	beginInsertRows(QModelIndex(), 0, vecPage.size() - 1);
+	const int nMask = m_vecRing.size() - 1;
+	m_nHead = (m_nHead - vecPage.size()) & nMask;
+	for (int nIndex = 0; nIndex < vecPage.size(); ++nIndex)
+		m_vecRing[(m_nHead + nIndex) & nMask] = vecPage.at(nIndex);
+	m_nCount += vecPage.size();
+	if (bWasEmpty)
+		m_nLastAuthor = nLastAuthor;
+	endInsertRows();
+	return vecPage.size();
+}
+
+void ChatModel::removeFirstRows(int nCount)
+{
+	nCount = qMin(nCount, m_nCount);
+	if (nCount <= 0)
+		return;
+	beginRemoveRows(QModelIndex(), 0, nCount - 1);
+	const int nMask = m_vecRing.size() - 1;
+	// the texts are released right away, the slots are reused by the next rows
+	for (int nIndex = 0; nIndex < nCount; ++nIndex)
+		m_vecRing[(m_nHead + nIndex) & nMask].sText.clear();
+	m_nHead = (m_nHead + nCount) & nMask;
+	m_nCount -= nCount;
+	if (m_nCount == 0)
+		m_nLastAuthor = 0;
+	endRemoveRows();
+}
+
+ChatModel::Record const& ChatModel::at(int nRow) const
+{
+	Q_ASSERT(nRow >= 0 && nRow < m_nCount);
+	return m_vecRing.at((m_nHead + nRow) & (m_vecRing.size() - 1));
+}
+
+void ChatModel::reserve(int nCount)
+{
+	if (nCount <= m_vecRing.size())
+		return;
+	int nCapacity = qMax(g_nInitialCapacity, m_vecRing.size());
+	while (nCapacity < nCount)
+		nCapacity *= 2;
+
+	// the rows are unrolled to the start of the new ring
+	QVector<Record> vecRing(nCapacity);
+	for (int nRow = 0; nRow < m_nCount; ++nRow)
+		vecRing[nRow] = at(nRow);
+	m_vecRing.swap(vecRing);
+	m_nHead = 0;
+}
+
+ChatModel::Record ChatModel::makeRecord(RowKind kind, quint32 nAuthor, QString const& sText, qint64 nSequence)
+{
+	Record record;
+	record.sText = sText;
+	record.nSequence = nSequence;
+	record.nKey = m_nNextKey++;
+	record.nAuthor = nAuthor;
+	record.nKind = quint32(kind);
+	return record;
+}
+
+quint32 ChatModel::internAuthor(QString const& sAuthor)
+{
+	auto it = m_mapAuthors.constFind(sAuthor);
+	if (it != m_mapAuthors.constEnd())
+		return it.value();
+	const quint32 nAuthor = quint32(m_vecAuthors.size());
+	m_vecAuthors.append(sAuthor);
+	m_mapAuthors.insert(sAuthor, nAuthor);
+	return nAuthor;
+}
+
+QString ChatModel::headerText(quint32 nAuthor) const
+{
+	QString const& sAuthor = m_vecAuthors.at(int(nAuthor));
+	if (sAuthor.compare(m_sSelfName, Qt::CaseInsensitive) == 0)
+		return tr("Me:");
+	return sAuthor + QLatin1Char(':');
+}
@@ -0,0 +1,87 @@
+#ifndef CHATMODEL_H
+#define CHATMODEL_H
+
+#include <QAbstractListModel>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+// One conversation. The rows are compact records in a ring buffer, the fonts, colours and header texts are derived
+// from the kind of the row when asked for, so a row costs its text and a few bytes.
+class ChatModel : public QAbstractListModel
+{
+	Q_OBJECT
+	Q_DISABLE_COPY(ChatModel)
+
+public:
+	enum RowKind
+	{
+		HeaderRow,
+		MessageRow,
+		NoticeRow
+	};
+
+	enum Role
+	{
+		// author of the header rows and of the message rows, the notices have none
+		AuthorRole = Qt::UserRole,
+		KindRole,
+		// number of the message on the server, only for the messages loaded from the history
+		SequenceRole,
+		// identifies the row for as long as it is in the model, the rows move when older ones are prepended
+		KeyRole
+	};
+
+	explicit ChatModel(QObject* parent = nullptr);
+
+	int rowCount(QModelIndex const& parent = QModelIndex()) const override;
+	QVariant data(QModelIndex const& index, int nRole = Qt::DisplayRole) const override;
+
+	// the messages of this user get "Me:" as header
+	void setSelfName(QString const& sName);
+
+	RowKind kind(int nRow) const;
+	QString author(int nRow) const;
+	QString text(int nRow) const;
+	qint64 sequence(int nRow) const;
+
+	// the author is shown above the first of its consecutive messages
+	void appendMessage(QString const& sAuthor, QString const& sText);
+	// the next message shows its author again
+	void appendNotice(QString const& sText);
+	// the first nCount messages of a history page, oldest first and numbered from nFirst, go above the rows there are,
+	// returns the number of rows inserted
+	int prependMessages(QStringList const& lstSenders, QStringList const& lstTexts, int nCount, qint64 nFirst);
+	void removeFirstRows(int nCount);
+
+private:
+	struct Record
+	{
+		QString sText;
+		qint64 nSequence;
+		quint32 nKey;
+		quint32 nAuthor : 30;
+		quint32 nKind : 2;
+	};
+
+	// the ring keeps a power of two capacity so a row maps to its slot with a mask
+	Record const& at(int nRow) const;
+	void reserve(int nCount);
+	Record makeRecord(RowKind kind, quint32 nAuthor, QString const& sText, qint64 nSequence);
+	quint32 internAuthor(QString const& sAuthor);
+	QString headerText(quint32 nAuthor) const;
+
+	QVector<Record> m_vecRing;
+	int m_nHead;
+	int m_nCount;
+	quint32 m_nNextKey;
+	// the authors are stored once per conversation, index 0 is nobody
+	QVector<QString> m_vecAuthors;
+	QHash<QString, quint32> m_mapAuthors;
+	// author of the last row, the next message from someone else gets a header
+	quint32 m_nLastAuthor;
+	QString m_sSelfName;
+};
+
+#endif // CHATMODEL_H
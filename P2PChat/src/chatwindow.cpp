@@ -4,34 +4,67 @@
 #include <QInputDialog>
 #include <QMessageBox>
 #include <QRegExp>
+#include <QScrollBar>
 
 #include "chatclient.h"
+#include "chatdelegate.h"
+#include "chatmodel.h"
+#include "rostermodel.h"
 #include "serverdialog.h"
 #include "ui_chatwindow.h"
 
+namespace
+{
+	// rows kept of a conversation that is not shown
+	const int g_nRowsKept = 500;
+}
+
 
 ChatWindow::ChatWindow(QWidget* parent)
 	: QWidget(parent),
 	ui(new Ui::ChatWindow),
-	m_pChatClient(new ChatClient(this))
+	m_pChatClient(new ChatClient(this)),
+	m_pRosterModel(new RosterModel(this)),
+	m_bScrollScheduled(false)
 {
 	ui->setupUi(this);
+	ui->rosterView->setModel(m_pRosterModel);
+	// the rows are all one line high, the view lays them out without measuring each of them
+	ui->chatView->setItemDelegate(new ChatDelegate(ui->chatView));
+	ui->chatView->setUniformItemSizes(true);
 	
 	connect(m_pChatClient, &ChatClient::connected, this, &ChatWindow::connectedToServer);
 	connect(m_pChatClient, &ChatClient::loggedIn, this, &ChatWindow::loggedIn);
 	connect(m_pChatClient, &ChatClient::loginError, this, &ChatWindow::loginFailed);
 	connect(m_pChatClient, &ChatClient::messageReceived, this, &ChatWindow::messageReceived);
 	connect(m_pChatClient, &ChatClient::disconnected, this, &ChatWindow::disconnectedFromServer);
+	connect(m_pChatClient, &ChatClient::reconnecting, this, &ChatWindow::reconnecting);
 	connect(m_pChatClient, &ChatClient::error, this, &ChatWindow::error);
 	connect(m_pChatClient, &ChatClient::userJoined, this, &ChatWindow::userJoined);
+	connect(m_pChatClient, &ChatClient::rosterReceived, this, &ChatWindow::rosterReceived);
 	connect(m_pChatClient, &ChatClient::userLeft, this, &ChatWindow::userLeft);
+	connect(m_pChatClient, &ChatClient::roomJoined, this, &ChatWindow::roomJoined);
+	connect(m_pChatClient, &ChatClient::roomLeft, this, &ChatWindow::roomLeft);
+	connect(m_pChatClient, &ChatClient::userJoinedRoom, this, &ChatWindow::userJoinedRoom);
+	connect(m_pChatClient, &ChatClient::userLeftRoom, this, &ChatWindow::userLeftRoom);
+	connect(m_pChatClient, &ChatClient::roomMessageReceived, this, &ChatWindow::roomMessageReceived);
+	connect(m_pChatClient, &ChatClient::historyReceived, this, &ChatWindow::historyReceived);
+	connect(m_pChatClient, &ChatClient::roomHistoryReceived, this, &ChatWindow::roomHistoryReceived);
+	connect(m_pChatClient, &ChatClient::historyFailed, this, &ChatWindow::historyFailed);
+	connect(m_pChatClient, &ChatClient::roomHistoryFailed, this, &ChatWindow::roomHistoryFailed);
 
 	attemptConnection();
 
 	connect(ui->sendButton, &QPushButton::clicked, this, &ChatWindow::sendMessage);
 	connect(ui->messageEdit, &QLineEdit::returnPressed, this, &ChatWindow::sendMessage);
 
-	connect(ui->listWidget, &QListWidget::itemSelectionChanged, this, &ChatWindow::onChatChanged);
+	connect(ui->rosterView, &QListView::clicked, this, &ChatWindow::onChatClicked);
+	connect(ui->filterEdit, &QLineEdit::textChanged, this, &ChatWindow::onFilterChanged);
+	// older pages are loaded when the top is reached, or while the loaded ones don't fill the view
+	connect(ui->chatView->verticalScrollBar(), &QScrollBar::valueChanged, this, &ChatWindow::onChatScrolled);
+	connect(ui->chatView->verticalScrollBar(), &QScrollBar::rangeChanged, this, &ChatWindow::onChatScrolled);
+	connect(ui->joinRoomButton, &QPushButton::clicked, this, &ChatWindow::joinRoom);
+	connect(ui->leaveRoomButton, &QPushButton::clicked, this, &ChatWindow::leaveRoom);
 }
 
 ChatWindow::~ChatWindow()
@@ -41,19 +74,176 @@ ChatWindow::~ChatWindow()
 
 void ChatWindow::updateUserChatView()
 {
-	CQListWidgetItem* pItem = dynamic_cast<CQListWidgetItem*>(ui->listWidget->currentItem());
-	if (!pItem)
+	if (m_sCurrentKey.isEmpty())
 		return;
 
-	QString sUserName = pItem->data().toString();
-	assert(!sUserName.isEmpty());
-
-	QBrush brush = pItem->data(Qt::ForegroundRole).value<QBrush>();
-	bool bUserActive = !(brush.color() == Qt::darkRed);
+	bool bUserActive = m_pRosterModel->isOnline(m_sCurrentKey);
 
 	ui->chatView->setEnabled(bUserActive);
 	ui->sendButton->setEnabled(bUserActive);
 	ui->messageEdit->setEnabled(bUserActive);
+	ui->leaveRoomButton->setEnabled(bUserActive && isRoomKey(m_sCurrentKey));
+}
+
+QString ChatWindow::roomKey(QString const& sRoom)
+{
+	return QLatin1Char('#') + sRoom;
+}
+
+bool ChatWindow::isRoomKey(QString const& sKey)
+{
+	return sKey.startsWith(QLatin1Char('#'));
+}
+
+ChatModel* ChatWindow::chatModel(QString const& sKey)
+{
+	ChatModel*& pModel = m_mapChatModels[sKey];
+	if (!pModel)
+	{
+		pModel = new ChatModel(this);
+		pModel->setSelfName(m_pChatClient->getName());
+	}
+	return pModel;
+}
+
+void ChatWindow::openChat(QString const& sKey)
+{
+	const QString sPreviousKey = m_sCurrentKey;
+	m_sCurrentKey = sKey;
+	ui->chatView->setModel(chatModel(sKey));
+	ui->chatView->scrollToBottom();
+	if (sPreviousKey != sKey)
+		trimChat(sPreviousKey);
+	// only the newest page is fetched, the older ones wait for the user to scroll up
+	if (!m_mapHistory.value(sKey).bLoaded)
+		requestHistory(sKey);
+
+	m_pRosterModel->setUnread(sKey, false);
+	selectCurrentChat();
+
+	updateUserChatView();
+}
+
+void ChatWindow::selectCurrentChat()
+{
+	const QModelIndex currentIndex = m_pRosterModel->indexOf(m_sCurrentKey);
+	if (currentIndex.isValid())
+		ui->rosterView->setCurrentIndex(currentIndex);
+	else
+		ui->rosterView->selectionModel()->clear();
+}
+
+void ChatWindow::showActivity(QString const& sKey)
+{
+	if (m_sCurrentKey.compare(sKey, Qt::CaseInsensitive) == 0)
+	{
+		scheduleScrollToBottom();
+		return;
+	}
+
+	m_pRosterModel->setUnread(sKey, true);
+}
+
+void ChatWindow::scheduleScrollToBottom()
+{
+	// scrolling lays the view out right away, once per message would redo it for every row of a burst
+	if (m_bScrollScheduled)
+		return;
+	m_bScrollScheduled = true;
+	QMetaObject::invokeMethod(this, 
+		[this]() -> void 
+		{
+			m_bScrollScheduled = false;
+			ui->chatView->scrollToBottom();
+		}, 
+		Qt::QueuedConnection
+	);
+}
+
+void ChatWindow::requestHistory(QString const& sKey)
+{
+	HistoryState& state = m_mapHistory[sKey];
+	if (state.bLoading || state.bComplete)
+		return;
+	state.bLoading = true;
+	const qint64 nBefore = state.bLoaded ? state.nCursor : 0;
+	if (isRoomKey(sKey))
+		m_pChatClient->requestRoomHistory(sKey.mid(1), nBefore);
+	else
+		m_pChatClient->requestHistory(sKey, nBefore);
+}
+
+void ChatWindow::prependHistory(QString const& sKey, QStringList const& lstSenders, QStringList const& lstTexts, qint64 nFirst)
+{
+	ChatModel* pModel = m_mapChatModels.value(sKey);
+	if (!pModel)
+		return;
+	HistoryState& state = m_mapHistory[sKey];
+	const bool bNewest = !state.bLoaded;
+	state.bLoaded = true;
+	state.nCursor = nFirst;
+	// numbering starts at 1, nothing precedes the first message
+	state.bComplete = nFirst <= 1;
+
+	int nCount = lstTexts.size();
+	if (bNewest)
+	{
+		// the messages received since the login are at the end of the newest page as well
+		QVector<int> vecLive;
+		for (int nRow = 0; nRow < pModel->rowCount() && vecLive.size() < nCount; ++nRow)
+		{
+			if (pModel->kind(nRow) == ChatModel::MessageRow)
+				vecLive.append(nRow);
+		}
+		for (int nOverlap = qMin(nCount, vecLive.size()); nOverlap > 0; --nOverlap)
+		{
+			bool bMatch = true;
+			for (int nIndex = 0; nIndex < nOverlap && bMatch; ++nIndex)
+			{
+				const int nLiveRow = vecLive.at(nIndex);
+				const int nPageIndex = nCount - nOverlap + nIndex;
+				bMatch = lstSenders.at(nPageIndex).compare(pModel->author(nLiveRow), Qt::CaseInsensitive) == 0 && lstTexts.at(nPageIndex) == pModel->text(nLiveRow);
+			}
+			if (bMatch)
+			{
+				nCount -= nOverlap;
+				break;
+			}
+		}
+	}
+	if (nCount == 0)
+		return;
+
+	const int nInserted = pModel->prependMessages(lstSenders, lstTexts, nCount, nFirst);
+
+	if (sKey != m_sCurrentKey)
+		return;
+	// after an older page the message that was on top stays in place, the older ones appear above it
+	if (bNewest)
+		ui->chatView->scrollToBottom();
+	else
+		ui->chatView->scrollTo(pModel->index(nInserted, 0), QAbstractItemView::PositionAtTop);
+}
+
+void ChatWindow::trimChat(QString const& sKey)
+{
+	ChatModel* pModel = m_mapChatModels.value(sKey);
+	if (!pModel || pModel->rowCount() <= g_nRowsKept)
+		return;
+	// cut before a header or a notice, a message is never left without its author above it
+	int nCut = pModel->rowCount() - g_nRowsKept;
+	while (nCut < pModel->rowCount() && pModel->kind(nCut) == ChatModel::MessageRow)
+		++nCut;
+
+	qint64 nNewestDropped = 0;
+	for (int nRow = 0; nRow < nCut; ++nRow)
+		nNewestDropped = qMax(nNewestDropped, pModel->sequence(nRow));
+	pModel->removeFirstRows(nCut);
+	if (nNewestDropped == 0)
+		return;
+	HistoryState& state = m_mapHistory[sKey];
+	state.nCursor = nNewestDropped + 1;
+	state.bComplete = false;
 }
 
 void ChatWindow::closeEvent(QCloseEvent* pEvent)
@@ -98,14 +288,34 @@ void ChatWindow::attemptLogin(const QString& userName)
 	m_pChatClient->login(userName);
 }
 
-void ChatWindow::loggedIn()
+void ChatWindow::loggedIn(bool bResumed)
 {
 	ui->loginLabel->setText("Logged in as: <b>" + m_pChatClient->getName() + "</b>");
+	for (ChatModel* pModel : qAsConst(m_mapChatModels))
+		pModel->setSelfName(m_pChatClient->getName());
+	if (ui->rosterView->isEnabled())
+	{
+		// back after a drop, a new session is followed by the roster and the rooms joined again,
+		// until then nobody is known to be online
+		if (!bResumed)
+			m_pRosterModel->setAllOffline();
+		updateUserChatView();
+		// the pages asked for before the drop are not coming, the one shown is asked for again
+		for (HistoryState& state : m_mapHistory)
+			state.bLoading = false;
+		if (!m_sCurrentKey.isEmpty() && !m_mapHistory.value(m_sCurrentKey).bLoaded)
+			requestHistory(m_sCurrentKey);
+		else
+			onChatScrolled();
+		return;
+	}
 	// once successully logged in, enable the ui to display and send messages
 	ui->sendButton->setEnabled(false);
 	ui->messageEdit->setEnabled(false);
 	ui->chatView->setEnabled(true);
-	ui->listWidget->setEnabled(true);
+	ui->rosterView->setEnabled(true);
+	ui->filterEdit->setEnabled(true);
+	ui->joinRoomButton->setEnabled(true);
 }
 
 void ChatWindow::loginFailed(QString const& sReason)
@@ -119,61 +329,10 @@ void ChatWindow::loginFailed(QString const& sReason)
 
 void ChatWindow::messageReceived(QString const& sSender, QString const& sText)
 {
-	assert(m_mapChatModels.contains(sSender));
-
-	CQStandardItemModel* pModel = m_mapChatModels[sSender];
-
-	int nRowCount = pModel->rowCount();
-	if (pModel->data().toBool() || nRowCount == 0) 
-	{
-		// set the flag to false
-		pModel->setData(false);
-		QFont boldFont;
-		boldFont.setBold(true);
-		
-		pModel->insertRows(nRowCount, 2);
-		
-		pModel->setData(pModel->index(nRowCount, 0), sSender + QLatin1Char(':'));
-		
-		pModel->setData(pModel->index(nRowCount, 0), int(Qt::AlignLeft | Qt::AlignVCenter), Qt::TextAlignmentRole);
-		
-		pModel->setData(pModel->index(nRowCount, 0), boldFont, Qt::FontRole);
-		pModel->setData(pModel->index(nRowCount, 0), QBrush(QColor("#66B2FF")), Qt::ForegroundRole);
-
-		++nRowCount;
-	}
-	else 
-	{
-		pModel->insertRow(nRowCount);
-	}
-
-	pModel->setData(pModel->index(nRowCount, 0), sText);
-	pModel->setData(pModel->index(nRowCount, 0), int(Qt::AlignLeft | Qt::AlignVCenter), Qt::TextAlignmentRole);
-	
-	auto* pCurrentItem = dynamic_cast<CQListWidgetItem*>(ui->listWidget->currentItem());
-	if (pCurrentItem)
-	{
-		QString sCurrentUser = pCurrentItem->data().toString();
-		if (sCurrentUser.compare(sSender, Qt::CaseInsensitive) == 0)
-		{
-			ui->chatView->scrollToBottom();
-			return;
-		}
-	}
-
-	for (qint32 nIndex = 0; nIndex < ui->listWidget->count(); ++nIndex)
-	{
-		auto* pItem = dynamic_cast<CQListWidgetItem*>(ui->listWidget->item(nIndex));
-		if (!pItem)
-			continue;
-		QString sUserName = pItem->data().toString();
-		if (sUserName.compare(sSender, Qt::CaseInsensitive) == 0)
-		{
-			if (!pItem->text().endsWith("*"))
-				pItem->setText(pItem->text() + "*");
-			return;
-		}
-	}
+	// delivered from the mailbox of the server, the sender may not be online anymore
+	m_pRosterModel->add(sSender, sSender, false);
+	chatModel(sSender)->appendMessage(sSender, sText);
+	showActivity(sSender);
 }
 
 void ChatWindow::sendMessage()
@@ -181,48 +340,24 @@ void ChatWindow::sendMessage()
 	if (ui->messageEdit->text().isEmpty())
 		return;
 
-	auto* pCurrentItem = dynamic_cast<CQListWidgetItem*>(ui->listWidget->currentItem());
-	if (!pCurrentItem)
-		return;
-	QString sCurrentUser = pCurrentItem->data().toString();
-
-	m_pChatClient->sendMessage(ui->messageEdit->text(), sCurrentUser);
-
-	CQStandardItemModel* pModel = m_mapChatModels[sCurrentUser];
-	if (!pModel)
+	if (m_sCurrentKey.isEmpty())
 		return;
 
-	int nRowCount = pModel->rowCount();
-
-	if (!pModel->data().toBool() || nRowCount == 0)
+	const bool bSent = isRoomKey(m_sCurrentKey)
+		? m_pChatClient->sendRoomMessage(ui->messageEdit->text(), m_sCurrentKey.mid(1))
+		: m_pChatClient->sendMessage(ui->messageEdit->text(), m_sCurrentKey);
+	if (!bSent)
 	{
-		QFont boldFont;
-		boldFont.setBold(true);
-
-		pModel->insertRows(nRowCount, 2);
-		
-		pModel->setData(pModel->index(nRowCount, 0), tr("Me:"));
-		
-		pModel->setData(pModel->index(nRowCount, 0), int(Qt::AlignLeft | Qt::AlignVCenter), Qt::TextAlignmentRole);
-		pModel->setData(pModel->index(nRowCount, 0), boldFont, Qt::FontRole);
-		pModel->setData(pModel->index(nRowCount, 0), QBrush(QColor("#66B2FF")), Qt::ForegroundRole);
-
-		++nRowCount;
-	}
-	else
-	{
-		pModel->insertRow(nRowCount);
+		// the text stays in the editor to be sent once the connection is back
+		QMessageBox::warning(this, tr("Error"), tr("Too many messages are waiting for the connection, please try again later"));
+		return;
 	}
 
-	pModel->setData(pModel->index(nRowCount, 0), ui->messageEdit->text());
-	pModel->setData(pModel->index(nRowCount, 0), int(Qt::AlignLeft | Qt::AlignVCenter), Qt::TextAlignmentRole);
+	chatModel(m_sCurrentKey)->appendMessage(m_pChatClient->getName(), ui->messageEdit->text());
 
 	ui->messageEdit->clear();
 
 	ui->chatView->scrollToBottom();
-
-	// reset the flag for last printed username
-	pModel->setData(true);
 }
 
 void ChatWindow::disconnectedFromServer()
@@ -233,76 +368,155 @@ void ChatWindow::disconnectedFromServer()
 	ui->sendButton->setEnabled(false);
 	ui->messageEdit->setEnabled(false);
 	ui->chatView->setEnabled(false);
-	ui->listWidget->setEnabled(false);
+	ui->rosterView->setEnabled(false);
+	ui->filterEdit->setEnabled(false);
+	ui->joinRoomButton->setEnabled(false);
+	ui->leaveRoomButton->setEnabled(false);
+
+	// the pages asked for are not coming anymore
+	for (HistoryState& state : m_mapHistory)
+		state.bLoading = false;
+}
+
+void ChatWindow::reconnecting(int nAttempt, int nDelayMs)
+{
+	// the conversations stay usable, what is sent meanwhile goes out once the connection is back
+	ui->loginLabel->setText(tr("Connection lost, reconnecting in %1 s (attempt %2)").arg((nDelayMs + 999) / 1000).arg(nAttempt));
 }
 
 void ChatWindow::userJoined(QString const& sUserName)
 {
-	if (m_mapChatModels.contains(sUserName))
+	// only the roster entry, the conversation gets its model once it is used
+	m_pRosterModel->add(sUserName, sUserName, true);
+	m_pRosterModel->setOnline(sUserName, true);
+	if (m_sCurrentKey.compare(sUserName, Qt::CaseInsensitive) == 0)
+		updateUserChatView();
+}
+
+void ChatWindow::rosterReceived(QStringList const& lstUserNames)
+{
+	// sorted in one go, the roster of a large server would be inserted one user at a time otherwise
+	m_pRosterModel->addOnline(lstUserNames);
+	selectCurrentChat();
+	updateUserChatView();
+}
+
+void ChatWindow::userLeft(QString const& sUserName)
+{
+	m_pRosterModel->setOnline(sUserName, false);
+	if (m_sCurrentKey.compare(sUserName, Qt::CaseInsensitive) == 0)
+		updateUserChatView();
+}
+
+void ChatWindow::joinRoom()
+{
+	QString sRoom = QInputDialog::getText(this, tr("Join Room"), tr("Room"));
+	if (sRoom.isEmpty())
+		return;
+
+	// the same rule as for the user names
+	QRegExp re("^[\\da-zA-Z_]*$");
+	if (!re.exactMatch(sRoom))
 	{
-		for (qint32 nIndex = 0; nIndex < ui->listWidget->count(); ++nIndex)
-		{
-			auto* pItem = dynamic_cast<CQListWidgetItem*>(ui->listWidget->item(nIndex));
-			if (!pItem)
-				continue;
+		QMessageBox::warning(this, tr("Error"), tr("Invalid room name. Please try another one"));
+		return;
+	}
+	if (!m_pChatClient->joinRoom(sRoom))
+		QMessageBox::warning(this, tr("Error"), tr("Too many messages are waiting for the connection, please try again later"));
+}
 
-			QString sItemUserName = pItem->data().toString();
+void ChatWindow::leaveRoom()
+{
+	if (isRoomKey(m_sCurrentKey) && !m_pChatClient->leaveRoom(m_sCurrentKey.mid(1)))
+		QMessageBox::warning(this, tr("Error"), tr("Too many messages are waiting for the connection, please try again later"));
+}
 
-			if (sUserName.compare(sItemUserName, Qt::CaseInsensitive) == 0)
-			{
-				pItem->setData(Qt::ForegroundRole, QBrush(Qt::black));
+void ChatWindow::roomJoined(QString const& sRoom, QStringList const& lstMembers)
+{
+	const QString sKey = roomKey(sRoom);
+	ChatModel* pModel = chatModel(sKey);
+	m_pRosterModel->add(sKey, sKey, true);
+	m_pRosterModel->setOnline(sKey, true);
 
-				auto* pCurrentItem = dynamic_cast<CQListWidgetItem*>(ui->listWidget->currentItem());
-				if (pCurrentItem)
-				{
-					QString sCurrentUser = pCurrentItem->data().toString();;
-					if (sCurrentUser.compare(sUserName, Qt::CaseInsensitive) == 0)
-						updateUserChatView();
-				}
+	if (lstMembers.isEmpty())
+		pModel->appendNotice(tr("You are the only member of %1").arg(sRoom));
+	else
+		pModel->appendNotice(tr("Members of %1: %2").arg(sRoom, lstMembers.join(QLatin1String(", "))));
 
-				break;
-			}
-		}
+	// open the conversation of the room that was just joined, the filter must not hide it
+	if (!m_pRosterModel->indexOf(sKey).isValid())
+		ui->filterEdit->clear();
+	openChat(sKey);
+}
 
+void ChatWindow::roomLeft(QString const& sRoom)
+{
+	const QString sKey = roomKey(sRoom);
+	ChatModel* pModel = m_mapChatModels.value(sKey);
+	if (!pModel)
 		return;
-	}
+	pModel->appendNotice(tr("You left %1").arg(sRoom));
 
-	CQStandardItemModel* pModel = new CQStandardItemModel(this);
-	pModel->insertColumn(0);
-	pModel->setData(false);
+	m_pRosterModel->setOnline(sKey, false);
+	updateUserChatView();
+}
 
-	m_mapChatModels[sUserName] = pModel;
+void ChatWindow::userJoinedRoom(QString const& sRoom, QString const& sUserName)
+{
+	const QString sKey = roomKey(sRoom);
+	ChatModel* pModel = m_mapChatModels.value(sKey);
+	if (!pModel)
+		return;
+	pModel->appendNotice(tr("%1 joined").arg(sUserName));
+	showActivity(sKey);
+}
 
-	CQListWidgetItem* pNewItem = new CQListWidgetItem(sUserName, ui->listWidget);
-	pNewItem->setData(sUserName);
-	ui->listWidget->addItem(pNewItem);
+void ChatWindow::userLeftRoom(QString const& sRoom, QString const& sUserName)
+{
+	const QString sKey = roomKey(sRoom);
+	ChatModel* pModel = m_mapChatModels.value(sKey);
+	if (!pModel)
+		return;
+	pModel->appendNotice(tr("%1 left").arg(sUserName));
+	showActivity(sKey);
 }
 
-void ChatWindow::userLeft(QString const& sUserName)
+void ChatWindow::roomMessageReceived(QString const& sRoom, QString const& sSender, QString const& sText)
 {
-	for (qint32 nIndex = 0; nIndex < ui->listWidget->count(); ++nIndex)
-	{
-		auto* pItem = dynamic_cast<CQListWidgetItem*>(ui->listWidget->item(nIndex));
-		if (!pItem)
-			continue;
+	const QString sKey = roomKey(sRoom);
+	ChatModel* pModel = m_mapChatModels.value(sKey);
+	if (!pModel)
+		return;
+	pModel->appendMessage(sSender, sText);
+	showActivity(sKey);
+}
 
-		QString sItemUserName = pItem->data().toString();
+void ChatWindow::historyReceived(QString const& sUserName, QStringList const& lstSenders, QStringList const& lstTexts, qint64 nFirst)
+{
+	prependHistory(sUserName, lstSenders, lstTexts, nFirst);
+	m_mapHistory[sUserName].bLoading = false;
+	onChatScrolled();
+}
 
-		if (sUserName.compare(sItemUserName, Qt::CaseInsensitive) == 0)
-		{
-			pItem->setData(Qt::ForegroundRole, QBrush(Qt::darkRed));
+void ChatWindow::roomHistoryReceived(QString const& sRoom, QStringList const& lstSenders, QStringList const& lstTexts, qint64 nFirst)
+{
+	const QString sKey = roomKey(sRoom);
+	prependHistory(sKey, lstSenders, lstTexts, nFirst);
+	m_mapHistory[sKey].bLoading = false;
+	onChatScrolled();
+}
 
-			auto* pCurrentItem = dynamic_cast<CQListWidgetItem*>(ui->listWidget->currentItem());
-			if (pCurrentItem)
-			{
-				QString sCurrentUser = pCurrentItem->data().toString();
-				if (sCurrentUser.compare(sUserName, Qt::CaseInsensitive) == 0)
-					updateUserChatView();
-			}
+void ChatWindow::historyFailed(QString const& sUserName, QString const& sReason)
+{
+	// the cursor and what is loaded stay as they are, the next scroll to the top asks again
+	m_mapHistory[sUserName].bLoading = false;
+	if (ChatModel* pModel = m_mapChatModels.value(sUserName))
+		pModel->appendNotice(tr("Older messages couldn't be loaded: %1").arg(sReason));
+}
 
-			break;
-		}
-	}
+void ChatWindow::roomHistoryFailed(QString const& sRoom, QString const& sReason)
+{
+	historyFailed(roomKey(sRoom), sReason);
 }
 
 void ChatWindow::error(QAbstractSocket::SocketError socketError)
@@ -369,19 +583,22 @@ void ChatWindow::error(QAbstractSocket::SocketError socketError)
 	ui->chatView->setEnabled(false);
 }
 
-void ChatWindow::onChatChanged()
+void ChatWindow::onChatClicked(QModelIndex const& index)
 {
-	auto* pItem = dynamic_cast<CQListWidgetItem*>(ui->listWidget->currentItem());
-	if (!pItem)
-		return;
-
-	QString sUserName = pItem->data().toString();
-	QStandardItemModel* pModel = m_mapChatModels[sUserName];
-	ui->chatView->setModel(pModel);
+	openChat(index.data(RosterModel::KeyRole).toString());
+}
 
-	QString sItemText = pItem->text();
-	if (sItemText.endsWith("*"))
-		pItem->setText(sItemText.left(sItemText.length() - 1));
+void ChatWindow::onFilterChanged(QString const& sText)
+{
+	m_pRosterModel->setFilter(sText);
+	selectCurrentChat();
+}
 
-	updateUserChatView();
+void ChatWindow::onChatScrolled()
+{
+	if (m_sCurrentKey.isEmpty() || !m_mapHistory.value(m_sCurrentKey).bLoaded)
+		return;
+	QScrollBar* pScrollBar = ui->chatView->verticalScrollBar();
+	if (pScrollBar->value() == pScrollBar->minimum())
+		requestHistory(m_sCurrentKey);
 }
@@ -2,70 +2,19 @@
 #define CHATWINDOW_H
 
 #include <QAbstractSocket>
-#include <QStandardItemModel>
-#include <QListWidget>
+#include <QHash>
 #include <QWidget>
 
 class ChatClient;
-class QListWidgetItem;
+class ChatModel;
+class QModelIndex;
+class RosterModel;
 
 namespace Ui
 {
 	class ChatWindow;
 }
 
-class CQStandardItemModel : public QStandardItemModel
-{
-public:
-	explicit CQStandardItemModel(QObject* parent = nullptr)
-		: QStandardItemModel(parent)
-	{ }
-
-	using QStandardItemModel::setData;
-	using QStandardItemModel::data;
-
-	void setData(QVariant const& vtData)
-	{
-		m_vtData = vtData;
-	}
-
-	QVariant data() const
-	{
-		return m_vtData;
-	}
-
-private:
-	QVariant m_vtData;
-};
-
-class CQListWidgetItem : public QListWidgetItem
-{
-public:
-	explicit CQListWidgetItem(QListWidget* parent = nullptr)
-		: QListWidgetItem(parent)
-	{ }
-
-	explicit CQListWidgetItem(const QString& text, QListWidget* parent = nullptr)
-		: QListWidgetItem(text, parent)
-	{ }
-
-	using QListWidgetItem::setData;
-	using QListWidgetItem::data;
-
-	void setData(QVariant const& vtData)
-	{
-		m_vtData = vtData;
-	}
-
-	QVariant data() const
-	{
-		return m_vtData;
-	}
-
-private:
-	QVariant m_vtData;
-};
-
 class ChatWindow : public QWidget
 {
 	Q_OBJECT
@@ -77,6 +26,23 @@ public:
 
 private:
 	void updateUserChatView();
+	// conversations are keyed by user name, or by '#' and the room name since user names can't hold a '#'
+	static QString roomKey(QString const& sRoom);
+	static bool isRoomKey(QString const& sKey);
+	// the model of a conversation is created the first time it is opened, gets a message or a room is joined
+	ChatModel* chatModel(QString const& sKey);
+	void openChat(QString const& sKey);
+	// selects the conversation shown, when the filter lets it through
+	void selectCurrentChat();
+	// scrolls the conversation when it is shown, otherwise marks it as unread
+	void showActivity(QString const& sKey);
+	// the messages of a batch are scrolled to once, after the view laid them out together
+	void scheduleScrollToBottom();
+	// asks the server for the page preceding the oldest message loaded, or for the newest page
+	void requestHistory(QString const& sKey);
+	void prependHistory(QString const& sKey, QStringList const& lstSenders, QStringList const& lstTexts, qint64 nFirst);
+	// drops the oldest messages of a conversation that is not shown, they are fetched again when scrolled to
+	void trimChat(QString const& sKey);
 
 private:
 	void closeEvent(QCloseEvent* pEvent) override;
@@ -85,21 +51,50 @@ private slots:
 	void attemptConnection();
 	void connectedToServer();
 	void attemptLogin(QString const& sUserName);
-	void loggedIn();
+	void loggedIn(bool bResumed);
 	void loginFailed(QString const& sReason);
 	void messageReceived(QString const& sSender, QString const& sText);
 	void sendMessage();
 	void disconnectedFromServer();
+	void reconnecting(int nAttempt, int nDelayMs);
 	void userJoined(QString const& sUserName);
+	void rosterReceived(QStringList const& lstUserNames);
 	void userLeft(QString const& sUserName);
+	void joinRoom();
+	void leaveRoom();
+	void roomJoined(QString const& sRoom, QStringList const& lstMembers);
+	void roomLeft(QString const& sRoom);
+	void userJoinedRoom(QString const& sRoom, QString const& sUserName);
+	void userLeftRoom(QString const& sRoom, QString const& sUserName);
+	void roomMessageReceived(QString const& sRoom, QString const& sSender, QString const& sText);
+	void historyReceived(QString const& sUserName, QStringList const& lstSenders, QStringList const& lstTexts, qint64 nFirst);
+	void roomHistoryReceived(QString const& sRoom, QStringList const& lstSenders, QStringList const& lstTexts, qint64 nFirst);
+	void historyFailed(QString const& sUserName, QString const& sReason);
+	void roomHistoryFailed(QString const& sRoom, QString const& sReason);
 	void error(QAbstractSocket::SocketError socketError);
 
-	void onChatChanged();
+	void onChatClicked(QModelIndex const& index);
+	void onFilterChanged(QString const& sText);
+	void onChatScrolled();
 
 private:
+	// what is loaded of the history the server keeps for a conversation
+	struct HistoryState
+	{
+		// number of the oldest message loaded, the next page ends right before it
+		qint64 nCursor = 0;
+		bool bLoaded = false;
+		bool bLoading = false;
+		bool bComplete = false;
+	};
+
 	Ui::ChatWindow* ui;
 	ChatClient* m_pChatClient;
-	QHash<QString, CQStandardItemModel*> m_mapChatModels;
+	RosterModel* m_pRosterModel;
+	QHash<QString, ChatModel*> m_mapChatModels;
+	QHash<QString, HistoryState> m_mapHistory;
+	QString m_sCurrentKey;
+	bool m_bScrollScheduled;
 };
 
 #endif // CHATWINDOW_H
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include "clientconnection.h"
+
+#include <QTcpSocket>
+#include <QTimer>
+
+namespace
+{
+	// one batch per frame at 60 Hz
+	const int g_nBatchIntervalMs = 16;
+}
+
+ClientConnection::ClientConnection(QObject* pReceiver, Decoder decoder)
+	: QObject(nullptr),
+	m_pReceiver(pReceiver),
+	m_decode(std::move(decoder)),
+	m_pSocket(new QTcpSocket(this)),
+	m_nReceivedBytes(0),
+	m_nInFlight(0),
+	m_pFlushTimer(new QTimer(this))
+{
+	m_pFlushTimer->setSingleShot(true);
+	connect(m_pFlushTimer, &QTimer::timeout, this, &ClientConnection::flushEvents);
+	connect(m_pSocket, &QTcpSocket::readyRead, this, &ClientConnection::onReadyRead);
+	connect(m_pSocket, &QTcpSocket::connected, this,
+		[this]() -> void
+		{
+			m_nReceivedBytes = 0;
+			post([this]() -> void { emit connected(); });
+		}
+	);
+	connect(m_pSocket, &QTcpSocket::disconnected, this,
+		[this]() -> void
+		{
+			m_decoder.reset();
+			const qint64 nReceivedBytes = m_nReceivedBytes;
+			post([this, nReceivedBytes]() -> void { emit disconnected(nReceivedBytes); });
+		}
+	);
+	connect(m_pSocket, &QTcpSocket::stateChanged, this,
+		[this](QAbstractSocket::SocketState socketState) -> void
+		{
+			post([this, socketState]() -> void { emit stateChanged(socketState); });
+		}
+	);
+	connect(m_pSocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this,
+		[this](QAbstractSocket::SocketError socketError) -> void
+		{
+			const QAbstractSocket::SocketState socketState = m_pSocket->state();
+			post([this, socketError, socketState]() -> void { emit error(socketError, socketState); });
+		}
+	);
+}
+
+void ClientConnection::connectToHost(QHostAddress const& address, quint16 nPort)
+{
+	m_pSocket->connectToHost(address, nPort);
+}
+
+void ClientConnection::write(QByteArray const& data)
+{
+	if (m_pSocket->state() == QAbstractSocket::ConnectedState)
+		m_pSocket->write(data);
+}
+
+void ClientConnection::disconnectFromHost()
+{
+	m_pSocket->disconnectFromHost();
+}
+
+void ClientConnection::abort()
+{
+	m_pSocket->abort();
+}
+
+void ClientConnection::close()
+{
+	// the event loop stops next, a farewell still buffered wouldn't be written otherwise
+	m_pSocket->flush();
+	m_pSocket->abort();
+	m_pFlushTimer->stop();
+}
+
+void ClientConnection::onReadyRead()
+{
+	m_decoder.readFrom(m_pSocket);
+	// the frames are views into the decoder buffer, the events hold what was decoded from them
+	QByteArray payload;
+	while (m_decoder.nextFrame(payload))
+	{
+		// counted like the server counts what it writes, the length prefix included
+		m_nReceivedBytes += payload.size() + 4;
+		if (Event event = m_decode(payload))
+			m_vecEvents.append(std::move(event));
+	}
+	flushEvents();
+	// the stream can't be resynchronised after an oversized frame
+	if (m_decoder.hasError())
+		m_pSocket->abort();
+}
+
+void ClientConnection::post(Event event)
+{
+	m_vecEvents.append(std::move(event));
+	flushEvents();
+}
+
+void ClientConnection::flushEvents()
+{
+	if (m_vecEvents.isEmpty() || m_nInFlight.loadAcquire())
+		return;
+	// an idle connection hands its events over right away, a busy one once per interval
+	if (m_lastFlush.isValid() && m_lastFlush.elapsed() < g_nBatchIntervalMs)
+	{
+		if (!m_pFlushTimer->isActive())
+			m_pFlushTimer->start(int(g_nBatchIntervalMs - m_lastFlush.elapsed()));
+		return;
+	}
+	m_lastFlush.start();
+	m_nInFlight.storeRelease(1);
+
+	QVector<Event> vecEvents;
+	vecEvents.swap(m_vecEvents);
+	QMetaObject::invokeMethod(m_pReceiver,
+		[this, vecEvents]() -> void
+		{
+			for (Event const& event : vecEvents)
+				event();
+			m_nInFlight.storeRelease(0);
+			// what arrived while the receiver was busy is the next batch
+			QMetaObject::invokeMethod(this, &ClientConnection::flushEvents, Qt::QueuedConnection);
+		},
+		Qt::QueuedConnection
+	);
+}
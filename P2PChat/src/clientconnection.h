@@ -0,0 +1,68 @@
+#ifndef CLIENTCONNECTION_H
+#define CLIENTCONNECTION_H
+
+#include <QAbstractSocket>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QObject>
+#include <QVector>
+#include <functional>
+#include "framecodec.h"
+
+class QTcpSocket;
+class QTimer;
+
+// The socket of the client and the decoding of its frames, living in the network thread.
+// The decoded messages and the socket notifications reach the receiver as one ordered stream of events, handed over
+// in batches of at most one per frame interval and never more than one at a time, so a burst costs the receiver
+// one update instead of one per message.
+class ClientConnection : public QObject
+{
+	Q_OBJECT
+	Q_DISABLE_COPY(ClientConnection)
+
+public:
+	// runs in the thread of the receiver
+	typedef std::function<void()> Event;
+	// called in the network thread, turns a frame into the event applying it, an empty event drops the frame
+	typedef std::function<Event(QByteArray const& payload)> Decoder;
+
+	ClientConnection(QObject* pReceiver, Decoder decoder);
+
+public slots:
+	void connectToHost(QHostAddress const& address, quint16 nPort);
+	void write(QByteArray const& data);
+	void disconnectFromHost();
+	void abort();
+	// writes what can be written and closes the socket, called before the thread stops
+	void close();
+
+signals:
+	// emitted in the thread of the receiver, in order with the messages
+	void connected();
+	// nReceivedBytes counts the frames received on the connection, length prefix included
+	void disconnected(qint64 nReceivedBytes);
+	void error(QAbstractSocket::SocketError socketError, QAbstractSocket::SocketState socketState);
+	void stateChanged(QAbstractSocket::SocketState socketState);
+
+private slots:
+	void onReadyRead();
+	void flushEvents();
+
+private:
+	void post(Event event);
+
+	QObject* m_pReceiver;
+	Decoder m_decode;
+	QTcpSocket* m_pSocket;
+	FrameDecoder m_decoder;
+	qint64 m_nReceivedBytes;
+	QVector<Event> m_vecEvents;
+	// set while a batch waits for the receiver, the events arriving meanwhile join the next one
+	QAtomicInteger<int> m_nInFlight;
+	QElapsedTimer m_lastFlush;
+	QTimer* m_pFlushTimer;
+};
+
+#endif // CLIENTCONNECTION_H
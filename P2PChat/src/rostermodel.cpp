@@ -0,0 +1,230 @@
+#include "rostermodel.h"
+
+#include <QBrush>
+#include <QFont>
+#include <algorithm>
+
+RosterModel::RosterModel(QObject* parent)
+	: QAbstractListModel(parent),
+	m_nFirst(0),
+	m_nLast(0)
+{
+}
+
+int RosterModel::rowCount(QModelIndex const& parent) const
+{
+	return parent.isValid() ? 0 : m_nLast - m_nFirst;
+}
+
+QVariant RosterModel::data(QModelIndex const& index, int nRole) const
+{
+	if (!index.isValid() || index.row() >= rowCount())
+		return QVariant();
+
+	Entry const& entry = m_vecEntries.at(m_nFirst + index.row());
+	switch (nRole)
+	{
+	case Qt::DisplayRole:
+		return entry.sTitle;
+	case Qt::ForegroundRole:
+		return QBrush(entry.bOnline ? Qt::black : Qt::darkRed);
+	case Qt::FontRole:
+	{
+		// a conversation with messages not seen yet is shown in bold
+		if (!entry.bUnread)
+			return QVariant();
+		QFont font;
+		font.setBold(true);
+		return font;
+	}
+	case KeyRole:
+		return entry.sKey;
+	default:
+		return QVariant();
+	}
+}
+
+void RosterModel::add(QString const& sKey, QString const& sTitle, bool bOnline)
+{
+	const QString sFolded = sKey.toCaseFolded();
+	const int nEntry = lowerBound(sFolded);
+	if (nEntry < m_vecEntries.size() && m_vecEntries.at(nEntry).sFolded == sFolded)
+		return;
+
+	const Entry entry = { sKey, sFolded, sTitle, bOnline, false };
+	if (!sFolded.startsWith(m_sPrefix))
+	{
+		m_vecEntries.insert(nEntry, entry);
+		// filtered out, it lands either before or after the rows shown
+		if (nEntry <= m_nFirst)
+		{
+			++m_nFirst;
+			++m_nLast;
+		}
+		return;
+	}
+	const int nRow = nEntry - m_nFirst;
+	beginInsertRows(QModelIndex(), nRow, nRow);
+	m_vecEntries.insert(nEntry, entry);
+	++m_nLast;
+	endInsertRows();
+}
+
+void RosterModel::addOnline(QStringList const& lstKeys)
+{
+	QVector<Entry> vecAdded;
+	for (QString const& sKey : lstKeys)
+	{
+		const int nEntry = find(sKey);
+		if (nEntry >= 0)
+		{
+			m_vecEntries[nEntry].bOnline = true;
+			updateEntry(nEntry);
+			continue;
+		}
+		vecAdded.append({ sKey, sKey.toCaseFolded(), sKey, true, false });
+	}
+	if (vecAdded.isEmpty())
+		return;
+
+	beginResetModel();
+	m_vecEntries += vecAdded;
+	auto lessFolded = [](Entry const& left, Entry const& right) -> bool { return left.sFolded < right.sFolded; };
+	std::stable_sort(m_vecEntries.begin(), m_vecEntries.end(), lessFolded);
+	// the roster can't name a user twice, the first entry wins if it does anyway
+	auto sameFolded = [](Entry const& left, Entry const& right) -> bool { return left.sFolded == right.sFolded; };
+	m_vecEntries.erase(std::unique(m_vecEntries.begin(), m_vecEntries.end(), sameFolded), m_vecEntries.end());
+	m_nFirst = lowerBound(m_sPrefix);
+	m_nLast = int(std::partition_point(m_vecEntries.begin() + m_nFirst, m_vecEntries.end(),
+		[this](Entry const& entry) -> bool { return entry.sFolded.startsWith(m_sPrefix); }) - m_vecEntries.begin());
+	endResetModel();
+}
+
+bool RosterModel::contains(QString const& sKey) const
+{
+	return find(sKey) >= 0;
+}
+
+QModelIndex RosterModel::indexOf(QString const& sKey) const
+{
+	const int nEntry = find(sKey);
+	if (nEntry < m_nFirst || nEntry >= m_nLast)
+		return QModelIndex();
+	return index(nEntry - m_nFirst);
+}
+
+bool RosterModel::isOnline(QString const& sKey) const
+{
+	const int nEntry = find(sKey);
+	return nEntry >= 0 && m_vecEntries.at(nEntry).bOnline;
+}
+
+void RosterModel::setOnline(QString const& sKey, bool bOnline)
+{
+	const int nEntry = find(sKey);
+	if (nEntry < 0 || m_vecEntries.at(nEntry).bOnline == bOnline)
+		return;
+	m_vecEntries[nEntry].bOnline = bOnline;
+	updateEntry(nEntry);
+}
+
+void RosterModel::setAllOffline()
+{
+	for (Entry& entry : m_vecEntries)
+		entry.bOnline = false;
+	if (rowCount() > 0)
+		emit dataChanged(index(0), index(rowCount() - 1), { Qt::ForegroundRole });
+}
+
+void RosterModel::setUnread(QString const& sKey, bool bUnread)
+{
+	const int nEntry = find(sKey);
+	if (nEntry < 0 || m_vecEntries.at(nEntry).bUnread == bUnread)
+		return;
+	m_vecEntries[nEntry].bUnread = bUnread;
+	updateEntry(nEntry);
+}
+
+void RosterModel::setFilter(QString const& sPrefix)
+{
+	const QString sFolded = sPrefix.toCaseFolded();
+	if (sFolded == m_sPrefix)
+		return;
+
+	// typing one more letter narrows the range shown, only that range is searched
+	const bool bNarrowing = sFolded.startsWith(m_sPrefix);
+	auto itFrom = m_vecEntries.begin() + (bNarrowing ? m_nFirst : 0);
+	auto itTo = bNarrowing ? m_vecEntries.begin() + m_nLast : m_vecEntries.end();
+	itFrom = std::lower_bound(itFrom, itTo, sFolded, [](Entry const& entry, QString const& sValue) -> bool { return entry.sFolded < sValue; });
+	itTo = std::partition_point(itFrom, itTo, [&sFolded](Entry const& entry) -> bool { return entry.sFolded.startsWith(sFolded); });
+	m_sPrefix = sFolded;
+	const int nFirst = int(itFrom - m_vecEntries.begin());
+	const int nLast = int(itTo - m_vecEntries.begin());
+
+	// the rows still shown stay in place, the views keep their selection on them
+	if (nLast <= m_nFirst || nFirst >= m_nLast)
+	{
+		if (m_nLast > m_nFirst)
+		{
+			beginRemoveRows(QModelIndex(), 0, m_nLast - m_nFirst - 1);
+			m_nLast = m_nFirst;
+			endRemoveRows();
+		}
+		m_nFirst = m_nLast = nFirst;
+		if (nLast > nFirst)
+		{
+			beginInsertRows(QModelIndex(), 0, nLast - nFirst - 1);
+			m_nLast = nLast;
+			endInsertRows();
+		}
+		return;
+	}
+	if (nFirst > m_nFirst)
+	{
+		beginRemoveRows(QModelIndex(), 0, nFirst - m_nFirst - 1);
+		m_nFirst = nFirst;
+		endRemoveRows();
+	}
+	else if (nFirst < m_nFirst)
+	{
+		beginInsertRows(QModelIndex(), 0, m_nFirst - nFirst - 1);
+		m_nFirst = nFirst;
+		endInsertRows();
+	}
+	if (nLast < m_nLast)
+	{
+		beginRemoveRows(QModelIndex(), nLast - m_nFirst, m_nLast - m_nFirst - 1);
+		m_nLast = nLast;
+		endRemoveRows();
+	}
+	else if (nLast > m_nLast)
+	{
+		beginInsertRows(QModelIndex(), m_nLast - m_nFirst, nLast - m_nFirst - 1);
+		m_nLast = nLast;
+		endInsertRows();
+	}
+}
+
+int RosterModel::lowerBound(QString const& sFolded) const
+{
+	auto it = std::lower_bound(m_vecEntries.begin(), m_vecEntries.end(), sFolded,
+		[](Entry const& entry, QString const& sValue) -> bool { return entry.sFolded < sValue; });
+	return int(it - m_vecEntries.begin());
+}
+
+int RosterModel::find(QString const& sKey) const
+{
+	const QString sFolded = sKey.toCaseFolded();
+	const int nEntry = lowerBound(sFolded);
+	if (nEntry < m_vecEntries.size() && m_vecEntries.at(nEntry).sFolded == sFolded)
+		return nEntry;
+	return -1;
+}
+
+void RosterModel::updateEntry(int nEntry)
+{
+	if (nEntry < m_nFirst || nEntry >= m_nLast)
+		return;
+	const QModelIndex entryIndex = index(nEntry - m_nFirst);
+	emit dataChanged(entryIndex, entryIndex);
+}
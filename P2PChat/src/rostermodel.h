@@ -0,0 +1,66 @@
+#ifndef ROSTERMODEL_H
+#define ROSTERMODEL_H
+
+#include <QAbstractListModel>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+// The conversations of the list, users and rooms, kept sorted by their case folded key.
+// A key is found with a binary search, and the entries starting with the filter prefix are one contiguous range,
+// so filtering only moves the bounds of the rows shown.
+class RosterModel : public QAbstractListModel
+{
+	Q_OBJECT
+	Q_DISABLE_COPY(RosterModel)
+
+public:
+	enum Role
+	{
+		KeyRole = Qt::UserRole
+	};
+
+	explicit RosterModel(QObject* parent = nullptr);
+
+	int rowCount(QModelIndex const& parent = QModelIndex()) const override;
+	QVariant data(QModelIndex const& index, int nRole = Qt::DisplayRole) const override;
+
+	// adds the conversation when it is missing, the key is compared without case
+	void add(QString const& sKey, QString const& sTitle, bool bOnline);
+	// the roster sent at login, inserted and sorted in one go
+	void addOnline(QStringList const& lstKeys);
+	bool contains(QString const& sKey) const;
+	// invalid when the conversation is missing or filtered out
+	QModelIndex indexOf(QString const& sKey) const;
+
+	bool isOnline(QString const& sKey) const;
+	void setOnline(QString const& sKey, bool bOnline);
+	void setAllOffline();
+	void setUnread(QString const& sKey, bool bUnread);
+
+	// shows the conversations whose key starts with sPrefix, all of them when it is empty
+	void setFilter(QString const& sPrefix);
+
+private:
+	struct Entry
+	{
+		QString sKey;
+		QString sFolded;
+		QString sTitle;
+		bool bOnline;
+		bool bUnread;
+	};
+
+	// position of the entry or of where it would be inserted
+	int lowerBound(QString const& sFolded) const;
+	int find(QString const& sKey) const;
+	void updateEntry(int nEntry);
+
+	QVector<Entry> m_vecEntries;
+	QString m_sPrefix;
+	// the entries shown are [m_nFirst, m_nLast)
+	int m_nFirst;
+	int m_nLast;
+};
+
+#endif // ROSTERMODEL_H
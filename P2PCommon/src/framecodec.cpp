@@ -0,0 +1,148 @@
+#include "framecodec.h"
+
+#include <QIODevice>
+#include <QtEndian>
+#include <cstring>
+
+namespace
+{
+	const int g_nHeaderSize = int(sizeof(quint32));
+	// QDataStream writes a null QByteArray with this size
+	const quint32 g_nNullSize = 0xFFFFFFFF;
+	const int g_nReceiveBufferInitial = 64 * 1024;
+}
+
+QByteArray FrameEncoder::encode(QByteArray const& payload)
+{
+	QByteArray frame;
+	frame.reserve(g_nHeaderSize + payload.size());
+	append(frame, payload);
+	return frame;
+}
+
+void FrameEncoder::append(QByteArray& out, QByteArray const& payload)
+{
+	const int nOffset = out.size();
+	out.resize(nOffset + g_nHeaderSize);
+	qToBigEndian<quint32>(quint32(payload.size()), out.data() + nOffset);
+	out += payload;
+}
+
+int FrameEncoder::begin(QByteArray& out)
+{
+	const int nHeaderPos = out.size();
+	out.resize(nHeaderPos + g_nHeaderSize);
+	return nHeaderPos;
+}
+
+void FrameEncoder::finish(QByteArray& out, int nHeaderPos)
+{
+	qToBigEndian<quint32>(quint32(out.size() - nHeaderPos - g_nHeaderSize), out.data() + nHeaderPos);
+}
+
+FrameDecoder::FrameDecoder(int nMaxFrameSize)
+	: m_nReadPos(0)
+	, m_state(State::Header)
+	, m_nPayloadSize(0)
+	, m_nMaxFrameSize(nMaxFrameSize)
+	, m_bError(false)
+{
+	m_buffer.reserve(g_nReceiveBufferInitial);
+}
+
+void FrameDecoder::setMaxFrameSize(int nMaxFrameSize)
+{
+	m_nMaxFrameSize = nMaxFrameSize;
+}
+
+int FrameDecoder::maxFrameSize() const
+{
+	return m_nMaxFrameSize;
+}
+
+char* FrameDecoder::prepareAppend(int nBytes)
+{
+	const int nPending = m_buffer.size() - m_nReadPos;
+	if (m_nReadPos > 0 && (nPending == 0 || m_nReadPos >= m_buffer.capacity() / 2))
+	{
+		// slide the unconsumed bytes to the front, at most once per half buffer so it stays linear
+		if (nPending > 0)
+			std::memmove(m_buffer.data(), m_buffer.constData() + m_nReadPos, size_t(nPending));
+		m_buffer.resize(nPending);
+		m_nReadPos = 0;
+	}
+	int nRequired = m_buffer.size() + nBytes;
+	// a partially received payload will need its full size, grow once for it
+	if (m_state == State::Payload)
+		nRequired = qMax(nRequired, m_nReadPos + m_nPayloadSize);
+	if (nRequired > m_buffer.capacity())
+		m_buffer.reserve(qMax(nRequired, m_buffer.capacity() * 2));
+
+	const int nOffset = m_buffer.size();
+	m_buffer.resize(nOffset + nBytes);
+	return m_buffer.data() + nOffset;
+}
+
+void FrameDecoder::readFrom(QIODevice* pDevice)
+{
+	const qint64 nAvailable = pDevice->bytesAvailable();
+	if (nAvailable <= 0 || m_bError)
+		return;
+	const int nToRead = int(nAvailable);
+	char* pDest = prepareAppend(nToRead);
+	const qint64 nRead = pDevice->read(pDest, nToRead);
+	m_buffer.resize(m_buffer.size() - nToRead + int(qMax<qint64>(nRead, 0)));
+}
+
+void FrameDecoder::feed(QByteArray const& data)
+{
+	if (data.isEmpty() || m_bError)
+		return;
+	std::memcpy(prepareAppend(data.size()), data.constData(), size_t(data.size()));
+}
+
+bool FrameDecoder::nextFrame(QByteArray& frame)
+{
+	if (m_bError)
+		return false;
+	if (m_state == State::Header)
+	{
+		if (m_buffer.size() - m_nReadPos < g_nHeaderSize)
+			return false;
+		const quint32 nSize = qFromBigEndian<quint32>(m_buffer.constData() + m_nReadPos);
+		m_nReadPos += g_nHeaderSize;
+		if (nSize == g_nNullSize)
+		{
+			frame = QByteArray();
+			return true;
+		}
+		if (nSize > quint32(m_nMaxFrameSize))
+		{
+			m_bError = true;
+			return false;
+		}
+		m_nPayloadSize = int(nSize);
+		m_state = State::Payload;
+	}
+	// the header is consumed once, waiting for the rest of a payload costs nothing per segment
+	if (m_buffer.size() - m_nReadPos < m_nPayloadSize)
+		return false;
+	frame = QByteArray::fromRawData(m_buffer.constData() + m_nReadPos, m_nPayloadSize);
+	m_nReadPos += m_nPayloadSize;
+	m_state = State::Header;
+	return true;
+}
+
+bool FrameDecoder::hasError() const
+{
+	return m_bError;
+}
+
+void FrameDecoder::reset()
+{
+	m_buffer.resize(0);
+	m_nReadPos = 0;
+	m_state = State::Header;
+	m_nPayloadSize = 0;
+	m_bError = false;
+}
@@ -0,0 +1,65 @@
+#ifndef FRAMECODEC_H
+#define FRAMECODEC_H
+
+#include <QByteArray>
+
+class QIODevice;
+
+// Frames on the wire are a big endian quint32 size followed by the payload,
+// the same layout QDataStream uses for a QByteArray.
+class FrameEncoder
+{
+public:
+	static QByteArray encode(QByteArray const& payload);
+	// appends the frame of payload to out, used to batch several frames into one buffer
+	static void append(QByteArray& out, QByteArray const& payload);
+	// for payloads serialized straight into out: begin reserves the header and returns its position,
+	// finish writes the size of everything appended since
+	static int begin(QByteArray& out);
+	static void finish(QByteArray& out, int nHeaderPos);
+};
+
+// Incremental decoder over a reusable receive buffer. Every received byte is looked at once,
+// a frame arriving in many segments is not parsed again for each of them.
+class FrameDecoder
+{
+public:
+	static const int s_nMaxFrameSizeDefault = 16 * 1024 * 1024;
+
+	explicit FrameDecoder(int nMaxFrameSize = s_nMaxFrameSizeDefault);
+
+	void setMaxFrameSize(int nMaxFrameSize);
+	int maxFrameSize() const;
+
+	// appends what is available on the device to the receive buffer.
+	// frames returned by nextFrame before this call are no longer valid afterwards
+	void readFrom(QIODevice* pDevice);
+	// appends data to the receive buffer, with the same rule as readFrom
+	void feed(QByteArray const& data);
+	// on success frame is a view into the receive buffer, no copy is made.
+	// returns false when no complete frame is buffered or after an error
+	bool nextFrame(QByteArray& frame);
+	// a frame announced a size above the maximum, the stream can't be trusted anymore
+	bool hasError() const;
+	void reset();
+
+private:
+	enum class State
+	{
+		Header,
+		Payload
+	};
+
+	// makes room for nBytes more at the end of the buffer, dropping what was already consumed
+	char* prepareAppend(int nBytes);
+
+	QByteArray m_buffer;
+	// start of the unconsumed data in m_buffer
+	int m_nReadPos;
+	State m_state;
+	int m_nPayloadSize;
+	int m_nMaxFrameSize;
+	bool m_bError;
+};
+
+#endif // FRAMECODEC_H
\ No newline at end of file
@@ -0,0 +1,130 @@
+#include "latencyhistogram.h"
+
+#include <QtAlgorithms>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+	// 2^5 linear buckets below 32, then 16 buckets per power of two
+	const int g_nSubBucketBits = 5;
+	const int g_nSubBuckets = 1 << g_nSubBucketBits;
+	const int g_nHalfSubBuckets = g_nSubBuckets / 2;
+	// values up to 2^40, 12 days in microseconds, 18 minutes in nanoseconds
+	const int g_nValueBits = 40;
+	const qint64 g_nMaxValue = (Q_INT64_C(1) << g_nValueBits) - 1;
+	const int g_nBucketCount = (g_nValueBits - g_nSubBucketBits + 2) * g_nHalfSubBuckets;
+}
+
+LatencyHistogram::LatencyHistogram()
+	: m_vecCounts(g_nBucketCount, 0),
+	m_nCount(0),
+	m_nSum(0),
+	m_nMin(std::numeric_limits<qint64>::max()),
+	m_nMax(0)
+{
+}
+
+void LatencyHistogram::record(qint64 nValue)
+{
+	nValue = qBound(Q_INT64_C(0), nValue, g_nMaxValue);
+	++m_vecCounts[bucketOf(nValue)];
+	++m_nCount;
+	m_nSum += nValue;
+	m_nMin = qMin(m_nMin, nValue);
+	m_nMax = qMax(m_nMax, nValue);
+}
+
+void LatencyHistogram::merge(LatencyHistogram const& other)
+{
+	if (other.m_nCount == 0)
+		return;
+	qint64* pCounts = m_vecCounts.data();
+	qint64 const* pOtherCounts = other.m_vecCounts.constData();
+	for (int nBucket = 0; nBucket < g_nBucketCount; ++nBucket)
+		pCounts[nBucket] += pOtherCounts[nBucket];
+	m_nCount += other.m_nCount;
+	m_nSum += other.m_nSum;
+	m_nMin = qMin(m_nMin, other.m_nMin);
+	m_nMax = qMax(m_nMax, other.m_nMax);
+}
+
+void LatencyHistogram::reset()
+{
+	m_vecCounts.fill(0);
+	m_nCount = 0;
+	m_nSum = 0;
+	m_nMin = std::numeric_limits<qint64>::max();
+	m_nMax = 0;
+}
+
+qint64 LatencyHistogram::count() const
+{
+	return m_nCount;
+}
+
+qint64 LatencyHistogram::sum() const
+{
+	return m_nSum;
+}
+
+qint64 LatencyHistogram::min() const
+{
+	return m_nCount ? m_nMin : 0;
+}
+
+qint64 LatencyHistogram::max() const
+{
+	return m_nMax;
+}
+
+double LatencyHistogram::mean() const
+{
+	return m_nCount ? double(m_nSum) / double(m_nCount) : 0.0;
+}
+
+qint64 LatencyHistogram::percentile(double dPercentile) const
+{
+	if (m_nCount == 0)
+		return 0;
+	const double dRank = std::ceil(qBound(0.0, dPercentile, 100.0) / 100.0 * double(m_nCount));
+	const qint64 nRank = qMax(Q_INT64_C(1), qint64(dRank));
+	qint64 nSeen = 0;
+	for (int nBucket = 0; nBucket < g_nBucketCount; ++nBucket)
+	{
+		nSeen += m_vecCounts.at(nBucket);
+		// the bucket bound is an overestimate, the exact extremes are known
+		if (nSeen >= nRank)
+			return qBound(m_nMin, bucketUpperBound(nBucket), m_nMax);
+	}
+	return m_nMax;
+}
+
+int LatencyHistogram::bucketCount() const
+{
+	return g_nBucketCount;
+}
+
+qint64 LatencyHistogram::bucketUpperBound(int nBucket) const
+{
+	if (nBucket < g_nSubBuckets)
+		return nBucket;
+	const int nShift = nBucket / g_nHalfSubBuckets - 1;
+	const qint64 nSubBucket = nBucket - nShift * g_nHalfSubBuckets;
+	return ((nSubBucket + 1) << nShift) - 1;
+}
+
+qint64 LatencyHistogram::bucketValueCount(int nBucket) const
+{
+	return m_vecCounts.at(nBucket);
+}
+
+int LatencyHistogram::bucketOf(qint64 nValue)
+{
+	if (nValue < g_nSubBuckets)
+		return int(nValue);
+	// the top g_nSubBucketBits bits of the value pick the sub bucket within its power of two
+	const int nHighestBit = 63 - int(qCountLeadingZeroBits(quint64(nValue)));
+	const int nShift = nHighestBit - g_nSubBucketBits + 1;
+	return nShift * g_nHalfSubBuckets + int(nValue >> nShift);
+}
@@ -0,0 +1,45 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <QtGlobal>
+#include <QVector>
+
+// Histogram of durations with the layout of an HDR histogram: every power of two is split into the same number
+// of linear sub buckets, so a value is kept within about 3% of itself whatever its magnitude and recording it
+// is a shift and an increment. The unit is the caller's: values are capped at 2^40, about 12 days in
+// microseconds but only about 18 minutes in nanoseconds.
+// Not thread safe, each thread records into its own histogram and they are merged for reporting.
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	// negative values count as 0, values past the highest bucket as the highest one
+	void record(qint64 nValue);
+	void merge(LatencyHistogram const& other);
+	void reset();
+
+	qint64 count() const;
+	qint64 sum() const;
+	qint64 min() const;
+	qint64 max() const;
+	double mean() const;
+	// the value at or below which dPercentile percent of the recorded values are, 0 when nothing was recorded
+	qint64 percentile(double dPercentile) const;
+
+	// the buckets in increasing order, for the exporters
+	int bucketCount() const;
+	qint64 bucketUpperBound(int nBucket) const;
+	qint64 bucketValueCount(int nBucket) const;
+
+private:
+	static int bucketOf(qint64 nValue);
+
+	QVector<qint64> m_vecCounts;
+	qint64 m_nCount;
+	qint64 m_nSum;
+	qint64 m_nMin;
+	qint64 m_nMax;
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -0,0 +1,147 @@
+#include "messagecodec.h"
+
+namespace
+{
+	// QString::trimmed() would change the text when it starts or ends with a space or a non ASCII character
+	bool needsTrim(QByteArray const& text)
+	{
+		const quint8 nFirst = quint8(text.front());
+		const quint8 nLast = quint8(text.back());
+		return nFirst <= ' ' || nFirst >= 0x80 || nLast <= ' ' || nLast >= 0x80;
+	}
+
+	// well formed UTF-8 as QString::fromUtf8 reads it without replacements: no overlong forms, no surrogates,
+	// nothing above U+10FFFF
+	bool isValidUtf8(QByteArray const& text)
+	{
+		const quint8* pByte = reinterpret_cast<const quint8*>(text.constData());
+		const quint8* const pEnd = pByte + text.size();
+		while (pByte != pEnd)
+		{
+			const quint8 nLead = *pByte++;
+			if (nLead < 0x80)
+				continue;
+			int nFollowing;
+			quint8 nMin = 0x80;
+			quint8 nMax = 0xBF;
+			if (nLead >= 0xC2 && nLead <= 0xDF)
+			{
+				nFollowing = 1;
+			}
+			else if (nLead >= 0xE0 && nLead <= 0xEF)
+			{
+				nFollowing = 2;
+				if (nLead == 0xE0)
+					nMin = 0xA0;
+				else if (nLead == 0xED)
+					nMax = 0x9F;
+			}
+			else if (nLead >= 0xF0 && nLead <= 0xF4)
+			{
+				nFollowing = 3;
+				if (nLead == 0xF0)
+					nMin = 0x90;
+				else if (nLead == 0xF4)
+					nMax = 0x8F;
+			}
+			else
+			{
+				return false;
+			}
+			if (pEnd - pByte < nFollowing || *pByte < nMin || *pByte > nMax)
+				return false;
+			for (++pByte, --nFollowing; nFollowing > 0; --nFollowing, ++pByte)
+			{
+				if (*pByte < 0x80 || *pByte > 0xBF)
+					return false;
+			}
+		}
+		return true;
+	}
+}
+
+WireEncoding MessageCodec::detect(QByteArray const& payload)
+{
+	return WireReader::detect(payload);
+}
+
+bool MessageCodec::scanDirectMessage(QByteArray const& payload, DirectMessage& message)
+{
+	WireReader reader(payload);
+	if (!reader.beginMap())
+		return false;
+	bool bText = false;
+	QByteArray receiver;
+	QByteArray text;
+	int nKey;
+	while (reader.nextKey(nKey))
+	{
+		bool bRead;
+		switch (nKey)
+		{
+		case int(WireKey::Type):
+		{
+			MessageType type;
+			bRead = reader.readType(type);
+			bText = type == MessageType::Text;
+			break;
+		}
+		case int(WireKey::Receiver):
+			bRead = reader.readUtf8View(receiver);
+			break;
+		case int(WireKey::Text):
+			bRead = reader.readUtf8View(text);
+			break;
+		case int(WireKey::Room):
+			// room messages are fanned out by ChatServer
+			return false;
+		default:
+			bRead = reader.skipValue();
+			break;
+		}
+		if (!bRead)
+			return false;
+	}
+	if (!reader.atEnd() || !bText || receiver.isEmpty() || text.isEmpty() || needsTrim(text))
+		return false;
+	// relayed as they are, malformed text is left to the typed path like any other invalid message
+	if (!isValidUtf8(receiver) || !isValidUtf8(text))
+		return false;
+	message.receiver = receiver;
+	message.text = text;
+	return true;
+}
+
+QByteArray MessageCodec::encodeDirectMessage(QByteArray const& text, QByteArray const& sender, WireEncoding encoding)
+{
+	QByteArray payload;
+	payload.reserve(text.size() + sender.size() + 48);
+	WireWriter writer(payload, encoding);
+	writer.beginMap(3);
+	writer.writeKey(WireKey::Type);
+	writer.writeType(MessageType::Text);
+	writer.writeKey(WireKey::Text);
+	writer.writeUtf8(text);
+	writer.writeKey(WireKey::Sender);
+	writer.writeUtf8(sender);
+	writer.endMap();
+	return payload;
+}
+
+QLatin1String MessageCodec::encodingName(WireEncoding encoding)
+{
+	return encoding == WireEncoding::Cbor ? QLatin1String("cbor") : QLatin1String("json");
+}
+
+bool MessageCodec::parseEncodingName(QString const& sName, WireEncoding& encoding)
+{
+	for (WireEncoding candidate : { WireEncoding::Json, WireEncoding::Cbor })
+	{
+		if (sName.compare(encodingName(candidate), Qt::CaseInsensitive) == 0)
+		{
+			encoding = candidate;
+			return true;
+		}
+	}
+	return false;
+}
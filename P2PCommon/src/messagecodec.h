@@ -0,0 +1,38 @@
+#ifndef MESSAGECODEC_H
+#define MESSAGECODEC_H
+
+#include <QByteArray>
+#include <QLatin1String>
+#include <QString>
+#include "wireformat.h"
+
+// Routing fields of a direct message, views into the scanned payload
+struct DirectMessage
+{
+	QByteArray receiver;
+	QByteArray text;
+};
+
+// Helpers around the message payloads carried by the frames, the messages themselves are the typed ones of messages.h.
+// Every peer starts with JSON, a client listing "cbor" in the "encodings" of its login is answered with
+// "encoding": "cbor" in the successful login reply, and both sides switch to CBOR from the next frame on.
+// The receiving side recognises the encoding of each payload from its first byte, so old JSON only peers keep working.
+// In CBOR the well known keys, and the well known values of "type", are written as small integers.
+// This class tells the encoding of a payload, relays the direct messages without parsing them into a typed message
+// and names the encodings for the login.
+class MessageCodec
+{
+public:
+	static WireEncoding detect(QByteArray const& payload);
+
+	// Relay fast path: finds type, receiver and text of a direct message without building a TextMessage.
+	// Fails for anything the slow path has to look at, escaped JSON strings, text needing a trim or malformed UTF-8.
+	static bool scanDirectMessage(QByteArray const& payload, DirectMessage& message);
+	// builds the forwarded message around the UTF-8 text and sender without converting them
+	static QByteArray encodeDirectMessage(QByteArray const& text, QByteArray const& sender, WireEncoding encoding);
+
+	static QLatin1String encodingName(WireEncoding encoding);
+	static bool parseEncodingName(QString const& sName, WireEncoding& encoding);
+};
+
+#endif // MESSAGECODEC_H
\ No newline at end of file
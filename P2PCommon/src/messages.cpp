@@ -0,0 +1,89 @@
+#include "messages.h"
+
+#define P2P_WRITE_String(writer, value) writer.writeString(value)
+#define P2P_WRITE_Bool(writer, value) writer.writeBool(value)
+#define P2P_WRITE_Int(writer, value) writer.writeInt(value)
+#define P2P_WRITE_StringList(writer, value) writer.writeStringList(value)
+#define P2P_READ_String(reader, value) reader.readString(value)
+#define P2P_READ_Bool(reader, value) reader.readBool(value)
+#define P2P_READ_Int(reader, value) reader.readInt(value)
+#define P2P_READ_StringList(reader, value) reader.readStringList(value)
+
+namespace
+{
+	int countBits(quint32 nMask)
+	{
+		int nCount = 0;
+		for (; nMask != 0; nMask &= nMask - 1)
+			++nCount;
+		return nCount;
+	}
+}
+
+// the type goes first so peekMessageType finds it without skipping anything
+#define P2P_MESSAGE(Name, type) \
+	void serializeMessage(Name##Message const& message, QByteArray& out, WireEncoding encoding) \
+	{ \
+		WireWriter writer(out, encoding); \
+		writer.beginMap(1 + countBits(message.nPresent)); \
+		writer.writeKey(WireKey::Type); \
+		writer.writeType(MessageType::Name);
+#define P2P_FIELD(Message, Kind, Name, Key) \
+		if (message.has##Name()) \
+		{ \
+			writer.writeKey(WireKey::Key); \
+			P2P_WRITE_##Kind(writer, message.P2P_MEMBER_##Kind(Name)); \
+		}
+#define P2P_END(Name) \
+		writer.endMap(); \
+	}
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+
+// a message without fields never touches the struct
+#define P2P_MESSAGE(Name, type) \
+	bool parseMessage(QByteArray const& payload, Name##Message& message) \
+	{ \
+		Q_UNUSED(message) \
+		WireReader reader(payload); \
+		if (!reader.beginMap()) \
+			return false; \
+		int nKey; \
+		while (reader.nextKey(nKey)) \
+		{ \
+			switch (nKey) \
+			{
+#define P2P_FIELD(Message, Kind, Name, Key) \
+			case int(WireKey::Key): \
+				if (!P2P_READ_##Kind(reader, message.P2P_MEMBER_##Kind(Name))) \
+					return false; \
+				message.nPresent |= 1u << int(Message##Field::Name); \
+				break;
+#define P2P_END(Name) \
+			default: \
+				if (!reader.skipValue()) \
+					return false; \
+				break; \
+			} \
+		} \
+		return reader.atEnd(); \
+	}
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+
+MessageType OutgoingMessage::type() const
+{
+	return m_type;
+}
+
+QByteArray const& OutgoingMessage::frame(WireEncoding encoding)
+{
+	QByteArray& frame = m_frames[int(encoding)];
+	if (frame.isEmpty())
+		m_append(frame, encoding);
+	return frame;
+}
@@ -0,0 +1,122 @@
+#ifndef MESSAGES_H
+#define MESSAGES_H
+
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <functional>
+#include "framecodec.h"
+#include "wireformat.h"
+
+#define P2P_TYPE_String QString
+#define P2P_TYPE_Bool bool
+#define P2P_TYPE_Int qint64
+#define P2P_TYPE_StringList QStringList
+#define P2P_MEMBER_String(Name) s##Name
+#define P2P_MEMBER_Bool(Name) b##Name
+#define P2P_MEMBER_Int(Name) n##Name
+#define P2P_MEMBER_StringList(Name) lst##Name
+
+// position of every field in the presence mask of its message
+#define P2P_MESSAGE(Name, type) enum class Name##Field {
+#define P2P_FIELD(Message, Kind, Name, Key) Name,
+#define P2P_END(Name) Count };
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+
+// One struct per message of messages.def, e.g. LoginMessage with sUserName, setUserName() and hasUserName().
+// Only the fields set, or found by the parser, are sent.
+#define P2P_MESSAGE(Name, type) \
+	struct Name##Message \
+	{ \
+		static constexpr MessageType s_type = MessageType::Name; \
+		quint32 nPresent = 0;
+#define P2P_FIELD(Message, Kind, Name, Key) \
+		P2P_TYPE_##Kind P2P_MEMBER_##Kind(Name) = P2P_TYPE_##Kind(); \
+		bool has##Name() const { return (nPresent & (1u << int(Message##Field::Name))) != 0; } \
+		void set##Name(P2P_TYPE_##Kind const& value) { P2P_MEMBER_##Kind(Name) = value; nPresent |= 1u << int(Message##Field::Name); }
+#define P2P_END(Name) \
+	};
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+
+// serializeMessage appends the payload to out, parseMessage reads a whole payload into the struct
+#define P2P_MESSAGE(Name, type) \
+	void serializeMessage(Name##Message const& message, QByteArray& out, WireEncoding encoding); \
+	bool parseMessage(QByteArray const& payload, Name##Message& message);
+#define P2P_FIELD(Message, Kind, Name, Key)
+#define P2P_END(Name)
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+
+// appends the frame of the message to out, the payload is serialized in place
+template <typename Message>
+void appendFrame(QByteArray& out, Message const& message, WireEncoding encoding)
+{
+	const int nHeaderPos = FrameEncoder::begin(out);
+	serializeMessage(message, out, encoding);
+	FrameEncoder::finish(out, nHeaderPos);
+}
+
+template <typename Message>
+QByteArray encodeFrame(Message const& message, WireEncoding encoding)
+{
+	QByteArray frame;
+	appendFrame(frame, message, encoding);
+	return frame;
+}
+
+// A message framed on demand, at most once per encoding, for sending the same message to many peers
+class OutgoingMessage
+{
+public:
+	template <typename Message>
+	explicit OutgoingMessage(Message const& message)
+		: m_type(Message::s_type)
+		, m_append([message](QByteArray& out, WireEncoding encoding) { appendFrame(out, message, encoding); })
+	{}
+
+	MessageType type() const;
+	QByteArray const& frame(WireEncoding encoding);
+
+private:
+	MessageType m_type;
+	std::function<void(QByteArray&, WireEncoding)> m_append;
+	QByteArray m_frames[2];
+};
+
+// Parses the payload into the struct of its type and calls handler(message) with it.
+// The switch over the types is the dispatch table, handler needs an overload (or a template) for every message.
+// Returns false for unknown types and malformed payloads.
+template <typename Handler>
+bool dispatchMessage(QByteArray const& payload, Handler&& handler)
+{
+	switch (WireReader::peekMessageType(payload))
+	{
+#define P2P_MESSAGE(Name, type) \
+	case MessageType::Name: \
+	{ \
+		Name##Message message; \
+		if (!parseMessage(payload, message)) \
+			return false; \
+		handler(message); \
+		return true; \
+	}
+#define P2P_FIELD(Message, Kind, Name, Key)
+#define P2P_END(Name)
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+	default:
+		return false;
+	}
+}
+
+#endif // MESSAGES_H
\ No newline at end of file
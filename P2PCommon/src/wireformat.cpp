@@ -0,0 +1,929 @@
+#include "wireformat.h"
+
+#include <cstring>
+#include <limits>
+
+namespace
+{
+	// in the order of WireKey
+	const QLatin1String g_keyNames[] = {
+		QLatin1String("type"),
+		QLatin1String("text"),
+		QLatin1String("sender"),
+		QLatin1String("receiver"),
+		QLatin1String("username"),
+		QLatin1String("success"),
+		QLatin1String("reason"),
+		QLatin1String("users"),
+		QLatin1String("encoding"),
+		QLatin1String("encodings"),
+		QLatin1String("room"),
+		QLatin1String("before"),
+		QLatin1String("limit"),
+		QLatin1String("cursor"),
+		QLatin1String("senders"),
+		QLatin1String("texts"),
+		QLatin1String("session"),
+		QLatin1String("received"),
+		QLatin1String("resumed")
+	};
+	static_assert(sizeof(g_keyNames) / sizeof(g_keyNames[0]) == size_t(WireKey::Count), "a key is missing its name");
+
+	const QLatin1String g_typeNames[] = {
+#define P2P_MESSAGE(Name, type) QLatin1String(#type),
+#define P2P_FIELD(Message, Kind, Name, Key)
+#define P2P_END(Name)
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+	};
+
+	const quint8 g_nCborUnsigned = 0x00;
+	const quint8 g_nCborNegative = 0x20;
+	const quint8 g_nCborBytes = 0x40;
+	const quint8 g_nCborText = 0x60;
+	const quint8 g_nCborArray = 0x80;
+	const quint8 g_nCborMap = 0xA0;
+	const quint8 g_nCborTag = 0xC0;
+	const quint8 g_nCborFalse = 0xF4;
+	const quint8 g_nCborTrue = 0xF5;
+	// nesting of the skipped values, deeper payloads are rejected
+	const int g_nDepthMax = 16;
+
+	int findName(QLatin1String const* pNames, int nCount, char const* pName, int nSize, Qt::CaseSensitivity cs)
+	{
+		for (int nIndex = 0; nIndex < nCount; ++nIndex)
+		{
+			if (pNames[nIndex].size() != nSize)
+				continue;
+			if (cs == Qt::CaseSensitive ? memcmp(pNames[nIndex].data(), pName, size_t(nSize)) == 0 : qstrnicmp(pNames[nIndex].data(), pName, uint(nSize)) == 0)
+				return nIndex;
+		}
+		return -1;
+	}
+
+	// calls visit for every code point, unpaired surrogates become U+FFFD
+	template <typename Visitor>
+	void forEachCodePoint(QString const& sValue, Visitor&& visit)
+	{
+		QChar const* pChar = sValue.constData();
+		QChar const* const pEnd = pChar + sValue.size();
+		while (pChar != pEnd)
+		{
+			uint nCode = pChar->unicode();
+			++pChar;
+			if (QChar::isHighSurrogate(nCode) && pChar != pEnd && pChar->isLowSurrogate())
+				nCode = QChar::surrogateToUcs4(ushort(nCode), (pChar++)->unicode());
+			else if (QChar::isSurrogate(nCode))
+				nCode = 0xFFFD;
+			visit(nCode);
+		}
+	}
+
+	int utf8Size(uint nCode)
+	{
+		return nCode < 0x80 ? 1 : nCode < 0x800 ? 2 : nCode < 0x10000 ? 3 : 4;
+	}
+
+	void appendUtf8(QByteArray& out, uint nCode)
+	{
+		if (nCode < 0x80)
+		{
+			out += char(nCode);
+		}
+		else if (nCode < 0x800)
+		{
+			out += char(0xC0 | (nCode >> 6));
+			out += char(0x80 | (nCode & 0x3F));
+		}
+		else if (nCode < 0x10000)
+		{
+			out += char(0xE0 | (nCode >> 12));
+			out += char(0x80 | ((nCode >> 6) & 0x3F));
+			out += char(0x80 | (nCode & 0x3F));
+		}
+		else
+		{
+			out += char(0xF0 | (nCode >> 18));
+			out += char(0x80 | ((nCode >> 12) & 0x3F));
+			out += char(0x80 | ((nCode >> 6) & 0x3F));
+			out += char(0x80 | (nCode & 0x3F));
+		}
+	}
+
+	void appendJsonEscape(QByteArray& out, uint nCode)
+	{
+		static const char s_hexDigits[] = "0123456789abcdef";
+		if (nCode == '"' || nCode == '\\')
+		{
+			out += '\\';
+			out += char(nCode);
+		}
+		else
+		{
+			out += "\\u00";
+			out += s_hexDigits[nCode >> 4];
+			out += s_hexDigits[nCode & 0x0F];
+		}
+	}
+
+	bool needsJsonEscape(uint nCode)
+	{
+		return nCode == '"' || nCode == '\\' || nCode < 0x20;
+	}
+
+	bool isJsonNumberChar(char chValue)
+	{
+		return (chValue >= '0' && chValue <= '9') || chValue == '-' || chValue == '+' || chValue == '.' || chValue == 'e' || chValue == 'E';
+	}
+
+	int hexValue(char chDigit)
+	{
+		if (chDigit >= '0' && chDigit <= '9')
+			return chDigit - '0';
+		if (chDigit >= 'a' && chDigit <= 'f')
+			return chDigit - 'a' + 10;
+		if (chDigit >= 'A' && chDigit <= 'F')
+			return chDigit - 'A' + 10;
+		return -1;
+	}
+
+	bool readHex4(char const* pDigits, char const* pEnd, uint& nCode)
+	{
+		if (pEnd - pDigits < 4)
+			return false;
+		nCode = 0;
+		for (int nIndex = 0; nIndex < 4; ++nIndex)
+		{
+			const int nDigit = hexValue(pDigits[nIndex]);
+			if (nDigit < 0)
+				return false;
+			nCode = (nCode << 4) | uint(nDigit);
+		}
+		return true;
+	}
+
+	// the content of a JSON string holding escapes, the quotes excluded
+	bool unescapeJson(char const* pBegin, int nSize, QString& sValue)
+	{
+		QByteArray utf8;
+		utf8.reserve(nSize);
+		char const* const pEnd = pBegin + nSize;
+		for (char const* pChar = pBegin; pChar != pEnd; ++pChar)
+		{
+			if (*pChar != '\\')
+			{
+				utf8 += *pChar;
+				continue;
+			}
+			if (++pChar == pEnd)
+				return false;
+			switch (*pChar)
+			{
+			case '"': utf8 += '"'; break;
+			case '\\': utf8 += '\\'; break;
+			case '/': utf8 += '/'; break;
+			case 'b': utf8 += '\b'; break;
+			case 'f': utf8 += '\f'; break;
+			case 'n': utf8 += '\n'; break;
+			case 'r': utf8 += '\r'; break;
+			case 't': utf8 += '\t'; break;
+			case 'u':
+			{
+				uint nCode;
+				if (!readHex4(pChar + 1, pEnd, nCode))
+					return false;
+				pChar += 4;
+				uint nLow;
+				if (QChar::isHighSurrogate(nCode) && pEnd - pChar > 2 && pChar[1] == '\\' && pChar[2] == 'u' && readHex4(pChar + 3, pEnd, nLow) && QChar::isLowSurrogate(nLow))
+				{
+					nCode = QChar::surrogateToUcs4(ushort(nCode), ushort(nLow));
+					pChar += 6;
+				}
+				else if (QChar::isSurrogate(nCode))
+				{
+					nCode = 0xFFFD;
+				}
+				appendUtf8(utf8, nCode);
+				break;
+			}
+			default:
+				return false;
+			}
+		}
+		sValue = QString::fromUtf8(utf8);
+		return true;
+	}
+}
+
+QLatin1String wireKeyName(WireKey key)
+{
+	return g_keyNames[int(key)];
+}
+
+int findWireKey(QString const& sName)
+{
+	for (int nIndex = 0; nIndex < int(WireKey::Count); ++nIndex)
+	{
+		if (g_keyNames[nIndex] == sName)
+			return nIndex;
+	}
+	return -1;
+}
+
+QLatin1String messageTypeName(MessageType type)
+{
+	return g_typeNames[int(type)];
+}
+
+MessageType findMessageType(QString const& sName)
+{
+	for (int nIndex = 0; nIndex < int(MessageType::Count); ++nIndex)
+	{
+		if (sName.compare(g_typeNames[nIndex], Qt::CaseInsensitive) == 0)
+			return MessageType(nIndex);
+	}
+	return MessageType::Count;
+}
+
+WireWriter::WireWriter(QByteArray& out, WireEncoding encoding)
+	: m_out(out)
+	, m_encoding(encoding)
+	, m_bFirst(true)
+{}
+
+void WireWriter::writeHead(quint8 nMajor, quint64 nArgument)
+{
+	if (nArgument < 24)
+	{
+		m_out += char(nMajor | nArgument);
+		return;
+	}
+	// the additional information 24 to 27 announces an argument of 1, 2, 4 or 8 bytes
+	int nInfo = 24;
+	while (nInfo < 27 && (nArgument >> ((1 << (nInfo - 24)) * 8)) != 0)
+		++nInfo;
+	m_out += char(nMajor | nInfo);
+	for (int nShift = ((1 << (nInfo - 24)) - 1) * 8; nShift >= 0; nShift -= 8)
+		m_out += char((nArgument >> nShift) & 0xFF);
+}
+
+void WireWriter::beginMap(int nPairs)
+{
+	m_bFirst = true;
+	if (m_encoding == WireEncoding::Json)
+		m_out += '{';
+	else
+		writeHead(g_nCborMap, quint64(nPairs));
+}
+
+void WireWriter::endMap()
+{
+	if (m_encoding == WireEncoding::Json)
+		m_out += '}';
+}
+
+void WireWriter::writeKey(WireKey key)
+{
+	if (m_encoding == WireEncoding::Cbor)
+		return writeHead(g_nCborUnsigned, quint64(key));
+
+	if (!m_bFirst)
+		m_out += ',';
+	m_bFirst = false;
+	m_out += '"';
+	m_out.append(g_keyNames[int(key)].data(), g_keyNames[int(key)].size());
+	m_out += "\":";
+}
+
+void WireWriter::writeType(MessageType type)
+{
+	if (m_encoding == WireEncoding::Cbor)
+		return writeHead(g_nCborUnsigned, quint64(type));
+
+	m_out += '"';
+	m_out.append(g_typeNames[int(type)].data(), g_typeNames[int(type)].size());
+	m_out += '"';
+}
+
+void WireWriter::writeString(QString const& sValue)
+{
+	// converted to UTF-8 right into the output, without an intermediate QByteArray
+	if (m_encoding == WireEncoding::Cbor)
+	{
+		quint64 nSize = 0;
+		forEachCodePoint(sValue, [&nSize](uint nCode) { nSize += quint64(utf8Size(nCode)); });
+		writeHead(g_nCborText, nSize);
+		forEachCodePoint(sValue, [this](uint nCode) { appendUtf8(m_out, nCode); });
+		return;
+	}
+
+	m_out += '"';
+	forEachCodePoint(sValue, 
+		[this](uint nCode) 
+		{
+			if (needsJsonEscape(nCode))
+				appendJsonEscape(m_out, nCode);
+			else
+				appendUtf8(m_out, nCode);
+		}
+	);
+	m_out += '"';
+}
+
+void WireWriter::writeUtf8(QByteArray const& value)
+{
+	if (m_encoding == WireEncoding::Cbor)
+	{
+		writeHead(g_nCborText, quint64(value.size()));
+		m_out += value;
+		return;
+	}
+
+	m_out += '"';
+	// the bytes between two escapes are copied in one go
+	char const* pRun = value.constData();
+	char const* const pEnd = pRun + value.size();
+	for (char const* pChar = pRun; pChar != pEnd; ++pChar)
+	{
+		if (!needsJsonEscape(quint8(*pChar)))
+			continue;
+		m_out.append(pRun, int(pChar - pRun));
+		appendJsonEscape(m_out, quint8(*pChar));
+		pRun = pChar + 1;
+	}
+	m_out.append(pRun, int(pEnd - pRun));
+	m_out += '"';
+}
+
+void WireWriter::writeBool(bool bValue)
+{
+	if (m_encoding == WireEncoding::Cbor)
+		m_out += char(bValue ? g_nCborTrue : g_nCborFalse);
+	else
+		m_out += bValue ? "true" : "false";
+}
+
+void WireWriter::writeInt(qint64 nValue)
+{
+	if (m_encoding == WireEncoding::Cbor)
+	{
+		// a negative integer n is sent as -1 - n
+		if (nValue < 0)
+			writeHead(g_nCborNegative, quint64(-1 - nValue));
+		else
+			writeHead(g_nCborUnsigned, quint64(nValue));
+		return;
+	}
+	m_out += QByteArray::number(nValue);
+}
+
+void WireWriter::writeStringList(QStringList const& lstValues)
+{
+	if (m_encoding == WireEncoding::Cbor)
+	{
+		writeHead(g_nCborArray, quint64(lstValues.size()));
+		for (QString const& sValue : lstValues)
+			writeString(sValue);
+		return;
+	}
+
+	m_out += '[';
+	for (int nIndex = 0; nIndex < lstValues.size(); ++nIndex)
+	{
+		if (nIndex > 0)
+			m_out += ',';
+		writeString(lstValues.at(nIndex));
+	}
+	m_out += ']';
+}
+
+WireReader::WireReader(QByteArray const& payload)
+	: m_pCursor(payload.constData())
+	, m_pEnd(payload.constData() + payload.size())
+	, m_encoding(detect(payload))
+	, m_nPairsLeft(0)
+	, m_bFirst(true)
+	, m_bError(false)
+{}
+
+WireEncoding WireReader::detect(QByteArray const& payload)
+{
+	// a CBOR map has major type 5 in the top three bits of its first byte, JSON starts with '{' or whitespace
+	if (!payload.isEmpty() && (quint8(payload.at(0)) & 0xE0) == g_nCborMap)
+		return WireEncoding::Cbor;
+	return WireEncoding::Json;
+}
+
+MessageType WireReader::peekMessageType(QByteArray const& payload)
+{
+	// the type is usually the first key, but QJsonDocument sorts the keys so it may come last
+	WireReader reader(payload);
+	if (!reader.beginMap())
+		return MessageType::Count;
+	int nKey;
+	while (reader.nextKey(nKey))
+	{
+		if (nKey == int(WireKey::Type))
+		{
+			MessageType type;
+			return reader.readType(type) ? type : MessageType::Count;
+		}
+		if (!reader.skipValue())
+			break;
+	}
+	return MessageType::Count;
+}
+
+WireEncoding WireReader::encoding() const
+{
+	return m_encoding;
+}
+
+bool WireReader::hasError() const
+{
+	return m_bError;
+}
+
+bool WireReader::fail()
+{
+	m_bError = true;
+	return false;
+}
+
+void WireReader::skipSpace()
+{
+	while (m_pCursor != m_pEnd && (*m_pCursor == ' ' || *m_pCursor == '\t' || *m_pCursor == '\n' || *m_pCursor == '\r'))
+		++m_pCursor;
+}
+
+bool WireReader::atEnd()
+{
+	if (m_bError || m_nPairsLeft > 0)
+		return false;
+	if (m_encoding == WireEncoding::Json)
+		skipSpace();
+	return m_pCursor == m_pEnd;
+}
+
+bool WireReader::beginMap()
+{
+	m_bFirst = true;
+	if (m_encoding == WireEncoding::Json)
+	{
+		skipSpace();
+		if (m_pCursor == m_pEnd || *m_pCursor != '{')
+			return fail();
+		++m_pCursor;
+		return true;
+	}
+
+	quint8 nMajor;
+	if (!readCborHead(nMajor, m_nPairsLeft) || nMajor != g_nCborMap)
+		return fail();
+	return true;
+}
+
+bool WireReader::nextKey(int& nKey)
+{
+	if (m_bError)
+		return false;
+
+	if (m_encoding == WireEncoding::Cbor)
+	{
+		if (m_nPairsLeft == 0)
+			return false;
+		--m_nPairsLeft;
+		if (m_pCursor == m_pEnd)
+			return fail();
+		if ((quint8(*m_pCursor) & 0xE0) == g_nCborUnsigned)
+		{
+			quint8 nMajor;
+			quint64 nCode;
+			if (!readCborHead(nMajor, nCode))
+				return false;
+			nKey = nCode < quint64(WireKey::Count) ? int(nCode) : -1;
+			return true;
+		}
+		char const* pName;
+		int nSize;
+		if (!readCborText(pName, nSize))
+			return false;
+		nKey = findName(g_keyNames, int(WireKey::Count), pName, nSize, Qt::CaseSensitive);
+		return true;
+	}
+
+	skipSpace();
+	if (m_pCursor == m_pEnd)
+		return fail();
+	if (*m_pCursor == '}')
+	{
+		++m_pCursor;
+		return false;
+	}
+	if (!m_bFirst)
+	{
+		if (*m_pCursor != ',')
+			return fail();
+		++m_pCursor;
+		skipSpace();
+	}
+	m_bFirst = false;
+
+	char const* pName;
+	int nSize;
+	bool bEscaped;
+	if (!scanJsonString(pName, nSize, bEscaped))
+		return false;
+	if (bEscaped)
+	{
+		QString sName;
+		if (!unescapeJson(pName, nSize, sName))
+			return fail();
+		nKey = findWireKey(sName);
+	}
+	else
+	{
+		nKey = findName(g_keyNames, int(WireKey::Count), pName, nSize, Qt::CaseSensitive);
+	}
+	skipSpace();
+	if (m_pCursor == m_pEnd || *m_pCursor != ':')
+		return fail();
+	++m_pCursor;
+	return true;
+}
+
+bool WireReader::readType(MessageType& type)
+{
+	if (m_encoding == WireEncoding::Cbor && m_pCursor != m_pEnd && (quint8(*m_pCursor) & 0xE0) == g_nCborUnsigned)
+	{
+		quint8 nMajor;
+		quint64 nCode;
+		if (!readCborHead(nMajor, nCode))
+			return false;
+		type = nCode < quint64(MessageType::Count) ? MessageType(nCode) : MessageType::Count;
+		return true;
+	}
+
+	QByteArray name;
+	if (readUtf8View(name))
+	{
+		const int nIndex = findName(g_typeNames, int(MessageType::Count), name.constData(), name.size(), Qt::CaseInsensitive);
+		type = nIndex < 0 ? MessageType::Count : MessageType(nIndex);
+		return true;
+	}
+	// an escaped JSON string, rare enough to go through QString
+	QString sName;
+	if (m_bError || !readString(sName))
+		return false;
+	type = findMessageType(sName);
+	return true;
+}
+
+bool WireReader::readUtf8View(QByteArray& view)
+{
+	char const* pBegin;
+	int nSize;
+	if (m_encoding == WireEncoding::Cbor)
+	{
+		if (!readCborText(pBegin, nSize))
+			return false;
+		view = QByteArray::fromRawData(pBegin, nSize);
+		return true;
+	}
+
+	skipSpace();
+	// the cursor stays on the string when it holds escapes, so readString can take it from there
+	char const* const pStart = m_pCursor;
+	bool bEscaped;
+	if (!scanJsonString(pBegin, nSize, bEscaped))
+		return false;
+	if (bEscaped)
+	{
+		m_pCursor = pStart;
+		return false;
+	}
+	view = QByteArray::fromRawData(pBegin, nSize);
+	return true;
+}
+
+bool WireReader::readString(QString& sValue)
+{
+	char const* pBegin;
+	int nSize;
+	if (m_encoding == WireEncoding::Cbor)
+	{
+		if (!readCborText(pBegin, nSize))
+			return false;
+		sValue = QString::fromUtf8(pBegin, nSize);
+		return true;
+	}
+
+	skipSpace();
+	bool bEscaped;
+	if (!scanJsonString(pBegin, nSize, bEscaped))
+		return false;
+	if (!bEscaped)
+	{
+		sValue = QString::fromUtf8(pBegin, nSize);
+		return true;
+	}
+	return unescapeJson(pBegin, nSize, sValue) || fail();
+}
+
+bool WireReader::readBool(bool& bValue)
+{
+	if (m_encoding == WireEncoding::Cbor)
+	{
+		if (m_pCursor == m_pEnd || (quint8(*m_pCursor) != g_nCborTrue && quint8(*m_pCursor) != g_nCborFalse))
+			return fail();
+		bValue = quint8(*m_pCursor++) == g_nCborTrue;
+		return true;
+	}
+
+	skipSpace();
+	const int nLeft = int(m_pEnd - m_pCursor);
+	if (nLeft >= 4 && memcmp(m_pCursor, "true", 4) == 0)
+	{
+		bValue = true;
+		m_pCursor += 4;
+		return true;
+	}
+	if (nLeft >= 5 && memcmp(m_pCursor, "false", 5) == 0)
+	{
+		bValue = false;
+		m_pCursor += 5;
+		return true;
+	}
+	return fail();
+}
+
+bool WireReader::readInt(qint64& nValue)
+{
+	if (m_encoding == WireEncoding::Cbor)
+	{
+		quint8 nMajor;
+		quint64 nArgument;
+		if (!readCborHead(nMajor, nArgument) || (nMajor != g_nCborUnsigned && nMajor != g_nCborNegative) || nArgument > quint64(std::numeric_limits<qint64>::max()))
+			return fail();
+		nValue = nMajor == g_nCborUnsigned ? qint64(nArgument) : -1 - qint64(nArgument);
+		return true;
+	}
+
+	skipSpace();
+	char const* const pStart = m_pCursor;
+	while (m_pCursor != m_pEnd && isJsonNumberChar(*m_pCursor))
+		++m_pCursor;
+	bool bOk = false;
+	nValue = QByteArray::fromRawData(pStart, int(m_pCursor - pStart)).toLongLong(&bOk);
+	return bOk || fail();
+}
+
+bool WireReader::readStringList(QStringList& lstValues)
+{
+	// items that are not strings are skipped, like the clients always did
+	lstValues.clear();
+	if (m_encoding == WireEncoding::Cbor)
+	{
+		quint8 nMajor;
+		quint64 nItems;
+		if (!readCborHead(nMajor, nItems) || nMajor != g_nCborArray || nItems > quint64(m_pEnd - m_pCursor))
+			return fail();
+		lstValues.reserve(int(nItems));
+		for (quint64 nItem = 0; nItem < nItems; ++nItem)
+		{
+			if (m_pCursor != m_pEnd && (quint8(*m_pCursor) & 0xE0) == g_nCborText)
+			{
+				QString sValue;
+				if (!readString(sValue))
+					return false;
+				lstValues.append(sValue);
+			}
+			else if (!skipCborValue(1))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	skipSpace();
+	if (m_pCursor == m_pEnd || *m_pCursor != '[')
+		return fail();
+	++m_pCursor;
+	skipSpace();
+	if (m_pCursor != m_pEnd && *m_pCursor == ']')
+	{
+		++m_pCursor;
+		return true;
+	}
+	for (;;)
+	{
+		skipSpace();
+		if (m_pCursor != m_pEnd && *m_pCursor == '"')
+		{
+			QString sValue;
+			if (!readString(sValue))
+				return false;
+			lstValues.append(sValue);
+		}
+		else if (!skipJsonValue(1))
+		{
+			return false;
+		}
+		skipSpace();
+		if (m_pCursor == m_pEnd)
+			return fail();
+		const char chSeparator = *m_pCursor++;
+		if (chSeparator == ']')
+			return true;
+		if (chSeparator != ',')
+			return fail();
+	}
+}
+
+bool WireReader::skipValue()
+{
+	return m_encoding == WireEncoding::Cbor ? skipCborValue(0) : skipJsonValue(0);
+}
+
+bool WireReader::scanJsonString(char const*& pBegin, int& nSize, bool& bEscaped)
+{
+	if (m_pCursor == m_pEnd || *m_pCursor != '"')
+		return fail();
+	pBegin = ++m_pCursor;
+	bEscaped = false;
+	for (; m_pCursor != m_pEnd; ++m_pCursor)
+	{
+		const quint8 nByte = quint8(*m_pCursor);
+		if (nByte == '"')
+		{
+			nSize = int(m_pCursor - pBegin);
+			++m_pCursor;
+			return true;
+		}
+		if (nByte < 0x20)
+			return fail();
+		if (nByte == '\\')
+		{
+			bEscaped = true;
+			if (++m_pCursor == m_pEnd)
+				break;
+		}
+	}
+	return fail();
+}
+
+bool WireReader::skipJsonValue(int nDepth)
+{
+	if (nDepth > g_nDepthMax)
+		return fail();
+	skipSpace();
+	if (m_pCursor == m_pEnd)
+		return fail();
+
+	switch (*m_pCursor)
+	{
+	case '"':
+	{
+		char const* pBegin;
+		int nSize;
+		bool bEscaped;
+		return scanJsonString(pBegin, nSize, bEscaped);
+	}
+	case '{':
+	case '[':
+	{
+		const bool bObject = *m_pCursor == '{';
+		const char chClose = bObject ? '}' : ']';
+		++m_pCursor;
+		skipSpace();
+		if (m_pCursor != m_pEnd && *m_pCursor == chClose)
+		{
+			++m_pCursor;
+			return true;
+		}
+		for (;;)
+		{
+			if (bObject)
+			{
+				char const* pBegin;
+				int nSize;
+				bool bEscaped;
+				skipSpace();
+				if (!scanJsonString(pBegin, nSize, bEscaped))
+					return false;
+				skipSpace();
+				if (m_pCursor == m_pEnd || *m_pCursor++ != ':')
+					return fail();
+			}
+			if (!skipJsonValue(nDepth + 1))
+				return false;
+			skipSpace();
+			if (m_pCursor == m_pEnd)
+				return fail();
+			const char chSeparator = *m_pCursor++;
+			if (chSeparator == chClose)
+				return true;
+			if (chSeparator != ',')
+				return fail();
+		}
+	}
+	case 't':
+	case 'f':
+	case 'n':
+	{
+		for (char const* pLiteral : { "true", "false", "null" })
+		{
+			const int nSize = int(strlen(pLiteral));
+			if (m_pEnd - m_pCursor >= nSize && memcmp(m_pCursor, pLiteral, size_t(nSize)) == 0)
+			{
+				m_pCursor += nSize;
+				return true;
+			}
+		}
+		return fail();
+	}
+	default:
+	{
+		char const* const pStart = m_pCursor;
+		while (m_pCursor != m_pEnd && isJsonNumberChar(*m_pCursor))
+			++m_pCursor;
+		return m_pCursor != pStart || fail();
+	}
+	}
+}
+
+bool WireReader::readCborHead(quint8& nMajor, quint64& nArgument)
+{
+	if (m_pCursor == m_pEnd)
+		return fail();
+	const quint8 nInitial = quint8(*m_pCursor++);
+	nMajor = nInitial & 0xE0;
+	const quint8 nInfo = nInitial & 0x1F;
+	if (nInfo < 24)
+	{
+		nArgument = nInfo;
+		return true;
+	}
+	// indefinite lengths are not used by any of our encoders
+	if (nInfo > 27)
+		return fail();
+	const int nBytes = 1 << (nInfo - 24);
+	if (m_pEnd - m_pCursor < nBytes)
+		return fail();
+	nArgument = 0;
+	for (int nIndex = 0; nIndex < nBytes; ++nIndex)
+		nArgument = (nArgument << 8) | quint8(*m_pCursor++);
+	return true;
+}
+
+bool WireReader::readCborText(char const*& pBegin, int& nSize)
+{
+	quint8 nMajor;
+	quint64 nLength;
+	if (!readCborHead(nMajor, nLength) || nMajor != g_nCborText || nLength > quint64(m_pEnd - m_pCursor))
+		return fail();
+	pBegin = m_pCursor;
+	nSize = int(nLength);
+	m_pCursor += nLength;
+	return true;
+}
+
+bool WireReader::skipCborValue(int nDepth)
+{
+	quint8 nMajor;
+	quint64 nArgument;
+	if (nDepth > g_nDepthMax || !readCborHead(nMajor, nArgument))
+		return fail();
+
+	switch (nMajor)
+	{
+	case g_nCborBytes:
+	case g_nCborText:
+		if (nArgument > quint64(m_pEnd - m_pCursor))
+			return fail();
+		m_pCursor += nArgument;
+		return true;
+	case g_nCborArray:
+	case g_nCborMap:
+	{
+		// every item takes at least one byte, bigger counts can only be lies
+		const quint64 nItems = nMajor == g_nCborMap ? nArgument * 2 : nArgument;
+		if (nArgument > quint64(m_pEnd - m_pCursor) || nItems > quint64(m_pEnd - m_pCursor))
+			return fail();
+		for (quint64 nItem = 0; nItem < nItems; ++nItem)
+		{
+			if (!skipCborValue(nDepth + 1))
+				return false;
+		}
+		return true;
+	}
+	case g_nCborTag:
+		return skipCborValue(nDepth + 1);
+	default:
+		// integers and simple values are complete with their head
+		return true;
+	}
+}
@@ -0,0 +1,133 @@
+#ifndef WIREFORMAT_H
+#define WIREFORMAT_H
+
+#include <QByteArray>
+#include <QLatin1String>
+#include <QString>
+#include <QStringList>
+
+enum class WireEncoding
+{
+	Json,
+	Cbor
+};
+
+// Keys with a fixed integer code in CBOR, the code is the position in the list, only append to it
+enum class WireKey
+{
+	Type,
+	Text,
+	Sender,
+	Receiver,
+	UserName,
+	Success,
+	Reason,
+	Users,
+	Encoding,
+	Encodings,
+	Room,
+	Before,
+	Limit,
+	Cursor,
+	Senders,
+	Texts,
+	Session,
+	Received,
+	Resumed,
+	Count
+};
+
+// one value per message of messages.def, in the same order
+enum class MessageType
+{
+#define P2P_MESSAGE(Name, type) Name,
+#define P2P_FIELD(Message, Kind, Name, Key)
+#define P2P_END(Name)
+#include "messages.def"
+#undef P2P_MESSAGE
+#undef P2P_FIELD
+#undef P2P_END
+	Count
+};
+
+QLatin1String wireKeyName(WireKey key);
+// -1 for the keys without a code
+int findWireKey(QString const& sName);
+QLatin1String messageTypeName(MessageType type);
+// MessageType::Count for unknown types, compared without case like the server always did
+MessageType findMessageType(QString const& sName);
+
+// Appends a flat map to a caller provided buffer, in JSON or in CBOR with the integer codes for the keys and types.
+// The caller writes exactly the number of pairs announced to beginMap.
+class WireWriter
+{
+public:
+	WireWriter(QByteArray& out, WireEncoding encoding);
+
+	void beginMap(int nPairs);
+	void endMap();
+	void writeKey(WireKey key);
+	void writeType(MessageType type);
+	void writeString(QString const& sValue);
+	// UTF-8 bytes written without conversion, only escaped for JSON
+	void writeUtf8(QByteArray const& value);
+	void writeBool(bool bValue);
+	void writeInt(qint64 nValue);
+	void writeStringList(QStringList const& lstValues);
+
+private:
+	void writeHead(quint8 nMajor, quint64 nArgument);
+
+	QByteArray& m_out;
+	WireEncoding m_encoding;
+	bool m_bFirst;
+};
+
+// Pulls the pairs of a flat map out of a payload, the encoding is detected from the first byte.
+// Values of unknown keys are skipped whatever they hold.
+class WireReader
+{
+public:
+	explicit WireReader(QByteArray const& payload);
+
+	static WireEncoding detect(QByteArray const& payload);
+	// the value of the type key, MessageType::Count when missing or unknown
+	static MessageType peekMessageType(QByteArray const& payload);
+
+	WireEncoding encoding() const;
+	bool beginMap();
+	// false at the end of the map or on error, nKey is a WireKey code or -1 for the keys without one
+	bool nextKey(int& nKey);
+	bool readType(MessageType& type);
+	bool readString(QString& sValue);
+	// a view into the payload, fails for JSON strings holding escapes
+	bool readUtf8View(QByteArray& view);
+	bool readBool(bool& bValue);
+	// integers only, JSON numbers with a fraction or an exponent are rejected
+	bool readInt(qint64& nValue);
+	bool readStringList(QStringList& lstValues);
+	bool skipValue();
+	// the map is closed and nothing follows it
+	bool atEnd();
+	bool hasError() const;
+
+private:
+	bool fail();
+	void skipSpace();
+	bool scanJsonString(char const*& pBegin, int& nSize, bool& bEscaped);
+	bool skipJsonValue(int nDepth);
+	bool readCborHead(quint8& nMajor, quint64& nArgument);
+	bool readCborText(char const*& pBegin, int& nSize);
+	bool skipCborValue(int nDepth);
+
+	char const* m_pCursor;
+	char const* m_pEnd;
+	WireEncoding m_encoding;
+	// pairs of the CBOR map still to read
+	quint64 m_nPairsLeft;
+	// no key of the JSON object read yet
+	bool m_bFirst;
+	bool m_bError;
+};
+
+#endif // WIREFORMAT_H
\ No newline at end of file
@@ -0,0 +1,197 @@
+#include "loadconfig.h"
+
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QRegExp>
+#include <QThread>
+
+namespace
+{
+	// room for the send timestamp and its separator
+	const int g_nMinMessageSize = 24;
+
+	bool parsePort(QString const& sPort, quint16& nPort)
+	{
+		bool bOk = false;
+		const uint nValue = sPort.toUInt(&bOk);
+		if (!bOk || nValue == 0 || nValue > 0xFFFF)
+			return false;
+		nPort = quint16(nValue);
+		return true;
+	}
+
+	bool parseCount(QString const& sCount, int nMin, int& nCount)
+	{
+		bool bOk = false;
+		const int nValue = sCount.toInt(&bOk);
+		if (!bOk || nValue < nMin)
+			return false;
+		nCount = nValue;
+		return true;
+	}
+
+	bool parseRate(QString const& sRate, double& dRate)
+	{
+		bool bOk = false;
+		const double dValue = sRate.toDouble(&bOk);
+		if (!bOk || dValue <= 0.0)
+			return false;
+		dRate = dValue;
+		return true;
+	}
+
+	bool parseRecipients(QString const& sRecipients, RecipientDistribution& recipients)
+	{
+		if (sRecipients.compare(QLatin1String("uniform"), Qt::CaseInsensitive) == 0)
+			recipients = RecipientDistribution::Uniform;
+		else if (sRecipients.compare(QLatin1String("zipf"), Qt::CaseInsensitive) == 0)
+			recipients = RecipientDistribution::Zipf;
+		else if (sRecipients.compare(QLatin1String("neighbour"), Qt::CaseInsensitive) == 0)
+			recipients = RecipientDistribution::Neighbour;
+		else
+			return false;
+		return true;
+	}
+
+	bool parseEncoding(QString const& sEncoding, WireEncoding& encoding)
+	{
+		if (sEncoding.compare(QLatin1String("json"), Qt::CaseInsensitive) == 0)
+			encoding = WireEncoding::Json;
+		else if (sEncoding.compare(QLatin1String("cbor"), Qt::CaseInsensitive) == 0)
+			encoding = WireEncoding::Cbor;
+		else
+			return false;
+		return true;
+	}
+}
+
+LoadConfig::LoadConfig()
+	: address(QHostAddress::LocalHost)
+	, nPort(1967)
+	, nClients(100)
+	, nThreadCount(QThread::idealThreadCount())
+	, dLoginRate(100.0)
+	, dMessageRate(1.0)
+	, nMessageSize(64)
+	, recipients(RecipientDistribution::Uniform)
+	, dZipfExponent(1.0)
+	, nDuration(30)
+	, nDrain(2)
+	, nReportInterval(1)
+	, encoding(WireEncoding::Cbor)
+	, sPrefix(QStringLiteral("load"))
+{}
+
+LoadConfig::ParseResult LoadConfig::parse(QStringList const& lstArguments, QString& sError)
+{
+	QCommandLineParser parser;
+	parser.setApplicationDescription(QStringLiteral("Load generator for the P2P chat server"));
+	parser.addHelpOption();
+	const QCommandLineOption addressOption(QStringLiteral("address"), QStringLiteral("Connect to the server at <address>."), QStringLiteral("address"));
+	const QCommandLineOption portOption(QStringLiteral("port"), QStringLiteral("Connect to the server on <port>."), QStringLiteral("port"));
+	const QCommandLineOption clientsOption(QStringLiteral("clients"), QStringLiteral("Open <count> connections."), QStringLiteral("count"));
+	const QCommandLineOption threadsOption(QStringLiteral("threads"), QStringLiteral("Drive the clients from <count> threads."), QStringLiteral("count"));
+	const QCommandLineOption loginRateOption(QStringLiteral("login-rate"), QStringLiteral("Start <rate> logins per second."), QStringLiteral("rate"));
+	const QCommandLineOption messageRateOption(QStringLiteral("message-rate"), QStringLiteral("Send <rate> messages per second from every client."), QStringLiteral("rate"));
+	const QCommandLineOption messageSizeOption(QStringLiteral("message-size"), QStringLiteral("Send messages of <bytes> of text."), QStringLiteral("bytes"));
+	const QCommandLineOption recipientsOption(QStringLiteral("recipients"), QStringLiteral("uniform, zipf or neighbour."), QStringLiteral("distribution"));
+	const QCommandLineOption zipfExponentOption(QStringLiteral("zipf-exponent"), QStringLiteral("Skew of the zipf distribution, 1 by default."), QStringLiteral("exponent"));
+	const QCommandLineOption durationOption(QStringLiteral("duration"), QStringLiteral("Send for <seconds> once the clients are logged in."), QStringLiteral("seconds"));
+	const QCommandLineOption drainOption(QStringLiteral("drain"), QStringLiteral("Wait <seconds> for the messages in flight after the sending stopped."), QStringLiteral("seconds"));
+	const QCommandLineOption reportIntervalOption(QStringLiteral("report-interval"), QStringLiteral("Print the progress every <seconds>."), QStringLiteral("seconds"));
+	const QCommandLineOption encodingOption(QStringLiteral("encoding"), QStringLiteral("json, or cbor when the server agrees."), QStringLiteral("encoding"));
+	const QCommandLineOption prefixOption(QStringLiteral("prefix"), QStringLiteral("Log the clients in as <prefix>_<number>."), QStringLiteral("prefix"));
+	parser.addOptions({ addressOption, portOption, clientsOption, threadsOption, loginRateOption, messageRateOption, messageSizeOption,
+		recipientsOption, zipfExponentOption, durationOption, drainOption, reportIntervalOption, encodingOption, prefixOption });
+
+	if (!parser.parse(lstArguments))
+	{
+		sError = parser.errorText();
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(QStringLiteral("help")))
+	{
+		sError = parser.helpText();
+		return ParseResult::Help;
+	}
+
+	if (parser.isSet(addressOption) && !address.setAddress(parser.value(addressOption)))
+	{
+		sError = QStringLiteral("Invalid address %1").arg(parser.value(addressOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(portOption) && !parsePort(parser.value(portOption), nPort))
+	{
+		sError = QStringLiteral("Invalid port %1").arg(parser.value(portOption));
+		return ParseResult::Invalid;
+	}
+	// a message needs somebody else to go to
+	if (parser.isSet(clientsOption) && !parseCount(parser.value(clientsOption), 2, nClients))
+	{
+		sError = QStringLiteral("Invalid client count %1, at least 2 are needed").arg(parser.value(clientsOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(threadsOption) && !parseCount(parser.value(threadsOption), 1, nThreadCount))
+	{
+		sError = QStringLiteral("Invalid thread count %1").arg(parser.value(threadsOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(loginRateOption) && !parseRate(parser.value(loginRateOption), dLoginRate))
+	{
+		sError = QStringLiteral("Invalid login rate %1").arg(parser.value(loginRateOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(messageRateOption) && !parseRate(parser.value(messageRateOption), dMessageRate))
+	{
+		sError = QStringLiteral("Invalid message rate %1").arg(parser.value(messageRateOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(messageSizeOption) && !parseCount(parser.value(messageSizeOption), g_nMinMessageSize, nMessageSize))
+	{
+		sError = QStringLiteral("Invalid message size %1, at least %2 bytes").arg(parser.value(messageSizeOption)).arg(g_nMinMessageSize);
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(recipientsOption) && !parseRecipients(parser.value(recipientsOption), recipients))
+	{
+		sError = QStringLiteral("Invalid recipient distribution %1").arg(parser.value(recipientsOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(zipfExponentOption) && !parseRate(parser.value(zipfExponentOption), dZipfExponent))
+	{
+		sError = QStringLiteral("Invalid zipf exponent %1").arg(parser.value(zipfExponentOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(durationOption) && !parseCount(parser.value(durationOption), 1, nDuration))
+	{
+		sError = QStringLiteral("Invalid duration %1").arg(parser.value(durationOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(drainOption) && !parseCount(parser.value(drainOption), 0, nDrain))
+	{
+		sError = QStringLiteral("Invalid drain time %1").arg(parser.value(drainOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(reportIntervalOption) && !parseCount(parser.value(reportIntervalOption), 1, nReportInterval))
+	{
+		sError = QStringLiteral("Invalid report interval %1").arg(parser.value(reportIntervalOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(encodingOption) && !parseEncoding(parser.value(encodingOption), encoding))
+	{
+		sError = QStringLiteral("Invalid encoding %1").arg(parser.value(encodingOption));
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(prefixOption))
+	{
+		// the same rule as the chat client applies to the user names
+		sPrefix = parser.value(prefixOption);
+		if (sPrefix.isEmpty() || !QRegExp(QStringLiteral("^[\\da-zA-Z_]*$")).exactMatch(sPrefix))
+		{
+			sError = QStringLiteral("Invalid prefix %1").arg(sPrefix);
+			return ParseResult::Invalid;
+		}
+	}
+	// no idle threads
+	nThreadCount = qMin(nThreadCount, nClients);
+	return ParseResult::Ok;
+}
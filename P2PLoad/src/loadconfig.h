@@ -0,0 +1,58 @@
+#ifndef LOADCONFIG_H
+#define LOADCONFIG_H
+
+#include <QHostAddress>
+#include <QString>
+#include <QStringList>
+#include "wireformat.h"
+
+// who the simulated clients send their messages to
+enum class RecipientDistribution
+{
+	// any other client with the same probability
+	Uniform,
+	// a few clients get most of the messages, the weight of the client ranked k is 1 / k^exponent
+	Zipf,
+	// every client writes to the next one, one conversation per client
+	Neighbour
+};
+
+// Settings of a load run, from the command line
+struct LoadConfig
+{
+	enum class ParseResult
+	{
+		Ok,
+		// --help was given, sError holds the help text
+		Help,
+		Invalid
+	};
+
+	LoadConfig();
+
+	// fills the config from the application arguments, sets sError on invalid input
+	ParseResult parse(QStringList const& lstArguments, QString& sError);
+
+	QHostAddress address;
+	quint16 nPort;
+	int nClients;
+	int nThreadCount;
+	// logins started per second, over all the clients
+	double dLoginRate;
+	// messages per second sent by every logged in client
+	double dMessageRate;
+	// bytes of text per message, the send timestamp included
+	int nMessageSize;
+	RecipientDistribution recipients;
+	double dZipfExponent;
+	// seconds of sending once the clients are logged in
+	int nDuration;
+	// seconds left for the messages in flight to arrive after the sending stopped
+	int nDrain;
+	int nReportInterval;
+	WireEncoding encoding;
+	// the clients log in as <prefix>_<number>
+	QString sPrefix;
+};
+
+#endif // LOADCONFIG_H
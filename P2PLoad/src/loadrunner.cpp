@@ -0,0 +1,189 @@
+#include "loadrunner.h"
+
+#include <QThread>
+#include <QTimer>
+#include <cstdio>
+#include "loadworker.h"
+
+namespace
+{
+	// time past the expected ramp after which the sending starts with the clients logged in so far
+	const qint64 g_nLoginGraceMs = 30000;
+
+	double toMs(qint64 nUs)
+	{
+		return double(nUs) / 1000.0;
+	}
+
+	double perSecond(qint64 nCount, double dSeconds)
+	{
+		return dSeconds > 0.0 ? double(nCount) / dSeconds : 0.0;
+	}
+}
+
+LoadRunner::LoadRunner(LoadConfig const& config, QObject* parent)
+	: QObject(parent)
+	, m_config(config)
+	, m_pReportTimer(new QTimer(this))
+	, m_phase(Phase::LoggingIn)
+	, m_nLastReportMs(0)
+	, m_nSendingStartMs(0)
+	, m_nSendingEndMs(0)
+{
+	connect(m_pReportTimer, &QTimer::timeout, this, &LoadRunner::onReport);
+}
+
+template <typename Function>
+void LoadRunner::forEachWorker(Function function)
+{
+	for (LoadWorker* pWorker : qAsConst(m_vecWorkers))
+		QMetaObject::invokeMethod(pWorker, [pWorker, function]() -> void { function(pWorker); }, Qt::QueuedConnection);
+}
+
+LoadRunner::~LoadRunner()
+{
+	stopWorkers();
+}
+
+void LoadRunner::start()
+{
+	m_runClock.start();
+	const QVector<double> vecZipfCdf = m_config.recipients == RecipientDistribution::Zipf
+		? LoadWorker::zipfCdf(m_config.nClients, m_config.dZipfExponent)
+		: QVector<double>();
+	for (int nThread = 0; nThread < m_config.nThreadCount; ++nThread)
+	{
+		const int nFirst = int(qint64(m_config.nClients) * nThread / m_config.nThreadCount);
+		const int nNext = int(qint64(m_config.nClients) * (nThread + 1) / m_config.nThreadCount);
+		QThread* pThread = new QThread(this);
+		pThread->setObjectName(QStringLiteral("Load %1").arg(nThread));
+		LoadWorker* pWorker = new LoadWorker(m_config, nFirst, nNext - nFirst, vecZipfCdf);
+		pWorker->moveToThread(pThread);
+		pThread->start();
+		m_vecThreads.append(pThread);
+		m_vecWorkers.append(pWorker);
+	}
+
+	std::printf("Connecting %d clients to %s:%u from %d threads at %.0f logins/s\n", m_config.nClients,
+		qPrintable(m_config.address.toString()), uint(m_config.nPort), m_config.nThreadCount, m_config.dLoginRate);
+	std::fflush(stdout);
+	forEachWorker([](LoadWorker* pWorker) -> void { pWorker->startLogins(); });
+	m_pReportTimer->start(m_config.nReportInterval * 1000);
+}
+
+void LoadRunner::onReport()
+{
+	const qint64 nNowMs = m_runClock.elapsed();
+	const LoadStats interval = collectStats();
+	printProgress(interval, double(nNowMs - m_nLastReportMs) / 1000.0);
+	m_nLastReportMs = nNowMs;
+
+	if (m_phase != Phase::LoggingIn)
+		return;
+	// every client logged in or failed to, or the slow ones are left behind
+	const qint64 nSettled = m_total.nLoggedIn + m_total.nLoginFailed;
+	const qint64 nRampMs = qint64(m_config.nClients / m_config.dLoginRate * 1000.0) + g_nLoginGraceMs;
+	if (nSettled >= m_config.nClients || nNowMs > nRampMs)
+		startSending();
+}
+
+void LoadRunner::startSending()
+{
+	const qint64 nOnline = m_total.nLoggedIn - m_total.nDisconnected;
+	if (nOnline < 2)
+	{
+		std::printf("Only %lld clients logged in, nothing to send\n", nOnline);
+		finish();
+		return;
+	}
+	std::printf("%lld clients logged in, sending %.2f messages/s each for %d s\n", nOnline, m_config.dMessageRate, m_config.nDuration);
+	std::fflush(stdout);
+	m_phase = Phase::Sending;
+	m_nSendingStartMs = m_runClock.elapsed();
+	forEachWorker([](LoadWorker* pWorker) -> void { pWorker->startSending(); });
+	QTimer::singleShot(m_config.nDuration * 1000, this, &LoadRunner::stopSending);
+}
+
+void LoadRunner::stopSending()
+{
+	m_phase = Phase::Draining;
+	m_nSendingEndMs = m_runClock.elapsed();
+	forEachWorker([](LoadWorker* pWorker) -> void { pWorker->stopSending(); });
+	QTimer::singleShot(m_config.nDrain * 1000, this, &LoadRunner::finish);
+}
+
+void LoadRunner::finish()
+{
+	m_pReportTimer->stop();
+	collectStats();
+	stopWorkers();
+	const bool bSent = m_phase != Phase::LoggingIn;
+	m_phase = Phase::Done;
+	if (bSent)
+		printSummary();
+	emit finished(bSent && m_sending.nReceived > 0 ? 0 : 1);
+}
+
+void LoadRunner::stopWorkers()
+{
+	// the workers log their clients out in their own thread before it stops
+	for (LoadWorker* pWorker : qAsConst(m_vecWorkers))
+		QMetaObject::invokeMethod(pWorker, [pWorker]() -> void { pWorker->stop(); }, Qt::BlockingQueuedConnection);
+	for (QThread* pThread : qAsConst(m_vecThreads))
+	{
+		pThread->quit();
+		pThread->wait();
+	}
+	qDeleteAll(m_vecWorkers);
+	qDeleteAll(m_vecThreads);
+	m_vecWorkers.clear();
+	m_vecThreads.clear();
+}
+
+LoadStats LoadRunner::collectStats()
+{
+	LoadStats interval;
+	for (LoadWorker* pWorker : qAsConst(m_vecWorkers))
+	{
+		LoadStats stats;
+		QMetaObject::invokeMethod(pWorker, [pWorker, &stats]() -> void { stats = pWorker->takeStats(); }, Qt::BlockingQueuedConnection);
+		interval.merge(stats);
+	}
+	m_total.merge(interval);
+	if (m_phase != Phase::LoggingIn)
+		m_sending.merge(interval);
+	return interval;
+}
+
+void LoadRunner::printProgress(LoadStats const& interval, double dSeconds) const
+{
+	std::printf("%7.1f s  online %lld/%d  failed %lld  sent %.0f/s  received %.0f/s  latency p50 %.2f ms  p99 %.2f ms\n",
+		double(m_runClock.elapsed()) / 1000.0,
+		m_total.nLoggedIn - m_total.nDisconnected, m_config.nClients, m_total.nLoginFailed,
+		perSecond(interval.nSent, dSeconds), perSecond(interval.nReceived, dSeconds),
+		toMs(interval.latency.percentile(50.0)), toMs(interval.latency.percentile(99.0)));
+	std::fflush(stdout);
+}
+
+void LoadRunner::printSummary() const
+{
+	const double dSeconds = double(m_nSendingEndMs - m_nSendingStartMs) / 1000.0;
+	LatencyHistogram const& loginTime = m_total.loginTime;
+	LatencyHistogram const& latency = m_sending.latency;
+
+	std::printf("\nClients      %lld logged in, %lld failed, %lld disconnected\n",
+		m_total.nLoggedIn, m_total.nLoginFailed, m_total.nDisconnected);
+	std::printf("Login time   p50 %.2f ms  p90 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+		toMs(loginTime.percentile(50.0)), toMs(loginTime.percentile(90.0)), toMs(loginTime.percentile(99.0)), toMs(loginTime.max()));
+	std::printf("Messages     %lld sent, %lld received, %lld lost\n",
+		m_sending.nSent, m_sending.nReceived, qMax(Q_INT64_C(0), m_sending.nSent - m_sending.nReceived));
+	// the drain is left out of the time, the messages received during it were sent before
+	std::printf("Throughput   %.0f sent/s, %.0f received/s over %.1f s, %.2f MB/s out, %.2f MB/s in\n",
+		perSecond(m_sending.nSent, dSeconds), perSecond(m_sending.nReceived, dSeconds), dSeconds,
+		perSecond(m_sending.nBytesSent, dSeconds) / 1e6, perSecond(m_sending.nBytesReceived, dSeconds) / 1e6);
+	std::printf("Latency      p50 %.2f ms  p90 %.2f ms  p99 %.2f ms  p99.9 %.2f ms  max %.2f ms  mean %.2f ms\n",
+		toMs(latency.percentile(50.0)), toMs(latency.percentile(90.0)), toMs(latency.percentile(99.0)),
+		toMs(latency.percentile(99.9)), toMs(latency.max()), latency.mean() / 1000.0);
+	std::printf("Other frames %lld, presence and rosters\n", m_total.nOtherFrames);
+	std::fflush(stdout);
+}
@@ -0,0 +1,70 @@
+#ifndef LOADRUNNER_H
+#define LOADRUNNER_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QVector>
+#include "loadconfig.h"
+#include "loadstats.h"
+
+class LoadWorker;
+class QThread;
+class QTimer;
+
+// Runs the load in phases: the clients log in at the login rate, then send for the configured duration once all
+// of them settled, then wait for the messages in flight. Progress is printed at every report interval, and a summary
+// of the login times, the throughput and the end to end latency at the end.
+class LoadRunner : public QObject
+{
+	Q_OBJECT
+	Q_DISABLE_COPY(LoadRunner)
+
+public:
+	explicit LoadRunner(LoadConfig const& config, QObject* parent = nullptr);
+	~LoadRunner();
+
+	void start();
+
+signals:
+	// nResult is the exit code of the run, 0 when messages went through
+	void finished(int nResult);
+
+private slots:
+	void onReport();
+	void stopSending();
+	void finish();
+
+private:
+	enum class Phase
+	{
+		LoggingIn,
+		Sending,
+		Draining,
+		Done
+	};
+
+	void startSending();
+	// stops the workers and their threads, the clients log out first
+	void stopWorkers();
+	// takes the stats of every worker and adds them to the totals
+	LoadStats collectStats();
+	void printProgress(LoadStats const& interval, double dSeconds) const;
+	void printSummary() const;
+	template <typename Function>
+	void forEachWorker(Function function);
+
+	LoadConfig m_config;
+	QVector<QThread*> m_vecThreads;
+	QVector<LoadWorker*> m_vecWorkers;
+	QTimer* m_pReportTimer;
+	Phase m_phase;
+	QElapsedTimer m_runClock;
+	qint64 m_nLastReportMs;
+	qint64 m_nSendingStartMs;
+	qint64 m_nSendingEndMs;
+	LoadStats m_total;
+	// since the sending started, the throughput and the latency are measured over it
+	LoadStats m_sending;
+};
+
+#endif // LOADRUNNER_H
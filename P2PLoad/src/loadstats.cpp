@@ -0,0 +1,34 @@
+#include "loadstats.h"
+
+#include <chrono>
+
+LoadStats::LoadStats()
+	: nLoggedIn(0)
+	, nLoginFailed(0)
+	, nDisconnected(0)
+	, nSent(0)
+	, nReceived(0)
+	, nBytesSent(0)
+	, nBytesReceived(0)
+	, nOtherFrames(0)
+{}
+
+void LoadStats::merge(LoadStats const& other)
+{
+	nLoggedIn += other.nLoggedIn;
+	nLoginFailed += other.nLoginFailed;
+	nDisconnected += other.nDisconnected;
+	nSent += other.nSent;
+	nReceived += other.nReceived;
+	nBytesSent += other.nBytesSent;
+	nBytesReceived += other.nBytesReceived;
+	nOtherFrames += other.nOtherFrames;
+	loginTime.merge(other.loginTime);
+	latency.merge(other.latency);
+}
+
+qint64 loadClockUs()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,35 @@
+#ifndef LOADSTATS_H
+#define LOADSTATS_H
+
+#include <QtGlobal>
+#include "latencyhistogram.h"
+
+// What the clients of a worker saw since the stats were last taken, merged over the workers for the reports.
+// Times are in microseconds.
+struct LoadStats
+{
+	LoadStats();
+
+	void merge(LoadStats const& other);
+
+	qint64 nLoggedIn;
+	// refused logins and connections lost before the login
+	qint64 nLoginFailed;
+	// logged in connections lost
+	qint64 nDisconnected;
+	qint64 nSent;
+	qint64 nReceived;
+	qint64 nBytesSent;
+	qint64 nBytesReceived;
+	// the frames that are neither our messages nor login replies, presence and rosters mostly
+	qint64 nOtherFrames;
+	// from the connection attempt to the successful login reply
+	LatencyHistogram loginTime;
+	// from the send by one client to the receipt by the other
+	LatencyHistogram latency;
+};
+
+// microseconds on a clock shared by the threads, the messages carry it from their sender to their recipient
+qint64 loadClockUs();
+
+#endif // LOADSTATS_H
@@ -0,0 +1,325 @@
+#include "loadworker.h"
+
+#include <QTcpSocket>
+#include <QTimer>
+#include <algorithm>
+#include <cmath>
+#include "messagecodec.h"
+
+namespace
+{
+	// the pacing resolution, the budget of a tick is spent at once
+	const int g_nTickMs = 5;
+	// a worker that fell behind catches up on at most one second of its rates, not on the whole stall
+	const double g_dMaxBudgetSeconds = 1.0;
+}
+
+LoadWorker::LoadWorker(LoadConfig const& config, int nFirstClient, int nClientCount, QVector<double> const& vecZipfCdf, QObject* parent)
+	: QObject(parent)
+	, m_config(config)
+	, m_nFirstClient(nFirstClient)
+	, m_nClientCount(nClientCount)
+	, m_vecZipfCdf(vecZipfCdf)
+	, m_pTickTimer(new QTimer(this))
+	, m_nLastTickUs(0)
+	, m_bLoggingIn(false)
+	, m_bSending(false)
+	, m_nNextLogin(0)
+	, m_nNextSender(0)
+	, m_dLoginBudget(0.0)
+	, m_dSendBudget(0.0)
+	, m_random(quint32(nFirstClient) ^ QRandomGenerator::global()->generate())
+	, m_sPadding(config.nMessageSize, QLatin1Char('x'))
+{
+	m_pTickTimer->setTimerType(Qt::PreciseTimer);
+	m_pTickTimer->setInterval(g_nTickMs);
+	connect(m_pTickTimer, &QTimer::timeout, this, &LoadWorker::onTick);
+}
+
+template <typename Message>
+void LoadWorker::write(Client* pClient, Message const& message)
+{
+	// the socket buffers what is written during the tick and sends it when the event loop gets back to it
+	const QByteArray frame = encodeFrame(message, pClient->encoding);
+	m_stats.nBytesSent += frame.size();
+	pClient->pSocket->write(frame);
+}
+
+LoadWorker::~LoadWorker()
+{
+	// the runner stops the worker in its thread before, this only closes what an aborted run left open
+	stop();
+	qDeleteAll(m_vecClients);
+}
+
+QVector<double> LoadWorker::zipfCdf(int nCount, double dExponent)
+{
+	QVector<double> vecCdf(nCount);
+	double dTotal = 0.0;
+	for (int nRank = 0; nRank < nCount; ++nRank)
+	{
+		dTotal += 1.0 / std::pow(double(nRank + 1), dExponent);
+		vecCdf[nRank] = dTotal;
+	}
+	for (double& dWeight : vecCdf)
+		dWeight /= dTotal;
+	return vecCdf;
+}
+
+LoadStats LoadWorker::takeStats()
+{
+	LoadStats stats = m_stats;
+	m_stats = LoadStats();
+	return stats;
+}
+
+void LoadWorker::startLogins()
+{
+	m_vecClients.reserve(m_nClientCount);
+	for (int nClient = 0; nClient < m_nClientCount; ++nClient)
+	{
+		Client* pClient = new Client;
+		pClient->nIndex = m_nFirstClient + nClient;
+		pClient->sName = clientName(pClient->nIndex);
+		m_vecClients.append(pClient);
+	}
+	m_bLoggingIn = true;
+	m_tickClock.start();
+	m_nLastTickUs = 0;
+	m_pTickTimer->start();
+}
+
+void LoadWorker::startSending()
+{
+	m_bSending = true;
+	m_dSendBudget = 0.0;
+}
+
+void LoadWorker::stopSending()
+{
+	m_bSending = false;
+}
+
+void LoadWorker::stop()
+{
+	m_pTickTimer->stop();
+	m_bLoggingIn = false;
+	m_bSending = false;
+	for (Client* pClient : qAsConst(m_vecClients))
+	{
+		if (!pClient->pSocket)
+			continue;
+		// our own disconnections are not counted
+		pClient->pSocket->disconnect(this);
+		// the server doesn't keep the sessions of clients that said goodbye
+		if (pClient->bLoggedIn)
+		{
+			write(pClient, LogoutMessage());
+			pClient->pSocket->flush();
+		}
+		pClient->pSocket->abort();
+		delete pClient->pSocket;
+		pClient->pSocket = nullptr;
+	}
+	m_vecSenders.clear();
+}
+
+void LoadWorker::onTick()
+{
+	const qint64 nNowUs = m_tickClock.nsecsElapsed() / 1000;
+	const double dElapsed = double(nNowUs - m_nLastTickUs) / 1000000.0;
+	m_nLastTickUs = nNowUs;
+
+	if (m_bLoggingIn)
+	{
+		// the login rate is shared by the workers in proportion to their clients
+		const double dRate = m_config.dLoginRate * m_nClientCount / m_config.nClients;
+		m_dLoginBudget = qMin(m_dLoginBudget + dElapsed * dRate, qMax(1.0, dRate * g_dMaxBudgetSeconds));
+		while (m_dLoginBudget >= 1.0 && m_nNextLogin < m_vecClients.size())
+		{
+			connectClient(m_vecClients.at(m_nNextLogin++));
+			m_dLoginBudget -= 1.0;
+		}
+		if (m_nNextLogin == m_vecClients.size())
+			m_bLoggingIn = false;
+	}
+
+	if (m_bSending && !m_vecSenders.isEmpty())
+	{
+		const double dRate = m_config.dMessageRate * m_vecSenders.size();
+		m_dSendBudget = qMin(m_dSendBudget + dElapsed * dRate, qMax(1.0, dRate * g_dMaxBudgetSeconds));
+		while (m_dSendBudget >= 1.0)
+		{
+			if (m_nNextSender >= m_vecSenders.size())
+				m_nNextSender = 0;
+			sendMessage(m_vecSenders.at(m_nNextSender++));
+			m_dSendBudget -= 1.0;
+		}
+	}
+}
+
+void LoadWorker::connectClient(Client* pClient)
+{
+	QTcpSocket* pSocket = new QTcpSocket(this);
+	pClient->pSocket = pSocket;
+	connect(pSocket, &QTcpSocket::connected, this, [this, pClient]() -> void { onConnected(pClient); });
+	connect(pSocket, &QTcpSocket::readyRead, this, [this, pClient]() -> void { onReadyRead(pClient); });
+	connect(pSocket, &QTcpSocket::disconnected, this, [this, pClient]() -> void { onLost(pClient); });
+	// a refused connection never connected, no disconnection follows
+	connect(pSocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this,
+		[this, pClient](QAbstractSocket::SocketError) -> void
+		{
+			if (pClient->pSocket->state() == QAbstractSocket::UnconnectedState)
+				onLost(pClient);
+		}
+	);
+	pClient->nConnectStartUs = loadClockUs();
+	pSocket->connectToHost(m_config.address, m_config.nPort);
+}
+
+void LoadWorker::onConnected(Client* pClient)
+{
+	// the same as the chat client: offer CBOR, keep JSON unless the server agrees
+	pClient->pSocket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+	LoginMessage message;
+	message.setUserName(pClient->sName);
+	if (m_config.encoding == WireEncoding::Cbor)
+		message.setEncodings(QStringList(MessageCodec::encodingName(WireEncoding::Cbor)));
+	write(pClient, message);
+}
+
+void LoadWorker::onReadyRead(Client* pClient)
+{
+	pClient->decoder.readFrom(pClient->pSocket);
+	QByteArray payload;
+	while (pClient->decoder.nextFrame(payload))
+	{
+		m_stats.nBytesReceived += payload.size() + 4;
+		// only the login replies and the messages are parsed, the presence of thousands of users is just counted
+		switch (WireReader::peekMessageType(payload))
+		{
+		case MessageType::Login:
+		{
+			LoginMessage message;
+			if (parseMessage(payload, message))
+				handleLogin(pClient, message);
+			break;
+		}
+		case MessageType::Text:
+		{
+			TextMessage message;
+			if (parseMessage(payload, message))
+				handleText(message);
+			break;
+		}
+		default:
+			++m_stats.nOtherFrames;
+			break;
+		}
+		// a refused login aborted the socket
+		if (!pClient->pSocket || pClient->pSocket->state() != QAbstractSocket::ConnectedState)
+			return;
+	}
+	if (pClient->decoder.hasError())
+		pClient->pSocket->abort();
+}
+
+void LoadWorker::onLost(Client* pClient)
+{
+	if (pClient->bLoggedIn)
+	{
+		pClient->bLoggedIn = false;
+		removeSender(pClient);
+		++m_stats.nDisconnected;
+	}
+	else if (!pClient->bSettled)
+		++m_stats.nLoginFailed;
+	pClient->bSettled = true;
+}
+
+void LoadWorker::handleLogin(Client* pClient, LoginMessage const& message)
+{
+	if (pClient->bSettled || !message.hasSuccess())
+		return;
+	if (!message.bSuccess)
+	{
+		// counted here, the disconnection that follows is not
+		pClient->bSettled = true;
+		++m_stats.nLoginFailed;
+		pClient->pSocket->abort();
+		return;
+	}
+	WireEncoding encoding;
+	if (MessageCodec::parseEncodingName(message.sEncoding, encoding))
+		pClient->encoding = encoding;
+	pClient->bLoggedIn = true;
+	pClient->bSettled = true;
+	pClient->nSenderPos = m_vecSenders.size();
+	m_vecSenders.append(pClient);
+	++m_stats.nLoggedIn;
+	m_stats.loginTime.record(loadClockUs() - pClient->nConnectStartUs);
+}
+
+void LoadWorker::handleText(TextMessage const& message)
+{
+	++m_stats.nReceived;
+	// the text starts with the time it was sent at
+	const int nSeparator = message.sText.indexOf(QLatin1Char(' '));
+	bool bOk = false;
+	const qint64 nSentUs = message.sText.leftRef(nSeparator).toLongLong(&bOk);
+	if (bOk)
+		m_stats.latency.record(loadClockUs() - nSentUs);
+}
+
+void LoadWorker::sendMessage(Client* pClient)
+{
+	QString sText = QString::number(loadClockUs());
+	sText += QLatin1Char(' ');
+	sText += m_sPadding.leftRef(m_config.nMessageSize - sText.size());
+
+	TextMessage message;
+	message.setText(sText);
+	message.setReceiver(clientName(pickRecipient(pClient->nIndex)));
+	write(pClient, message);
+	++m_stats.nSent;
+}
+
+int LoadWorker::pickRecipient(int nSender)
+{
+	const int nClients = m_config.nClients;
+	int nRecipient = 0;
+	switch (m_config.recipients)
+	{
+	case RecipientDistribution::Uniform:
+		// every client but the sender
+		nRecipient = int(m_random.bounded(quint32(nClients - 1)));
+		return nRecipient >= nSender ? nRecipient + 1 : nRecipient;
+	case RecipientDistribution::Zipf:
+		nRecipient = int(std::lower_bound(m_vecZipfCdf.cbegin(), m_vecZipfCdf.cend(), m_random.generateDouble()) - m_vecZipfCdf.cbegin());
+		nRecipient = qMin(nRecipient, nClients - 1);
+		return nRecipient == nSender ? (nRecipient + 1) % nClients : nRecipient;
+	case RecipientDistribution::Neighbour:
+	default:
+		return (nSender + 1) % nClients;
+	}
+}
+
+QString LoadWorker::clientName(int nClient) const
+{
+	return m_config.sPrefix + QLatin1Char('_') + QString::number(nClient);
+}
+
+void LoadWorker::removeSender(Client* pClient)
+{
+	// the last sender takes the place of the one removed
+	const int nPos = pClient->nSenderPos;
+	if (nPos < 0)
+		return;
+	Client* pLast = m_vecSenders.takeLast();
+	if (pLast != pClient)
+	{
+		m_vecSenders[nPos] = pLast;
+		pLast->nSenderPos = nPos;
+	}
+	pClient->nSenderPos = -1;
+}
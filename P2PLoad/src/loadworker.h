@@ -0,0 +1,96 @@
+#ifndef LOADWORKER_H
+#define LOADWORKER_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QRandomGenerator>
+#include <QVector>
+#include "framecodec.h"
+#include "loadconfig.h"
+#include "loadstats.h"
+#include "messages.h"
+
+class QTcpSocket;
+class QTimer;
+
+// Drives a share of the simulated clients from one thread. The clients speak the protocol of the chat client through
+// the typed messages of P2PCommon, but a few thousand of them share an event loop instead of a network thread each.
+// The logins and the messages are paced by a fast timer spending a budget that grows with the configured rates.
+class LoadWorker : public QObject
+{
+	Q_OBJECT
+	Q_DISABLE_COPY(LoadWorker)
+
+public:
+	// drives the clients numbered [nFirstClient, nFirstClient + nClientCount), vecZipfCdf is shared by the workers
+	LoadWorker(LoadConfig const& config, int nFirstClient, int nClientCount, QVector<double> const& vecZipfCdf, QObject* parent = nullptr);
+	~LoadWorker();
+
+	// cumulative weights of the zipf distribution over nCount clients, the client numbered 0 weighs the most
+	static QVector<double> zipfCdf(int nCount, double dExponent);
+
+	// what happened since the previous call, called in the worker thread
+	LoadStats takeStats();
+
+public slots:
+	void startLogins();
+	void startSending();
+	void stopSending();
+	// logs the clients out and closes their connections
+	void stop();
+
+private slots:
+	void onTick();
+
+private:
+	struct Client
+	{
+		int nIndex = 0;
+		QString sName;
+		QTcpSocket* pSocket = nullptr;
+		FrameDecoder decoder;
+		WireEncoding encoding = WireEncoding::Json;
+		qint64 nConnectStartUs = 0;
+		bool bLoggedIn = false;
+		// logged in, refused or lost, the login is counted once
+		bool bSettled = false;
+		// position in m_vecSenders, -1 when not logged in
+		int nSenderPos = -1;
+	};
+
+	void connectClient(Client* pClient);
+	void onConnected(Client* pClient);
+	void onReadyRead(Client* pClient);
+	void onLost(Client* pClient);
+	void handleLogin(Client* pClient, LoginMessage const& message);
+	void handleText(TextMessage const& message);
+	void sendMessage(Client* pClient);
+	int pickRecipient(int nSender);
+	QString clientName(int nClient) const;
+	void removeSender(Client* pClient);
+	template <typename Message>
+	void write(Client* pClient, Message const& message);
+
+	LoadConfig m_config;
+	int m_nFirstClient;
+	int m_nClientCount;
+	QVector<double> m_vecZipfCdf;
+	QVector<Client*> m_vecClients;
+	// the logged in clients, sending in turn
+	QVector<Client*> m_vecSenders;
+	QTimer* m_pTickTimer;
+	QElapsedTimer m_tickClock;
+	qint64 m_nLastTickUs;
+	bool m_bLoggingIn;
+	bool m_bSending;
+	int m_nNextLogin;
+	int m_nNextSender;
+	double m_dLoginBudget;
+	double m_dSendBudget;
+	QRandomGenerator m_random;
+	// filler of the messages after their timestamp
+	QString m_sPadding;
+	LoadStats m_stats;
+};
+
+#endif // LOADWORKER_H
@@ -0,0 +1,27 @@
+#include <QCoreApplication>
+#include <cstdio>
+#include "loadconfig.h"
+#include "loadrunner.h"
+
+int main(int argc, char* argv[])
+{
+	QCoreApplication a(argc, argv);
+	LoadConfig config;
+	QString sError;
+	switch (config.parse(a.arguments(), sError))
+	{
+	case LoadConfig::ParseResult::Help:
+		std::fprintf(stdout, "%s", qPrintable(sError));
+		return 0;
+	case LoadConfig::ParseResult::Invalid:
+		std::fprintf(stderr, "%s\n", qPrintable(sError));
+		return 1;
+	case LoadConfig::ParseResult::Ok:
+		break;
+	}
+
+	LoadRunner runner(config);
+	QObject::connect(&runner, &LoadRunner::finished, &a, &QCoreApplication::exit, Qt::QueuedConnection);
+	runner.start();
+	return a.exec();
+}
@@ -1,69 +1,447 @@
 #include "chatserver.h"
 #include "serverworker.h"
+#include "serverthread.h"
+#include "mailbox.h"
+#include "logger.h"
+#include "servermetrics.h"
+#include "messagetracer.h"
+#include "serverconfig.h"
+#include <QRandomGenerator>
 #include <QThread>
+#include <algorithm>
 #include <functional>
-#include <QJsonDocument>
-#include <QJsonObject>
-#include <QJsonValue>
+#include <QTcpSocket>
 #include <QTimer>
 
 ChatServer::ChatServer(QObject *parent)
 	: QTcpServer(parent)
-{}
+	, m_nThreadCount(QThread::idealThreadCount())
+	, m_nMaxConnections(0)
+	, m_nMaxFrameSize(FrameDecoder::s_nMaxFrameSizeDefault)
+	, m_pReportTimer(new QTimer(this))
+	, m_pCompactTimer(new QTimer(this))
+	, m_pTraceTimer(new QTimer(this))
+	, m_pHistoryTimer(new QTimer(this))
+	, m_pMetricsExporter(new MetricsExporter([this]() -> MetricsGauges { return gauges(); }, this))
+	, m_lockClients(QReadWriteLock::Recursive)
+{
+	connect(m_pReportTimer, &QTimer::timeout, this, &ChatServer::reportConnections);
+	connect(m_pCompactTimer, &QTimer::timeout, this, &ChatServer::compactMailboxes);
+	connect(m_pTraceTimer, &QTimer::timeout, this, &ChatServer::flushTrace);
+	connect(m_pHistoryTimer, &QTimer::timeout, this, &ChatServer::flushHistory);
+}
+
+ChatServer::~ChatServer()
+{
+	stopServer();
+	stopThreads();
+	// the threads are finished, everything they traced is in the file once it is closed
+	if (m_pTraceTimer->isActive())
+		MessageTracer::close();
+}
+
+void ChatServer::setThreadCount(int nThreadCount)
+{
+	m_nThreadCount = qMax(1, nThreadCount);
+}
+
+int ChatServer::threadCount() const
+{
+	return m_nThreadCount;
+}
+
+void ChatServer::setMaxConnections(int nMaxConnections)
+{
+	m_nMaxConnections = qMax(0, nMaxConnections);
+}
+
+int ChatServer::maxConnections() const
+{
+	return m_nMaxConnections;
+}
+
+int ChatServer::connectionCount() const
+{
+	int nCount = 0;
+	for (ServerThread* pThread : m_vecThreads)
+		nCount += pThread->clientCount();
+	return nCount;
+}
+
+void ChatServer::setOutboundLimits(OutboundLimits const& limits)
+{
+	m_outboundLimits = limits;
+}
+
+OutboundLimits ChatServer::outboundLimits() const
+{
+	return m_outboundLimits;
+}
+
+void ChatServer::setMaxFrameSize(int nMaxFrameSize)
+{
+	m_nMaxFrameSize = nMaxFrameSize;
+}
+
+int ChatServer::maxFrameSize() const
+{
+	return m_nMaxFrameSize;
+}
+
+void ChatServer::setSessionSettings(SessionSettings const& settings)
+{
+	m_sessionSettings = settings;
+}
+
+SessionSettings ChatServer::sessionSettings() const
+{
+	return m_sessionSettings;
+}
+
+void ChatServer::setReportInterval(int nSeconds)
+{
+	if (nSeconds <= 0)
+		return m_pReportTimer->stop();
+	m_pReportTimer->start(nSeconds * 1000);
+}
+
+bool ChatServer::setMailboxSettings(MailboxSettings const& settings)
+{
+	m_pCompactTimer->stop();
+	if (!m_offlineStore.open(settings))
+		return false;
+	if (!m_offlineStore.isOpen())
+		return true;
+	// the expired messages are dropped at most an hour late
+	const int nCompactInterval = qBound(60, settings.nTtl, 3600);
+	m_pCompactTimer->start(nCompactInterval * 1000);
+	compactMailboxes();
+	return true;
+}
+
+bool ChatServer::setHistorySettings(HistorySettings const& settings)
+{
+	m_pHistoryTimer->stop();
+	if (!m_history.open(settings))
+		return false;
+	if (!m_history.isOpen())
+		return true;
+	// the conversations buffer their messages, a crash loses at most the last second of them
+	m_pHistoryTimer->start(1000);
+	return true;
+}
+
+bool ChatServer::setMetricsSettings(MetricsSettings const& settings)
+{
+	return m_pMetricsExporter->apply(settings);
+}
+
+MetricsGauges ChatServer::gauges() const
+{
+	MetricsGauges gauges;
+	gauges.nThreads = m_vecThreads.size();
+	for (ServerThread* pThread : m_vecThreads)
+	{
+		gauges.nConnections += pThread->clientCount();
+		gauges.nMailboxDepth += pThread->mailbox()->depth();
+	}
+	QReadLocker locker(&m_lockClients);
+	gauges.nSessions = m_sessions.size();
+	for (ServerWorker* worker : m_clients.workers())
+	{
+		const qint64 nPending = worker->pendingBytes();
+		gauges.nPendingBytes += nPending;
+		gauges.nPendingBytesMax = qMax(gauges.nPendingBytesMax, nPending);
+	}
+	return gauges;
+}
+
+bool ChatServer::setTraceSettings(TraceSettings const& settings)
+{
+	m_pTraceTimer->stop();
+	if (!MessageTracer::open(settings))
+		return false;
+	if (settings.sFile.isEmpty() || settings.nSampleInterval <= 0)
+		return true;
+	// the threads buffer their events, the file gets them every second
+	m_pTraceTimer->start(1000);
+	return true;
+}
+
+bool ChatServer::applyConfig(ServerConfig const& config, QString& sError)
+{
+	setThreadCount(config.nThreadCount);
+	setMaxConnections(config.nMaxConnections);
+	setOutboundLimits(config.outboundLimits);
+	setMaxFrameSize(config.nMaxFrameSize);
+	setReportInterval(config.nReportInterval);
+	setSessionSettings(config.session);
+	QStringList lstErrors;
+	if (!setMailboxSettings(config.mailbox))
+		lstErrors.append(QStringLiteral("Unable to use the mailbox directory %1, messages to offline users are dropped").arg(config.mailbox.sDirectory));
+	if (!setHistorySettings(config.history))
+		lstErrors.append(QStringLiteral("Unable to use the history directory %1, no history is kept").arg(config.history.sDirectory));
+	if (!setMetricsSettings(config.metrics))
+		lstErrors.append(QStringLiteral("Unable to serve the metrics on %1:%2").arg(config.metrics.address.toString()).arg(config.metrics.nPort));
+	if (!setTraceSettings(config.trace))
+		lstErrors.append(QStringLiteral("Unable to write the trace to %1, no frame is traced").arg(config.trace.sFile));
+	sError = lstErrors.join(QLatin1Char('\n'));
+	return lstErrors.isEmpty();
+}
+
+void ChatServer::compactMailboxes()
+{
+	m_offlineStore.compact();
+}
+
+void ChatServer::flushTrace()
+{
+	MessageTracer::flush();
+}
+
+void ChatServer::flushHistory()
+{
+	m_history.flush();
+}
+
+void ChatServer::reportConnections()
+{
+	// how much memory each connection holds in queued and buffered frames, the heaviest ones first
+	const int nListedMax = 10;
+	QVector<QPair<qint64, QString>> vecPending;
+	qint64 nTotal = 0;
+	{
+		QReadLocker locker(&m_lockClients);
+		for (ServerWorker* worker : m_clients.workers())
+		{
+			const qint64 nPending = worker->pendingBytes();
+			nTotal += nPending;
+			if (nPending > 0)
+				vecPending.append(qMakePair(nPending, worker->userName()));
+		}
+	}
+	std::sort(vecPending.begin(), vecPending.end(), std::greater<QPair<qint64, QString>>());
+	LOG_INFO(QStringLiteral("%1 connections, %2 bytes pending in %3 of them").arg(connectionCount()).arg(nTotal).arg(vecPending.size()));
+	for (int nIndex = 0; nIndex < qMin(nListedMax, vecPending.size()); ++nIndex)
+		LOG_INFO(QStringLiteral("  %1: %2 bytes pending").arg(vecPending.at(nIndex).second).arg(vecPending.at(nIndex).first));
+}
+
+bool ChatServer::startServer(QHostAddress const& address, quint16 nPort)
+{
+	if (m_vecThreads.size() != m_nThreadCount)
+	{
+		stopThreads();
+		startThreads();
+	}
+	return listen(address, nPort);
+}
+
+void ChatServer::startThreads()
+{
+	for (int nIndex = 0; nIndex < m_nThreadCount; ++nIndex)
+	{
+		ServerThread* pThread = new ServerThread(this);
+		pThread->setObjectName(QStringLiteral("ServerThread %1").arg(nIndex));
+		pThread->start();
+		m_vecThreads.append(pThread);
+	}
+}
+
+void ChatServer::stopThreads()
+{
+	// forget the workers first so no handler still running in another thread can reach them
+	m_lockClients.lockForWrite();
+	m_clients.clear();
+	m_rooms.clear();
+	m_sessions.clear();
+	m_lockClients.unlock();
+	// the workers still living in the threads are deleted when their thread finishes
+	for (ServerThread* pThread : qAsConst(m_vecThreads))
+		pThread->quit();
+	for (ServerThread* pThread : qAsConst(m_vecThreads))
+		pThread->wait();
+	qDeleteAll(m_vecThreads);
+	m_vecThreads.clear();
+	m_lockClients.lockForWrite();
+	m_clients.clear();
+	m_rooms.clear();
+	m_sessions.clear();
+	m_lockClients.unlock();
+}
+
+ServerThread* ChatServer::leastLoadedThread() const
+{
+	ServerThread* pBest = m_vecThreads.first();
+	for (ServerThread* pThread : m_vecThreads)
+	{
+		if (pThread->clientCount() < pBest->clientCount())
+			pBest = pThread;
+	}
+	return pBest;
+}
 
 void ChatServer::incomingConnection(qintptr socketDescriptor)
 {
-	ServerWorker* worker = new ServerWorker(this);
-	if (!worker->setSocketDescriptor(socketDescriptor)) 
+	// listen() may have been called directly instead of startServer()
+	if (m_vecThreads.isEmpty())
+		startThreads();
+	if (m_nMaxConnections > 0 && connectionCount() >= m_nMaxConnections)
 	{
+		QTcpSocket socket;
+		if (socket.setSocketDescriptor(socketDescriptor))
+			socket.abort();
+		LOG_WARNING(QStringLiteral("Connection refused, limit of %1 clients reached").arg(m_nMaxConnections));
+		ServerMetrics::add(MetricCounter::ConnectionsRefused);
+		return;
+	}
+	ServerThread* pThread = leastLoadedThread();
+	ServerWorker* worker = new ServerWorker;
+	worker->setOutboundLimits(m_outboundLimits);
+	worker->setMaxFrameSize(m_nMaxFrameSize);
+	worker->moveToThread(pThread);
+	pThread->clientAdded();
+	connect(pThread, &QThread::finished, worker, &QObject::deleteLater);
+
+	// the socket must be opened by the thread that is going to serve it
+	QMetaObject::invokeMethod(worker, std::bind(&ChatServer::clientConnected, this, worker, socketDescriptor), Qt::QueuedConnection);
+}
+
+void ChatServer::clientConnected(ServerWorker* worker, qintptr socketDescriptor)
+{
+	if (!worker->setSocketDescriptor(socketDescriptor))
+	{
+		static_cast<ServerThread*>(worker->thread())->clientRemoved();
 		worker->deleteLater();
 		return;
 	}
 
-	connect(worker, &ServerWorker::disconnectedFromClient, this, std::bind(&ChatServer::userDisconnected, this, worker));
-	connect(worker, &ServerWorker::error, this, std::bind(&ChatServer::userError, this, worker));
-	connect(worker, &ServerWorker::jsonReceived, this, std::bind(&ChatServer::jsonReceived, this, worker, std::placeholders::_1));
-	connect(worker, &ServerWorker::logMessage, this, &ChatServer::logMessage);
+	// the handlers run in the thread of the worker, the shared state they touch is guarded by m_lockClients
+	connect(worker, &ServerWorker::disconnectedFromClient, this, std::bind(&ChatServer::userDisconnected, this, worker), Qt::DirectConnection);
+	connect(worker, &ServerWorker::error, this, std::bind(&ChatServer::userError, this, worker), Qt::DirectConnection);
+	connect(worker, &ServerWorker::messageReceived, this, std::bind(&ChatServer::messageReceived, this, worker, std::placeholders::_1), Qt::DirectConnection);
+	connect(worker, &ServerWorker::directMessageReceived, this, std::bind(&ChatServer::directMessageReceived, this, worker, std::placeholders::_1, std::placeholders::_2), Qt::DirectConnection);
 
-	m_vecClients.append(worker);
-	emit logMessage(QStringLiteral("New client Connected"));
+	{
+		QWriteLocker locker(&m_lockClients);
+		m_clients.add(worker);
+	}
+	ServerMetrics::add(MetricCounter::ConnectionsAccepted);
+	LOG_INFO(QStringLiteral("New client Connected"));
 }
-void ChatServer::sendJson(ServerWorker* destination, const QJsonObject &message)
+
+void ChatServer::sendFrame(ServerWorker* destination, QByteArray const& frame, FrameKind kind)
 {
 	Q_ASSERT(destination);
-	destination->sendJson(message);
+	ServerThread* pThread = static_cast<ServerThread*>(destination->thread());
+	if (pThread == QThread::currentThread())
+		return destination->sendFrame(frame, kind);
+	pThread->mailbox()->post(destination, frame, kind);
+}
+
+void ChatServer::broadcast(OutgoingMessage& message, ServerWorker* exclude, FrameKind kind)
+{
+	QReadLocker locker(&m_lockClients);
+	fanOut(m_clients.workers(), message, exclude, kind);
 }
-void ChatServer::broadcast(QJsonObject const& message, ServerWorker* exclude)
+
+void ChatServer::fanOut(QVector<ServerWorker*> const& vecRecipients, OutgoingMessage& message, ServerWorker* exclude, FrameKind kind)
 {
-	for (ServerWorker *worker : m_vecClients) 
+	// serialized at most once per encoding, every recipient gets a reference to the same buffer
+	for (ServerWorker *worker : vecRecipients) 
 	{
 		Q_ASSERT(worker);
 		if (worker == exclude)
 			continue;
-		sendJson(worker, message);
+		sendFrame(worker, message.frame(worker->encoding()), kind);
 	}
 }
 
-void ChatServer::jsonReceived(ServerWorker* sender, QJsonObject const& doc)
+void ChatServer::messageReceived(ServerWorker* sender, QByteArray const& payload)
 {
 	Q_ASSERT(sender);
-	emit logMessage(QLatin1String("JSON received ") + QString::fromUtf8(QJsonDocument(doc).toJson()));
-	if (sender->userName().isEmpty())
-		return jsonFromLoggedOut(sender, doc);
-	jsonFromLoggedIn(sender, doc);
+	LOG_DEBUG(QStringLiteral("%1 bytes of %2 received from %3").arg(payload.size()).arg(MessageCodec::encodingName(MessageCodec::detect(payload))).arg(sender->userName()));
+	// every frame says its own encoding, a client switches to CBOR only after the login reply
+	const bool bValid = dispatchMessage(payload, 
+		[this, sender](auto const& message) -> void 
+		{
+			MessageTracer::mark(TraceStage::Parse);
+			handleMessage(sender, message);
+		}
+	);
+	if (bValid)
+		return;
+	ServerMetrics::add(MetricCounter::InvalidMessages);
+	LOG_WARNING(QStringLiteral("Invalid message of %1 bytes from %2").arg(payload.size()).arg(sender->userName()));
+}
+
+void ChatServer::directMessageReceived(ServerWorker* sender, QByteArray const& receiver, QByteArray const& text)
+{
+	Q_ASSERT(sender);
+	// the text goes through as the sender wrote it, only the receiver name is decoded for the lookup
+	const QString sReceiver = QString::fromUtf8(receiver);
+	if (UserRegistry::key(sReceiver) == UserRegistry::key(sender->userName()))
+		return;
+	{
+		// the mailbox stays locked from the lookup to the store, the delivery of a login in between waits for it
+		OfflineStore::Locker mailbox(m_offlineStore, sReceiver);
+		bool bOnline = false;
+		{
+			QReadLocker locker(&m_lockClients);
+			if (ServerWorker* worker = m_clients.find(sReceiver))
+			{
+				const QByteArray frame = FrameEncoder::encode(MessageCodec::encodeDirectMessage(text, sender->userNameUtf8(), worker->encoding()));
+				sendFrame(worker, frame);
+				bOnline = true;
+			}
+		}
+		if (!bOnline && !storeOffline(sReceiver, sender->userNameUtf8(), text))
+			return;
+	}
+	// only the messages that reached their receiver or its mailbox are kept
+	m_history.append(HistoryStore::directKey(sender->userName(), sReceiver), sender->userNameUtf8(), text);
 }
 
 void ChatServer::userDisconnected(ServerWorker* sender)
 {
-	m_vecClients.removeAll(sender);
+	// a client with a session may come back, until then it stays online for the others and its frames are held
+	if (m_sessionSettings.nGrace > 0 && sender->detach(m_sessionSettings.nGrace * 1000))
+	{
+		LOG_INFO(QStringLiteral("%1 lost the connection, its session is kept for %2 seconds").arg(sender->userName()).arg(m_sessionSettings.nGrace));
+		return;
+	}
+
+	QStringList lstRooms;
+	{
+		QWriteLocker locker(&m_lockClients);
+		// the worker reports the disconnection both when asked to disconnect and when the socket closes
+		if (!m_clients.remove(sender))
+			return;
+		ServerMetrics::add(MetricCounter::ConnectionsClosed);
+		lstRooms = m_rooms.leaveAll(sender);
+		const QByteArray token = sender->sessionToken();
+		if (!token.isEmpty() && m_sessions.value(token) == sender)
+			m_sessions.remove(token);
+	}
+	static_cast<ServerThread*>(sender->thread())->clientRemoved();
 	const QString userName = sender->userName();
 	if (!userName.isEmpty()) 
 	{
-		QJsonObject disconnectedMessage;
-		disconnectedMessage[QStringLiteral("type")] = QStringLiteral("userdisconnected");
-		disconnectedMessage[QStringLiteral("username")] = userName;
-		broadcast(disconnectedMessage, nullptr);
-		emit logMessage(userName + QLatin1String(" disconnected"));
+		UserDisconnectedMessage disconnectedMessage;
+		disconnectedMessage.setUserName(userName);
+		OutgoingMessage outgoing(disconnectedMessage);
+		broadcast(outgoing, nullptr, FrameKind::Ephemeral);
+		// the members of its rooms see it leave them, like after a leave request
+		QReadLocker locker(&m_lockClients);
+		for (QString const& sRoom : qAsConst(lstRooms))
+		{
+			LeaveMessage leaveMessage;
+			leaveMessage.setRoom(sRoom);
+			leaveMessage.setUserName(userName);
+			OutgoingMessage roomOutgoing(leaveMessage);
+			if (QVector<ServerWorker*> const* pMembers = m_rooms.members(sRoom))
+				fanOut(*pMembers, roomOutgoing, nullptr, FrameKind::Ephemeral);
+		}
+		LOG_INFO(userName + QLatin1String(" disconnected"));
 	}
 	sender->deleteLater();
 }
@@ -71,111 +449,412 @@ void ChatServer::userDisconnected(ServerWorker* sender)
 void ChatServer::userError(ServerWorker* sender)
 {
 	Q_UNUSED(sender)
-	emit logMessage(QLatin1String("Error from ") + sender->userName());
+	LOG_WARNING(QLatin1String("Error from ") + sender->userName());
 }
 
 void ChatServer::stopServer()
 {
-	for (ServerWorker* worker : m_vecClients) 
 	{
-		worker->disconnectFromClient();
+		QReadLocker locker(&m_lockClients);
+		for (ServerWorker* worker : m_clients.workers()) 
+		{
+			// the clients are not expected back, the sessions end with the connections
+			QMetaObject::invokeMethod(worker, 
+				[worker]() -> void 
+				{
+					worker->endSession();
+					worker->disconnectFromClient();
+				}, 
+				Qt::QueuedConnection
+			);
+		}
 	}
 	close();
 }
 
-void ChatServer::jsonFromLoggedOut(ServerWorker* sender, QJsonObject const& docObj)
+void ChatServer::handleMessage(ServerWorker* sender, LoginMessage const& message)
 {
 	Q_ASSERT(sender);
-	const QJsonValue typeVal = docObj.value(QLatin1String("type"));
-	if (typeVal.isNull() || !typeVal.isString())
-		return;
-	if (typeVal.toString().compare(QLatin1String("login"), Qt::CaseInsensitive) != 0)
-		return;
-	const QJsonValue usernameVal = docObj.value(QLatin1String("username"));
-	if (usernameVal.isNull() || !usernameVal.isString())
+	if (!sender->userName().isEmpty())
 		return;
-	const QString newUserName = usernameVal.toString().simplified();
+	const QString newUserName = message.sUserName.simplified();
 	if (newUserName.isEmpty())
 		return;
-	for (ServerWorker* worker : qAsConst(m_vecClients)) 
+	// the client lists the encodings it understands besides JSON, old clients list none
+	WireEncoding encoding = WireEncoding::Json;
+	for (QString const& sEncoding : message.lstEncodings)
 	{
-		if (worker == sender)
-			continue;
-		if (worker->userName().compare(newUserName, Qt::CaseInsensitive) == 0)
+		WireEncoding offered;
+		if (MessageCodec::parseEncodingName(sEncoding, offered) && offered == WireEncoding::Cbor)
+			encoding = offered;
+	}
+	if (message.hasSession() && m_sessionSettings.nGrace > 0 && resumeSession(sender, message, encoding, false))
+		return;
+
+	QByteArray token;
+	if (m_sessionSettings.nGrace > 0)
+	{
+		token.resize(16);
+		QRandomGenerator::system()->fillRange(reinterpret_cast<quint32*>(token.data()), token.size() / int(sizeof(quint32)));
+		token = token.toHex();
+	}
+	bool bRegistered;
+	QStringList lstUsers;
+	{
+		// checking and taking the name has to be atomic, two threads may log in the same name at once
+		QWriteLocker locker(&m_lockClients);
+		bRegistered = m_clients.registerName(sender, newUserName);
+		// the other threads read the encoding under the lock once the name is visible
+		if (bRegistered)
 		{
-			QJsonObject message;
-			message[QStringLiteral("type")] = QStringLiteral("login");
-			message[QStringLiteral("success")] = false;
-			message[QStringLiteral("reason")] = QStringLiteral("duplicate username");
-			sendJson(sender, message);
-			return;
+			sender->setEncoding(encoding);
+			if (!token.isEmpty())
+			{
+				sender->startSession(token, m_sessionSettings.nReplaySize);
+				m_sessions.insert(token, sender);
+			}
+			// the newcomer gets everybody already online in one frame and only they learn about the newcomer,
+			// both under the lock that registered it so a concurrent login lands in exactly one of the two
+			QVector<ServerWorker*> vecPeers;
+			vecPeers.reserve(m_clients.size());
+			lstUsers.reserve(m_clients.size());
+			for (ServerWorker* worker : m_clients.workers())
+			{
+				const QString sUserName = worker->userName();
+				if (worker == sender || sUserName.isEmpty())
+					continue;
+				lstUsers.append(sUserName);
+				vecPeers.append(worker);
+			}
+			NewUserMessage connectedMessage;
+			connectedMessage.setUserName(newUserName);
+			OutgoingMessage outgoing(connectedMessage);
+			fanOut(vecPeers, outgoing, sender, FrameKind::Ephemeral);
 		}
 	}
-	sender->setUserName(newUserName);
-	QJsonObject successMessage;
-	successMessage[QStringLiteral("type")] = QStringLiteral("login");
-	successMessage[QStringLiteral("success")] = true;
-	sendJson(sender, successMessage);
-	
-	QJsonObject connectedMessage;
-	connectedMessage[QStringLiteral("type")] = QStringLiteral("newuser");
-	connectedMessage[QStringLiteral("username")] = newUserName;
-	broadcast(connectedMessage, sender);
+	if (!bRegistered)
+	{
+		ServerMetrics::add(MetricCounter::LoginsRefused);
+		LoginMessage failureMessage;
+		failureMessage.setSuccess(false);
+		failureMessage.setReason(QStringLiteral("duplicate username"));
+		sendMessage(sender, failureMessage);
+		return;
+	}
+	ServerMetrics::add(MetricCounter::Logins);
+	LoginMessage successMessage;
+	successMessage.setSuccess(true);
+	successMessage.setEncoding(MessageCodec::encodingName(encoding));
+	if (!token.isEmpty())
+		successMessage.setSession(QString::fromLatin1(token));
+	// the reply still goes as JSON, the client switches to the chosen encoding once it reads it
+	sendFrame(sender, encodeFrame(successMessage, WireEncoding::Json));
+	RosterMessage rosterMessage;
+	rosterMessage.setUsers(lstUsers);
+	sendMessage(sender, rosterMessage);
 
-	for (ServerWorker* worker : qAsConst(m_vecClients)) 
+	deliverMailbox(sender);
+}
+
+bool ChatServer::storeOffline(QString const& sReceiver, QByteArray const& sender, QByteArray const& text)
+{
+	if (!m_offlineStore.append(sReceiver, sender, text))
 	{
-		if (worker == sender)
-			continue;
-		QString sUserName = worker->userName();
+		ServerMetrics::add(MetricCounter::MessagesUndeliverable);
+		return false;
+	}
+	ServerMetrics::add(MetricCounter::MessagesStored);
+	return true;
+}
+
+void ChatServer::deliverMailbox(ServerWorker* destination)
+{
+	// the messages come already framed in a few large batches, each one goes out as a single write.
+	// a resumed session replays at most nReplaySize bytes, a batch never needs more
+	const QString sUserName = destination->userName();
+	const qint64 nBatchMax = m_sessionSettings.nGrace > 0 ? m_sessionSettings.nReplaySize : 0;
+	qint64 nEnd = 0;
+	QVector<QByteArray> vecBatches;
+	{
+		// a sender that found us offline before the login stored its message by now
+		OfflineStore::Locker mailbox(m_offlineStore, sUserName);
+		vecBatches = m_offlineStore.read(sUserName, destination->encoding(), nBatchMax, nEnd);
+		// nothing but expired messages
+		if (vecBatches.isEmpty())
+			return m_offlineStore.remove(sUserName, nEnd);
+	}
+	for (int nBatch = 0; nBatch < vecBatches.size() - 1; ++nBatch)
+		destination->sendFrame(vecBatches.at(nBatch));
+	// the mailbox stays until the socket took the last batch, a client gone before that gets it all again at its next login
+	destination->sendFrame(vecBatches.last(), 
+		[this, sUserName, nEnd]() -> void 
 		{
-			QJsonObject message;
-			message[QStringLiteral("type")] = QStringLiteral("newuser");
-			message[QStringLiteral("username")] = sUserName;
-			broadcast(message, worker);
+			OfflineStore::Locker mailbox(m_offlineStore, sUserName);
+			m_offlineStore.remove(sUserName, nEnd);
+			LOG_INFO(QStringLiteral("Mailbox of %1 delivered").arg(sUserName));
 		}
+	);
+}
+
+bool ChatServer::resumeSession(ServerWorker* sender, LoginMessage const& message, WireEncoding encoding, bool bRetry)
+{
+	const QByteArray token = message.sSession.toLatin1();
+	ServerWorker* pPrevious = nullptr;
+	QVector<QByteArray> vecFrames;
+	bool bResumed = false;
+	{
+		QWriteLocker locker(&m_lockClients);
+		pPrevious = m_sessions.value(token);
+		if (!pPrevious || pPrevious == sender || UserRegistry::key(pPrevious->userName()) != UserRegistry::key(message.sUserName.simplified()))
+			return false;
+		bResumed = pPrevious->takeSession(message.hasReceived() ? message.nReceived : 0, sender, vecFrames);
+		if (bResumed)
+		{
+			m_clients.replace(pPrevious, sender);
+			m_rooms.replace(pPrevious, sender);
+			m_sessions.insert(token, sender);
+			sender->setEncoding(encoding);
+			sender->startSession(token, m_sessionSettings.nReplaySize);
+		}
+	}
+
+	if (bResumed)
+	{
+		// sent once the lock is released, an overflow of the replay may evict the sender. The frames sent to it from
+		// now on come from other threads through its mailbox or from this thread after this handler, so the missed
+		// frames still come first and in their order
+		LoginMessage resumedMessage;
+		resumedMessage.setSuccess(true);
+		resumedMessage.setEncoding(MessageCodec::encodingName(encoding));
+		resumedMessage.setSession(QString::fromLatin1(token));
+		resumedMessage.setResumed(true);
+		sender->sendFrame(encodeFrame(resumedMessage, WireEncoding::Json));
+		for (QByteArray const& frame : qAsConst(vecFrames))
+			sender->sendFrame(frame);
+		ServerMetrics::add(MetricCounter::SessionsResumed);
+		LOG_INFO(QStringLiteral("%1 resumed its session, %2 frames sent again").arg(sender->userName()).arg(vecFrames.size()));
+		static_cast<ServerThread*>(pPrevious->thread())->clientRemoved();
+		pPrevious->deleteLater();
+		return true;
+	}
+	if (pPrevious->abandonSession())
+	{
+		// the client owns the session but missed more than was kept, it starts over with a new login
+		userDisconnected(pPrevious);
+		return false;
 	}
+	if (bRetry)
+		return false;
+
+	// the server didn't notice yet that the previous connection is gone, it is closed and the login tried again
+	QPointer<ServerWorker> pSender(sender);
+	QMetaObject::invokeMethod(pPrevious, 
+		[this, pPrevious, pSender, message, encoding]() -> void 
+		{
+			pPrevious->disconnectFromClient();
+			if (!pSender)
+				return;
+			QMetaObject::invokeMethod(pSender.data(), 
+				[this, pSender, message, encoding]() -> void 
+				{
+					if (pSender && pSender->userName().isEmpty() && !resumeSession(pSender, message, encoding, true))
+						handleMessage(pSender, message);
+				}, 
+				Qt::QueuedConnection
+			);
+		}, 
+		Qt::QueuedConnection
+	);
+	return true;
 }
 
-void ChatServer::jsonFromLoggedIn(ServerWorker* sender, QJsonObject const& docObj)
+void ChatServer::handleMessage(ServerWorker* sender, TextMessage const& message)
 {
 	Q_ASSERT(sender);
-	const QJsonValue typeVal = docObj.value(QLatin1String("type"));
-	if (typeVal.isNull() || !typeVal.isString())
+	if (sender->userName().isEmpty())
+		return;
+
+	const QString text = message.sText.trimmed();
+	if (text.isEmpty())
 		return;
-	if (typeVal.toString().compare(QLatin1String("message"), Qt::CaseInsensitive) != 0)
+
+	if (message.hasRoom())
+		return sendToRoom(sender, message.sRoom, text);
+
+	QString const& sReceiver = message.sReceiver;
+	if (sReceiver.isEmpty())
 		return;
 
-	const QJsonValue textVal = docObj.value(QLatin1String("text"));
-	if (textVal.isNull() || !textVal.isString())
+	if (UserRegistry::key(sReceiver) == UserRegistry::key(sender->userName()))
 		return;
+	const QByteArray textUtf8 = text.toUtf8();
 
-	const QString text = textVal.toString().trimmed();
-	if (text.isEmpty())
+	TextMessage relayedMessage;
+	relayedMessage.setText(text);
+	relayedMessage.setSender(sender->userName());
+
+	{
+		OfflineStore::Locker mailbox(m_offlineStore, sReceiver);
+		bool bOnline = false;
+		{
+			QReadLocker locker(&m_lockClients);
+			if (ServerWorker* worker = m_clients.find(sReceiver))
+			{
+				sendMessage(worker, relayedMessage);
+				bOnline = true;
+			}
+		}
+		if (!bOnline && !storeOffline(sReceiver, sender->userNameUtf8(), textUtf8))
+			return;
+	}
+	m_history.append(HistoryStore::directKey(sender->userName(), sReceiver), sender->userNameUtf8(), textUtf8);
+}
+
+void ChatServer::sendToRoom(ServerWorker* sender, QString const& sRoom, QString const& sText)
+{
+	QReadLocker locker(&m_lockClients);
+	QVector<ServerWorker*> const* pMembers = m_rooms.members(sRoom);
+	// only the members can talk in a room
+	if (!pMembers || !pMembers->contains(sender))
 		return;
 
-	const QJsonValue receiver = docObj.value(QLatin1String("receiver"));
-	if (receiver.isNull() || !receiver.isString())
+	TextMessage roomMessage;
+	roomMessage.setText(sText);
+	roomMessage.setSender(sender->userName());
+	roomMessage.setRoom(m_rooms.name(sRoom));
+	OutgoingMessage outgoing(roomMessage);
+	fanOut(*pMembers, outgoing, sender, FrameKind::Essential);
+	locker.unlock();
+	m_history.append(HistoryStore::roomKey(sRoom), sender->userNameUtf8(), sText.toUtf8());
+}
+
+void ChatServer::handleMessage(ServerWorker* sender, JoinMessage const& message)
+{
+	Q_ASSERT(sender);
+	if (sender->userName().isEmpty())
+		return;
+	const QString sRoom = message.sRoom.simplified();
+	if (sRoom.isEmpty())
 		return;
 
-	QString const& sReceiver = receiver.toString();
-	if (sReceiver.isEmpty())
+	bool bJoined;
+	{
+		QWriteLocker locker(&m_lockClients);
+		bJoined = m_rooms.join(sRoom, sender);
+	}
+	// the read lock keeps the members from being deleted during the sends, which go through a copy of the list
+	// since the room itself can change under them
+	QReadLocker locker(&m_lockClients);
+	QVector<ServerWorker*> const* pMembers = m_rooms.members(sRoom);
+	if (!pMembers)
+		return;
+	const QVector<ServerWorker*> vecMembers = *pMembers;
+	const QString sRoomName = m_rooms.name(sRoom);
+
+	// the joiner learns who is already there, asking again for a room it is in just repeats that
+	QStringList lstUsers;
+	lstUsers.reserve(vecMembers.size());
+	for (ServerWorker* worker : vecMembers)
+	{
+		if (worker != sender)
+			lstUsers.append(worker->userName());
+	}
+	JoinMessage replyMessage;
+	replyMessage.setRoom(sRoomName);
+	replyMessage.setUsers(lstUsers);
+	sendMessage(sender, replyMessage);
+	if (!bJoined)
+		return;
+
+	JoinMessage joinedMessage;
+	joinedMessage.setRoom(sRoomName);
+	joinedMessage.setUserName(sender->userName());
+	OutgoingMessage outgoing(joinedMessage);
+	fanOut(vecMembers, outgoing, sender, FrameKind::Ephemeral);
+}
+
+void ChatServer::handleMessage(ServerWorker* sender, LeaveMessage const& message)
+{
+	Q_ASSERT(sender);
+	if (sender->userName().isEmpty())
 		return;
 
-	QJsonObject message;
-	message[QStringLiteral("type")] = QStringLiteral("message");
-	message[QStringLiteral("text")] = text;
-	message[QStringLiteral("sender")] = sender->userName();
+	QString sRoomName;
+	{
+		QWriteLocker locker(&m_lockClients);
+		sRoomName = m_rooms.name(message.sRoom.simplified());
+		if (!m_rooms.leave(sRoomName, sender))
+			return;
+	}
+	// the room is gone with its last member
+	QReadLocker locker(&m_lockClients);
+	QVector<ServerWorker*> const* pMembers = m_rooms.members(sRoomName);
+	const QVector<ServerWorker*> vecMembers = pMembers ? *pMembers : QVector<ServerWorker*>();
+
+	LeaveMessage leftMessage;
+	leftMessage.setRoom(sRoomName);
+	leftMessage.setUserName(sender->userName());
+	OutgoingMessage outgoing(leftMessage);
+	sendFrame(sender, outgoing.frame(sender->encoding()));
+	fanOut(vecMembers, outgoing, sender, FrameKind::Ephemeral);
+}
 
-	for (ServerWorker* worker : qAsConst(m_vecClients)) 
+void ChatServer::handleMessage(ServerWorker* sender, HistoryMessage const& message)
+{
+	Q_ASSERT(sender);
+	if (sender->userName().isEmpty())
+		return;
+	const int nPageDefault = 50;
+	const int nPageMax = 200;
+	// text escaped in JSON takes up to six times its size, the page stays well below the frame limit of the clients
+	const qint64 nPageBytesMax = 1024 * 1024;
+
+	HistoryMessage pageMessage;
+	QString sConversation;
+	if (message.hasRoom())
 	{
-		if (worker == sender)
-			continue;
-		if (worker->userName().compare(sReceiver, Qt::CaseInsensitive) == 0) 
+		// only the members can read a room, the others get an empty page so they don't wait for one
+		QReadLocker locker(&m_lockClients);
+		const QString sRoom = message.sRoom.simplified();
+		if (!m_rooms.isMember(sRoom, sender))
 		{
-			sendJson(worker, message);
-			return;
+			locker.unlock();
+			pageMessage.setRoom(message.sRoom);
+			return sendMessage(sender, pageMessage);
 		}
+		pageMessage.setRoom(m_rooms.name(sRoom));
+		sConversation = HistoryStore::roomKey(sRoom);
+	}
+	else if (message.hasUserName())
+	{
+		pageMessage.setUserName(message.sUserName);
+		sConversation = HistoryStore::directKey(sender->userName(), message.sUserName);
+	}
+	else
+	{
+		return;
 	}
-}
 
+	const int nLimit = message.hasLimit() ? int(qBound<qint64>(1, message.nLimit, nPageMax)) : nPageDefault;
+	const HistoryPage page = m_history.page(sConversation, message.hasBefore() ? message.nBefore : 0, nLimit, nPageBytesMax);
+	pageMessage.setSenders(page.lstSenders);
+	pageMessage.setTexts(page.lstTexts);
+	if (page.nFirst > 0)
+		pageMessage.setCursor(page.nFirst);
+	if (page.bFailed)
+		pageMessage.setReason(QStringLiteral("history unavailable"));
+	sendMessage(sender, pageMessage);
+}
 
+void ChatServer::handleMessage(ServerWorker* sender, LogoutMessage const&)
+{
+	Q_ASSERT(sender);
+	// the disconnection that follows is final, nobody waits for the client to come back
+	const QByteArray token = sender->sessionToken();
+	sender->endSession();
+	if (token.isEmpty())
+		return;
+	QWriteLocker locker(&m_lockClients);
+	if (m_sessions.value(token) == sender)
+		m_sessions.remove(token);
+}
@@ -2,39 +2,138 @@
 #define CHATSERVER_H
 
 #include <QTcpServer>
+#include <QHash>
+#include <QHostAddress>
+#include <QReadWriteLock>
 #include <QVector>
+#include "userregistry.h"
+#include "roomregistry.h"
+#include "offlinestore.h"
+#include "historystore.h"
+#include "serverworker.h"
+#include "metricsexporter.h"
+#include "messagetracer.h"
+#include "messages.h"
 
-class QThread;
+class QTimer;
+
+class ServerThread;
 class ServerWorker;
+struct ServerConfig;
 
 class ChatServer : public QTcpServer
 {
 	Q_OBJECT
 	Q_DISABLE_COPY(ChatServer)
+	// the microbenchmarks of P2PBench drive the private paths without a listening server
+	friend class ServerBench;
 
 public:
 	explicit ChatServer(QObject *parent = nullptr);
+	~ChatServer();
+
+	// number of event loop threads serving the clients, takes effect on the next startServer
+	void setThreadCount(int nThreadCount);
+	int threadCount() const;
+	// clients past this many connections are refused, 0 means no limit
+	void setMaxConnections(int nMaxConnections);
+	int maxConnections() const;
+	int connectionCount() const;
+	// applies to the clients connecting afterwards
+	void setOutboundLimits(OutboundLimits const& limits);
+	OutboundLimits outboundLimits() const;
+	// clients sending a bigger frame are disconnected, applies to the clients connecting afterwards
+	void setMaxFrameSize(int nMaxFrameSize);
+	int maxFrameSize() const;
+	// applies to the logins that follow
+	void setSessionSettings(SessionSettings const& settings);
+	SessionSettings sessionSettings() const;
+	// logs the memory held for the connections every nSeconds, 0 turns the report off
+	void setReportInterval(int nSeconds);
+	// direct messages to users that are offline wait in their mailbox until they log in, returns false if the directory can't be used
+	bool setMailboxSettings(MailboxSettings const& settings);
+	// conversations kept for the history requests, returns false if the directory can't be used
+	bool setHistorySettings(HistorySettings const& settings);
+	// serves the metrics and writes their snapshots, returns false if the endpoint can't listen
+	bool setMetricsSettings(MetricsSettings const& settings);
+	MetricsGauges gauges() const;
+	// traces the sampled frames to a file, returns false if it can't be written
+	bool setTraceSettings(TraceSettings const& settings);
+	// every setting of the config but the address to listen on. The server goes on without the ones that fail,
+	// returns false with sError telling which, one per line
+	bool applyConfig(ServerConfig const& config, QString& sError);
+	bool startServer(QHostAddress const& address, quint16 nPort);
 
 protected:
 	void incomingConnection(qintptr socketDescriptor) override;
 
-signals:
-	void logMessage(QString const& msg);
-
 public slots:
 	void stopServer();
 
 private slots:
-	void broadcast(QJsonObject const& message, ServerWorker *exclude);
-	void jsonReceived(ServerWorker* sender, QJsonObject const& doc);
+	void reportConnections();
+	void compactMailboxes();
+	void flushTrace();
+	void flushHistory();
+	void messageReceived(ServerWorker* sender, QByteArray const& payload);
+	void directMessageReceived(ServerWorker* sender, QByteArray const& receiver, QByteArray const& text);
 	void userDisconnected(ServerWorker* sender);
 	void userError(ServerWorker* sender);
 
 private:
-	void jsonFromLoggedOut(ServerWorker *sender, QJsonObject const& doc);
-	void jsonFromLoggedIn(ServerWorker *sender, QJsonObject const& doc);
-	void sendJson(ServerWorker* destination, QJsonObject const& message);
-	QVector<ServerWorker*> m_vecClients;
+	void handleMessage(ServerWorker* sender, LoginMessage const& message);
+	void handleMessage(ServerWorker* sender, TextMessage const& message);
+	void handleMessage(ServerWorker* sender, JoinMessage const& message);
+	void handleMessage(ServerWorker* sender, LeaveMessage const& message);
+	void handleMessage(ServerWorker* sender, HistoryMessage const& message);
+	void handleMessage(ServerWorker* sender, LogoutMessage const& message);
+	// hands the session of the token to the sender, returns false when the login has to go on as a new one
+	bool resumeSession(ServerWorker* sender, LoginMessage const& message, WireEncoding encoding, bool bRetry);
+	void sendToRoom(ServerWorker* sender, QString const& sRoom, QString const& sText);
+	void deliverMailbox(ServerWorker* destination);
+	// the message waits in the mailbox of the receiver if the store is on and the mailbox not full, returns false otherwise.
+	// called with the mailbox locked and without m_lockClients
+	bool storeOffline(QString const& sReceiver, QByteArray const& sender, QByteArray const& text);
+	// the other messages are only sent by the server
+	template <typename Message>
+	void handleMessage(ServerWorker*, Message const&) {}
+	template <typename Message>
+	void sendMessage(ServerWorker* destination, Message const& message);
+	void broadcast(OutgoingMessage& message, ServerWorker *exclude, FrameKind kind = FrameKind::Essential);
+	// the caller holds m_lockClients, at least for reading
+	void fanOut(QVector<ServerWorker*> const& vecRecipients, OutgoingMessage& message, ServerWorker* exclude, FrameKind kind);
+	void sendFrame(ServerWorker* destination, QByteArray const& frame, FrameKind kind = FrameKind::Essential);
+	void clientConnected(ServerWorker* worker, qintptr socketDescriptor);
+	void startThreads();
+	void stopThreads();
+	ServerThread* leastLoadedThread() const;
+
+	int m_nThreadCount;
+	int m_nMaxConnections;
+	OutboundLimits m_outboundLimits;
+	int m_nMaxFrameSize;
+	QTimer* m_pReportTimer;
+	QTimer* m_pCompactTimer;
+	QTimer* m_pTraceTimer;
+	QTimer* m_pHistoryTimer;
+	MetricsExporter* m_pMetricsExporter;
+	QVector<ServerThread*> m_vecThreads;
+	// the handlers run in the threads of the workers, so the clients are shared between threads.
+	// the lock is recursive because broadcasts are nested inside loops over the clients
+	mutable QReadWriteLock m_lockClients;
+	UserRegistry m_clients;
+	RoomRegistry m_rooms;
+	OfflineStore m_offlineStore;
+	HistoryStore m_history;
+	SessionSettings m_sessionSettings;
+	// the workers by session token, guarded by m_lockClients like the registries
+	QHash<QByteArray, ServerWorker*> m_sessions;
 };
 
+template <typename Message>
+void ChatServer::sendMessage(ServerWorker* destination, Message const& message)
+{
+	sendFrame(destination, encodeFrame(message, destination->encoding()));
+}
+
 #endif // CHATSERVER_H
\ No newline at end of file
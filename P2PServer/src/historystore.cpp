@@ -0,0 +1,366 @@
+#include "historystore.h"
+#include "userregistry.h"
+#include "logger.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QtEndian>
+#include <algorithm>
+
+namespace
+{
+	// record: quint32 size of the rest, qint64 arrival in ms since the epoch, quint16 sender size, sender, text
+	const int g_nSizeField = int(sizeof(quint32));
+	const int g_nRecordHeader = int(sizeof(quint32) + sizeof(qint64) + sizeof(quint16));
+	// the index holds the offset of every record in the log
+	const int g_nIndexEntry = int(sizeof(quint64));
+	const char g_szLogSuffix[] = ".log";
+	const char g_szIndexSuffix[] = ".idx";
+	// conversations kept loaded, each one keeps its last segment open and file handles are not unlimited
+	const int g_nConversationsMax = 128;
+}
+
+HistoryStore::HistoryStore()
+	: m_bOpen(false)
+	, m_nLastUse(0)
+{}
+
+HistoryStore::~HistoryStore()
+{
+	close();
+}
+
+bool HistoryStore::open(HistorySettings const& settings)
+{
+	close();
+	QMutexLocker locker(&m_mutex);
+	m_settings = settings;
+	m_settings.nSegmentRecords = qMax(1, m_settings.nSegmentRecords);
+	if (settings.sDirectory.isEmpty())
+		return true;
+	if (!QDir().mkpath(settings.sDirectory))
+		return false;
+	m_bOpen = true;
+	return true;
+}
+
+void HistoryStore::close()
+{
+	QMutexLocker locker(&m_mutex);
+	m_bOpen = false;
+	for (QSharedPointer<Conversation> const& pConversation : qAsConst(m_mapConversations))
+	{
+		QMutexLocker conversationLocker(&pConversation->mutex);
+		drop(pConversation.data());
+	}
+	m_mapConversations.clear();
+}
+
+bool HistoryStore::isOpen() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_bOpen;
+}
+
+void HistoryStore::flush()
+{
+	QVector<QSharedPointer<Conversation>> vecConversations;
+	{
+		QMutexLocker locker(&m_mutex);
+		vecConversations.reserve(m_mapConversations.size());
+		for (QSharedPointer<Conversation> const& pConversation : qAsConst(m_mapConversations))
+			vecConversations.append(pConversation);
+	}
+	for (QSharedPointer<Conversation> const& pConversation : qAsConst(vecConversations))
+	{
+		QMutexLocker locker(&pConversation->mutex);
+		// the log goes first, an index entry always points to a complete record
+		if (pConversation->log.isOpen() && (!pConversation->log.flush() || !pConversation->index.flush()))
+			LOG_WARNING(QStringLiteral("Unable to write the history segment %1 - %2").arg(pConversation->log.fileName(), pConversation->log.errorString()));
+	}
+}
+
+QString HistoryStore::directKey(QString const& sUserName, QString const& sOtherName)
+{
+	// both sides of a conversation find it under the same key
+	const QString sFirst = UserRegistry::key(sUserName);
+	const QString sSecond = UserRegistry::key(sOtherName);
+	return sFirst < sSecond ? sFirst + QLatin1Char('\n') + sSecond : sSecond + QLatin1Char('\n') + sFirst;
+}
+
+QString HistoryStore::roomKey(QString const& sRoom)
+{
+	// user names can't hold a '#', so rooms never collide with the direct conversations
+	return QLatin1Char('#') + UserRegistry::key(sRoom);
+}
+
+QString HistoryStore::segmentPath(Conversation const* pConversation, qint64 nFirst, char const* szSuffix) const
+{
+	return pConversation->sDirectory + QLatin1Char('/') + QStringLiteral("%1").arg(nFirst, 16, 16, QLatin1Char('0')) + QLatin1String(szSuffix);
+}
+
+QSharedPointer<HistoryStore::Conversation> HistoryStore::conversation(QString const& sConversation, bool bCreate)
+{
+	QMutexLocker locker(&m_mutex);
+	if (!m_bOpen)
+		return {};
+	auto it = m_mapConversations.find(sConversation);
+	if (it != m_mapConversations.end())
+	{
+		(*it)->nLastUse = ++m_nLastUse;
+		return *it;
+	}
+
+	// a read of a conversation that was never written leaves nothing behind
+	const QString sDirectory = m_settings.sDirectory + QLatin1Char('/') + QString::fromLatin1(sConversation.toUtf8().toHex());
+	if (!bCreate && !QFileInfo(sDirectory).isDir())
+		return {};
+	if (m_mapConversations.size() >= g_nConversationsMax)
+	{
+		auto itOldest = std::min_element(m_mapConversations.begin(), m_mapConversations.end(), 
+			[](QSharedPointer<Conversation> const& pFirst, QSharedPointer<Conversation> const& pSecond) -> bool 
+			{
+				return pFirst->nLastUse < pSecond->nLastUse;
+			}
+		);
+		// the oldest one being written right now is left for the next lookup, the map goes over the cap meanwhile
+		if ((*itOldest)->mutex.tryLock())
+		{
+			drop(itOldest->data());
+			(*itOldest)->mutex.unlock();
+			m_mapConversations.erase(itOldest);
+		}
+	}
+
+	QSharedPointer<Conversation> pConversation = QSharedPointer<Conversation>::create();
+	pConversation->sDirectory = sDirectory;
+	pConversation->nSegmentRecords = m_settings.nSegmentRecords;
+	pConversation->nLastUse = ++m_nLastUse;
+	m_mapConversations.insert(sConversation, pConversation);
+	return pConversation;
+}
+
+void HistoryStore::drop(Conversation* pConversation)
+{
+	closeSegment(pConversation);
+	pConversation->bDropped = true;
+}
+
+void HistoryStore::load(Conversation* pConversation)
+{
+	pConversation->bLoaded = true;
+	const QDir dir(pConversation->sDirectory);
+	for (QString const& sFile : dir.entryList({ QStringLiteral("*.idx") }, QDir::Files))
+	{
+		bool bOk = false;
+		const qint64 nFirst = sFile.left(sFile.size() - int(sizeof(g_szIndexSuffix) - 1)).toLongLong(&bOk, 16);
+		if (bOk && nFirst > 0)
+			pConversation->vecSegments.append(nFirst);
+	}
+	std::sort(pConversation->vecSegments.begin(), pConversation->vecSegments.end());
+	if (pConversation->vecSegments.isEmpty())
+		return;
+
+	const qint64 nLast = pConversation->vecSegments.last();
+	QFile index(segmentPath(pConversation, nLast, g_szIndexSuffix));
+	QFile log(segmentPath(pConversation, nLast, g_szLogSuffix));
+	qint64 nEntries = index.size() / g_nIndexEntry;
+	if (index.open(QIODevice::ReadOnly))
+	{
+		// the buffers of a crashed server may have reached the index and not the log, the entries pointing past the
+		// last complete record are dropped with the entry cut by the crash. A missing log drops them all
+		log.open(QIODevice::ReadOnly);
+		const qint64 nLogSize = log.isOpen() ? log.size() : 0;
+		for (; nEntries > 0; --nEntries)
+		{
+			uchar entry[g_nIndexEntry];
+			uchar size[g_nSizeField];
+			if (!index.seek((nEntries - 1) * g_nIndexEntry) || index.read(reinterpret_cast<char*>(entry), g_nIndexEntry) != g_nIndexEntry)
+				continue;
+			const quint64 nOffset = qFromBigEndian<quint64>(entry);
+			if (nOffset + g_nRecordHeader > quint64(nLogSize) || !log.seek(qint64(nOffset)) || log.read(reinterpret_cast<char*>(size), g_nSizeField) != g_nSizeField)
+				continue;
+			if (nOffset + g_nSizeField + qFromBigEndian<quint32>(size) <= quint64(nLogSize))
+				break;
+		}
+		index.close();
+	}
+	if (index.size() != nEntries * g_nIndexEntry)
+		index.resize(nEntries * g_nIndexEntry);
+	pConversation->nNextSeq = nLast + nEntries;
+}
+
+bool HistoryStore::openLastSegment(Conversation* pConversation)
+{
+	const qint64 nFirst = pConversation->vecSegments.last();
+	pConversation->log.setFileName(segmentPath(pConversation, nFirst, g_szLogSuffix));
+	pConversation->index.setFileName(segmentPath(pConversation, nFirst, g_szIndexSuffix));
+	const QIODevice::OpenMode mode = QIODevice::WriteOnly | QIODevice::Append;
+	if (!pConversation->log.open(mode) || !pConversation->index.open(mode))
+	{
+		LOG_WARNING(QStringLiteral("Unable to open the history segment %1 - %2").arg(pConversation->log.fileName(), pConversation->log.errorString()));
+		closeSegment(pConversation);
+		return false;
+	}
+	pConversation->nLogSize = pConversation->log.size();
+	return true;
+}
+
+void HistoryStore::closeSegment(Conversation* pConversation)
+{
+	pConversation->log.close();
+	pConversation->index.close();
+}
+
+bool HistoryStore::append(QString const& sConversation, QByteArray const& sender, QByteArray const& text)
+{
+	if (sender.size() > 0xFFFF)
+		return false;
+	QByteArray record(g_nRecordHeader + sender.size() + text.size(), Qt::Uninitialized);
+	char* pRecord = record.data();
+	qToBigEndian<quint32>(quint32(record.size() - g_nSizeField), pRecord);
+	qToBigEndian<qint64>(QDateTime::currentMSecsSinceEpoch(), pRecord + g_nSizeField);
+	qToBigEndian<quint16>(quint16(sender.size()), pRecord + g_nSizeField + sizeof(qint64));
+	memcpy(pRecord + g_nRecordHeader, sender.constData(), size_t(sender.size()));
+	memcpy(pRecord + g_nRecordHeader + sender.size(), text.constData(), size_t(text.size()));
+
+	for (;;)
+	{
+		const QSharedPointer<Conversation> pConversation = conversation(sConversation, true);
+		if (!pConversation)
+			return false;
+		QMutexLocker locker(&pConversation->mutex);
+		if (!pConversation->bDropped)
+			return write(pConversation.data(), record);
+	}
+}
+
+bool HistoryStore::write(Conversation* pConversation, QByteArray const& record)
+{
+	if (!pConversation->bLoaded)
+		load(pConversation);
+	if (pConversation->vecSegments.isEmpty() || pConversation->nNextSeq - pConversation->vecSegments.last() >= pConversation->nSegmentRecords)
+	{
+		closeSegment(pConversation);
+		if (!QDir().mkpath(pConversation->sDirectory))
+			return false;
+		pConversation->vecSegments.append(pConversation->nNextSeq);
+	}
+	if (!pConversation->log.isOpen() && !openLastSegment(pConversation))
+		return false;
+
+	// the record goes first, an index entry always points to a complete record
+	char entry[g_nIndexEntry];
+	qToBigEndian<quint64>(quint64(pConversation->nLogSize), entry);
+	if (pConversation->log.write(record) != record.size() || pConversation->index.write(entry, g_nIndexEntry) != g_nIndexEntry)
+	{
+		LOG_WARNING(QStringLiteral("Unable to write the history segment %1 - %2").arg(pConversation->log.fileName(), pConversation->log.errorString()));
+		// reopened for the next message, the size of the log is read again
+		closeSegment(pConversation);
+		return false;
+	}
+	pConversation->nLogSize += record.size();
+	++pConversation->nNextSeq;
+	return true;
+}
+
+HistoryPage HistoryStore::page(QString const& sConversation, qint64 nBefore, int nLimit, qint64 nMaxBytes)
+{
+	if (nLimit <= 0)
+		return HistoryPage();
+	for (;;)
+	{
+		const QSharedPointer<Conversation> pConversation = conversation(sConversation, false);
+		if (!pConversation)
+			return HistoryPage();
+		QMutexLocker locker(&pConversation->mutex);
+		if (pConversation->bDropped)
+			continue;
+		if (!pConversation->bLoaded)
+			load(pConversation.data());
+		// the page is read from the files, the buffered messages go first
+		if (pConversation->log.isOpen() && (!pConversation->log.flush() || !pConversation->index.flush()))
+		{
+			LOG_WARNING(QStringLiteral("Unable to write the history segment %1 - %2").arg(pConversation->log.fileName(), pConversation->log.errorString()));
+			HistoryPage page;
+			page.bFailed = true;
+			return page;
+		}
+		return readPage(pConversation.data(), nBefore, nLimit, nMaxBytes);
+	}
+}
+
+HistoryPage HistoryStore::readPage(Conversation const* pConversation, qint64 nBefore, int nLimit, qint64 nMaxBytes) const
+{
+	HistoryPage page;
+	QVector<qint64> const& vecSegments = pConversation->vecSegments;
+	if (vecSegments.isEmpty())
+		return page;
+
+	const qint64 nTo = nBefore <= 0 || nBefore > pConversation->nNextSeq ? pConversation->nNextSeq : nBefore;
+	const qint64 nFrom = qMax(vecSegments.first(), nTo - nLimit);
+	if (nFrom >= nTo)
+		return page;
+	// the newest messages first, the page ends up starting with the oldest one that fit in the budget
+	qint64 nBudget = nMaxBytes;
+	page.nFirst = nTo;
+	int nSegment = int(std::upper_bound(vecSegments.begin(), vecSegments.end(), nTo - 1) - vecSegments.begin()) - 1;
+	for (; nSegment >= 0 && page.nFirst > nFrom && nBudget > 0; --nSegment)
+	{
+		const qint64 nSegmentEnd = nSegment + 1 < vecSegments.size() ? vecSegments.at(nSegment + 1) : pConversation->nNextSeq;
+		if (!readSegment(pConversation, nSegment, qMax(nFrom, vecSegments.at(nSegment)), qMin(nTo, nSegmentEnd), nBudget, page))
+		{
+			// a page with a hole would mislead the client about what precedes it
+			LOG_WARNING(QStringLiteral("Unable to read the history segment %1 of %2").arg(vecSegments.at(nSegment)).arg(pConversation->sDirectory));
+			HistoryPage failed;
+			failed.bFailed = true;
+			return failed;
+		}
+	}
+	if (page.lstTexts.isEmpty())
+		page.nFirst = 0;
+	return page;
+}
+
+bool HistoryStore::readSegment(Conversation const* pConversation, int nSegment, qint64 nFrom, qint64 nTo, qint64& nBudget, HistoryPage& page) const
+{
+	const qint64 nFirst = pConversation->vecSegments.at(nSegment);
+	QFile index(segmentPath(pConversation, nFirst, g_szIndexSuffix));
+	QFile log(segmentPath(pConversation, nFirst, g_szLogSuffix));
+	if (!index.open(QIODevice::ReadOnly) || !log.open(QIODevice::ReadOnly))
+		return false;
+	const qint64 nIndexSize = index.size();
+	const qint64 nLogSize = log.size();
+	if (nIndexSize < (nTo - nFirst) * g_nIndexEntry || nLogSize == 0)
+		return false;
+	// only the entries of the page are mapped from the index, the log is mapped whole
+	uchar const* pIndex = index.map((nFrom - nFirst) * g_nIndexEntry, (nTo - nFrom) * g_nIndexEntry);
+	uchar const* pLog = log.map(0, nLogSize);
+	if (!pIndex || !pLog)
+		return false;
+
+	for (qint64 nEntry = nTo - nFrom - 1; nEntry >= 0; --nEntry)
+	{
+		const quint64 nOffset = qFromBigEndian<quint64>(pIndex + nEntry * g_nIndexEntry);
+		if (nOffset + g_nRecordHeader > quint64(nLogSize))
+			return false;
+		uchar const* pRecord = pLog + nOffset;
+		const quint32 nRecordSize = qFromBigEndian<quint32>(pRecord);
+		const quint16 nSenderSize = qFromBigEndian<quint16>(pRecord + g_nSizeField + sizeof(qint64));
+		if (nOffset + g_nSizeField + nRecordSize > quint64(nLogSize) || g_nRecordHeader - g_nSizeField + nSenderSize > int(nRecordSize))
+			return false;
+		// the newest message is always in, whatever its size
+		if (!page.lstTexts.isEmpty() && qint64(nRecordSize) > nBudget)
+		{
+			nBudget = 0;
+			return true;
+		}
+		nBudget -= nRecordSize;
+		char const* pSender = reinterpret_cast<char const*>(pRecord + g_nRecordHeader);
+		page.lstSenders.prepend(QString::fromUtf8(pSender, nSenderSize));
+		page.lstTexts.prepend(QString::fromUtf8(pSender + nSenderSize, int(nRecordSize) - (g_nRecordHeader - g_nSizeField) - nSenderSize));
+		page.nFirst = nFrom + nEntry;
+	}
+	return true;
+}
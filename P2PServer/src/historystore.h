@@ -0,0 +1,102 @@
+#ifndef HISTORYSTORE_H
+#define HISTORYSTORE_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+struct HistorySettings
+{
+	// an empty directory keeps the store off, no history is kept
+	QString sDirectory;
+	// messages per segment, a segment is a log and an index of the offsets of its records
+	int nSegmentRecords = 4096;
+};
+
+// A page of a conversation, oldest message first
+struct HistoryPage
+{
+	QStringList lstSenders;
+	QStringList lstTexts;
+	// sequence number of the first message, 0 for an empty page
+	qint64 nFirst = 0;
+	// the files couldn't be read, the empty page says nothing about the history
+	bool bFailed = false;
+};
+
+// Conversations kept on disk, one directory per conversation holding segments named after the sequence number of
+// their first message. A message is appended to the log of the last segment and its offset to the index, so a page
+// is found with one lookup in the index and read through a memory mapping of the log.
+// Safe to call from any thread, a conversation is only locked against the others writing or reading it. The writes
+// are buffered, they reach the files when the buffers fill up, before a page is read and at every flush.
+class HistoryStore
+{
+public:
+	HistoryStore();
+	~HistoryStore();
+
+	// creates the directory if needed, returns false if it can't be used
+	bool open(HistorySettings const& settings);
+	void close();
+	bool isOpen() const;
+	// writes the buffered messages of every conversation to its files
+	void flush();
+
+	static QString directKey(QString const& sUserName, QString const& sOtherName);
+	static QString roomKey(QString const& sRoom);
+
+	bool append(QString const& sConversation, QByteArray const& sender, QByteArray const& text);
+	// up to nLimit messages preceding the sequence number nBefore, the newest ones when nBefore is 0. The page stops
+	// at the older messages that would take it past nMaxBytes of records, it always holds at least one message
+	HistoryPage page(QString const& sConversation, qint64 nBefore, int nLimit, qint64 nMaxBytes);
+
+private:
+	struct Conversation
+	{
+		// guards the members below, except nLastUse which goes with the map
+		QMutex mutex;
+		// dropped from the map, a thread that got it before looks the conversation up again
+		bool bDropped = false;
+		// the segments are listed by the first thread locking the conversation, not under the lock of the map
+		bool bLoaded = false;
+		QString sDirectory;
+		int nSegmentRecords = 0;
+		// the last lookup, the conversation looked up the longest ago is dropped first
+		quint64 nLastUse = 0;
+		// first sequence number of every segment, ascending
+		QVector<qint64> vecSegments;
+		qint64 nNextSeq = 1;
+		// the last segment, kept open while the conversation is loaded. The size of its log counts the buffered records
+		QFile log;
+		QFile index;
+		qint64 nLogSize = 0;
+	};
+
+	// the conversation is not locked yet, nullptr if the store is closed or if it has no directory and bCreate is false
+	QSharedPointer<Conversation> conversation(QString const& sConversation, bool bCreate);
+	// closes the conversation for good, called with both the lock of the map and its own held
+	void drop(Conversation* pConversation);
+	// the functions below are called with the lock of the conversation held
+	void load(Conversation* pConversation);
+	bool write(Conversation* pConversation, QByteArray const& record);
+	bool openLastSegment(Conversation* pConversation);
+	void closeSegment(Conversation* pConversation);
+	QString segmentPath(Conversation const* pConversation, qint64 nFirst, char const* szSuffix) const;
+	HistoryPage readPage(Conversation const* pConversation, qint64 nBefore, int nLimit, qint64 nMaxBytes) const;
+	// prepends the messages from nTo - 1 down to nFrom to the page while they fit in nBudget
+	bool readSegment(Conversation const* pConversation, int nSegment, qint64 nFrom, qint64 nTo, qint64& nBudget, HistoryPage& page) const;
+
+	// guards the map and the settings, never taken by a thread holding the lock of a conversation
+	mutable QMutex m_mutex;
+	HistorySettings m_settings;
+	bool m_bOpen;
+	QHash<QString, QSharedPointer<Conversation>> m_mapConversations;
+	quint64 m_nLastUse;
+};
+
+#endif // HISTORYSTORE_H
\ No newline at end of file
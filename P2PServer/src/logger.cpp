@@ -0,0 +1,156 @@
+#include "logger.h"
+
+#include <QDateTime>
+#include <QMutexLocker>
+#include <cstdio>
+
+namespace
+{
+	const quint32 g_nRecordsMax = 16384;
+	// how long the logger thread sleeps when there is nothing to write
+	const unsigned long g_nIdleSleepMs = 20;
+
+	QLatin1String levelName(LogLevel level)
+	{
+		switch (level)
+		{
+		case LogLevel::Debug:
+			return QLatin1String("DEBUG");
+		case LogLevel::Info:
+			return QLatin1String("INFO");
+		case LogLevel::Warning:
+			return QLatin1String("WARNING");
+		case LogLevel::Error:
+			return QLatin1String("ERROR");
+		default:
+			return QLatin1String("OFF");
+		}
+	}
+}
+
+QAtomicInteger<int> Logger::s_nLevel(int(LogLevel::Info));
+
+Logger& Logger::instance()
+{
+	static Logger logger;
+	return logger;
+}
+
+Logger::Logger()
+	: m_records(g_nRecordsMax)
+	, m_nDropped(0)
+	, m_nStop(0)
+	, m_nDroppedReported(0)
+{
+	setObjectName(QStringLiteral("Logger"));
+	m_output.open(stderr, QIODevice::WriteOnly);
+	start(QThread::LowPriority);
+}
+
+Logger::~Logger()
+{
+	stop();
+}
+
+void Logger::setLevel(LogLevel level)
+{
+	s_nLevel.storeRelaxed(int(level));
+}
+
+LogLevel Logger::level()
+{
+	return LogLevel(s_nLevel.loadRelaxed());
+}
+
+bool Logger::parseLevel(QString const& sLevel, LogLevel& level)
+{
+	for (LogLevel candidate : { LogLevel::Debug, LogLevel::Info, LogLevel::Warning, LogLevel::Error, LogLevel::Off })
+	{
+		if (sLevel.compare(levelName(candidate), Qt::CaseInsensitive) == 0)
+		{
+			level = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Logger::setOutput(QString const& sFilePath)
+{
+	QMutexLocker locker(&m_lockOutput);
+	m_output.close();
+	if (sFilePath.isEmpty())
+		return m_output.open(stderr, QIODevice::WriteOnly);
+	m_output.setFileName(sFilePath);
+	return m_output.open(QIODevice::WriteOnly | QIODevice::Append);
+}
+
+void Logger::write(LogLevel level, QString const& sText)
+{
+	Record record;
+	record.nTimestamp = QDateTime::currentMSecsSinceEpoch();
+	record.level = level;
+	record.sText = sText;
+	// never block the caller, a full buffer loses the record
+	if (!m_records.tryPush(std::move(record)))
+		m_nDropped.ref();
+}
+
+void Logger::stop()
+{
+	m_nStop.storeRelease(1);
+	wait();
+}
+
+quint64 Logger::droppedCount() const
+{
+	return m_nDropped.loadRelaxed();
+}
+
+void Logger::run()
+{
+	while (!m_nStop.loadAcquire())
+	{
+		if (!drain())
+			msleep(g_nIdleSleepMs);
+	}
+	drain();
+}
+
+bool Logger::drain()
+{
+	QByteArray lines;
+	QString sForwarded;
+	Record record;
+	while (m_records.tryPop(record))
+	{
+		const QString sLine = QDateTime::fromMSecsSinceEpoch(record.nTimestamp).toString(Qt::ISODateWithMs)
+			+ QLatin1String(" [") + levelName(record.level) + QLatin1String("] ") + record.sText;
+		lines += sLine.toUtf8();
+		lines += '\n';
+		if (record.level >= LogLevel::Info)
+		{
+			if (!sForwarded.isEmpty())
+				sForwarded += QLatin1Char('\n');
+			sForwarded += sLine;
+		}
+	}
+	if (lines.isEmpty())
+		return false;
+
+	const quint64 nDropped = m_nDropped.loadRelaxed();
+	if (nDropped != m_nDroppedReported)
+	{
+		lines += QByteArray::number(nDropped - m_nDroppedReported) + " log records dropped\n";
+		m_nDroppedReported = nDropped;
+	}
+
+	{
+		QMutexLocker locker(&m_lockOutput);
+		m_output.write(lines);
+		m_output.flush();
+	}
+	if (!sForwarded.isEmpty())
+		emit messageLogged(sForwarded);
+	return true;
+}
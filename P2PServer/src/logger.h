@@ -0,0 +1,94 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <QThread>
+#include <QAtomicInteger>
+#include <QFile>
+#include <QMutex>
+#include <QString>
+#include "ringbuffer.h"
+
+enum class LogLevel
+{
+	Debug,
+	Info,
+	Warning,
+	Error,
+	Off
+};
+
+// levels below this one are compiled out, release builds drop the debug lines entirely
+#ifndef P2P_LOG_MIN_LEVEL
+#	ifdef QT_NO_DEBUG
+#		define P2P_LOG_MIN_LEVEL 1
+#	else
+#		define P2P_LOG_MIN_LEVEL 0
+#	endif
+#endif
+
+// the message expression is only evaluated when the level is enabled
+#define P2P_LOG(level, message) \
+	do { \
+		if (int(level) >= P2P_LOG_MIN_LEVEL && Logger::isEnabled(level)) \
+			Logger::instance().write(level, message); \
+	} while (false)
+
+#define LOG_DEBUG(message) P2P_LOG(LogLevel::Debug, message)
+#define LOG_INFO(message) P2P_LOG(LogLevel::Info, message)
+#define LOG_WARNING(message) P2P_LOG(LogLevel::Warning, message)
+#define LOG_ERROR(message) P2P_LOG(LogLevel::Error, message)
+
+// Asynchronous logger. The callers only push a record into a lock-free ring buffer,
+// a background thread formats the records and writes them to a file or stderr.
+class Logger : public QThread
+{
+	Q_OBJECT
+	Q_DISABLE_COPY(Logger)
+public:
+	static Logger& instance();
+
+	static bool isEnabled(LogLevel level)
+	{
+		return int(level) >= s_nLevel.loadRelaxed();
+	}
+	static void setLevel(LogLevel level);
+	static LogLevel level();
+	static bool parseLevel(QString const& sLevel, LogLevel& level);
+
+	// an empty path writes to stderr
+	bool setOutput(QString const& sFilePath);
+	void write(LogLevel level, QString const& sText);
+	// flushes the pending records and stops the background thread
+	void stop();
+	quint64 droppedCount() const;
+
+signals:
+	// records of Info level and above, batched and emitted from the logger thread
+	void messageLogged(QString const& msg);
+
+protected:
+	void run() override;
+
+private:
+	struct Record
+	{
+		qint64 nTimestamp = 0;
+		LogLevel level = LogLevel::Debug;
+		QString sText;
+	};
+
+	Logger();
+	~Logger();
+	bool drain();
+
+	static QAtomicInteger<int> s_nLevel;
+	RingBuffer<Record> m_records;
+	QAtomicInteger<quint64> m_nDropped;
+	QAtomicInteger<int> m_nStop;
+	// only touched by the logger thread
+	quint64 m_nDroppedReported;
+	QMutex m_lockOutput;
+	QFile m_output;
+};
+
+#endif // LOGGER_H
\ No newline at end of file
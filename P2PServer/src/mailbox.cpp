@@ -0,0 +1,117 @@
+#include "mailbox.h"
+#include "servermetrics.h"
+#include "messagetracer.h"
+
+#include <QCoreApplication>
+#include <QEvent>
+
+namespace
+{
+	const QEvent::Type g_eventDrain = static_cast<QEvent::Type>(QEvent::registerEventType());
+	// upper bound of frames delivered per event so a flooded mailbox can't starve the sockets of its thread
+	const int g_nDrainBatch = 1024;
+}
+
+Mailbox::Mailbox(QObject* parent)
+	: QObject(parent)
+	, m_pHead(&m_stub)
+	, m_pTail(&m_stub)
+	, m_nScheduled(0)
+	, m_nDepth(0)
+{}
+
+Mailbox::~Mailbox()
+{
+	while (Node* pNode = pop())
+		delete pNode;
+}
+
+void Mailbox::post(ServerWorker* pDestination, QByteArray const& frame, FrameKind kind)
+{
+	Node* pNode = new Node;
+	pNode->pDestination = pDestination;
+	// only a reference to the frame is queued, a broadcast shares one buffer between all the mailboxes
+	pNode->frame = frame;
+	pNode->kind = kind;
+	pNode->nTraceId = MessageTracer::current();
+	pNode->nPostedNs = pNode->nTraceId != 0 ? ServerMetrics::clockNs() : 0;
+	m_nDepth.ref();
+	push(pNode);
+	schedule();
+}
+
+int Mailbox::depth() const
+{
+	return m_nDepth.loadRelaxed();
+}
+
+void Mailbox::push(Node* pNode)
+{
+	pNode->pNext.storeRelaxed(nullptr);
+	Node* pPrev = m_pHead.fetchAndStoreOrdered(pNode);
+	pPrev->pNext.storeRelease(pNode);
+}
+
+Mailbox::Node* Mailbox::pop()
+{
+	Node* pTail = m_pTail;
+	Node* pNext = pTail->pNext.loadAcquire();
+	if (pTail == &m_stub)
+	{
+		if (!pNext)
+			return nullptr;
+		m_pTail = pNext;
+		pTail = pNext;
+		pNext = pNext->pNext.loadAcquire();
+	}
+	if (pNext)
+	{
+		m_pTail = pNext;
+		return pTail;
+	}
+	// a producer swapped the head but didn't link it yet, it will schedule another drain once it does
+	if (pTail != m_pHead.loadAcquire())
+		return nullptr;
+
+	push(&m_stub);
+	pNext = pTail->pNext.loadAcquire();
+	if (pNext)
+	{
+		m_pTail = pNext;
+		return pTail;
+	}
+	return nullptr;
+}
+
+void Mailbox::schedule()
+{
+	// only the producer that finds the mailbox idle wakes up the consumer thread
+	if (m_nScheduled.fetchAndStoreOrdered(1) == 0)
+		QCoreApplication::postEvent(this, new QEvent(g_eventDrain));
+}
+
+bool Mailbox::event(QEvent* pEvent)
+{
+	if (pEvent->type() != g_eventDrain)
+		return QObject::event(pEvent);
+
+	m_nScheduled.fetchAndStoreOrdered(0);
+	for (int nDelivered = 0; nDelivered < g_nDrainBatch; ++nDelivered)
+	{
+		Node* pNode = pop();
+		if (!pNode)
+			return true;
+		// the destination lives in this thread, so it can't be deleted while we are using it
+		if (pNode->pDestination)
+		{
+			// the trace goes on in this thread, the frame is queued as part of it
+			MessageTracer::Scope trace(pNode->nTraceId, pNode->nPostedNs);
+			MessageTracer::mark(TraceStage::Mailbox);
+			pNode->pDestination->sendFrame(pNode->frame, pNode->kind);
+		}
+		delete pNode;
+		m_nDepth.deref();
+	}
+	schedule();
+	return true;
+}
@@ -0,0 +1,50 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <QObject>
+#include <QAtomicInteger>
+#include <QAtomicPointer>
+#include <QByteArray>
+#include <QPointer>
+#include "serverworker.h"
+
+// Multi producer / single consumer queue of outgoing frames for the workers living in one thread.
+// Any thread can post, the frames are delivered by the thread the mailbox lives in.
+class Mailbox : public QObject
+{
+	Q_DISABLE_COPY(Mailbox)
+public:
+	explicit Mailbox(QObject* parent = nullptr);
+	~Mailbox();
+
+	void post(ServerWorker* pDestination, QByteArray const& frame, FrameKind kind);
+	// frames posted and not delivered yet, a thread falling behind lets it grow
+	int depth() const;
+
+protected:
+	bool event(QEvent* pEvent) override;
+
+private:
+	struct Node
+	{
+		QAtomicPointer<Node> pNext;
+		QPointer<ServerWorker> pDestination;
+		QByteArray frame;
+		FrameKind kind;
+		// the trace of the frame being handled when it was posted
+		quint64 nTraceId;
+		qint64 nPostedNs;
+	};
+
+	void push(Node* pNode);
+	Node* pop();
+	void schedule();
+
+	QAtomicPointer<Node> m_pHead;
+	Node* m_pTail;
+	Node m_stub;
+	QAtomicInteger<int> m_nScheduled;
+	QAtomicInteger<int> m_nDepth;
+};
+
+#endif // MAILBOX_H
\ No newline at end of file
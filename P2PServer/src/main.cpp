@@ -1,12 +1,74 @@
 #include <QApplication>
+#include <QCoreApplication>
+#include <QMessageBox>
+#include <cstdio>
 #include "serverwindow.h"
+#include "serverdaemon.h"
+#include "serverconfig.h"
+#include "logger.h"
 
-int main(int argc, char* argv[])
+namespace
 {
-	QApplication a(argc, argv);
-
-	ServerWindow serverWin;
-	serverWin.show();
+	ServerConfig::ParseResult applyConfig(ServerConfig& config, QStringList const& lstArguments, QString& sError)
+	{
+		const ServerConfig::ParseResult result = config.parse(lstArguments, sError);
+		if (result != ServerConfig::ParseResult::Ok)
+			return result;
+		Logger::setLevel(config.logLevel);
+		if (!config.sLogFile.isEmpty() && !Logger::instance().setOutput(config.sLogFile))
+		{
+			sError = QStringLiteral("Unable to open the log file %1").arg(config.sLogFile);
+			return ServerConfig::ParseResult::Invalid;
+		}
+		return result;
+	}
+}
 
-	return a.exec();
+int main(int argc, char* argv[])
+{
+	ServerConfig config;
+	QString sError;
+	int nResult = 0;
+	if (ServerConfig::isHeadless(argc, argv))
+	{
+		// no widget, no display connection
+		QCoreApplication a(argc, argv);
+		const ServerConfig::ParseResult result = applyConfig(config, a.arguments(), sError);
+		if (result == ServerConfig::ParseResult::Help)
+		{
+			std::fprintf(stdout, "%s", qPrintable(sError));
+			return 0;
+		}
+		if (result == ServerConfig::ParseResult::Invalid)
+		{
+			std::fprintf(stderr, "%s\n", qPrintable(sError));
+			return 1;
+		}
+		ServerDaemon daemon(config);
+		if (!daemon.start())
+			nResult = 1;
+		else
+			nResult = a.exec();
+	}
+	else
+	{
+		QApplication a(argc, argv);
+		const ServerConfig::ParseResult result = applyConfig(config, a.arguments(), sError);
+		if (result == ServerConfig::ParseResult::Help)
+		{
+			// asked from a terminal, the text goes there like in headless mode
+			std::fprintf(stdout, "%s", qPrintable(sError));
+			return 0;
+		}
+		if (result == ServerConfig::ParseResult::Invalid)
+		{
+			QMessageBox::critical(nullptr, QObject::tr("Error"), sError);
+			return 1;
+		}
+		ServerWindow serverWin(config);
+		serverWin.show();
+		nResult = a.exec();
+	}
+	Logger::instance().stop();
+	return nResult;
 }
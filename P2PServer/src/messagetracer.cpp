@@ -0,0 +1,250 @@
+#include "messagetracer.h"
+#include "servermetrics.h"
+#include "logger.h"
+
+#include <QAtomicInteger>
+#include <QCoreApplication>
+#include <QFile>
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+
+namespace
+{
+	char const* const g_szStageNames[] = { "decode", "parse", "dispatch", "mailbox", "queue", "socket" };
+	static_assert(sizeof(g_szStageNames) / sizeof(g_szStageNames[0]) == size_t(TraceStage::Count), "every stage needs a name");
+
+	// 0 while no file is open, nothing gets sampled then
+	QAtomicInteger<int> g_nSampleInterval(0);
+	QAtomicInteger<quint64> g_nLastTraceId(0);
+
+	struct Context
+	{
+		quint64 nTraceId;
+		qint64 nMarkNs;
+	};
+
+	Context& context()
+	{
+		thread_local Context s_context = { 0, 0 };
+		return s_context;
+	}
+
+	qint64 processId()
+	{
+		static const qint64 s_nProcessId = QCoreApplication::applicationPid();
+		return s_nProcessId;
+	}
+
+	// the trace events take microseconds, the nanoseconds are kept as decimals
+	QByteArray microseconds(qint64 nNs)
+	{
+		return QByteArray::number(double(nNs) / 1e3, 'f', 3);
+	}
+
+	// every event starts with the separator, the file begins with the process name so none is ever first
+	void appendMetadata(QByteArray& out, char const* szName, int nThread, QByteArray const& value)
+	{
+		out += ",\n{\"name\":\"";
+		out += szName;
+		out += "\",\"ph\":\"M\",\"pid\":" + QByteArray::number(processId()) + ",\"tid\":" + QByteArray::number(nThread);
+		out += ",\"args\":{\"name\":\"" + value + "\"}}";
+	}
+
+	void appendSpan(QByteArray& out, int nThread, quint64 nTraceId, TraceStage stage, qint64 nStartNs, qint64 nEndNs)
+	{
+		out += ",\n{\"name\":\"";
+		out += g_szStageNames[int(stage)];
+		out += "\",\"cat\":\"p2p\",\"ph\":\"X\",\"pid\":" + QByteArray::number(processId()) + ",\"tid\":" + QByteArray::number(nThread);
+		out += ",\"ts\":" + microseconds(nStartNs) + ",\"dur\":" + microseconds(qMax<qint64>(0, nEndNs - nStartNs));
+		out += ",\"args\":{\"trace\":" + QByteArray::number(nTraceId) + "}}";
+	}
+
+	class Shard;
+
+	struct Registry
+	{
+		QMutex lock;
+		QVector<Shard*> vecShards;
+		int nLastThread = 0;
+		// what the finished threads recorded since the last flush
+		QByteArray retired;
+		QFile file;
+	};
+
+	Registry& registry()
+	{
+		static Registry s_registry;
+		return s_registry;
+	}
+
+	class Shard
+	{
+	public:
+		Shard()
+			: m_bNamed(false)
+		{
+			// the server threads are named before they start, the others are told apart by their number
+			Registry& reg = registry();
+			QMutexLocker locker(&reg.lock);
+			m_nThread = ++reg.nLastThread;
+			m_name = QThread::currentThread()->objectName().toUtf8();
+			if (m_name.isEmpty())
+				m_name = "Thread " + QByteArray::number(m_nThread);
+			reg.vecShards.append(this);
+		}
+
+		~Shard()
+		{
+			Registry& reg = registry();
+			QMutexLocker locker(&reg.lock);
+			takeEvents(reg.retired);
+			reg.vecShards.removeOne(this);
+		}
+
+		void append(quint64 nTraceId, TraceStage stage, qint64 nStartNs, qint64 nEndNs)
+		{
+			QMutexLocker locker(&m_lock);
+			appendSpan(m_events, m_nThread, nTraceId, stage, nStartNs, nEndNs);
+		}
+
+		// called with the lock of the registry held
+		void takeEvents(QByteArray& out)
+		{
+			if (!m_bNamed)
+			{
+				appendMetadata(out, "thread_name", m_nThread, m_name);
+				m_bNamed = true;
+			}
+			QMutexLocker locker(&m_lock);
+			out += m_events;
+			m_events.clear();
+		}
+
+		// called with the lock of the registry held, a new file names the threads again
+		void reset()
+		{
+			m_bNamed = false;
+			QMutexLocker locker(&m_lock);
+			m_events.clear();
+		}
+
+	private:
+		int m_nThread;
+		QByteArray m_name;
+		bool m_bNamed;
+		QMutex m_lock;
+		QByteArray m_events;
+	};
+
+	Shard& localShard()
+	{
+		thread_local Shard s_shard;
+		return s_shard;
+	}
+}
+
+MessageTracer::Scope::Scope(quint64 nTraceId, qint64 nStartNs)
+{
+	// a mailbox can deliver while a frame is handled, the outer trace goes on afterwards
+	Context& ctx = context();
+	m_nOuterTraceId = ctx.nTraceId;
+	m_nOuterMarkNs = ctx.nMarkNs;
+	ctx.nTraceId = nTraceId;
+	ctx.nMarkNs = nStartNs;
+}
+
+MessageTracer::Scope::~Scope()
+{
+	Context& ctx = context();
+	ctx.nTraceId = m_nOuterTraceId;
+	ctx.nMarkNs = m_nOuterMarkNs;
+}
+
+bool MessageTracer::open(TraceSettings const& settings)
+{
+	close();
+	if (settings.sFile.isEmpty() || settings.nSampleInterval <= 0)
+		return true;
+
+	Registry& reg = registry();
+	QMutexLocker locker(&reg.lock);
+	reg.file.setFileName(settings.sFile);
+	if (!reg.file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return false;
+	for (Shard* pShard : qAsConst(reg.vecShards))
+		pShard->reset();
+	reg.retired.clear();
+	// a JSON array of events, the viewers load it even before the closing bracket is written
+	QByteArray header = "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + QByteArray::number(processId());
+	header += ",\"args\":{\"name\":\"" + QCoreApplication::applicationName().toUtf8() + "\"}}";
+	reg.file.write(header);
+	g_nSampleInterval.storeRelaxed(settings.nSampleInterval);
+	LOG_INFO(QStringLiteral("Tracing one frame out of %1 to %2").arg(settings.nSampleInterval).arg(settings.sFile));
+	return true;
+}
+
+void MessageTracer::flush()
+{
+	Registry& reg = registry();
+	QMutexLocker locker(&reg.lock);
+	if (!reg.file.isOpen())
+		return;
+	QByteArray events;
+	events.swap(reg.retired);
+	for (Shard* pShard : qAsConst(reg.vecShards))
+		pShard->takeEvents(events);
+	if (events.isEmpty())
+		return;
+	if (reg.file.write(events) < 0 || !reg.file.flush())
+	{
+		LOG_WARNING(QStringLiteral("Unable to write the trace to %1, tracing stopped").arg(reg.file.fileName()));
+		g_nSampleInterval.storeRelaxed(0);
+		reg.file.close();
+	}
+}
+
+void MessageTracer::close()
+{
+	g_nSampleInterval.storeRelaxed(0);
+	flush();
+	Registry& reg = registry();
+	QMutexLocker locker(&reg.lock);
+	if (!reg.file.isOpen())
+		return;
+	reg.file.write("\n]\n");
+	reg.file.close();
+}
+
+quint64 MessageTracer::sample()
+{
+	const int nInterval = g_nSampleInterval.loadRelaxed();
+	if (nInterval == 0)
+		return 0;
+	// every thread counts its own frames, the first one it reads is traced
+	thread_local int s_nCountdown = 0;
+	if (--s_nCountdown > 0)
+		return 0;
+	s_nCountdown = nInterval;
+	return g_nLastTraceId.fetchAndAddRelaxed(1) + 1;
+}
+
+quint64 MessageTracer::current()
+{
+	return context().nTraceId;
+}
+
+void MessageTracer::mark(TraceStage stage)
+{
+	Context& ctx = context();
+	if (ctx.nTraceId == 0)
+		return;
+	const qint64 nNowNs = ServerMetrics::clockNs();
+	localShard().append(ctx.nTraceId, stage, ctx.nMarkNs, nNowNs);
+	ctx.nMarkNs = nNowNs;
+}
+
+void MessageTracer::span(quint64 nTraceId, TraceStage stage, qint64 nStartNs, qint64 nEndNs)
+{
+	localShard().append(nTraceId, stage, nStartNs, nEndNs);
+}
@@ -0,0 +1,71 @@
+#ifndef MESSAGETRACER_H
+#define MESSAGETRACER_H
+
+#include <QString>
+#include <QtGlobal>
+
+// What a traced frame goes through, each stage is recorded as a span of its own
+enum class TraceStage
+{
+	// from the readyRead that brought the frame, or the end of the frame before it, to the frame being cut out
+	Decode,
+	// until a handler of ChatServer got the message
+	Parse,
+	// the handler routing the message, until it returns with the frames it sent queued
+	Dispatch,
+	// a frame sent to a client of another thread, from the post to its delivery by the mailbox
+	Mailbox,
+	// in the outbound queue of the recipient, until it is taken to be written
+	Queue,
+	// buffered by the socket until the kernel took its last byte, it grows when the kernel buffer of the client is full
+	Socket,
+	Count
+};
+
+struct TraceSettings
+{
+	// the trace events are written to this file, an empty path traces nothing
+	QString sFile;
+	// one frame out of this many is traced by every thread, 0 traces nothing
+	int nSampleInterval = 1000;
+};
+
+// Opt-in tracing of sampled frames, written as Chrome trace events for chrome://tracing or ui.perfetto.dev.
+// A sampled frame gets a trace id, followed from the thread that read it to the sockets of all its recipients,
+// every span carries it in its args. Like the metrics, every thread records into its own buffer and the file is only
+// written by flush, the frames that are not sampled pay for a thread local read.
+class MessageTracer
+{
+public:
+	// makes nTraceId the trace of the frames handled by this thread until destroyed, its first stage starting at
+	// nStartNs. A trace id of 0 traces nothing
+	class Scope
+	{
+		Q_DISABLE_COPY(Scope)
+	public:
+		Scope(quint64 nTraceId, qint64 nStartNs);
+		~Scope();
+
+	private:
+		quint64 m_nOuterTraceId;
+		qint64 m_nOuterMarkNs;
+	};
+
+	// starts writing the file, returns false if it can't be written. Settings tracing nothing close the file
+	static bool open(TraceSettings const& settings);
+	// writes what the threads recorded since the last flush
+	static void flush();
+	// stops the sampling and completes the file
+	static void close();
+
+	// a new trace id if the frame read by this thread is sampled, 0 otherwise
+	static quint64 sample();
+	// the trace of the frame this thread is handling, 0 for none
+	static quint64 current();
+	// ends the current stage of the current trace now, the next one starts where it ends
+	static void mark(TraceStage stage);
+	// records a stage of a trace that isn't the current one, the timestamps come from ServerMetrics::clockNs
+	static void span(quint64 nTraceId, TraceStage stage, qint64 nStartNs, qint64 nEndNs);
+};
+
+#endif // MESSAGETRACER_H
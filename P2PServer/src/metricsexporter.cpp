@@ -0,0 +1,203 @@
+#include "metricsexporter.h"
+#include "servermetrics.h"
+#include "logger.h"
+
+#include <QSaveFile>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+
+namespace
+{
+	// a request is a line and a few headers, anything bigger is not a scraper
+	const int g_nRequestMax = 8192;
+	const int g_nRequestTimeoutMs = 5000;
+
+	struct CounterInfo
+	{
+		MetricCounter counter;
+		char const* szName;
+		char const* szHelp;
+	};
+
+	const CounterInfo g_counters[] = {
+		{ MetricCounter::ConnectionsAccepted, "p2p_connections_accepted_total", "Client connections accepted." },
+		{ MetricCounter::ConnectionsRefused, "p2p_connections_refused_total", "Client connections refused past the connection limit." },
+		{ MetricCounter::ConnectionsClosed, "p2p_connections_closed_total", "Client connections closed, sessions expiring included." },
+		{ MetricCounter::Logins, "p2p_logins_total", "Successful logins, resumed sessions excluded." },
+		{ MetricCounter::LoginsRefused, "p2p_logins_refused_total", "Logins refused because the name was taken." },
+		{ MetricCounter::SessionsResumed, "p2p_sessions_resumed_total", "Sessions taken back by a reconnecting client." },
+		{ MetricCounter::FramesReceived, "p2p_frames_received_total", "Frames received from the clients." },
+		{ MetricCounter::BytesReceived, "p2p_bytes_received_total", "Bytes of the frames received from the clients." },
+		{ MetricCounter::FramesSent, "p2p_frames_sent_total", "Frames handed to the client sockets." },
+		{ MetricCounter::BytesSent, "p2p_bytes_sent_total", "Bytes of the frames handed to the client sockets." },
+		{ MetricCounter::InvalidMessages, "p2p_invalid_messages_total", "Payloads that didn't parse into a message." },
+		{ MetricCounter::FramesDropped, "p2p_frames_dropped_total", "Queued frames thrown away before being written." },
+		{ MetricCounter::ClientsEvicted, "p2p_clients_evicted_total", "Clients disconnected for not reading their frames." },
+		{ MetricCounter::FramesOversized, "p2p_frames_oversized_total", "Clients disconnected for a frame above the maximum size." },
+		{ MetricCounter::MessagesStored, "p2p_messages_stored_total", "Direct messages kept for an offline user." },
+		{ MetricCounter::MessagesUndeliverable, "p2p_messages_undeliverable_total", "Direct messages to an offline user lost, the mailbox being off or full." },
+	};
+	static_assert(sizeof(g_counters) / sizeof(g_counters[0]) == size_t(MetricCounter::Count), "every counter needs a name");
+
+	// bounds of the exported latency buckets in seconds, from a microsecond to a second
+	const double g_dLatencyBounds[] = { 1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+		1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1.0 };
+	const double g_dQuantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	QByteArray seconds(qint64 nNs)
+	{
+		return QByteArray::number(double(nNs) / 1e9, 'g', 9);
+	}
+
+	void appendHeader(QByteArray& out, char const* szName, char const* szHelp, char const* szType)
+	{
+		out += "# HELP ";
+		out += szName;
+		out += ' ';
+		out += szHelp;
+		out += "\n# TYPE ";
+		out += szName;
+		out += ' ';
+		out += szType;
+		out += '\n';
+	}
+
+	void appendValue(QByteArray& out, char const* szName, char const* szHelp, char const* szType, QByteArray const& value)
+	{
+		appendHeader(out, szName, szHelp, szType);
+		out += szName;
+		out += ' ';
+		out += value;
+		out += '\n';
+	}
+
+	void appendHistogram(QByteArray& out, char const* szName, char const* szHelp, LatencyHistogram const& histogram)
+	{
+		const QByteArray name(szName);
+		appendHeader(out, szName, szHelp, "histogram");
+		// the buckets of the histogram are finer than the exported ones, a bucket straddling a bound counts above it
+		int nBucket = 0;
+		qint64 nCumulative = 0;
+		for (double dBound : g_dLatencyBounds)
+		{
+			const qint64 nBoundNs = qint64(dBound * 1e9);
+			while (nBucket < histogram.bucketCount() && histogram.bucketUpperBound(nBucket) <= nBoundNs)
+				nCumulative += histogram.bucketValueCount(nBucket++);
+			out += name + "_bucket{le=\"" + QByteArray::number(dBound, 'g', 6) + "\"} " + QByteArray::number(nCumulative) + '\n';
+		}
+		out += name + "_bucket{le=\"+Inf\"} " + QByteArray::number(histogram.count()) + '\n';
+		out += name + "_sum " + seconds(histogram.sum()) + '\n';
+		out += name + "_count " + QByteArray::number(histogram.count()) + '\n';
+
+		// the percentiles at the full resolution of the histogram, for the readers of the plain text
+		const QByteArray quantileName = name + "_quantile";
+		appendHeader(out, quantileName.constData(), "Percentiles since the start.", "gauge");
+		for (double dQuantile : g_dQuantiles)
+			out += quantileName + "{quantile=\"" + QByteArray::number(dQuantile) + "\"} " + seconds(histogram.percentile(dQuantile * 100.0)) + '\n';
+		const QByteArray maxName = name + "_max";
+		appendValue(out, maxName.constData(), "Highest value since the start.", "gauge", seconds(histogram.max()));
+	}
+}
+
+MetricsExporter::MetricsExporter(std::function<MetricsGauges()> gauges, QObject* parent)
+	: QObject(parent)
+	, m_gauges(std::move(gauges))
+	, m_pServer(new QTcpServer(this))
+	, m_pSnapshotTimer(new QTimer(this))
+{
+	m_uptime.start();
+	connect(m_pServer, &QTcpServer::newConnection, this, &MetricsExporter::onNewConnection);
+	connect(m_pSnapshotTimer, &QTimer::timeout, this, &MetricsExporter::writeSnapshot);
+}
+
+bool MetricsExporter::apply(MetricsSettings const& settings)
+{
+	m_pServer->close();
+	m_pSnapshotTimer->stop();
+	m_sFile = settings.sFile;
+	if (!m_sFile.isEmpty())
+	{
+		m_pSnapshotTimer->start(qMax(1, settings.nInterval) * 1000);
+		writeSnapshot();
+	}
+	if (settings.nPort == 0)
+		return true;
+	if (!m_pServer->listen(settings.address, settings.nPort))
+		return false;
+	LOG_INFO(QStringLiteral("Metrics served on %1:%2").arg(settings.address.toString()).arg(settings.nPort));
+	return true;
+}
+
+QByteArray MetricsExporter::render() const
+{
+	const MetricsSnapshot snapshot = ServerMetrics::snapshot();
+	const MetricsGauges gauges = m_gauges();
+	QByteArray out;
+	out.reserve(8192);
+	for (CounterInfo const& info : g_counters)
+		appendValue(out, info.szName, info.szHelp, "counter", QByteArray::number(snapshot.counter(info.counter)));
+
+	appendValue(out, "p2p_uptime_seconds", "Seconds since the server started.", "gauge", QByteArray::number(double(m_uptime.elapsed()) / 1000.0, 'f', 3));
+	appendValue(out, "p2p_threads", "Event loop threads serving the clients.", "gauge", QByteArray::number(gauges.nThreads));
+	appendValue(out, "p2p_connections", "Client connections open.", "gauge", QByteArray::number(gauges.nConnections));
+	appendValue(out, "p2p_sessions", "Sessions kept for resumption, detached ones included.", "gauge", QByteArray::number(gauges.nSessions));
+	appendValue(out, "p2p_outbound_pending_bytes", "Bytes queued or buffered for the clients.", "gauge", QByteArray::number(gauges.nPendingBytes));
+	appendValue(out, "p2p_outbound_pending_bytes_max", "Most bytes queued or buffered for one client.", "gauge", QByteArray::number(gauges.nPendingBytesMax));
+	appendValue(out, "p2p_mailbox_depth", "Frames posted between threads and not delivered yet.", "gauge", QByteArray::number(gauges.nMailboxDepth));
+
+	appendHistogram(out, "p2p_routing_latency_seconds", "From the readyRead that brought a frame to the writes it caused being queued.", snapshot.routing);
+	return out;
+}
+
+void MetricsExporter::onNewConnection()
+{
+	while (QTcpSocket* pSocket = m_pServer->nextPendingConnection())
+	{
+		connect(pSocket, &QTcpSocket::readyRead, this, [this, pSocket]() -> void { serve(pSocket); });
+		connect(pSocket, &QTcpSocket::disconnected, pSocket, &QObject::deleteLater);
+		// a connection that never completes its request doesn't stay around
+		QTimer::singleShot(g_nRequestTimeoutMs, pSocket, [pSocket]() -> void { pSocket->abort(); });
+	}
+}
+
+void MetricsExporter::serve(QTcpSocket* pSocket)
+{
+	// the request is left in the socket until its headers are complete
+	const QByteArray request = pSocket->peek(g_nRequestMax);
+	if (!request.contains("\r\n\r\n"))
+	{
+		if (request.size() >= g_nRequestMax)
+			pSocket->abort();
+		return;
+	}
+	pSocket->disconnect(this);
+	pSocket->readAll();
+
+	const QList<QByteArray> lstRequestLine = request.left(request.indexOf("\r\n")).split(' ');
+	const QByteArray method = lstRequestLine.value(0);
+	const QByteArray path = lstRequestLine.value(1).split('?').value(0);
+	QByteArray status = "200 OK";
+	QByteArray body;
+	if (method != "GET")
+		status = "405 Method Not Allowed";
+	else if (path != "/" && path != "/metrics")
+		status = "404 Not Found";
+	else
+		body = render();
+
+	QByteArray response = "HTTP/1.1 " + status + "\r\n";
+	response += "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n";
+	response += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+	response += "Connection: close\r\n\r\n";
+	response += body;
+	pSocket->write(response);
+	pSocket->disconnectFromHost();
+}
+
+void MetricsExporter::writeSnapshot()
+{
+	QSaveFile file(m_sFile);
+	if (!file.open(QIODevice::WriteOnly) || file.write(render()) < 0 || !file.commit())
+		LOG_WARNING(QStringLiteral("Unable to write the metrics to %1").arg(m_sFile));
+}
@@ -0,0 +1,68 @@
+#ifndef METRICSEXPORTER_H
+#define METRICSEXPORTER_H
+
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QObject>
+#include <QString>
+#include <functional>
+
+class QTcpServer;
+class QTcpSocket;
+class QTimer;
+
+struct MetricsSettings
+{
+	// the metrics are for the operators, not the clients, so only the loopback is served by default
+	QHostAddress address = QHostAddress(QHostAddress::LocalHost);
+	// 0 serves no endpoint
+	quint16 nPort = 0;
+	// an empty path writes no snapshot
+	QString sFile;
+	// seconds between the snapshots
+	int nInterval = 60;
+};
+
+// What the server holds right now, read at every export
+struct MetricsGauges
+{
+	int nThreads = 0;
+	int nConnections = 0;
+	// detached ones included
+	int nSessions = 0;
+	qint64 nPendingBytes = 0;
+	qint64 nPendingBytesMax = 0;
+	// frames posted between threads and not delivered yet
+	int nMailboxDepth = 0;
+};
+
+// Exports the metrics in the Prometheus text format, which also reads fine as plain text: served over HTTP on a port
+// of their own (any GET of / or /metrics) and written to a file at a fixed interval. The file is replaced as a whole,
+// a reader never sees half a snapshot.
+class MetricsExporter : public QObject
+{
+	Q_OBJECT
+	Q_DISABLE_COPY(MetricsExporter)
+public:
+	// gauges is called from the thread of the exporter at every export
+	explicit MetricsExporter(std::function<MetricsGauges()> gauges, QObject* parent = nullptr);
+
+	// returns false when the endpoint can't listen, the snapshots are written anyway
+	bool apply(MetricsSettings const& settings);
+	QByteArray render() const;
+
+private slots:
+	void onNewConnection();
+	void writeSnapshot();
+
+private:
+	void serve(QTcpSocket* pSocket);
+
+	std::function<MetricsGauges()> m_gauges;
+	QTcpServer* m_pServer;
+	QTimer* m_pSnapshotTimer;
+	QString m_sFile;
+	QElapsedTimer m_uptime;
+};
+
+#endif // METRICSEXPORTER_H
@@ -0,0 +1,319 @@
+#include "offlinestore.h"
+#include "userregistry.h"
+#include "framecodec.h"
+#include "messagecodec.h"
+#include "logger.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QtEndian>
+
+namespace
+{
+	// record: quint32 size of the rest, qint64 arrival in ms since the epoch, quint16 sender size, sender, text
+	const int g_nSizeField = int(sizeof(quint32));
+	const int g_nRecordHeader = int(sizeof(quint32) + sizeof(qint64) + sizeof(quint16));
+	const char g_szSuffix[] = ".mbox";
+	// about what a socket takes before it stops accepting, see OutboundLimits::nHighWatermark
+	const int g_nDeliveryBatch = 256 * 1024;
+}
+
+OfflineStore::OfflineStore()
+	: m_bOpen(false)
+	, m_nTotalSize(0)
+{}
+
+bool OfflineStore::open(MailboxSettings const& settings)
+{
+	QMutexLocker locker(&m_mutex);
+	m_settings = settings;
+	m_bOpen = false;
+	if (settings.sDirectory.isEmpty())
+		return true;
+	if (!QDir().mkpath(settings.sDirectory))
+		return false;
+	m_nTotalSize = 0;
+	const QDir dir(settings.sDirectory);
+	for (QFileInfo const& info : dir.entryInfoList({ QLatin1Char('*') + QLatin1String(g_szSuffix) }, QDir::Files))
+		m_nTotalSize += info.size();
+	m_bOpen = true;
+	return true;
+}
+
+void OfflineStore::close()
+{
+	QMutexLocker locker(&m_mutex);
+	m_bOpen = false;
+}
+
+bool OfflineStore::isOpen() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_bOpen;
+}
+
+QString OfflineStore::fileName(QString const& sRecipient)
+{
+	// hex keeps any user name a valid file name on every platform
+	return QString::fromLatin1(UserRegistry::key(sRecipient).toUtf8().toHex()) + QLatin1String(g_szSuffix);
+}
+
+QString OfflineStore::directory() const
+{
+	QMutexLocker locker(&m_mutex);
+	return m_bOpen ? m_settings.sDirectory : QString();
+}
+
+OfflineStore::MailboxLock* OfflineStore::lockMailbox(QString const& sFileName)
+{
+	MailboxLock* pLock;
+	{
+		QMutexLocker locker(&m_mutex);
+		MailboxLock*& pEntry = m_mapLocks[sFileName];
+		if (!pEntry)
+			pEntry = new MailboxLock;
+		++pEntry->nUsers;
+		pLock = pEntry;
+	}
+	pLock->mutex.lock();
+	return pLock;
+}
+
+void OfflineStore::unlockMailbox(QString const& sFileName, MailboxLock* pLock)
+{
+	pLock->mutex.unlock();
+	QMutexLocker locker(&m_mutex);
+	if (--pLock->nUsers > 0)
+		return;
+	m_mapLocks.remove(sFileName);
+	delete pLock;
+}
+
+OfflineStore::Locker::Locker(OfflineStore& store, QString const& sRecipient)
+	: m_store(store)
+	, m_sFileName(fileName(sRecipient))
+	, m_pLock(store.lockMailbox(m_sFileName))
+{}
+
+OfflineStore::Locker::~Locker()
+{
+	m_store.unlockMailbox(m_sFileName, m_pLock);
+}
+
+bool OfflineStore::append(QString const& sRecipient, QByteArray const& sender, QByteArray const& text)
+{
+	if (sender.size() > 0xFFFF)
+		return false;
+	QByteArray record(g_nRecordHeader + sender.size() + text.size(), Qt::Uninitialized);
+	char* pRecord = record.data();
+	qToBigEndian<quint32>(quint32(record.size() - g_nSizeField), pRecord);
+	qToBigEndian<qint64>(QDateTime::currentMSecsSinceEpoch(), pRecord + g_nSizeField);
+	qToBigEndian<quint16>(quint16(sender.size()), pRecord + g_nSizeField + sizeof(qint64));
+	memcpy(pRecord + g_nRecordHeader, sender.constData(), size_t(sender.size()));
+	memcpy(pRecord + g_nRecordHeader + sender.size(), text.constData(), size_t(text.size()));
+
+	// the record is counted before it is written, the appends to the other mailboxes see it
+	QString sPath;
+	qint64 nMaxSize;
+	{
+		QMutexLocker locker(&m_mutex);
+		if (!m_bOpen || m_nTotalSize + record.size() > m_settings.nMaxTotalSize)
+			return false;
+		sPath = m_settings.sDirectory + QLatin1Char('/') + fileName(sRecipient);
+		nMaxSize = m_settings.nMaxSize;
+		m_nTotalSize += record.size();
+	}
+	// checked before the open, a refused message leaves no empty mailbox behind
+	QFile file(sPath);
+	qint64 nWritten = 0;
+	if (file.size() + record.size() <= nMaxSize)
+	{
+		if (file.open(QIODevice::WriteOnly | QIODevice::Append))
+		{
+			// one write per record, a crash can only leave a truncated last record which the readers ignore
+			nWritten = qMax<qint64>(0, file.write(record));
+		}
+		else
+		{
+			LOG_WARNING(QStringLiteral("Unable to open the mailbox %1 - %2").arg(file.fileName(), file.errorString()));
+		}
+	}
+	if (nWritten != record.size())
+	{
+		QMutexLocker locker(&m_mutex);
+		m_nTotalSize -= record.size() - nWritten;
+		return false;
+	}
+	return true;
+}
+
+qint64 OfflineStore::firstAlive(uchar const* pData, qint64 nSize, qint64 nOldest) const
+{
+	qint64 nOffset = 0;
+	while (nSize - nOffset >= g_nRecordHeader)
+	{
+		const quint32 nRecordSize = qFromBigEndian<quint32>(pData + nOffset);
+		const qint64 nArrival = qFromBigEndian<qint64>(pData + nOffset + g_nSizeField);
+		if (nArrival >= nOldest || nRecordSize > quint64(nSize - nOffset - g_nSizeField))
+			break;
+		nOffset += g_nSizeField + nRecordSize;
+	}
+	return nOffset;
+}
+
+QVector<QByteArray> OfflineStore::read(QString const& sRecipient, WireEncoding encoding, qint64 nBatchMax, qint64& nEnd)
+{
+	QVector<QByteArray> vecBatches;
+	const qint64 nBatchSize = nBatchMax > 0 ? qMin<qint64>(nBatchMax, g_nDeliveryBatch) : g_nDeliveryBatch;
+	nEnd = 0;
+	QString sPath;
+	qint64 nOldest;
+	{
+		QMutexLocker locker(&m_mutex);
+		if (!m_bOpen)
+			return vecBatches;
+		sPath = m_settings.sDirectory + QLatin1Char('/') + fileName(sRecipient);
+		nOldest = QDateTime::currentMSecsSinceEpoch() - qint64(m_settings.nTtl) * 1000;
+	}
+	QFile file(sPath);
+	if (!file.exists() || !file.open(QIODevice::ReadOnly))
+		return vecBatches;
+
+	const qint64 nSize = file.size();
+	uchar const* pData = nSize > 0 ? file.map(0, nSize) : nullptr;
+	if (nSize > 0 && !pData)
+	{
+		// the mailbox stays for the next login
+		LOG_WARNING(QStringLiteral("Unable to map the mailbox %1 - %2").arg(file.fileName(), file.errorString()));
+		return vecBatches;
+	}
+	if (pData)
+	{
+		qint64 nOffset = firstAlive(pData, nSize, nOldest);
+		QByteArray batch;
+		while (nSize - nOffset >= g_nRecordHeader)
+		{
+			const quint32 nRecordSize = qFromBigEndian<quint32>(pData + nOffset);
+			const quint16 nSenderSize = qFromBigEndian<quint16>(pData + nOffset + g_nSizeField + sizeof(qint64));
+			// a record cut by a crash ends the log
+			if (nRecordSize > quint64(nSize - nOffset - g_nSizeField) || g_nRecordHeader - g_nSizeField + nSenderSize > int(nRecordSize))
+				break;
+			char const* pSender = reinterpret_cast<char const*>(pData + nOffset + g_nRecordHeader);
+			const int nTextSize = int(nRecordSize) - (g_nRecordHeader - g_nSizeField) - nSenderSize;
+			// views into the mapping, copied once into the batch
+			const QByteArray sender = QByteArray::fromRawData(pSender, nSenderSize);
+			const QByteArray text = QByteArray::fromRawData(pSender + nSenderSize, nTextSize);
+			const int nBatched = batch.size();
+			FrameEncoder::append(batch, MessageCodec::encodeDirectMessage(text, sender, encoding));
+			// the frame that goes past the cap starts the next batch
+			if (nBatched > 0 && batch.size() > nBatchSize)
+			{
+				vecBatches.append(batch.left(nBatched));
+				batch.remove(0, nBatched);
+			}
+			nOffset += g_nSizeField + nRecordSize;
+		}
+		if (!batch.isEmpty())
+			vecBatches.append(batch);
+		file.unmap(const_cast<uchar*>(pData));
+	}
+	// a truncated last record is dropped with the rest
+	nEnd = nSize;
+	return vecBatches;
+}
+
+void OfflineStore::remove(QString const& sRecipient, qint64 nEnd)
+{
+	const QString sDirectory = directory();
+	if (sDirectory.isEmpty() || nEnd <= 0)
+		return;
+	const qint64 nDropped = dropHead(sDirectory + QLatin1Char('/') + fileName(sRecipient), nEnd);
+	if (nDropped < 0)
+	{
+		LOG_WARNING(QStringLiteral("Unable to empty the mailbox of %1, its messages come again at the next login").arg(sRecipient));
+		return;
+	}
+	QMutexLocker locker(&m_mutex);
+	m_nTotalSize -= nDropped;
+}
+
+qint64 OfflineStore::dropHead(QString const& sPath, qint64 nOffset) const
+{
+	QFile file(sPath);
+	if (!file.open(QIODevice::ReadOnly))
+		return file.exists() ? -1 : 0;
+	const qint64 nSize = file.size();
+	if (nOffset >= nSize)
+	{
+		file.close();
+		return file.remove() ? nSize : -1;
+	}
+	uchar const* pData = file.map(nOffset, nSize - nOffset);
+	if (!pData)
+		return -1;
+	QSaveFile kept(sPath);
+	const bool bWritten = kept.open(QIODevice::WriteOnly)
+		&& kept.write(reinterpret_cast<char const*>(pData), nSize - nOffset) == nSize - nOffset;
+	file.unmap(const_cast<uchar*>(pData));
+	file.close();
+	// the old log is only replaced by a complete new one
+	return bWritten && kept.commit() ? nOffset : -1;
+}
+
+qint64 OfflineStore::compactMailbox(QString const& sPath, qint64 nOldest, bool& bRemoved) const
+{
+	bRemoved = false;
+	QFile file(sPath);
+	if (!file.open(QIODevice::ReadOnly))
+		return 0;
+	const qint64 nSize = file.size();
+	uchar const* pData = nSize > 0 ? file.map(0, nSize) : nullptr;
+	if (nSize > 0 && !pData)
+		return -1;
+	const qint64 nOffset = pData ? firstAlive(pData, nSize, nOldest) : nSize;
+	if (pData)
+		file.unmap(const_cast<uchar*>(pData));
+	file.close();
+	if (nOffset == 0)
+		return 0;
+	bRemoved = nOffset >= nSize;
+	return dropHead(sPath, nOffset);
+}
+
+void OfflineStore::compact()
+{
+	qint64 nOldest;
+	{
+		QMutexLocker locker(&m_mutex);
+		nOldest = QDateTime::currentMSecsSinceEpoch() - qint64(m_settings.nTtl) * 1000;
+	}
+	const QString sDirectory = directory();
+	if (sDirectory.isEmpty())
+		return;
+	const QDir dir(sDirectory);
+	const QStringList lstFiles = dir.entryList({ QLatin1Char('*') + QLatin1String(g_szSuffix) }, QDir::Files);
+	int nRemoved = 0;
+	for (QString const& sFile : lstFiles)
+	{
+		// one mailbox at a time, the appends to the others go on in between
+		MailboxLock* pLock = lockMailbox(sFile);
+		bool bRemoved = false;
+		const qint64 nDropped = compactMailbox(dir.filePath(sFile), nOldest, bRemoved);
+		unlockMailbox(sFile, pLock);
+		// a failed compaction leaves the log as it was, the next one tries again
+		if (nDropped < 0)
+		{
+			LOG_WARNING(QStringLiteral("Unable to compact the mailbox %1").arg(dir.filePath(sFile)));
+			continue;
+		}
+		if (bRemoved)
+			++nRemoved;
+		QMutexLocker locker(&m_mutex);
+		m_nTotalSize -= nDropped;
+	}
+	if (nRemoved > 0)
+		LOG_INFO(QStringLiteral("%1 expired mailboxes removed").arg(nRemoved));
+}
@@ -0,0 +1,98 @@
+#ifndef OFFLINESTORE_H
+#define OFFLINESTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+#include "wireformat.h"
+
+struct MailboxSettings
+{
+	// an empty directory keeps the store off, messages to offline users are dropped as before
+	QString sDirectory;
+	// seconds a message waits for its recipient before compaction drops it
+	int nTtl = 7 * 24 * 3600;
+	// messages past this size of a mailbox are dropped, keep it below the outbound queue limit
+	qint64 nMaxSize = 1024 * 1024;
+	// messages past this size of all the mailboxes together are dropped, any name can be sent to so the disk needs a bound
+	qint64 nMaxTotalSize = qint64(1024) * 1024 * 1024;
+};
+
+// Mailboxes of the users that are offline, one append-only log file per recipient.
+// The records are appended with plain writes and read back through a memory mapping, which are
+// the cheap operations on both sides. Records are in arrival order, so the expired ones are always at the start of a log.
+// Safe to call from any thread. The files of a mailbox are only touched under its own lock, the lock of the store is
+// never held during a file operation.
+class OfflineStore
+{
+	struct MailboxLock;
+
+public:
+	// Holds the lock of the mailbox of a recipient while it lives, append, read and remove are called under it.
+	// A sender finding the recipient offline and storing its message under the same locker can't miss a login in
+	// between, the delivery of that login waits for the locker and reads the message
+	class Locker
+	{
+		Q_DISABLE_COPY(Locker)
+	public:
+		Locker(OfflineStore& store, QString const& sRecipient);
+		~Locker();
+
+	private:
+		OfflineStore& m_store;
+		QString m_sFileName;
+		MailboxLock* m_pLock;
+	};
+
+	OfflineStore();
+
+	// creates the directory if needed, returns false if it can't be used
+	bool open(MailboxSettings const& settings);
+	void close();
+	bool isOpen() const;
+
+	// returns false when the store is off, the mailbox of the recipient is full or all of them together are
+	bool append(QString const& sRecipient, QByteArray const& sender, QByteArray const& text);
+	// the messages of the mailbox as frames in the given encoding, packed into a few large batches. A positive
+	// nBatchMax caps the batches, short of a single message bigger than that. The mailbox stays as it is, nEnd is
+	// set to pass to remove once the batches are delivered
+	QVector<QByteArray> read(QString const& sRecipient, WireEncoding encoding, qint64 nBatchMax, qint64& nEnd);
+	// drops the messages read up to nEnd, the ones that came afterwards stay
+	void remove(QString const& sRecipient, qint64 nEnd);
+	// drops the expired messages of every mailbox, locking them one at a time
+	void compact();
+
+private:
+	struct MailboxLock
+	{
+		QMutex mutex;
+		// the lockers holding or waiting for it, it is freed with the last one
+		int nUsers = 0;
+	};
+
+	static QString fileName(QString const& sRecipient);
+	MailboxLock* lockMailbox(QString const& sFileName);
+	void unlockMailbox(QString const& sFileName, MailboxLock* pLock);
+	// the directory of the store if it is open, an empty string otherwise
+	QString directory() const;
+	// offset of the first record still alive in the mapped log
+	qint64 firstAlive(uchar const* pData, qint64 nSize, qint64 nOldest) const;
+	// keeps the records from nOffset on, the log is replaced as a whole so a failure leaves it as it was.
+	// returns the bytes dropped, -1 on failure
+	qint64 dropHead(QString const& sPath, qint64 nOffset) const;
+	// drops the expired records of one mailbox under its lock, returns the bytes dropped, -1 on failure
+	qint64 compactMailbox(QString const& sPath, qint64 nOldest, bool& bRemoved) const;
+
+	// guards the members below
+	mutable QMutex m_mutex;
+	MailboxSettings m_settings;
+	bool m_bOpen;
+	// size of all the mailboxes, counted at open and kept up to date by the appends and drops
+	qint64 m_nTotalSize;
+	// the locks of the mailboxes in use by file name
+	QHash<QString, MailboxLock*> m_mapLocks;
+};
+
+#endif // OFFLINESTORE_H
\ No newline at end of file
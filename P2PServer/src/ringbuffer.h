@@ -0,0 +1,92 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <QAtomicInteger>
+#include <QtGlobal>
+#include <QtMath>
+#include <utility>
+
+// Bounded lock-free queue, any number of producers and a single consumer.
+// Pushing into a full buffer fails instead of blocking, so it can be used on the hot path.
+template <typename T>
+class RingBuffer
+{
+	Q_DISABLE_COPY(RingBuffer)
+public:
+	// the capacity is rounded up to a power of two
+	explicit RingBuffer(quint32 nCapacity)
+		: m_nMask(qNextPowerOfTwo(qMax(nCapacity, 2u) - 1) - 1)
+		, m_pCells(new Cell[m_nMask + 1])
+		, m_nEnqueuePos(0)
+		, m_nDequeuePos(0)
+	{
+		for (quint32 nIndex = 0; nIndex <= m_nMask; ++nIndex)
+			m_pCells[nIndex].nSequence.storeRelaxed(nIndex);
+	}
+
+	~RingBuffer()
+	{
+		delete[] m_pCells;
+	}
+
+	quint32 capacity() const
+	{
+		return m_nMask + 1;
+	}
+
+	bool tryPush(T&& value)
+	{
+		quint32 nPos = m_nEnqueuePos.loadRelaxed();
+		for (;;)
+		{
+			Cell& cell = m_pCells[nPos & m_nMask];
+			const qint32 nDiff = qint32(cell.nSequence.loadAcquire() - nPos);
+			if (nDiff == 0)
+			{
+				// on failure nPos is updated with the position another producer moved to
+				if (m_nEnqueuePos.testAndSetRelaxed(nPos, nPos + 1, nPos))
+				{
+					cell.value = std::move(value);
+					cell.nSequence.storeRelease(nPos + 1);
+					return true;
+				}
+			}
+			else if (nDiff < 0)
+			{
+				// the consumer didn't free this cell yet, the buffer is full
+				return false;
+			}
+			else
+			{
+				nPos = m_nEnqueuePos.loadRelaxed();
+			}
+		}
+	}
+
+	// must only be called by the consumer thread
+	bool tryPop(T& value)
+	{
+		Cell& cell = m_pCells[m_nDequeuePos & m_nMask];
+		if (qint32(cell.nSequence.loadAcquire() - (m_nDequeuePos + 1)) < 0)
+			return false;
+		value = std::move(cell.value);
+		cell.value = T();
+		cell.nSequence.storeRelease(m_nDequeuePos + m_nMask + 1);
+		++m_nDequeuePos;
+		return true;
+	}
+
+private:
+	struct Cell
+	{
+		QAtomicInteger<quint32> nSequence;
+		T value;
+	};
+
+	const quint32 m_nMask;
+	Cell* m_pCells;
+	QAtomicInteger<quint32> m_nEnqueuePos;
+	quint32 m_nDequeuePos;
+};
+
+#endif // RINGBUFFER_H
\ No newline at end of file
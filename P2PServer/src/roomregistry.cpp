@@ -0,0 +1,97 @@
+#include "roomregistry.h"
+#include "userregistry.h"
+
+bool RoomRegistry::join(QString const& sRoom, ServerWorker* pWorker)
+{
+	Q_ASSERT(pWorker);
+	const QString sKey = UserRegistry::key(sRoom);
+	Room& room = m_mapRooms[sKey];
+	if (room.vecMembers.contains(pWorker))
+		return false;
+	if (room.sName.isEmpty())
+		room.sName = sRoom;
+	room.vecMembers.append(pWorker);
+	m_mapMemberships[pWorker].append(sKey);
+	return true;
+}
+
+bool RoomRegistry::leave(QString const& sRoom, ServerWorker* pWorker)
+{
+	const QString sKey = UserRegistry::key(sRoom);
+	auto itRoom = m_mapRooms.find(sKey);
+	if (itRoom == m_mapRooms.end() || !itRoom->vecMembers.contains(pWorker))
+		return false;
+	removeMember(itRoom, pWorker);
+
+	auto itMemberships = m_mapMemberships.find(pWorker);
+	itMemberships->removeOne(sKey);
+	if (itMemberships->isEmpty())
+		m_mapMemberships.erase(itMemberships);
+	return true;
+}
+
+QStringList RoomRegistry::leaveAll(ServerWorker* pWorker)
+{
+	QStringList lstNames;
+	const QStringList lstKeys = m_mapMemberships.take(pWorker);
+	for (QString const& sKey : lstKeys)
+	{
+		auto itRoom = m_mapRooms.find(sKey);
+		if (itRoom == m_mapRooms.end())
+			continue;
+		lstNames.append(itRoom->sName);
+		removeMember(itRoom, pWorker);
+	}
+	return lstNames;
+}
+
+void RoomRegistry::replace(ServerWorker* pOld, ServerWorker* pNew)
+{
+	const QStringList lstKeys = m_mapMemberships.take(pOld);
+	for (QString const& sKey : lstKeys)
+	{
+		auto itRoom = m_mapRooms.find(sKey);
+		if (itRoom == m_mapRooms.end())
+			continue;
+		const int nIndex = itRoom->vecMembers.indexOf(pOld);
+		if (nIndex >= 0)
+			itRoom->vecMembers[nIndex] = pNew;
+	}
+	if (!lstKeys.isEmpty())
+		m_mapMemberships.insert(pNew, lstKeys);
+}
+
+void RoomRegistry::removeMember(QHash<QString, Room>::iterator itRoom, ServerWorker* pWorker)
+{
+	// the order of the members doesn't matter, so the last one takes the freed place
+	QVector<ServerWorker*>& vecMembers = itRoom->vecMembers;
+	const int nIndex = vecMembers.indexOf(pWorker);
+	vecMembers[nIndex] = vecMembers.last();
+	vecMembers.removeLast();
+	if (vecMembers.isEmpty())
+		m_mapRooms.erase(itRoom);
+}
+
+QVector<ServerWorker*> const* RoomRegistry::members(QString const& sRoom) const
+{
+	auto itRoom = m_mapRooms.constFind(UserRegistry::key(sRoom));
+	return itRoom == m_mapRooms.cend() ? nullptr : &itRoom->vecMembers;
+}
+
+QString RoomRegistry::name(QString const& sRoom) const
+{
+	auto itRoom = m_mapRooms.constFind(UserRegistry::key(sRoom));
+	return itRoom == m_mapRooms.cend() ? QString() : itRoom->sName;
+}
+
+bool RoomRegistry::isMember(QString const& sRoom, ServerWorker* pWorker) const
+{
+	QVector<ServerWorker*> const* pMembers = members(sRoom);
+	return pMembers && pMembers->contains(pWorker);
+}
+
+void RoomRegistry::clear()
+{
+	m_mapRooms.clear();
+	m_mapMemberships.clear();
+}
@@ -0,0 +1,43 @@
+#ifndef ROOMREGISTRY_H
+#define ROOMREGISTRY_H
+
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+class ServerWorker;
+
+// Rooms by case folded name with their members, plus the rooms of every worker for the cleanup on disconnect.
+// A room exists while it has members. It is not thread safe, ChatServer guards it with the lock of the clients.
+class RoomRegistry
+{
+public:
+	// returns false when the worker already is a member
+	bool join(QString const& sRoom, ServerWorker* pWorker);
+	bool leave(QString const& sRoom, ServerWorker* pWorker);
+	// returns the names of the rooms the worker was in
+	QStringList leaveAll(ServerWorker* pWorker);
+	// pNew takes the place of pOld in all its rooms
+	void replace(ServerWorker* pOld, ServerWorker* pNew);
+	// nullptr when there is no such room
+	QVector<ServerWorker*> const* members(QString const& sRoom) const;
+	// the room as spelled by its first member, empty when there is no such room
+	QString name(QString const& sRoom) const;
+	bool isMember(QString const& sRoom, ServerWorker* pWorker) const;
+	void clear();
+
+private:
+	struct Room
+	{
+		QString sName;
+		QVector<ServerWorker*> vecMembers;
+	};
+
+	void removeMember(QHash<QString, Room>::iterator itRoom, ServerWorker* pWorker);
+
+	QHash<QString, Room> m_mapRooms;
+	QHash<ServerWorker*, QStringList> m_mapMemberships;
+};
+
+#endif // ROOMREGISTRY_H
\ No newline at end of file
@@ -0,0 +1,319 @@
+#include "serverconfig.h"
+
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QFileInfo>
+#include <QScopedPointer>
+#include <QSettings>
+#include <QThread>
+
+namespace
+{
+	const quint16 g_nPortDefault = 1967;
+	const char g_szHeadlessOption[] = "headless";
+	// a sixteenth of FrameDecoder::s_nMaxFrameSizeDefault, the limit of the clients. A relayed text comes back with its
+	// sender and, in JSON, escaped up to six times its size, the frame still has to fit in the limit of its receiver
+	const int g_nMaxFrameSizeDefault = FrameDecoder::s_nMaxFrameSizeDefault / 16;
+
+	bool parsePort(QString const& sPort, quint16& nPort)
+	{
+		bool bOk = false;
+		const uint nValue = sPort.toUInt(&bOk);
+		if (!bOk || nValue == 0 || nValue > 0xFFFF)
+			return false;
+		nPort = quint16(nValue);
+		return true;
+	}
+
+	bool parseBytes(QString const& sBytes, qint64& nBytes)
+	{
+		bool bOk = false;
+		const qint64 nValue = sBytes.toLongLong(&bOk);
+		if (!bOk || nValue <= 0)
+			return false;
+		nBytes = nValue;
+		return true;
+	}
+
+	bool parseOverflowPolicy(QString const& sPolicy, OverflowPolicy& policy)
+	{
+		if (sPolicy.compare(QLatin1String("drop-ephemeral"), Qt::CaseInsensitive) == 0)
+			policy = OverflowPolicy::DropEphemeral;
+		else if (sPolicy.compare(QLatin1String("disconnect"), Qt::CaseInsensitive) == 0)
+			policy = OverflowPolicy::Disconnect;
+		else
+			return false;
+		return true;
+	}
+
+	bool parseSwitch(QString const& sValue, bool& bValue)
+	{
+		for (char const* szOn : { "on", "true", "yes", "1" })
+		{
+			if (sValue.compare(QLatin1String(szOn), Qt::CaseInsensitive) == 0)
+			{
+				bValue = true;
+				return true;
+			}
+		}
+		for (char const* szOff : { "off", "false", "no", "0" })
+		{
+			if (sValue.compare(QLatin1String(szOff), Qt::CaseInsensitive) == 0)
+			{
+				bValue = false;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool parseCount(QString const& sCount, int nMin, int& nCount)
+	{
+		bool bOk = false;
+		const int nValue = sCount.toInt(&bOk);
+		if (!bOk || nValue < nMin)
+			return false;
+		nCount = nValue;
+		return true;
+	}
+}
+
+ServerConfig::ServerConfig()
+	: bHeadless(false)
+	, address(QHostAddress::Any)
+	, nPort(g_nPortDefault)
+	, nThreadCount(QThread::idealThreadCount())
+	, nMaxConnections(0)
+	, nReportInterval(0)
+	, nMaxFrameSize(g_nMaxFrameSizeDefault)
+	, logLevel(LogLevel::Info)
+{}
+
+bool ServerConfig::isHeadless(int argc, char* argv[])
+{
+	const QByteArray option = QByteArray("--") + g_szHeadlessOption;
+	for (int nIndex = 1; nIndex < argc; ++nIndex)
+	{
+		if (option == argv[nIndex])
+			return true;
+	}
+	return false;
+}
+
+ServerConfig::ParseResult ServerConfig::parse(QStringList const& lstArguments, QString& sError)
+{
+	QCommandLineParser parser;
+	parser.setApplicationDescription(QStringLiteral("P2P chat server"));
+	parser.addHelpOption();
+	const QCommandLineOption headlessOption(QLatin1String(g_szHeadlessOption), QStringLiteral("Run without a window."));
+	const QCommandLineOption configOption(QStringLiteral("config"), QStringLiteral("Read the settings from an ini <file>."), QStringLiteral("file"));
+	const QCommandLineOption addressOption(QStringLiteral("address"), QStringLiteral("Listen on <address>."), QStringLiteral("address"));
+	const QCommandLineOption portOption(QStringLiteral("port"), QStringLiteral("Listen on <port>."), QStringLiteral("port"));
+	const QCommandLineOption threadsOption(QStringLiteral("threads"), QStringLiteral("Serve the clients from <count> threads."), QStringLiteral("count"));
+	const QCommandLineOption maxConnectionsOption(QStringLiteral("max-connections"), QStringLiteral("Refuse clients past <count> connections, 0 for no limit."), QStringLiteral("count"));
+	const QCommandLineOption logFileOption(QStringLiteral("log-file"), QStringLiteral("Append the log to <file> instead of stderr."), QStringLiteral("file"));
+	const QCommandLineOption logLevelOption(QStringLiteral("log-level"), QStringLiteral("debug, info, warning, error or off."), QStringLiteral("level"));
+	const QCommandLineOption reportIntervalOption(QStringLiteral("report-interval"), QStringLiteral("Log the memory held per connection every <seconds>, 0 to disable."), QStringLiteral("seconds"));
+	const QCommandLineOption queueLimitOption(QStringLiteral("queue-limit"), QStringLiteral("Bytes queued for one client before the overflow policy applies."), QStringLiteral("bytes"));
+	const QCommandLineOption highWatermarkOption(QStringLiteral("high-watermark"), QStringLiteral("Stop writing to a client socket holding <bytes>."), QStringLiteral("bytes"));
+	const QCommandLineOption lowWatermarkOption(QStringLiteral("low-watermark"), QStringLiteral("Resume writing once the socket drained below <bytes>."), QStringLiteral("bytes"));
+	const QCommandLineOption maxFrameSizeOption(QStringLiteral("max-frame-size"), QStringLiteral("Disconnect clients sending a frame above <bytes>."), QStringLiteral("bytes"));
+	const QCommandLineOption noDelayOption(QStringLiteral("tcp-nodelay"), QStringLiteral("on or off, Nagle's algorithm on the client sockets is disabled when on."), QStringLiteral("on|off"));
+	const QCommandLineOption overflowPolicyOption(QStringLiteral("overflow-policy"), QStringLiteral("drop-ephemeral or disconnect."), QStringLiteral("policy"));
+	const QCommandLineOption mailboxDirOption(QStringLiteral("mailbox-dir"), QStringLiteral("Keep the messages to offline users in <directory>, none are kept without it."), QStringLiteral("directory"));
+	const QCommandLineOption mailboxTtlOption(QStringLiteral("mailbox-ttl"), QStringLiteral("Drop the messages waiting in a mailbox for more than <seconds>."), QStringLiteral("seconds"));
+	const QCommandLineOption mailboxSizeOption(QStringLiteral("mailbox-size"), QStringLiteral("Drop the messages to an offline user past <bytes> in the mailbox."), QStringLiteral("bytes"));
+	const QCommandLineOption mailboxTotalOption(QStringLiteral("mailbox-total"), QStringLiteral("Drop the messages to offline users past <bytes> in all the mailboxes."), QStringLiteral("bytes"));
+	const QCommandLineOption historyDirOption(QStringLiteral("history-dir"), QStringLiteral("Keep the conversations in <directory> for the history requests, none are kept without it."), QStringLiteral("directory"));
+	const QCommandLineOption historySegmentOption(QStringLiteral("history-segment"), QStringLiteral("Start a new history segment every <count> messages of a conversation."), QStringLiteral("count"));
+	const QCommandLineOption sessionGraceOption(QStringLiteral("session-grace"), QStringLiteral("Keep the session of a dropped client for <seconds>, 0 to disable resumption."), QStringLiteral("seconds"));
+	const QCommandLineOption sessionReplayOption(QStringLiteral("session-replay"), QStringLiteral("Keep the last <bytes> written to a client to replay them on resumption."), QStringLiteral("bytes"));
+	const QCommandLineOption metricsAddressOption(QStringLiteral("metrics-address"), QStringLiteral("Serve the metrics on <address>, the loopback by default."), QStringLiteral("address"));
+	const QCommandLineOption metricsPortOption(QStringLiteral("metrics-port"), QStringLiteral("Serve the metrics on <port>, 0 to serve none."), QStringLiteral("port"));
+	const QCommandLineOption metricsFileOption(QStringLiteral("metrics-file"), QStringLiteral("Write the metrics to <file> at every interval."), QStringLiteral("file"));
+	const QCommandLineOption metricsIntervalOption(QStringLiteral("metrics-interval"), QStringLiteral("Write the metrics file every <seconds>."), QStringLiteral("seconds"));
+	const QCommandLineOption traceFileOption(QStringLiteral("trace-file"), QStringLiteral("Write the stages of the sampled frames to <file> as Chrome trace events."), QStringLiteral("file"));
+	const QCommandLineOption traceSampleOption(QStringLiteral("trace-sample"), QStringLiteral("Trace one frame out of <count> per thread, 0 to trace none."), QStringLiteral("count"));
+	parser.addOptions({ headlessOption, configOption, addressOption, portOption, threadsOption, maxConnectionsOption, logFileOption, logLevelOption,
+		reportIntervalOption, queueLimitOption, highWatermarkOption, lowWatermarkOption, overflowPolicyOption, noDelayOption, maxFrameSizeOption,
+		mailboxDirOption, mailboxTtlOption, mailboxSizeOption, mailboxTotalOption, historyDirOption, historySegmentOption,
+		sessionGraceOption, sessionReplayOption, metricsAddressOption, metricsPortOption, metricsFileOption, metricsIntervalOption,
+		traceFileOption, traceSampleOption });
+
+	if (!parser.parse(lstArguments))
+	{
+		sError = parser.errorText();
+		return ParseResult::Invalid;
+	}
+	if (parser.isSet(QStringLiteral("help")))
+	{
+		sError = parser.helpText();
+		return ParseResult::Help;
+	}
+
+	// the ini file provides the defaults, the command line wins over it
+	QScopedPointer<QSettings> pSettings;
+	if (parser.isSet(configOption))
+	{
+		const QString sConfigFile = parser.value(configOption);
+		if (!QFileInfo::exists(sConfigFile))
+		{
+			sError = QStringLiteral("Config file %1 not found").arg(sConfigFile);
+			return ParseResult::Invalid;
+		}
+		pSettings.reset(new QSettings(sConfigFile, QSettings::IniFormat));
+	}
+	auto lookup = [&parser, &pSettings](QCommandLineOption const& option, QString const& sKey) -> QString
+	{
+		if (parser.isSet(option))
+			return parser.value(option);
+		return pSettings ? pSettings->value(sKey).toString() : QString();
+	};
+	const QString sAddress = lookup(addressOption, QStringLiteral("server/address"));
+	const QString sPort = lookup(portOption, QStringLiteral("server/port"));
+	const QString sThreads = lookup(threadsOption, QStringLiteral("server/threads"));
+	const QString sMaxConnections = lookup(maxConnectionsOption, QStringLiteral("server/max_connections"));
+	const QString sReportInterval = lookup(reportIntervalOption, QStringLiteral("server/report_interval"));
+	const QString sMaxFrameSize = lookup(maxFrameSizeOption, QStringLiteral("server/max_frame_size"));
+	const QString sQueueLimit = lookup(queueLimitOption, QStringLiteral("outbound/queue_limit"));
+	const QString sHighWatermark = lookup(highWatermarkOption, QStringLiteral("outbound/high_watermark"));
+	const QString sLowWatermark = lookup(lowWatermarkOption, QStringLiteral("outbound/low_watermark"));
+	const QString sOverflowPolicy = lookup(overflowPolicyOption, QStringLiteral("outbound/overflow_policy"));
+	const QString sNoDelay = lookup(noDelayOption, QStringLiteral("outbound/tcp_nodelay"));
+	const QString sMailboxTtl = lookup(mailboxTtlOption, QStringLiteral("mailbox/ttl"));
+	const QString sMailboxSize = lookup(mailboxSizeOption, QStringLiteral("mailbox/max_size"));
+	const QString sMailboxTotal = lookup(mailboxTotalOption, QStringLiteral("mailbox/max_total_size"));
+	mailbox.sDirectory = lookup(mailboxDirOption, QStringLiteral("mailbox/dir"));
+	const QString sHistorySegment = lookup(historySegmentOption, QStringLiteral("history/segment_records"));
+	history.sDirectory = lookup(historyDirOption, QStringLiteral("history/dir"));
+	const QString sSessionGrace = lookup(sessionGraceOption, QStringLiteral("session/grace"));
+	const QString sSessionReplay = lookup(sessionReplayOption, QStringLiteral("session/replay_size"));
+	const QString sMetricsAddress = lookup(metricsAddressOption, QStringLiteral("metrics/address"));
+	const QString sMetricsPort = lookup(metricsPortOption, QStringLiteral("metrics/port"));
+	const QString sMetricsInterval = lookup(metricsIntervalOption, QStringLiteral("metrics/interval"));
+	metrics.sFile = lookup(metricsFileOption, QStringLiteral("metrics/file"));
+	const QString sTraceSample = lookup(traceSampleOption, QStringLiteral("trace/sample"));
+	trace.sFile = lookup(traceFileOption, QStringLiteral("trace/file"));
+	const QString sLogLevel = lookup(logLevelOption, QStringLiteral("log/level"));
+	sLogFile = lookup(logFileOption, QStringLiteral("log/file"));
+
+	bHeadless = parser.isSet(headlessOption);
+	if (!sAddress.isEmpty() && !address.setAddress(sAddress))
+	{
+		sError = QStringLiteral("Invalid address %1").arg(sAddress);
+		return ParseResult::Invalid;
+	}
+	if (!sPort.isEmpty() && !parsePort(sPort, nPort))
+	{
+		sError = QStringLiteral("Invalid port %1").arg(sPort);
+		return ParseResult::Invalid;
+	}
+	if (!sThreads.isEmpty() && !parseCount(sThreads, 1, nThreadCount))
+	{
+		sError = QStringLiteral("Invalid thread count %1").arg(sThreads);
+		return ParseResult::Invalid;
+	}
+	if (!sMaxConnections.isEmpty() && !parseCount(sMaxConnections, 0, nMaxConnections))
+	{
+		sError = QStringLiteral("Invalid connection limit %1").arg(sMaxConnections);
+		return ParseResult::Invalid;
+	}
+	if (!sReportInterval.isEmpty() && !parseCount(sReportInterval, 0, nReportInterval))
+	{
+		sError = QStringLiteral("Invalid report interval %1").arg(sReportInterval);
+		return ParseResult::Invalid;
+	}
+	if (!sMaxFrameSize.isEmpty() && !parseCount(sMaxFrameSize, 1, nMaxFrameSize))
+	{
+		sError = QStringLiteral("Invalid maximum frame size %1").arg(sMaxFrameSize);
+		return ParseResult::Invalid;
+	}
+	if (!sQueueLimit.isEmpty() && !parseBytes(sQueueLimit, outboundLimits.nMaxQueuedBytes))
+	{
+		sError = QStringLiteral("Invalid queue limit %1").arg(sQueueLimit);
+		return ParseResult::Invalid;
+	}
+	if (!sHighWatermark.isEmpty() && !parseBytes(sHighWatermark, outboundLimits.nHighWatermark))
+	{
+		sError = QStringLiteral("Invalid high watermark %1").arg(sHighWatermark);
+		return ParseResult::Invalid;
+	}
+	if (!sLowWatermark.isEmpty() && !parseBytes(sLowWatermark, outboundLimits.nLowWatermark))
+	{
+		sError = QStringLiteral("Invalid low watermark %1").arg(sLowWatermark);
+		return ParseResult::Invalid;
+	}
+	if (outboundLimits.nLowWatermark > outboundLimits.nHighWatermark)
+	{
+		sError = QStringLiteral("The low watermark can't be above the high watermark");
+		return ParseResult::Invalid;
+	}
+	if (!sOverflowPolicy.isEmpty() && !parseOverflowPolicy(sOverflowPolicy, outboundLimits.overflowPolicy))
+	{
+		sError = QStringLiteral("Invalid overflow policy %1").arg(sOverflowPolicy);
+		return ParseResult::Invalid;
+	}
+	if (!sNoDelay.isEmpty() && !parseSwitch(sNoDelay, outboundLimits.bNoDelay))
+	{
+		sError = QStringLiteral("Invalid tcp-nodelay value %1").arg(sNoDelay);
+		return ParseResult::Invalid;
+	}
+	if (!sMailboxTtl.isEmpty() && !parseCount(sMailboxTtl, 1, mailbox.nTtl))
+	{
+		sError = QStringLiteral("Invalid mailbox ttl %1").arg(sMailboxTtl);
+		return ParseResult::Invalid;
+	}
+	if (!sMailboxSize.isEmpty() && !parseBytes(sMailboxSize, mailbox.nMaxSize))
+	{
+		sError = QStringLiteral("Invalid mailbox size %1").arg(sMailboxSize);
+		return ParseResult::Invalid;
+	}
+	if (!sMailboxTotal.isEmpty() && !parseBytes(sMailboxTotal, mailbox.nMaxTotalSize))
+	{
+		sError = QStringLiteral("Invalid mailbox total size %1").arg(sMailboxTotal);
+		return ParseResult::Invalid;
+	}
+	if (!sHistorySegment.isEmpty() && !parseCount(sHistorySegment, 1, history.nSegmentRecords))
+	{
+		sError = QStringLiteral("Invalid history segment size %1").arg(sHistorySegment);
+		return ParseResult::Invalid;
+	}
+	if (!sSessionGrace.isEmpty() && !parseCount(sSessionGrace, 0, session.nGrace))
+	{
+		sError = QStringLiteral("Invalid session grace period %1").arg(sSessionGrace);
+		return ParseResult::Invalid;
+	}
+	if (!sSessionReplay.isEmpty() && !parseBytes(sSessionReplay, session.nReplaySize))
+	{
+		sError = QStringLiteral("Invalid session replay size %1").arg(sSessionReplay);
+		return ParseResult::Invalid;
+	}
+	if (!sMetricsAddress.isEmpty() && !metrics.address.setAddress(sMetricsAddress))
+	{
+		sError = QStringLiteral("Invalid metrics address %1").arg(sMetricsAddress);
+		return ParseResult::Invalid;
+	}
+	int nMetricsPort = metrics.nPort;
+	if (!sMetricsPort.isEmpty() && (!parseCount(sMetricsPort, 0, nMetricsPort) || nMetricsPort > 0xFFFF))
+	{
+		sError = QStringLiteral("Invalid metrics port %1").arg(sMetricsPort);
+		return ParseResult::Invalid;
+	}
+	metrics.nPort = quint16(nMetricsPort);
+	if (!sMetricsInterval.isEmpty() && !parseCount(sMetricsInterval, 1, metrics.nInterval))
+	{
+		sError = QStringLiteral("Invalid metrics interval %1").arg(sMetricsInterval);
+		return ParseResult::Invalid;
+	}
+	if (!sTraceSample.isEmpty() && !parseCount(sTraceSample, 0, trace.nSampleInterval))
+	{
+		sError = QStringLiteral("Invalid trace sample interval %1").arg(sTraceSample);
+		return ParseResult::Invalid;
+	}
+	if (!sLogLevel.isEmpty() && !Logger::parseLevel(sLogLevel, logLevel))
+	{
+		sError = QStringLiteral("Invalid log level %1").arg(sLogLevel);
+		return ParseResult::Invalid;
+	}
+	return ParseResult::Ok;
+}
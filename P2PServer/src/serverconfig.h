@@ -0,0 +1,51 @@
+#ifndef SERVERCONFIG_H
+#define SERVERCONFIG_H
+
+#include <QHostAddress>
+#include <QString>
+#include <QStringList>
+#include "logger.h"
+#include "serverworker.h"
+#include "offlinestore.h"
+#include "historystore.h"
+#include "metricsexporter.h"
+#include "messagetracer.h"
+
+// Settings of the server, read from an optional ini file and overridden by the command line
+struct ServerConfig
+{
+	enum class ParseResult
+	{
+		Ok,
+		// --help was given, sError holds the help text
+		Help,
+		Invalid
+	};
+
+	ServerConfig();
+
+	// fills the config from the application arguments, sets sError on invalid input
+	ParseResult parse(QStringList const& lstArguments, QString& sError);
+	// checked before the application object exists, to decide between QApplication and QCoreApplication
+	static bool isHeadless(int argc, char* argv[]);
+
+	bool bHeadless;
+	QHostAddress address;
+	quint16 nPort;
+	int nThreadCount;
+	// 0 means no limit
+	int nMaxConnections;
+	// seconds between the reports of the memory held per connection, 0 turns them off
+	int nReportInterval;
+	OutboundLimits outboundLimits;
+	int nMaxFrameSize;
+	MailboxSettings mailbox;
+	HistorySettings history;
+	SessionSettings session;
+	MetricsSettings metrics;
+	TraceSettings trace;
+	QString sLogFile;
+	LogLevel logLevel;
+};
+
+#endif // SERVERCONFIG_H
\ No newline at end of file
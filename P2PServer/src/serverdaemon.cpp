@@ -0,0 +1,122 @@
+#include "serverdaemon.h"
+#include "chatserver.h"
+#include "logger.h"
+
+#include <QCoreApplication>
+#include <QSocketNotifier>
+#include <QTimer>
+
+#ifdef Q_OS_WIN
+#	include <windows.h>
+#else
+#	include <signal.h>
+#	include <sys/socket.h>
+#	include <unistd.h>
+#endif
+
+namespace
+{
+	// time given to the workers to flush and close their sockets before the event loop quits
+	const int g_nShutdownGraceMs = 500;
+
+#ifdef Q_OS_WIN
+	ServerDaemon* g_pDaemon = nullptr;
+
+	BOOL WINAPI consoleHandler(DWORD dwCtrlType)
+	{
+		Q_UNUSED(dwCtrlType)
+		if (!g_pDaemon)
+			return FALSE;
+		QMetaObject::invokeMethod(g_pDaemon, "shutdown", Qt::QueuedConnection);
+		return TRUE;
+	}
+#else
+	// the signal handler can only do async-signal-safe calls, so it just wakes up the event loop through a socket pair
+	int g_signalFd[2] = { -1, -1 };
+
+	void signalHandler(int)
+	{
+		const char c = 1;
+		const ssize_t nWritten = ::write(g_signalFd[0], &c, sizeof(c));
+		Q_UNUSED(nWritten)
+	}
+#endif
+}
+
+ServerDaemon::ServerDaemon(ServerConfig const& config, QObject* parent)
+	: QObject(parent)
+	, m_config(config)
+	, m_pChatServer(new ChatServer(this))
+	, m_pSignalNotifier(nullptr)
+	, m_bShuttingDown(false)
+{
+	QString sError;
+	if (!m_pChatServer->applyConfig(m_config, sError))
+		LOG_ERROR(sError);
+	installSignalHandlers();
+}
+
+ServerDaemon::~ServerDaemon()
+{
+#ifdef Q_OS_WIN
+	SetConsoleCtrlHandler(consoleHandler, FALSE);
+	g_pDaemon = nullptr;
+#endif
+}
+
+bool ServerDaemon::start()
+{
+	if (!m_pChatServer->startServer(m_config.address, m_config.nPort))
+	{
+		LOG_ERROR(QStringLiteral("Unable to listen on %1:%2 - %3").arg(m_config.address.toString()).arg(m_config.nPort).arg(m_pChatServer->errorString()));
+		return false;
+	}
+	LOG_INFO(QStringLiteral("Server Started on %1:%2 with %3 threads").arg(m_config.address.toString()).arg(m_config.nPort).arg(m_pChatServer->threadCount()));
+	return true;
+}
+
+void ServerDaemon::shutdown()
+{
+	if (m_bShuttingDown)
+		return;
+	m_bShuttingDown = true;
+	LOG_INFO(QStringLiteral("Shutting down"));
+	m_pChatServer->stopServer();
+	QTimer::singleShot(g_nShutdownGraceMs, qApp, &QCoreApplication::quit);
+}
+
+void ServerDaemon::onSignal()
+{
+#ifndef Q_OS_WIN
+	m_pSignalNotifier->setEnabled(false);
+	char c;
+	const ssize_t nRead = ::read(g_signalFd[1], &c, sizeof(c));
+	Q_UNUSED(nRead)
+	m_pSignalNotifier->setEnabled(true);
+#endif
+	shutdown();
+}
+
+void ServerDaemon::installSignalHandlers()
+{
+#ifdef Q_OS_WIN
+	g_pDaemon = this;
+	SetConsoleCtrlHandler(consoleHandler, TRUE);
+#else
+	if (::socketpair(AF_UNIX, SOCK_STREAM, 0, g_signalFd) != 0)
+	{
+		LOG_WARNING(QStringLiteral("Unable to install the signal handlers"));
+		return;
+	}
+	m_pSignalNotifier = new QSocketNotifier(g_signalFd[1], QSocketNotifier::Read, this);
+	// activated is overloaded with private signal tags in Qt 5.15, which the function pointer syntax can't pick
+	connect(m_pSignalNotifier, SIGNAL(activated(int)), this, SLOT(onSignal()));
+
+	struct sigaction action = {};
+	action.sa_handler = signalHandler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGTERM, &action, nullptr);
+	sigaction(SIGINT, &action, nullptr);
+#endif
+}
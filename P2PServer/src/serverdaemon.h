@@ -0,0 +1,36 @@
+#ifndef SERVERDAEMON_H
+#define SERVERDAEMON_H
+
+#include <QObject>
+#include "serverconfig.h"
+
+class ChatServer;
+class QSocketNotifier;
+
+// Runs the chat server without any widget, stops it gracefully on SIGTERM / SIGINT (console close on Windows)
+class ServerDaemon : public QObject
+{
+	Q_OBJECT
+	Q_DISABLE_COPY(ServerDaemon)
+public:
+	explicit ServerDaemon(ServerConfig const& config, QObject* parent = nullptr);
+	~ServerDaemon();
+
+	bool start();
+
+public slots:
+	void shutdown();
+
+private slots:
+	void onSignal();
+
+private:
+	void installSignalHandlers();
+
+	ServerConfig m_config;
+	ChatServer* m_pChatServer;
+	QSocketNotifier* m_pSignalNotifier;
+	bool m_bShuttingDown;
+};
+
+#endif // SERVERDAEMON_H
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "servermetrics.h"
+
+#include <QAtomicInteger>
+#include <QMutex>
+#include <QVector>
+#include <chrono>
+
+namespace
+{
+	class Shard;
+
+	struct Registry
+	{
+		QMutex lock;
+		QVector<Shard*> vecShards;
+		// what the finished threads recorded
+		MetricsSnapshot retired;
+	};
+
+	Registry& registry()
+	{
+		static Registry s_registry;
+		return s_registry;
+	}
+
+	class Shard
+	{
+	public:
+		Shard()
+		{
+			Registry& reg = registry();
+			QMutexLocker locker(&reg.lock);
+			reg.vecShards.append(this);
+		}
+
+		~Shard()
+		{
+			Registry& reg = registry();
+			QMutexLocker locker(&reg.lock);
+			addTo(reg.retired);
+			reg.vecShards.removeOne(this);
+		}
+
+		void add(MetricCounter counter, qint64 nValue)
+		{
+			// no other thread writes it, the snapshots only need to read a whole value
+			QAtomicInteger<qint64>& nCounter = m_nCounters[int(counter)];
+			nCounter.storeRelaxed(nCounter.loadRelaxed() + nValue);
+		}
+
+		void recordRouting(qint64 nNs)
+		{
+			QMutexLocker locker(&m_lockHistograms);
+			m_routing.record(nNs);
+		}
+
+		void addTo(MetricsSnapshot& snapshot) const
+		{
+			for (int nCounter = 0; nCounter < int(MetricCounter::Count); ++nCounter)
+				snapshot.nCounters[nCounter] += m_nCounters[nCounter].loadRelaxed();
+			QMutexLocker locker(&m_lockHistograms);
+			snapshot.routing.merge(m_routing);
+		}
+
+	private:
+		QAtomicInteger<qint64> m_nCounters[int(MetricCounter::Count)];
+		mutable QMutex m_lockHistograms;
+		LatencyHistogram m_routing;
+	};
+
+	Shard& localShard()
+	{
+		thread_local Shard s_shard;
+		return s_shard;
+	}
+}
+
+MetricsSnapshot::MetricsSnapshot()
+	: nCounters()
+{}
+
+qint64 MetricsSnapshot::counter(MetricCounter counter) const
+{
+	return nCounters[int(counter)];
+}
+
+void ServerMetrics::add(MetricCounter counter, qint64 nValue)
+{
+	localShard().add(counter, nValue);
+}
+
+void ServerMetrics::recordRouting(qint64 nNs)
+{
+	localShard().recordRouting(nNs);
+}
+
+qint64 ServerMetrics::clockNs()
+{
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+MetricsSnapshot ServerMetrics::snapshot()
+{
+	Registry& reg = registry();
+	QMutexLocker locker(&reg.lock);
+	MetricsSnapshot snapshot = reg.retired;
+	for (Shard const* pShard : qAsConst(reg.vecShards))
+		pShard->addTo(snapshot);
+	return snapshot;
+}
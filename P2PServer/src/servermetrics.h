@@ -0,0 +1,64 @@
+#ifndef SERVERMETRICS_H
+#define SERVERMETRICS_H
+
+#include <QtGlobal>
+#include "latencyhistogram.h"
+
+// Counters of what the server did since it started, the names they are exported under are in metricsexporter.cpp
+enum class MetricCounter
+{
+	ConnectionsAccepted,
+	// refused past the connection limit
+	ConnectionsRefused,
+	ConnectionsClosed,
+	Logins,
+	// the name was taken
+	LoginsRefused,
+	SessionsResumed,
+	FramesReceived,
+	BytesReceived,
+	// taken from the outbound queues to be written, the kernel may still hold them
+	FramesSent,
+	BytesSent,
+	// payloads that don't parse into a message
+	InvalidMessages,
+	// queued frames thrown away, the presence updates of slow clients and the queues of evicted clients and expired sessions
+	FramesDropped,
+	// disconnected for not reading their frames
+	ClientsEvicted,
+	// disconnected for announcing a frame above the maximum size
+	FramesOversized,
+	// direct messages kept in the mailbox of an offline user
+	MessagesStored,
+	// direct messages to an offline user lost because the mailbox is off or full
+	MessagesUndeliverable,
+	Count
+};
+
+// The counters and the histograms of every thread added up
+struct MetricsSnapshot
+{
+	MetricsSnapshot();
+
+	qint64 counter(MetricCounter counter) const;
+
+	qint64 nCounters[int(MetricCounter::Count)];
+	// nanoseconds from the readyRead that brought a frame to the writes it caused being queued
+	LatencyHistogram routing;
+};
+
+// Always-on metrics of the server. Every thread records into its own shard: a counter is only ever written by its
+// thread, so counting is a plain store without a locked instruction, and the histogram lock is only contended while
+// a snapshot is taken. The shards of the threads that finished are kept in the totals.
+class ServerMetrics
+{
+public:
+	static void add(MetricCounter counter, qint64 nValue = 1);
+	static void recordRouting(qint64 nNs);
+	// monotonic nanoseconds, for the durations given to recordRouting
+	static qint64 clockNs();
+	// safe to call from any thread
+	static MetricsSnapshot snapshot();
+};
+
+#endif // SERVERMETRICS_H
@@ -0,0 +1,37 @@
+#include "serverthread.h"
+#include "mailbox.h"
+
+ServerThread::ServerThread(QObject *parent)
+	: QThread(parent)
+	, m_pMailbox(new Mailbox)
+	, m_nClients(0)
+{
+	m_pMailbox->moveToThread(this);
+}
+
+ServerThread::~ServerThread()
+{
+	quit();
+	wait();
+	delete m_pMailbox;
+}
+
+Mailbox* ServerThread::mailbox() const
+{
+	return m_pMailbox;
+}
+
+int ServerThread::clientCount() const
+{
+	return m_nClients.loadRelaxed();
+}
+
+void ServerThread::clientAdded()
+{
+	m_nClients.ref();
+}
+
+void ServerThread::clientRemoved()
+{
+	m_nClients.deref();
+}
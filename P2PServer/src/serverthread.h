@@ -0,0 +1,27 @@
+#ifndef SERVERTHREAD_H
+#define SERVERTHREAD_H
+
+#include <QThread>
+#include <QAtomicInteger>
+
+class Mailbox;
+
+// Event loop thread serving a share of the connected clients
+class ServerThread : public QThread
+{
+	Q_DISABLE_COPY(ServerThread)
+public:
+	explicit ServerThread(QObject *parent = nullptr);
+	~ServerThread();
+
+	Mailbox* mailbox() const;
+	int clientCount() const;
+	void clientAdded();
+	void clientRemoved();
+
+private:
+	Mailbox* m_pMailbox;
+	QAtomicInteger<int> m_nClients;
+};
+
+#endif // SERVERTHREAD_H
\ No newline at end of file
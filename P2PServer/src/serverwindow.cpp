@@ -1,18 +1,25 @@
 #include "serverwindow.h"
 #include "ui_serverwindow.h"
 #include "chatserver.h"
+#include "logger.h"
 #include <QMessageBox>
 
-const quint16 g_nPortDefault = 1967;
+// the log view keeps only the most recent lines, the full log goes to the logger output
+const int g_nLogLinesMax = 2000;
 
-ServerWindow::ServerWindow(QWidget *parent)
+ServerWindow::ServerWindow(ServerConfig const& config, QWidget *parent)
 	: QWidget(parent)
 	, ui(new Ui::ServerWindow)
 	, m_pChatServer(new ChatServer(this))
+	, m_config(config)
 {
 	ui->setupUi(this);
+	QString sError;
+	if (!m_pChatServer->applyConfig(m_config, sError))
+		LOG_ERROR(sError);
 	connect(ui->startStopButton, &QPushButton::clicked, this, &ServerWindow::toggleStartServer);
-	connect(m_pChatServer, &ChatServer::logMessage, this, &ServerWindow::logMessage);
+	ui->logEditor->setMaximumBlockCount(g_nLogLinesMax);
+	connect(&Logger::instance(), &Logger::messageLogged, this, &ServerWindow::logMessage);
 }
 
 ServerWindow::~ServerWindow()
@@ -26,21 +33,21 @@ void ServerWindow::toggleStartServer()
 	{
 		m_pChatServer->stopServer();
 		ui->startStopButton->setText(tr("Start Server"));
-		logMessage(QStringLiteral("Server Stopped"));
+		LOG_INFO(QStringLiteral("Server Stopped"));
 	} 
 	else
 	{
-		if (!m_pChatServer->listen(QHostAddress::Any, g_nPortDefault))
+		if (!m_pChatServer->startServer(m_config.address, m_config.nPort))
 		{
 			QMessageBox::critical(this, tr("Error"), tr("Unable to start the server"));
 			return;
 		}
-		logMessage(QStringLiteral("Server Started"));
+		LOG_INFO(QStringLiteral("Server Started"));
 		ui->startStopButton->setText(tr("Stop Server"));
 	}
 }
 
 void ServerWindow::logMessage(QString const& msg)
 {
-	ui->logEditor->appendPlainText(msg + QLatin1Char('\n'));
+	ui->logEditor->appendPlainText(msg);
 }
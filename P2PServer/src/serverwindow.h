@@ -2,6 +2,7 @@
 #define SERVERWINDOW_H
 
 #include <QWidget>
+#include "serverconfig.h"
 
 namespace Ui {
 class ServerWindow;
@@ -12,12 +13,13 @@ class ServerWindow : public QWidget
 	Q_OBJECT
 	Q_DISABLE_COPY(ServerWindow)
 public:
-	explicit ServerWindow(QWidget *parent = nullptr);
+	explicit ServerWindow(ServerConfig const& config, QWidget *parent = nullptr);
 	~ServerWindow();
 
 private:
 	Ui::ServerWindow *ui;
 	ChatServer* m_pChatServer;
+	ServerConfig m_config;
 private slots:
 	void toggleStartServer();
 	void logMessage(QString const& msg);
@@ -1,15 +1,51 @@
 #include "serverworker.h"
+#include "serverthread.h"
+#include "mailbox.h"
+#include "logger.h"
+#include "servermetrics.h"
+#include "messagetracer.h"
 
-#include <QDataStream>
-#include <QJsonDocument>
-#include <QJsonParseError>
-#include <QJsonObject>
+#include <QThread>
+#include <QTimer>
+
+#ifdef Q_OS_UNIX
+#	include <errno.h>
+#	include <sys/socket.h>
+#	include <sys/uio.h>
+#endif
+
+namespace
+{
+#ifdef Q_OS_UNIX
+	// frames handed to the kernel in one vectored send
+	const int g_nSendVectorsMax = 64;
+#	ifdef MSG_NOSIGNAL
+	const int g_nSendFlags = MSG_NOSIGNAL;
+#	else
+	const int g_nSendFlags = 0;
+#	endif
+#endif
+}
 
 ServerWorker::ServerWorker(QObject* parent)
 	: QObject(parent)
 	, m_pServerSocket(new QTcpSocket(this))
+	, m_nQueuedBytes(0)
+	, m_nEphemeralFrames(0)
+	, m_nPendingBytes(0)
+	, m_bFlushScheduled(false)
+	, m_bEvicted(false)
+	, m_nRegistrySlot(-1)
+	, m_encoding(WireEncoding::Json)
+	, m_nStreamOffset(0)
+	, m_nReplayBytes(0)
+	, m_nReplaySize(0)
+	, m_nLastReceipt(0)
+	, m_bDetached(false)
+	, m_bExpired(false)
 {
 	connect(m_pServerSocket, &QTcpSocket::readyRead, this, &ServerWorker::receiveJson);
+	connect(m_pServerSocket, &QTcpSocket::bytesWritten, this, &ServerWorker::onBytesWritten);
 
 	connect(m_pServerSocket, &QTcpSocket::disconnected, this, &ServerWorker::disconnectFromClient);
 	connect(m_pServerSocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &ServerWorker::error);
@@ -18,22 +54,401 @@ ServerWorker::ServerWorker(QObject* parent)
 
 bool ServerWorker::setSocketDescriptor(qintptr socketDescriptor)
 {
-	return m_pServerSocket->setSocketDescriptor(socketDescriptor);
+	if (!m_pServerSocket->setSocketDescriptor(socketDescriptor))
+		return false;
+	// the frames are already batched per event loop iteration, Nagle would only add latency on top
+	m_pServerSocket->setSocketOption(QAbstractSocket::LowDelayOption, m_limits.bNoDelay ? 1 : 0);
+	return true;
+}
+
+void ServerWorker::sendFrame(QByteArray const& frame, FrameKind kind)
+{
+	LOG_DEBUG(QStringLiteral("Sending %1 bytes to %2").arg(frame.size()).arg(userName()));
+	if (m_bEvicted)
+		return;
+	OutboundFrame outbound = { frame, kind, MessageTracer::current(), 0, 0 };
+	if (outbound.nTraceId != 0)
+		outbound.nQueuedNs = ServerMetrics::clockNs();
+	queueFrame(outbound);
+}
+
+void ServerWorker::sendFrame(QByteArray const& frame, std::function<void()> onWritten)
+{
+	Q_ASSERT(QThread::currentThread() == thread());
+	if (m_bEvicted || m_bDetached)
+		return sendFrame(frame);
+	OutboundFrame outbound = { frame, FrameKind::Essential, MessageTracer::current(), 0, ++m_nLastReceipt };
+	if (outbound.nReceipt == 0)
+		outbound.nReceipt = ++m_nLastReceipt;
+	if (outbound.nTraceId != 0)
+		outbound.nQueuedNs = ServerMetrics::clockNs();
+	m_mapReceipts.insert(outbound.nReceipt, std::move(onWritten));
+	queueFrame(outbound);
+}
+
+void ServerWorker::queueFrame(OutboundFrame const& outbound)
+{
+	if (m_bDetached)
+		return holdFrame(outbound);
+	if (m_pServerSocket->state() != QAbstractSocket::ConnectedState)
+		return;
+
+	m_queOutbound.enqueue(outbound);
+	m_nQueuedBytes += outbound.frame.size();
+	if (outbound.kind == FrameKind::Ephemeral)
+		++m_nEphemeralFrames;
+	if (m_nQueuedBytes > m_limits.nMaxQueuedBytes && !handleOverflow())
+		return;
+	scheduleFlush();
+}
+
+void ServerWorker::holdFrame(OutboundFrame const& outbound)
+{
+	QMutexLocker locker(&m_sessionMutex);
+	if (m_pSuccessor)
+	{
+		// posted before the session was taken over, the successor gets it through its mailbox like from any other thread
+		ServerWorker* pSuccessor = m_pSuccessor;
+		locker.unlock();
+		static_cast<ServerThread*>(pSuccessor->thread())->mailbox()->post(pSuccessor, outbound.frame, outbound.kind);
+		return;
+	}
+	if (m_bExpired)
+		return;
+
+	m_queOutbound.enqueue(outbound);
+	m_nQueuedBytes += outbound.frame.size();
+	if (outbound.kind == FrameKind::Ephemeral)
+		++m_nEphemeralFrames;
+	if (m_nQueuedBytes <= m_limits.nMaxQueuedBytes)
+		return;
+	// a session missing frames can't be resumed, it ends here
+	LOG_WARNING(QStringLiteral("%1 has been away for too long, %2 bytes held for it").arg(userName()).arg(m_nQueuedBytes));
+	m_bExpired = true;
+	ServerMetrics::add(MetricCounter::FramesDropped, m_queOutbound.size());
+	m_queOutbound.clear();
+	m_nQueuedBytes = 0;
+	m_nEphemeralFrames = 0;
+	// reported later, the frame may be sent by a fan out holding the lock of the clients
+	QMetaObject::invokeMethod(this, &ServerWorker::disconnectedFromClient, Qt::QueuedConnection);
+}
+
+void ServerWorker::startSession(QByteArray const& token, qint64 nReplaySize)
+{
+	QMutexLocker locker(&m_sessionMutex);
+	m_sessionToken = token;
+	m_nReplaySize = nReplaySize;
+}
+
+void ServerWorker::endSession()
+{
+	QMutexLocker locker(&m_sessionMutex);
+	m_sessionToken.clear();
+	m_queReplay.clear();
+	m_nReplayBytes = 0;
+	if (!m_bDetached || m_pSuccessor || m_bExpired)
+		return;
+	m_bExpired = true;
+	locker.unlock();
+	emit disconnectedFromClient();
+}
+
+QByteArray ServerWorker::sessionToken() const
+{
+	QMutexLocker locker(&m_sessionMutex);
+	return m_sessionToken;
+}
+
+bool ServerWorker::detach(int nGraceMs)
+{
+	QMutexLocker locker(&m_sessionMutex);
+	if (m_sessionToken.isEmpty() || m_bDetached)
+		return false;
+	// the frames still queued were never written, they are held with the ones sent from now on
+	m_bDetached = true;
+	QTimer::singleShot(nGraceMs, this, &ServerWorker::expireSession);
+	return true;
+}
+
+void ServerWorker::expireSession()
+{
+	QMutexLocker locker(&m_sessionMutex);
+	if (m_pSuccessor || m_bExpired)
+		return;
+	m_bExpired = true;
+	locker.unlock();
+	emit disconnectedFromClient();
+}
+
+bool ServerWorker::takeSession(qint64 nReceived, ServerWorker* pSuccessor, QVector<QByteArray>& frames)
+{
+	QMutexLocker locker(&m_sessionMutex);
+	if (!m_bDetached || m_pSuccessor || m_bExpired)
+		return false;
+	// the client must have got everything written before the oldest frame kept
+	const qint64 nOldest = m_queReplay.isEmpty() ? m_nStreamOffset : m_queReplay.head().first;
+	if (nReceived < nOldest || nReceived > m_nStreamOffset)
+		return false;
+
+	frames.reserve(m_queReplay.size() + m_queOutbound.size());
+	for (QPair<qint64, QByteArray> const& written : qAsConst(m_queReplay))
+	{
+		const qint64 nEnd = written.first + written.second.size();
+		if (nEnd <= nReceived)
+			continue;
+		// a batch of frames can be received in part, the client counts whole frames so the cut is on a frame boundary
+		frames.append(written.first < nReceived ? written.second.mid(int(nReceived - written.first)) : written.second);
+	}
+	for (OutboundFrame const& outbound : qAsConst(m_queOutbound))
+		frames.append(outbound.frame);
+	m_queOutbound.clear();
+	m_nQueuedBytes = 0;
+	m_nEphemeralFrames = 0;
+	m_queReplay.clear();
+	m_nReplayBytes = 0;
+	m_pSuccessor = pSuccessor;
+	return true;
+}
+
+bool ServerWorker::abandonSession()
+{
+	QMutexLocker locker(&m_sessionMutex);
+	if (!m_bDetached || m_pSuccessor || m_bExpired)
+		return false;
+	m_bExpired = true;
+	return true;
+}
+
+void ServerWorker::setOutboundLimits(OutboundLimits const& limits)
+{
+	m_limits = limits;
+}
+
+qint64 ServerWorker::pendingBytes() const
+{
+	return m_nPendingBytes.loadRelaxed();
+}
+
+void ServerWorker::scheduleFlush()
+{
+	// everything queued during this event loop iteration goes out together
+	if (m_bFlushScheduled)
+		return;
+	m_bFlushScheduled = true;
+	QMetaObject::invokeMethod(this, &ServerWorker::flushOutbound, Qt::QueuedConnection);
+}
+
+void ServerWorker::flushOutbound()
+{
+	m_bFlushScheduled = false;
+	pumpOutbound();
+}
+
+ServerWorker::OutboundFrame ServerWorker::takeOutbound()
+{
+	OutboundFrame outbound = m_queOutbound.dequeue();
+	m_nQueuedBytes -= outbound.frame.size();
+	if (outbound.kind == FrameKind::Ephemeral)
+		--m_nEphemeralFrames;
+	// the frames are kept by reference, a broadcast shares its buffer with the replay queues of all the recipients
+	if (!m_sessionToken.isEmpty())
+	{
+		m_queReplay.enqueue(qMakePair(m_nStreamOffset, outbound.frame));
+		m_nReplayBytes += outbound.frame.size();
+		while (!m_queReplay.isEmpty() && m_nReplayBytes > m_nReplaySize)
+			m_nReplayBytes -= m_queReplay.dequeue().second.size();
+	}
+	m_nStreamOffset += outbound.frame.size();
+	ServerMetrics::add(MetricCounter::FramesSent);
+	ServerMetrics::add(MetricCounter::BytesSent, outbound.frame.size());
+	if (outbound.nTraceId != 0 || outbound.nReceipt != 0)
+	{
+		const qint64 nTakenNs = outbound.nTraceId != 0 ? ServerMetrics::clockNs() : 0;
+		if (outbound.nTraceId != 0)
+			MessageTracer::span(outbound.nTraceId, TraceStage::Queue, outbound.nQueuedNs, nTakenNs);
+		m_quePendingWrites.enqueue({ m_nStreamOffset, outbound.nTraceId, nTakenNs, outbound.nReceipt });
+	}
+	return outbound;
+}
+
+void ServerWorker::pumpOutbound()
+{
+	// a detached worker holds its frames for the successor
+	if (m_bDetached)
+		return;
+#ifdef Q_OS_UNIX
+	// with nothing buffered by the socket the frames can go straight to the kernel without being copied
+	if (m_pServerSocket->bytesToWrite() == 0)
+		sendVectored();
+#endif
+	// whatever the kernel didn't take is gathered into one buffer, the socket sends it as a single block
+	// instead of one block per frame
+	if (!m_queOutbound.isEmpty() && m_pServerSocket->bytesToWrite() < m_limits.nHighWatermark)
+	{
+		const qint64 nBudget = m_limits.nHighWatermark - m_pServerSocket->bytesToWrite();
+		const OutboundFrame first = takeOutbound();
+		if (m_queOutbound.isEmpty() || first.frame.size() >= nBudget)
+		{
+			m_pServerSocket->write(first.frame);
+		}
+		else
+		{
+			QByteArray batch;
+			batch.reserve(int(qMin<qint64>(nBudget, m_nQueuedBytes + first.frame.size())));
+			batch += first.frame;
+			while (!m_queOutbound.isEmpty() && batch.size() < nBudget)
+				batch += takeOutbound().frame;
+			m_pServerSocket->write(batch);
+		}
+	}
+	updatePendingBytes();
+}
+
+#ifdef Q_OS_UNIX
+void ServerWorker::sendVectored()
+{
+	const int nDescriptor = int(m_pServerSocket->socketDescriptor());
+	iovec vecIo[g_nSendVectorsMax];
+	while (!m_queOutbound.isEmpty())
+	{
+		int nVectors = 0;
+		qint64 nBytes = 0;
+		for (auto it = m_queOutbound.cbegin(); it != m_queOutbound.cend() && nVectors < g_nSendVectorsMax && nBytes < m_limits.nHighWatermark; ++it)
+		{
+			vecIo[nVectors].iov_base = const_cast<char*>(it->frame.constData());
+			vecIo[nVectors].iov_len = size_t(it->frame.size());
+			nBytes += it->frame.size();
+			++nVectors;
+		}
+
+		msghdr message = {};
+		message.msg_iov = vecIo;
+		message.msg_iovlen = nVectors;
+		const ssize_t nSent = ::sendmsg(nDescriptor, &message, g_nSendFlags);
+		if (nSent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			// the kernel buffer is full or the socket failed, QTcpSocket takes it from here and reports errors
+			return;
+		}
+
+		qint64 nLeft = nSent;
+		while (nLeft > 0)
+		{
+			if (nLeft < m_queOutbound.head().frame.size())
+			{
+				// the kernel took part of this frame, the rest has to be the first thing the socket sends
+				const OutboundFrame partial = takeOutbound();
+				m_pServerSocket->write(partial.frame.constData() + nLeft, partial.frame.size() - nLeft);
+				return;
+			}
+			nLeft -= m_queOutbound.head().frame.size();
+			takeOutbound();
+		}
+		if (nSent < nBytes)
+			return;
+	}
+}
+#endif
+
+void ServerWorker::onBytesWritten()
+{
+	if (!m_queOutbound.isEmpty() && m_pServerSocket->bytesToWrite() <= m_limits.nLowWatermark)
+		pumpOutbound();
+	else
+		updatePendingBytes();
+}
+
+bool ServerWorker::handleOverflow()
+{
+	if (m_limits.overflowPolicy == OverflowPolicy::DropEphemeral && m_nEphemeralFrames > 0)
+	{
+		const int nDropped = m_nEphemeralFrames;
+		QQueue<OutboundFrame> queKept;
+		for (OutboundFrame const& outbound : qAsConst(m_queOutbound))
+		{
+			if (outbound.kind == FrameKind::Ephemeral)
+				m_nQueuedBytes -= outbound.frame.size();
+			else
+				queKept.enqueue(outbound);
+		}
+		m_queOutbound.swap(queKept);
+		m_nEphemeralFrames = 0;
+		ServerMetrics::add(MetricCounter::FramesDropped, nDropped);
+		LOG_WARNING(QStringLiteral("%1 is not keeping up, dropped %2 presence updates").arg(userName()).arg(nDropped));
+		if (m_nQueuedBytes <= m_limits.nMaxQueuedBytes)
+			return true;
+	}
+
+	// the client stopped reading, don't let it grow the server memory any further.
+	// the frames thrown away would be missing after a resumption, so the session ends too
+	LOG_WARNING(QStringLiteral("%1 is not keeping up with %2 bytes pending, disconnecting it").arg(userName()).arg(m_nQueuedBytes + m_pServerSocket->bytesToWrite()));
+	ServerMetrics::add(MetricCounter::ClientsEvicted);
+	evict();
+	return false;
+}
+
+void ServerWorker::evict()
+{
+	if (m_bEvicted)
+		return;
+	m_bEvicted = true;
+	endSession();
+	ServerMetrics::add(MetricCounter::FramesDropped, m_queOutbound.size());
+	m_queOutbound.clear();
+	m_nQueuedBytes = 0;
+	m_nEphemeralFrames = 0;
+	updatePendingBytes();
+	QMetaObject::invokeMethod(this, &ServerWorker::closeEvicted, Qt::QueuedConnection);
 }
 
-void ServerWorker::sendJson(QJsonObject const& json)
+void ServerWorker::closeEvicted()
 {
-	const QByteArray jsonData = QJsonDocument(json).toJson(QJsonDocument::Compact);
-	// notify the central server we are about to send the message
-	emit logMessage(QLatin1String("Sending to ") + userName() + QLatin1String(" - ") + QString::fromUtf8(jsonData));
-	
-	QDataStream socketStream(m_pServerSocket);
-	socketStream.setVersion(QDataStream::Qt_5_15);
-	socketStream << jsonData;
+	emit disconnectedFromClient();
+	m_pServerSocket->abort();
+	updatePendingBytes();
+}
+
+void ServerWorker::updatePendingBytes()
+{
+	const qint64 nBuffered = m_pServerSocket->bytesToWrite();
+	m_nPendingBytes.storeRelaxed(m_nQueuedBytes + nBuffered);
+	// whatever was taken from the queue and isn't buffered by the socket anymore is in the kernel
+	const qint64 nHandedOver = m_nStreamOffset - nBuffered;
+	while (!m_quePendingWrites.isEmpty() && m_quePendingWrites.head().nStreamEnd <= nHandedOver)
+	{
+		const PendingWrite write = m_quePendingWrites.dequeue();
+		if (write.nTraceId != 0)
+			MessageTracer::span(write.nTraceId, TraceStage::Socket, write.nTakenNs, ServerMetrics::clockNs());
+		// run from the event loop, this may be a send made with the lock of the clients held
+		const std::function<void()> onWritten = write.nReceipt != 0 ? m_mapReceipts.take(write.nReceipt) : std::function<void()>();
+		if (onWritten)
+			QMetaObject::invokeMethod(this, onWritten, Qt::QueuedConnection);
+	}
+}
+
+WireEncoding ServerWorker::encoding() const
+{
+	return m_encoding;
+}
+
+void ServerWorker::setEncoding(WireEncoding encoding)
+{
+	m_encoding = encoding;
+}
+
+void ServerWorker::setMaxFrameSize(int nMaxFrameSize)
+{
+	m_decoder.setMaxFrameSize(nMaxFrameSize);
 }
 
 void ServerWorker::disconnectFromClient()
 {
+	// the drop of the connection was already reported, the session reports its expiry itself
+	// and an evicted client is reported by closeEvicted
+	if (m_bDetached || m_bEvicted)
+		return;
 	emit disconnectedFromClient();
 	m_pServerSocket->disconnectFromHost();
 }
@@ -46,41 +461,61 @@ QString ServerWorker::userName() const
 void ServerWorker::setUserName(QString const& sUserName)
 {
 	m_sUserName = sUserName;
+	m_userNameUtf8 = sUserName.toUtf8();
 }
 
-void ServerWorker::receiveJson()
+QByteArray ServerWorker::userNameUtf8() const
 {
-	QByteArray jsonData;
-	QDataStream socketStream(m_pServerSocket);
-	socketStream.setVersion(QDataStream::Qt_5_15);
+	return m_userNameUtf8;
+}
 
-	for (;;) 
+int ServerWorker::registrySlot() const
+{
+	return m_nRegistrySlot;
+}
+
+void ServerWorker::setRegistrySlot(int nSlot)
+{
+	m_nRegistrySlot = nSlot;
+}
+
+void ServerWorker::receiveJson()
+{
+	// the routing latency of a frame includes the frames before it in the same read
+	const qint64 nReadyNs = ServerMetrics::clockNs();
+	qint64 nFrameStartNs = nReadyNs;
+	m_decoder.readFrom(m_pServerSocket);
+	// the frames are views into the decoder buffer, they are consumed before the next read
+	QByteArray payload;
+	// a handler may evict the sender, what it sent after that is ignored
+	while (!m_bEvicted && m_decoder.nextFrame(payload))
 	{
-		// start a transaction so we can revert to the previous state in case we try to read more data than is available on the socket
-		socketStream.startTransaction();
-		socketStream >> jsonData;
-		if (socketStream.commitTransaction()) 
+		ServerMetrics::add(MetricCounter::FramesReceived);
+		ServerMetrics::add(MetricCounter::BytesReceived, payload.size() + int(sizeof(quint32)));
+		// a sampled frame is followed through the handlers and every frame they send
+		MessageTracer::Scope trace(MessageTracer::sample(), nFrameStartNs);
+		MessageTracer::mark(TraceStage::Decode);
+		// direct messages of logged in users are relayed without being decoded
+		DirectMessage direct;
+		if (!m_sUserName.isEmpty() && MessageCodec::scanDirectMessage(payload, direct))
 		{
-			QJsonParseError parseError;
-			const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData, &parseError);
-			if (parseError.error == QJsonParseError::NoError) 
-			{
-				if (jsonDoc.isObject())
-					emit jsonReceived(jsonDoc.object());
-				else
-					emit logMessage(QLatin1String("Invalid message: ") + QString::fromUtf8(jsonData));
-			} 
-			else 
-			{
-				emit logMessage(QLatin1String("Invalid message: ") + QString::fromUtf8(jsonData));
-			}
-		} 
-		else 
+			MessageTracer::mark(TraceStage::Parse);
+			emit directMessageReceived(direct.receiver, direct.text);
+		}
+		else
 		{
-			// just exit the loop and wait for more data to become available
-			break;
+			emit messageReceived(payload);
 		}
+		MessageTracer::mark(TraceStage::Dispatch);
+		// the handlers return once the frames they send are queued, in this thread or in the mailbox of another one
+		const qint64 nHandledNs = ServerMetrics::clockNs();
+		ServerMetrics::recordRouting(nHandledNs - nReadyNs);
+		nFrameStartNs = nHandledNs;
+	}
+	if (m_decoder.hasError())
+	{
+		LOG_WARNING(QStringLiteral("%1 sent a frame above %2 bytes, disconnecting it").arg(userName()).arg(m_decoder.maxFrameSize()));
+		ServerMetrics::add(MetricCounter::FramesOversized);
+		evict();
 	}
 }
-
-
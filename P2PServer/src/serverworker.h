@@ -2,30 +2,175 @@
 #define SERVERWORKER_H
 
 #include <QObject>
+#include <QAtomicInteger>
+#include <QHash>
+#include <QMutex>
+#include <QPair>
+#include <QPointer>
+#include <QQueue>
+#include <QVector>
 #include <QTcpSocket>
-class QJsonObject;
+#include "framecodec.h"
+#include "messagecodec.h"
+#include <functional>
+
+// Ephemeral frames (presence updates) are the first to go when a client can't keep up
+enum class FrameKind
+{
+	Essential,
+	Ephemeral
+};
+
+enum class OverflowPolicy
+{
+	// drop the queued ephemeral frames, disconnect the client if that is not enough
+	DropEphemeral,
+	Disconnect
+};
+
+// Bounds of the data waiting to be sent to one client
+struct OutboundLimits
+{
+	// frames are moved from the queue into the socket only while the socket holds less than the high watermark,
+	// and moving resumes once the socket drained below the low watermark
+	qint64 nHighWatermark = 256 * 1024;
+	qint64 nLowWatermark = 64 * 1024;
+	// bytes allowed in the queue before the overflow policy applies
+	qint64 nMaxQueuedBytes = 4 * 1024 * 1024;
+	OverflowPolicy overflowPolicy = OverflowPolicy::DropEphemeral;
+	// TCP_NODELAY on the client sockets
+	bool bNoDelay = true;
+};
+
+// Resumable sessions, a client that lost its connection can take its session back within the grace period
+struct SessionSettings
+{
+	// seconds the session waits for its client, 0 turns the sessions off
+	int nGrace = 30;
+	// bytes of the last frames written to a client, kept to replay what was lost with the connection
+	qint64 nReplaySize = 64 * 1024;
+};
+
 class ServerWorker : public QObject
 {
 	Q_OBJECT
 	Q_DISABLE_COPY(ServerWorker)
+	// P2PBench reads the socket and the stream offset to drain what a worker wrote
+	friend class ServerBench;
 public:
 	explicit ServerWorker(QObject *parent = nullptr);
 	virtual bool setSocketDescriptor(qintptr socketDescriptor);
 	QString userName() const;
 	void setUserName(QString const& sUserName);
-	void sendJson(QJsonObject const& jsonData);
+	// the name as sent in relayed messages
+	QByteArray userNameUtf8() const;
+	int registrySlot() const;
+	void setRegistrySlot(int nSlot);
+	// queues a frame built by encodeFrame of messages.h, the same frame can be shared by any number of workers
+	void sendFrame(QByteArray const& frame, FrameKind kind = FrameKind::Essential);
+	// queues an essential frame from the thread of the worker, onWritten runs in that thread once the socket handed
+	// the frame to the kernel. It never runs if the client goes away or detaches first
+	void sendFrame(QByteArray const& frame, std::function<void()> onWritten);
+	// encoding negotiated at login, the frames sent to this client have to use it
+	WireEncoding encoding() const;
+	void setEncoding(WireEncoding encoding);
+	void setOutboundLimits(OutboundLimits const& limits);
+	// clients sending a bigger frame are disconnected
+	void setMaxFrameSize(int nMaxFrameSize);
+	// bytes queued plus bytes buffered by the socket, safe to call from any thread
+	qint64 pendingBytes() const;
+
+	// the frames written from now on are kept for a resumption under the token
+	void startSession(QByteArray const& token, qint64 nReplaySize);
+	// the client left for good, a detached session expires right away
+	void endSession();
+	QByteArray sessionToken() const;
+	// keeps the session after the connection dropped and holds the frames sent to it, false without a session.
+	// disconnectedFromClient is emitted again once the grace period is over
+	bool detach(int nGraceMs);
+	// called from the thread of the successor with the lock of the clients held. nReceived is the position in the
+	// frame stream the client got to, frames holds the frames to send again followed by the ones held since the
+	// connection dropped. The frames that still arrive for this worker are forwarded to the successor
+	bool takeSession(qint64 nReceived, ServerWorker* pSuccessor, QVector<QByteArray>& frames);
+	// gives up a detached session that can't be resumed, returns false if it is not detached anymore
+	bool abandonSession();
 signals:
-	void jsonReceived(QJsonObject const& jsonDoc);
+	// the payload is a view into the receive buffer, only valid during the emission
+	void messageReceived(QByteArray const& payload);
+	// a direct message found by the relay fast path, the arguments are only valid during the emission
+	void directMessageReceived(QByteArray const& receiver, QByteArray const& text);
 	void disconnectedFromClient();
 	void error();
-	void logMessage(QString const& msg);
 public slots:
 	void disconnectFromClient();
 private slots:
+	void expireSession();
+	void closeEvicted();
 	void receiveJson();
+	void onBytesWritten();
+	void flushOutbound();
 private:
+	struct OutboundFrame
+	{
+		QByteArray frame;
+		FrameKind kind;
+		// 0 unless the frame was sent while handling a traced one
+		quint64 nTraceId;
+		qint64 nQueuedNs;
+		// key of its m_mapReceipts entry, 0 for none
+		quint32 nReceipt;
+	};
+	// a traced or receipted frame taken from the queue, waiting for the socket to hand its last byte to the kernel
+	struct PendingWrite
+	{
+		qint64 nStreamEnd;
+		quint64 nTraceId;
+		qint64 nTakenNs;
+		quint32 nReceipt;
+	};
+
+	void scheduleFlush();
+	OutboundFrame takeOutbound();
+	void pumpOutbound();
+#ifdef Q_OS_UNIX
+	void sendVectored();
+#endif
+	bool handleOverflow();
+	// drops the client without reporting it right away, the caller may hold the lock of the clients or be iterating
+	// over them. Nothing is queued for it anymore and the disconnection is reported from the next event loop iteration
+	void evict();
+	void updatePendingBytes();
+	void queueFrame(OutboundFrame const& outbound);
+	void holdFrame(OutboundFrame const& outbound);
+
 	QTcpSocket* m_pServerSocket;
+	FrameDecoder m_decoder;
+	OutboundLimits m_limits;
+	QQueue<OutboundFrame> m_queOutbound;
+	qint64 m_nQueuedBytes;
+	int m_nEphemeralFrames;
+	QAtomicInteger<qint64> m_nPendingBytes;
+	bool m_bFlushScheduled;
+	bool m_bEvicted;
 	QString m_sUserName;
+	QByteArray m_userNameUtf8;
+	int m_nRegistrySlot;
+	WireEncoding m_encoding;
+	// bytes of the frames taken from the queue since the connection, both sides count the same
+	qint64 m_nStreamOffset;
+	// the last frames taken from the queue with their position in the stream, only written by the thread of the worker
+	QQueue<QPair<qint64, QByteArray>> m_queReplay;
+	qint64 m_nReplayBytes;
+	qint64 m_nReplaySize;
+	QQueue<PendingWrite> m_quePendingWrites;
+	QHash<quint32, std::function<void()>> m_mapReceipts;
+	quint32 m_nLastReceipt;
+	// guards the session once detached, the successor takes it over from its own thread
+	mutable QMutex m_sessionMutex;
+	QByteArray m_sessionToken;
+	bool m_bDetached;
+	bool m_bExpired;
+	QPointer<ServerWorker> m_pSuccessor;
 };
 
 #endif // SERVERWORKER_H
\ No newline at end of file
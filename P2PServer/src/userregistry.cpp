@@ -0,0 +1,82 @@
+#include "userregistry.h"
+#include "serverworker.h"
+
+void UserRegistry::add(ServerWorker* pWorker)
+{
+	Q_ASSERT(pWorker);
+	pWorker->setRegistrySlot(m_vecSlots.size());
+	m_vecSlots.append(pWorker);
+}
+
+bool UserRegistry::remove(ServerWorker* pWorker)
+{
+	const int nSlot = pWorker->registrySlot();
+	if (nSlot < 0 || nSlot >= m_vecSlots.size() || m_vecSlots.at(nSlot) != pWorker)
+		return false;
+
+	// move the last worker into the freed slot so removal doesn't shift the vector
+	ServerWorker* pLast = m_vecSlots.last();
+	m_vecSlots[nSlot] = pLast;
+	pLast->setRegistrySlot(nSlot);
+	m_vecSlots.removeLast();
+	pWorker->setRegistrySlot(-1);
+
+	const QString sUserName = pWorker->userName();
+	if (!sUserName.isEmpty())
+	{
+		auto it = m_mapByName.find(key(sUserName));
+		if (it != m_mapByName.end() && it.value() == pWorker)
+			m_mapByName.erase(it);
+	}
+	return true;
+}
+
+bool UserRegistry::registerName(ServerWorker* pWorker, QString const& sUserName)
+{
+	ServerWorker*& pOwner = m_mapByName[key(sUserName)];
+	if (pOwner && pOwner != pWorker)
+		return false;
+	pOwner = pWorker;
+	pWorker->setUserName(sUserName);
+	return true;
+}
+
+bool UserRegistry::replace(ServerWorker* pOld, ServerWorker* pNew)
+{
+	const QString sUserName = pOld->userName();
+	if (!remove(pOld))
+		return false;
+	if (!sUserName.isEmpty())
+	{
+		m_mapByName.insert(key(sUserName), pNew);
+		pNew->setUserName(sUserName);
+	}
+	return true;
+}
+
+ServerWorker* UserRegistry::find(QString const& sUserName) const
+{
+	return m_mapByName.value(key(sUserName), nullptr);
+}
+
+QVector<ServerWorker*> const& UserRegistry::workers() const
+{
+	return m_vecSlots;
+}
+
+int UserRegistry::size() const
+{
+	return m_vecSlots.size();
+}
+
+void UserRegistry::clear()
+{
+	// only used when the workers are being thrown away, so their slots are left as they are
+	m_vecSlots.clear();
+	m_mapByName.clear();
+}
+
+QString UserRegistry::key(QString const& sUserName)
+{
+	return sUserName.toCaseFolded();
+}
@@ -0,0 +1,33 @@
+#ifndef USERREGISTRY_H
+#define USERREGISTRY_H
+
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+class ServerWorker;
+
+// Connected workers kept in swap-remove slots, plus an index of the logged in ones by case folded user name.
+// It is not thread safe, ChatServer guards it with its own lock.
+class UserRegistry
+{
+public:
+	void add(ServerWorker* pWorker);
+	bool remove(ServerWorker* pWorker);
+	// gives sUserName to the worker, fails if another worker already uses it
+	bool registerName(ServerWorker* pWorker, QString const& sUserName);
+	// removes pOld and gives its name to pNew, which must be added already
+	bool replace(ServerWorker* pOld, ServerWorker* pNew);
+	ServerWorker* find(QString const& sUserName) const;
+	QVector<ServerWorker*> const& workers() const;
+	int size() const;
+	void clear();
+
+	static QString key(QString const& sUserName);
+
+private:
+	QVector<ServerWorker*> m_vecSlots;
+	QHash<QString, ServerWorker*> m_mapByName;
+};
+
+#endif // USERREGISTRY_H
\ No newline at end of file